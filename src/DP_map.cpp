@@ -1,80 +1,98 @@
 #include "math.hpp"
 #include "DP_map.hpp"
 
-DPUpdateMap::DPUpdateMap() {}
+template<typename policy>
+basicDPUpdateMap<policy>::basicDPUpdateMap() {}
 
-DPUpdateMap::DPUpdateMap(double coefficient) : coefficient(coefficient) {
+template<typename policy>
+basicDPUpdateMap<policy>::basicDPUpdateMap(value_t coefficient) : coefficient(coefficient) {
   scalar = true;
-  constant == 0;
+  constant = policy::zero();
 }
 
-DPUpdateMap::DPUpdateMap(double coefficient, double constant) : 
+template<typename policy>
+basicDPUpdateMap<policy>::basicDPUpdateMap(value_t coefficient, value_t constant) : 
           coefficient(coefficient), constant(constant) {
 }
 
-DPUpdateMap::DPUpdateMap(const DPUpdateMap& other) {
+template<typename policy>
+basicDPUpdateMap<policy>::basicDPUpdateMap(const basicDPUpdateMap& other) {
   scalar = other.scalar;
   coefficient = other.coefficient;
   constant = other.constant;
 }
 
-double DPUpdateMap::of(double x) const {
+template<typename policy>
+basicDPUpdateMap<policy> basicDPUpdateMap<policy>::identity() {
+  return basicDPUpdateMap(policy::one());
+}
+
+template<typename policy>
+typename policy::value_t basicDPUpdateMap<policy>::of(value_t x) const {
   if(scalar) {
-    return coefficient + x;
+    return policy::times(coefficient, x);
   } else {
-    return coefficient + logsum(x, constant);
+    return policy::times(coefficient, policy::plus(x, constant));
   }
 }
 
-DPUpdateMap DPUpdateMap::of(const DPUpdateMap& inner) const {
-  DPUpdateMap to_return = *this;
+template<typename policy>
+basicDPUpdateMap<policy> basicDPUpdateMap<policy>::of(const basicDPUpdateMap& inner) const {
+  basicDPUpdateMap to_return = *this;
   to_return.compose_in_place(inner);
   return to_return;
 }
 
-DPUpdateMap DPUpdateMap::compose(const DPUpdateMap& inner) const {
+template<typename policy>
+basicDPUpdateMap<policy> basicDPUpdateMap<policy>::compose(const basicDPUpdateMap& inner) const {
   return this->of(inner);
 }
 
-void DPUpdateMap::compose_in_place(const DPUpdateMap& inner) {
+template<typename policy>
+void basicDPUpdateMap<policy>::compose_in_place(const basicDPUpdateMap& inner) {
   if(scalar && inner.scalar) {
-    coefficient = coefficient + inner.coefficient;
+    coefficient = policy::times(coefficient, inner.coefficient);
     return;
   } else if(scalar) {
-    coefficient = coefficient + inner.coefficient;
+    coefficient = policy::times(coefficient, inner.coefficient);
     constant = inner.constant;  
     scalar = false;
     return;
   } else if(inner.scalar) {
-    coefficient = coefficient + inner.coefficient;
-    constant = constant - inner.coefficient;
+    coefficient = policy::times(coefficient, inner.coefficient);
+    constant = policy::divide(constant, inner.coefficient);
     return;
   } else {
-    coefficient = coefficient + inner.coefficient; 
-    constant = logsum(inner.constant, constant - inner.coefficient);
+    coefficient = policy::times(coefficient, inner.coefficient); 
+    constant = policy::plus(inner.constant, policy::divide(constant, inner.coefficient));
     return;
   }
 }
 
-DPUpdateMap DPUpdateMap::scale(double C) const {
-  DPUpdateMap to_return = *this;
+template<typename policy>
+basicDPUpdateMap<policy> basicDPUpdateMap<policy>::scale(value_t C) const {
+  basicDPUpdateMap to_return = *this;
   to_return.scale_in_place(C);
   return to_return;
 }
 
-void DPUpdateMap::scale_in_place(double C) {
-  coefficient += C;
+template<typename policy>
+void basicDPUpdateMap<policy>::scale_in_place(value_t C) {
+  coefficient = policy::times(coefficient, C);
 }
 
-bool DPUpdateMap::is_identity() const {
-  return coefficient == 0 && scalar;
+template<typename policy>
+bool basicDPUpdateMap<policy>::is_identity() const {
+  return coefficient == policy::one() && scalar;
 }
 
-bool DPUpdateMap::is_degenerate() const {
+template<typename policy>
+bool basicDPUpdateMap<policy>::is_degenerate() const {
   return scalar;
 }
 
-bool DPUpdateMap::operator==(const DPUpdateMap &other) const {
+template<typename policy>
+bool basicDPUpdateMap<policy>::operator==(const basicDPUpdateMap &other) const {
   if(scalar && other.scalar) {
     return coefficient == other.coefficient;
   } if(scalar != other.scalar) {
@@ -84,9 +102,18 @@ bool DPUpdateMap::operator==(const DPUpdateMap &other) const {
   }
 }
 
-bool DPUpdateMap::operator!=(const DPUpdateMap &other) const {
+template<typename policy>
+bool basicDPUpdateMap<policy>::operator!=(const basicDPUpdateMap &other) const {
   return !(*this == other);
 }
+
+template struct basicDPUpdateMap<logSpace<double> >;
+template struct basicDPUpdateMap<logSpace<float> >;
+template struct basicDPUpdateMap<scaledLinear<double> >;
+template struct basicDPUpdateMap<scaledLinear<float> >;
+template struct basicDPUpdateMap<maxProduct>;
+template struct basicDPUpdateMap<sweepLinear>;
+
 // 
 // DPUpdateMap& operator+=(const DPUpdateMap& other) {
 //   
@@ -1,47 +1,205 @@
 #ifndef LH_DP_STATE_MAP
 #define LH_DP_STATE_MAP
 
+#include <cmath>
+#include <cstdint>
 #include "math.hpp"
 
-// one-dimensional linear map
+// Arithmetic policies fix the type in which probabilities are held and the
+// operations on them:
+//    plus, minus, times, divide    the sum, difference, product and quotient
+//                                  of probabilities
+//    one(), zero()                 the multiplicative and additive identities
+//    from_log, to_log              conversions from and to log-probabilities
+//    accumulator                   sums a stream of probabilities
+// logSpace holds log-probabilities, so that plus is logsum and times is +.
+// scaledLinear holds probabilities themselves, which avoids exp and log in
+// every operation but leaves it to the user to rescale values to keep them in
+// range. maxProduct is the log-space semiring with max in place of plus, for
+// the Viterbi algorithm. laneLinear holds W linear probabilities side by side,
+// one for each of W models scored over the same cohort traversal (see
+// sweepFwdAlgState); its operations act lane by lane. Each policy has a
+// distinct binary_id, which binary state files are marked with
 
-struct DPUpdateMap{
+template<typename T>
+struct logSpace{
+  typedef T value_t;
+  static const bool is_linear = false;
+  static const uint64_t binary_id = 0x100 + sizeof(T);
+  static T plus(T a, T b) { return logsum(a, b); }
+  static T minus(T a, T b) { return logdiff(a, b); }
+  static T times(T a, T b) { return a + b; }
+  static T divide(T a, T b) { return a - b; }
+  static T one() { return 0; }
+  static T zero() { return -INFINITY; }
+  static T from_log(double x) { return x; }
+  static double to_log(T a) { return a; }
+  // online log-sum-exp: sum holds the sum of exp(x - max_summand) over every
+  // summand but the maximal one
+  struct accumulator{
+    T max_summand = -INFINITY;
+    T sum = 0;
+    void add(T x) {
+      if(x > max_summand) {
+        sum = (sum + 1) * exp(max_summand - x);
+        max_summand = x;
+      } else {
+        sum += exp(x - max_summand);
+      }
+    }
+    T total() const { return max_summand + log1p(sum); }
+  };
+};
+
+template<typename T>
+struct scaledLinear{
+  typedef T value_t;
+  static const bool is_linear = true;
+  static const uint64_t binary_id = 0x200 + sizeof(T);
+  static T plus(T a, T b) { return a + b; }
+  static T minus(T a, T b) { return a - b; }
+  static T times(T a, T b) { return a * b; }
+  static T divide(T a, T b) { return a / b; }
+  static T one() { return 1; }
+  static T zero() { return 0; }
+  static T from_log(double x) { return exp(x); }
+  static double to_log(T a) { return log((double)a); }
+  struct accumulator{
+    T sum = 0;
+    void add(T x) { sum += x; }
+    T total() const { return sum; }
+  };
+};
+
+struct maxProduct{
+  typedef double value_t;
+  static const bool is_linear = false;
+  static const uint64_t binary_id = 0x300;
+  static double plus(double a, double b) { return a > b ? a : b; }
+  static double times(double a, double b) { return a + b; }
+  static double divide(double a, double b) { return a - b; }
+  static double one() { return 0; }
+  static double zero() { return -INFINITY; }
+  static double from_log(double x) { return x; }
+  static double to_log(double a) { return a; }
+};
+
+typedef logSpace<double> sumProduct;
+
+template<size_t W>
+struct probabilityLanes{
+  double lane[W];
+  bool operator==(const probabilityLanes& other) const {
+    for(size_t i = 0; i < W; i++) {
+      if(lane[i] != other.lane[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator!=(const probabilityLanes& other) const {
+    return !(*this == other);
+  }
+  // lexicographic, so that maps of lanes can be sorted
+  bool operator<(const probabilityLanes& other) const {
+    for(size_t i = 0; i < W; i++) {
+      if(lane[i] != other.lane[i]) {
+        return lane[i] < other.lane[i];
+      }
+    }
+    return false;
+  }
+};
+
+template<size_t W>
+struct laneLinear{
+  typedef probabilityLanes<W> value_t;
+  static const bool is_linear = true;
+  static const uint64_t binary_id = 0x400 + W;
+  static const size_t width = W;
+  static value_t plus(value_t a, const value_t& b) {
+    for(size_t i = 0; i < W; i++) { a.lane[i] += b.lane[i]; }
+    return a;
+  }
+  static value_t minus(value_t a, const value_t& b) {
+    for(size_t i = 0; i < W; i++) { a.lane[i] -= b.lane[i]; }
+    return a;
+  }
+  static value_t times(value_t a, const value_t& b) {
+    for(size_t i = 0; i < W; i++) { a.lane[i] *= b.lane[i]; }
+    return a;
+  }
+  static value_t divide(value_t a, const value_t& b) {
+    for(size_t i = 0; i < W; i++) { a.lane[i] /= b.lane[i]; }
+    return a;
+  }
+  static value_t fill(double x) {
+    value_t to_return;
+    for(size_t i = 0; i < W; i++) { to_return.lane[i] = x; }
+    return to_return;
+  }
+  static value_t one() { return fill(1); }
+  static value_t zero() { return fill(0); }
+  static value_t from_log(double x) { return fill(exp(x)); }
+  struct accumulator{
+    value_t sum = zero();
+    void add(const value_t& x) { sum = plus(sum, x); }
+    value_t total() const { return sum; }
+  };
+};
+
+template<size_t W>
+const size_t laneLinear<W>::width;
+
+// the lane width of parameter sweeps
+typedef laneLinear<8> sweepLinear;
+
+// one-dimensional linear map x |-> A(x + B) over an arithmetic policy
+
+template<typename policy>
+struct basicDPUpdateMap{
+  typedef typename policy::value_t value_t;
 private:
   bool scalar = false;
 public:
-  double coefficient;
-  double constant;
+  value_t coefficient;
+  value_t constant;
 
-  DPUpdateMap();
-  DPUpdateMap(double coefficient);
-  DPUpdateMap(double coefficient, double constant);
-  DPUpdateMap(const DPUpdateMap& other);
+  basicDPUpdateMap();
+  basicDPUpdateMap(value_t coefficient);
+  basicDPUpdateMap(value_t coefficient, value_t constant);
+  basicDPUpdateMap(const basicDPUpdateMap& other);
+  
+  static basicDPUpdateMap identity();
 
   bool is_identity() const;
   bool is_degenerate() const;
 
-  double of(double x) const;
-  DPUpdateMap of(const DPUpdateMap& inner) const;
+  value_t of(value_t x) const;
+  basicDPUpdateMap of(const basicDPUpdateMap& inner) const;
 
   // Composes the maps f1: x |-> A1(x + B1) and f2: x |-> A2(x + B2) to form a map
-  // f': x |-> A2A1(x + B1 + B2/A1). Performs this in log-space
-  DPUpdateMap compose(const DPUpdateMap& inner) const;
-  void compose_in_place(const DPUpdateMap& inner);
+  // f': x |-> A2A1(x + B1 + B2/A1)
+  basicDPUpdateMap compose(const basicDPUpdateMap& inner) const;
+  void compose_in_place(const basicDPUpdateMap& inner);
   
-  DPUpdateMap scale(double C) const;
-  void scale_in_place(double C);
+  basicDPUpdateMap scale(value_t C) const;
+  void scale_in_place(value_t C);
   
-  bool operator==(const DPUpdateMap &other) const;
-  bool operator!=(const DPUpdateMap &other) const;
+  bool operator==(const basicDPUpdateMap &other) const;
+  bool operator!=(const basicDPUpdateMap &other) const;
   
-  DPUpdateMap& operator+=(const DPUpdateMap& other);
-  DPUpdateMap operator+(const DPUpdateMap& other) const;
-  DPUpdateMap& operator-=(const DPUpdateMap& other);
-  DPUpdateMap operator-(const DPUpdateMap& other) const;
-  DPUpdateMap& operator*=(const DPUpdateMap& other);
-  DPUpdateMap operator*(const DPUpdateMap& other) const;
-  DPUpdateMap& operator*=(const double& other);
-  DPUpdateMap operator*(const double& other) const;
+  basicDPUpdateMap& operator+=(const basicDPUpdateMap& other);
+  basicDPUpdateMap operator+(const basicDPUpdateMap& other) const;
+  basicDPUpdateMap& operator-=(const basicDPUpdateMap& other);
+  basicDPUpdateMap operator-(const basicDPUpdateMap& other) const;
+  basicDPUpdateMap& operator*=(const basicDPUpdateMap& other);
+  basicDPUpdateMap operator*(const basicDPUpdateMap& other) const;
+  basicDPUpdateMap& operator*=(const double& other);
+  basicDPUpdateMap operator*(const double& other) const;
 };
 
+typedef basicDPUpdateMap<sumProduct> DPUpdateMap;
+typedef basicDPUpdateMap<maxProduct> maxProductMap;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "binary_io.hpp"
+
+using namespace std;
+
+void write_uint64(ostream& out, uint64_t x) {
+  char bytes[8];
+  for(size_t i = 0; i < 8; i++) {
+    bytes[i] = (char)((x >> (8 * i)) & 0xff);
+  }
+  out.write(bytes, 8);
+}
+
+uint64_t read_uint64(istream& in) {
+  unsigned char bytes[8];
+  if(!in.read((char*)bytes, 8)) {
+    throw runtime_error("truncated binary stream");
+  }
+  uint64_t x = 0;
+  for(size_t i = 0; i < 8; i++) {
+    x |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return x;
+}
+
+void write_bool(ostream& out, bool x) {
+  out.put(x ? 1 : 0);
+}
+
+bool read_bool(istream& in) {
+  char byte;
+  if(!in.get(byte)) {
+    throw runtime_error("truncated binary stream");
+  }
+  return byte != 0;
+}
+
+static void write_uint32(ostream& out, uint32_t x) {
+  char bytes[4];
+  for(size_t i = 0; i < 4; i++) {
+    bytes[i] = (char)((x >> (8 * i)) & 0xff);
+  }
+  out.write(bytes, 4);
+}
+
+static uint32_t read_uint32(istream& in) {
+  unsigned char bytes[4];
+  if(!in.read((char*)bytes, 4)) {
+    throw runtime_error("truncated binary stream");
+  }
+  uint32_t x = 0;
+  for(size_t i = 0; i < 4; i++) {
+    x |= (uint32_t)bytes[i] << (8 * i);
+  }
+  return x;
+}
+
+void write_value(ostream& out, double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, 8);
+  write_uint64(out, bits);
+}
+
+void write_value(ostream& out, float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, 4);
+  write_uint32(out, bits);
+}
+
+void read_value(istream& in, double& x) {
+  uint64_t bits = read_uint64(in);
+  memcpy(&x, &bits, 8);
+}
+
+void read_value(istream& in, float& x) {
+  uint32_t bits = read_uint32(in);
+  memcpy(&x, &bits, 4);
+}
+
+void write_size_vector(ostream& out, const vector<size_t>& v) {
+  write_uint64(out, v.size());
+  for(size_t i = 0; i < v.size(); i++) {
+    write_uint64(out, v[i]);
+  }
+}
+
+void expect_items(istream& in, uint64_t count, size_t item_bytes) {
+  streampos here = in.tellg();
+  if(here == streampos(-1)) {
+    return;
+  }
+  in.seekg(0, ios::end);
+  streampos last = in.tellg();
+  in.seekg(here);
+  if(last == streampos(-1) || !in) {
+    throw runtime_error("unreadable binary stream");
+  }
+  if(count > (uint64_t)(last - here) / item_bytes) {
+    throw runtime_error("binary stream is too short for the count it holds");
+  }
+}
+
+uint64_t read_count(istream& in, size_t item_bytes) {
+  uint64_t count = read_uint64(in);
+  expect_items(in, count, item_bytes);
+  return count;
+}
+
+// grown as read, so that an unchecked count fails at the end of the stream
+// rather than allocating it
+void read_size_vector(istream& in, vector<size_t>& v) {
+  uint64_t n = read_count(in, 8);
+  v.clear();
+  for(uint64_t i = 0; i < n; i++) {
+    v.push_back(read_uint64(in));
+  }
+}
+
+uint64_t binary_tag(const char* name) {
+  uint64_t tag = 0;
+  for(size_t i = 0; i < 8 && name[i] != '\0'; i++) {
+    tag |= (uint64_t)(unsigned char)name[i] << (8 * i);
+  }
+  return tag;
+}
+
+void expect_tag(istream& in, uint64_t tag, const char* what) {
+  if(read_uint64(in) != tag) {
+    throw runtime_error(string("binary stream does not hold a ") + what);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef LINEAR_HAPLO_BINARY_IO_H
+#define LINEAR_HAPLO_BINARY_IO_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+
+// Fixed-width little-endian encoding for binary state files, so that a file
+// written by one build or platform reads back in any other. Integers are
+// written as 64 bits, flags as one byte and values as IEEE 754 single or double precision
+// according to their type. Reads throw a runtime_error on a truncated stream
+
+void write_uint64(ostream& out, uint64_t x);
+uint64_t read_uint64(istream& in);
+// flags take a single byte
+void write_bool(ostream& out, bool x);
+bool read_bool(istream& in);
+
+void write_value(ostream& out, double x);
+void write_value(ostream& out, float x);
+void read_value(istream& in, double& x);
+void read_value(istream& in, float& x);
+
+// lanes of values are written lane by lane
+template<size_t W> struct probabilityLanes;
+template<size_t W>
+void write_value(ostream& out, const probabilityLanes<W>& x) {
+  for(size_t i = 0; i < W; i++) {
+    write_value(out, x.lane[i]);
+  }
+}
+template<size_t W>
+void read_value(istream& in, probabilityLanes<W>& x) {
+  for(size_t i = 0; i < W; i++) {
+    read_value(in, x.lane[i]);
+  }
+}
+
+// throws if the rest of the stream is too short to hold count items which
+// take at least item_bytes each, so that a corrupt count is never allocated.
+// Unseekable streams are not checked
+void expect_items(istream& in, uint64_t count, size_t item_bytes);
+// reads a count of items and checks it as expect_items() does
+uint64_t read_count(istream& in, size_t item_bytes);
+
+void write_size_vector(ostream& out, const vector<size_t>& v);
+void read_size_vector(istream& in, vector<size_t>& v);
+
+// tags open each serialized structure; a tag packs eight characters, such as
+// "SLLSFWD2", into 64 bits
+uint64_t binary_tag(const char* name);
+// reads a tag and throws if it is not the one expected
+void expect_tag(istream& in, uint64_t tag, const char* what);
+
+#endif
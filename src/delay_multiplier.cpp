@@ -1,177 +1,729 @@
 #include "row_set.hpp"
 #include "delay_multiplier.hpp"
 #include "math.hpp"
+#include "binary_io.hpp"
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 
-void mapHistory::push_back(const DPUpdateMap& map) {
-	elements.push_back(map);
+// Each entry i of the history also stores suffix(i), the composition of the
+// maps in (prev_site(i), i]. prev_site(i) is i with its lowest set bit cleared,
+// or the start of the history if that is later, so the skips form a Fenwick
+// tree over the history and any range of it is composed in O(log n) steps
+
+static inline size_t skip_target(size_t i, size_t start) {
+  size_t target = i & (i - 1);
+  return target < start ? start : target;
+}
+
+template<typename policy>
+basicHistoryEntry<policy>::basicHistoryEntry(const map_t& map, size_t previous,
+              const map_t& suffix) :
+  map(map), previous(previous), suffix(suffix) {
+  
+}
+
+template<typename policy>
+basicHistoryChunk<policy>::basicHistoryChunk() {
+  entries.reserve(capacity);
+}
+
+template<typename policy>
+basicHistoryChunk<policy>::basicHistoryChunk(const basicHistoryChunk& other) {
+  entries.reserve(capacity);
+  entries = other.entries;
+}
+
+template<typename policy>
+const basicHistoryEntry<policy>& basicMapHistory<policy>::entry(size_t i) const {
+  size_t offset = i - base;
+  return chunks[offset >> chunk_t::length_bits]->entries[offset & (chunk_t::capacity - 1)];
+}
+
+// returns the chunk which the next entry goes into, starting a new one or
+// cloning a shared one as needed
+template<typename policy>
+basicHistoryChunk<policy>* basicMapHistory<policy>::writable_last_chunk() {
+  if(chunks.size() == 0 || chunks.back()->entries.size() == chunk_t::capacity) {
+    if(spare_chunks.size() > 0) {
+      chunks.push_back(spare_chunks.back());
+      spare_chunks.pop_back();
+    } else {
+      chunks.push_back(make_shared<chunk_t>());
+    }
+  } else if(chunks.back().use_count() > 1) {
+    chunks.back() = make_shared<chunk_t>(*(chunks.back()));
+  }
+  return chunks.back().get();
+}
+
+template<typename policy>
+void basicMapHistory<policy>::push_back(const map_t& map) {
+  size_t i = end;
+  size_t target = i == start ? i : skip_target(i, start);
+  map_t skip = map;
+  if(target < i) {
+    skip.compose_in_place(compose_range(target, i - 1));
+  }
+  writable_last_chunk()->entries.push_back(entry_t(map, target, skip));
+  ++end;
+}
+
+template<typename policy>
+void basicMapHistory<policy>::truncate(size_t new_end) {
+  if(new_end >= end) {
+    return;
+  }
+  size_t kept = new_end - base;
+  size_t kept_chunks = (kept + chunk_t::capacity - 1) >> chunk_t::length_bits;
+  while(chunks.size() > kept_chunks) {
+    if(chunks.back().use_count() == 1) {
+      chunks.back()->entries.clear();
+      spare_chunks.push_back(chunks.back());
+    }
+    chunks.pop_back();
+  }
+  if(kept_chunks > 0) {
+    size_t kept_in_last = kept - ((kept_chunks - 1) << chunk_t::length_bits);
+    if(chunks.back()->entries.size() > kept_in_last) {
+      if(chunks.back().use_count() > 1) {
+        chunks.back() = make_shared<chunk_t>(*(chunks.back()));
+      }
+      vector<entry_t>& entries = chunks.back()->entries;
+      entries.erase(entries.begin() + kept_in_last, entries.end());
+    }
+  }
+  end = new_end;
+}
+
+template<typename policy>
+basicDPUpdateMap<policy> basicMapHistory<policy>::compose_range(size_t from, size_t to) const {
+  map_t to_return = map_t::identity();
+  size_t i = to;
+  while(i > from) {
+    const entry_t& current = entry(i);
+    if(current.previous >= from && current.previous < i) {
+      to_return.compose_in_place(current.suffix);
+      i = current.previous;
+    } else {
+      to_return.compose_in_place(current.map);
+      --i;
+    }
+  }
+  return to_return;
 }
 
-size_t mapHistory::size() const {
-	return elements.size();
+template<typename policy>
+size_t basicMapHistory<policy>::size() const {
+	return end - start;
 }
 
-mapHistory::mapHistory() {
-  start = 0;
+template<typename policy>
+size_t basicMapHistory<policy>::number_of_chunks() const {
+  return chunks.size();
 }
 
-mapHistory::mapHistory(const DPUpdateMap& map, size_t start) : start(start) {
-	elements = {map};
+template<typename policy>
+basicMapHistory<policy>::basicMapHistory() : start(0), base(0), end(0) {
+  
 }
 
+template<typename policy>
+basicMapHistory<policy>::basicMapHistory(const map_t& map, size_t start) : 
+  start(start), base(start), end(start) {
+  push_back(map);
+}
 
-mapHistory::mapHistory(const mapHistory& other) {
-	start = other.start;
-  elements = other.elements;
+template<typename policy>
+basicMapHistory<policy>::basicMapHistory(const basicMapHistory& other) :
+  start(other.start), base(other.base), end(other.end), chunks(other.chunks) {
+  
 }
 
-mapHistory::mapHistory(const mapHistory& other, size_t new_start) {
+// shares every chunk holding a site at or after new_start; skips reaching
+// below new_start are kept, but compose_range never follows them
+template<typename policy>
+basicMapHistory<policy>::basicMapHistory(const basicMapHistory& other, size_t new_start) {
 	start = new_start;
-	size_t offset = new_start - other.start;
-	elements = vector<DPUpdateMap>(other.elements.begin() + offset, other.elements.end());	
+  end = other.end;
+  size_t dropped = (new_start - other.base) >> chunk_t::length_bits;
+  base = other.base + (dropped << chunk_t::length_bits);
+  chunks = vector<shared_ptr<chunk_t> >(other.chunks.begin() + dropped, 
+                                              other.chunks.end());
+}
+
+template<typename policy>
+void basicMapHistory<policy>::drop_before(size_t new_start) {
+  if(new_start <= start) {
+    return;
+  }
+  size_t dropped = (new_start - base) >> chunk_t::length_bits;
+  for(size_t i = 0; i < dropped; i++) {
+    if(chunks[i].use_count() == 1) {
+      chunks[i]->entries.clear();
+      spare_chunks.push_back(chunks[i]);
+    }
+  }
+  chunks.erase(chunks.begin(), chunks.begin() + dropped);
+  base += dropped << chunk_t::length_bits;
+  start = new_start;
+}
+
+template<typename policy>
+basicMapHistory<policy>& basicMapHistory<policy>::operator=(const basicMapHistory& other) {
+  start = other.start;
+  base = other.base;
+  end = other.end;
+  chunks = other.chunks;
+  return *this;
+}
+
+template<typename policy>
+void basicMapHistory<policy>::reserve_length(size_t length) {
+  size_t needed = (length >> chunk_t::length_bits) + 2;
+  chunks.reserve(needed);
+  spare_chunks.reserve(needed);
+  while(chunks.size() + spare_chunks.size() < needed) {
+    spare_chunks.push_back(make_shared<chunk_t>());
+  }
 }
 
-DPUpdateMap& mapHistory::operator[](size_t i) {
-	return elements[i - start];
+// chunks still shared with a copy are released to it; the rest are kept
+template<typename policy>
+void basicMapHistory<policy>::reset(const map_t& map, size_t start) {
+  for(size_t i = 0; i < chunks.size(); i++) {
+    if(chunks[i].use_count() == 1) {
+      chunks[i]->entries.clear();
+      spare_chunks.push_back(chunks[i]);
+    }
+  }
+  chunks.clear();
+  this->start = start;
+  base = start;
+  end = start;
+  push_back(map);
+}
+
+template<typename policy>
+const basicDPUpdateMap<policy>& basicMapHistory<policy>::operator[](size_t i) const {
+	return entry(i).map;
+}
+
+template<typename policy>
+const basicDPUpdateMap<policy>& basicMapHistory<policy>::back() const {
+	return entry(end - 1).map;
+}
+
+template<typename policy>
+const basicDPUpdateMap<policy>& basicMapHistory<policy>::suffix(size_t i) const {
+  return entry(i).suffix;
 }
 
-DPUpdateMap& mapHistory::back() {
-	return elements.back();
+template<typename policy>
+size_t basicMapHistory<policy>::prev_site(size_t i) const {
+  return entry(i).previous;
 }
 
-const vector<DPUpdateMap>& mapHistory::get_elements() const {
-  return elements;
+template<typename policy>
+size_t basicMapHistory<policy>::start_site() const {
+  return start;
 }
 
-lazyEvalMap::lazyEvalMap() {
+template<typename policy>
+size_t basicMapHistory<policy>::end_site() const {
+  return end;
+}
+
+template<typename policy>
+const eqclass_t basicLazyEvalMap<policy>::no_eqclass;
+
+template<typename policy>
+basicLazyEvalMap<policy>::basicLazyEvalMap() {
   
 }
 
-void lazyEvalMap::increment_site_marker() {
+// the history is padded with the identity so that it stays aligned with the
+// site marker
+template<typename policy>
+void basicLazyEvalMap<policy>::increment_site_marker() {
   current_site++;
+  map_history.push_back(map_t::identity());
+  extend_site_lists();
+  if(current_site >= next_history_collection && checkpoints.empty()) {
+    collect_history();
+  }
 }
 
-lazyEvalMap::lazyEvalMap(size_t rows, size_t start) : 
+template<typename policy>
+basicLazyEvalMap<policy>::basicLazyEvalMap(size_t rows, size_t start) : 
 	row_to_eqclass(vector<size_t>(rows, 0)), 
 	eqclass_size(vector<size_t>(1, rows)),
 	current_site(start),
 	eqclass_last_updated(vector<size_t>(1, start)),
 	newest_eqclass(0),
-	eqclass_to_map(vector<DPUpdateMap>(1, DPUpdateMap(0))),
-	map_history(mapHistory(DPUpdateMap(0), start)) {
+	eqclass_to_map(vector<map_t>(1, map_t::identity())),
+	map_history(history_t(map_t::identity(), start)),
+  next_history_collection(start + 2 * min_history_window),
+  site_list_base(start),
+  site_n_classes(vector<size_t>(1, 1)),
+  rep_eqclass_of_site(vector<eqclass_t>(1, 0)),
+  site_class_list_above(vector<eqclass_t>(1, no_eqclass)),
+  site_class_list_below(vector<eqclass_t>(1, no_eqclass)),
+  eqclass_forward(vector<eqclass_t>(1, no_eqclass)),
+  eqclass_forwarders(vector<size_t>(1, 0)) {
+  // there can never be more live eqclasses than rows, plus the newest one
+  eqclass_to_map.reserve(rows + 1);
+  eqclass_size.reserve(rows + 1);
+  eqclass_last_updated.reserve(rows + 1);
+  empty_eqclass_indices.reserve(rows + 1);
+  active_eqclasses.reserve(rows + 1);
+  eqclass_epoch.reserve(rows + 1);
+  site_class_list_above.reserve(rows + 1);
+  site_class_list_below.reserve(rows + 1);
+  eqclass_forward.reserve(rows + 1);
+  eqclass_forwarders.reserve(rows + 1);
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::reserve_length(size_t length) {
+  map_history.reserve_length(length);
+  site_n_classes.reserve(length);
+  rep_eqclass_of_site.reserve(length);
+}
 
+template<typename policy>
+void basicLazyEvalMap<policy>::reset(size_t start) {
+  release_checkpoints();
+  current_site = start;
+  collapse_eqclasses();
+  merge_count = 0;
+  map_history.reset(map_t::identity(), start);
+  next_history_collection = start + 2 * min_history_window;
 }
 
-void lazyEvalMap::add_identity_eqclass() {
-  add_eqclass(DPUpdateMap(0));
+template<typename policy>
+void basicLazyEvalMap<policy>::collapse_eqclasses() {
+  std::fill(row_to_eqclass.begin(), row_to_eqclass.end(), 0);
+  eqclass_to_map.resize(1);
+  eqclass_to_map[0] = map_t::identity();
+  eqclass_size.resize(1);
+  eqclass_size[0] = row_to_eqclass.size();
+  eqclass_last_updated.resize(1);
+  eqclass_last_updated[0] = current_site;
+  empty_eqclass_indices.clear();
+  newest_eqclass = 0;
+  site_list_base = current_site;
+  site_n_classes.assign(1, 1);
+  rep_eqclass_of_site.assign(1, 0);
+  site_class_list_above.assign(1, no_eqclass);
+  site_class_list_below.assign(1, no_eqclass);
+  eqclass_forward.assign(1, no_eqclass);
+  eqclass_forwarders.assign(1, 0);
+  n_forwarded = 0;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::add_identity_eqclass() {
+  add_eqclass(map_t::identity());
   return;
 }
 
-lazyEvalMap::lazyEvalMap(const lazyEvalMap &other) {
+template<typename policy>
+basicLazyEvalMap<policy>::basicLazyEvalMap(const basicLazyEvalMap &other) {
+  *this = other;
+}
+
+template<typename policy>
+basicLazyEvalMap<policy>& basicLazyEvalMap<policy>::operator=(const basicLazyEvalMap& other) {
+  if(this == &other) {
+    return *this;
+  }
+  release_checkpoints();
 	current_site = other.current_site;
 	row_to_eqclass = other.row_to_eqclass;
 	eqclass_last_updated = other.eqclass_last_updated;
-  size_t oldest_seen = current_site;
-  for(size_t i = 0; i < eqclass_last_updated.size(); i++) {
-    if(eqclass_last_updated[i] < oldest_seen) {
-      oldest_seen = eqclass_last_updated[i];
-    }
-  }
-  map_history = mapHistory(other.map_history, oldest_seen);
 	eqclass_to_map = other.eqclass_to_map;
 	eqclass_size = other.eqclass_size;
 	empty_eqclass_indices = other.empty_eqclass_indices;
+  newest_eqclass = other.newest_eqclass;
+  next_history_collection = other.next_history_collection;
+  site_list_base = other.site_list_base;
+  site_n_classes = other.site_n_classes;
+  rep_eqclass_of_site = other.rep_eqclass_of_site;
+  site_class_list_above = other.site_class_list_above;
+  site_class_list_below = other.site_class_list_below;
+  merge_identical = other.merge_identical;
+  merge_count = other.merge_count;
+  n_forwarded = other.n_forwarded;
+  eqclass_forward = other.eqclass_forward;
+  eqclass_forwarders = other.eqclass_forwarders;
+  step_t oldest = other.oldest_live_site();
+  map_history = history_t(other.map_history, oldest);
+  truncate_site_lists(oldest);
+  return *this;
+}
+
+template<typename policy>
+step_t basicLazyEvalMap<policy>::oldest_live_site() const {
+  step_t oldest = site_list_base;
+  while(oldest < current_site && site_n_classes[oldest - site_list_base] == 0) {
+    ++oldest;
+  }
+  return oldest < map_history.start_site() ? map_history.start_site() : oldest;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::condense_history(step_t top, step_t bottom) {
+  if(top > current_site || bottom > top) {
+    throw runtime_error("condense_history must have bottom <= top <= current site");
+  }
+  for(step_t site = max(bottom, site_list_base); site < top; site++) {
+    catch_up_site(site, top);
+  }
+  if(!checkpoints.empty()) {
+    return;
+  }
+  step_t oldest = oldest_live_site();
+  map_history.drop_before(oldest);
+  truncate_site_lists(oldest);
+}
+
+// Keeps the retained history within twice a window of W sites, where W is at
+// least the number of eqclasses: every W sites, eqclasses more than W sites
+// stale are caught up and the history behind them dropped. The eqclass scan
+// is then O(1) per site amortized and catch-up O(log n) per site amortized
+template<typename policy>
+void basicLazyEvalMap<policy>::collect_history() {
+  size_t window = eqclass_to_map.size();
+  if(window < min_history_window) {
+    window = min_history_window;
+  }
+  if(current_site > window) {
+    condense_history(current_site - window, 0);
+  }
+  next_history_collection = current_site + window;
 }
 
-void lazyEvalMap::assign_row_to_newest_eqclass(size_t row) {
+template<typename policy>
+void basicLazyEvalMap<policy>::assign_row_to_newest_eqclass(size_t row) {
   //TODO: complain if row_to_eqclass[row] != |H|
+  journal_row(row);
+  journal_eqclass(newest_eqclass);
   row_to_eqclass[row] = newest_eqclass;
   eqclass_size[newest_eqclass]++;
   return;
 }
 
-void lazyEvalMap::hard_clear_all() {
-  for(int i = 0; i < eqclass_to_map.size(); i++) {
-    delete_eqclass(i);
-  }
-  add_identity_eqclass();
-  for(int i = 0; i < row_to_eqclass.size(); i++) {
-    assign_row_to_newest_eqclass(i);
+// while a checkpoint is open the eqclasses, which the undo log refers to, are
+// kept in place and only their maps cleared; they are all up to date once
+// hard_update_all() has been called
+template<typename policy>
+void basicLazyEvalMap<policy>::hard_clear_all() {
+  if(!checkpoints.empty()) {
+    for(eqclass_t eqclass = get_rep_eqclass(current_site); 
+              eqclass != no_eqclass; eqclass = site_class_list_above[eqclass]) {
+      journal_eqclass(eqclass);
+      eqclass_to_map[eqclass] = map_t::identity();
+    }
+    return;
   }
+  collapse_eqclasses();
+  // every eqclass is now up to date, so no earlier history will be read again
+  map_history.reset(map_t::identity(), current_site);
+  next_history_collection = current_site + 2 * min_history_window;
   return;
 }
 
-void lazyEvalMap::hard_update_all() {
-  vector<size_t> non_empty_eqclasses;
-  
-  for(int i = 0; i < eqclass_size.size(); i++) {
-    if(eqclass_size[i] != 0) {
-      non_empty_eqclasses.push_back(i);
-    }
+template<typename policy>
+void basicLazyEvalMap<policy>::hard_update_all() {
+  for(step_t site = site_list_base; site < current_site; site++) {
+    catch_up_site(site, current_site);
   }
-  update_maps(non_empty_eqclasses);
   return;
 }
 
-vector<size_t> lazyEvalMap::rows_to_eqclasses(const rowSet& rows) const {
-  vector<size_t> to_return(0);
-  if(rows.empty()) {
-    return to_return;
+template<typename policy>
+const vector<eqclass_t>& basicLazyEvalMap<policy>::rows_to_eqclasses(const rowSet& rows) {
+  gather_eqclasses(rows);
+  return active_eqclasses;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::gather_eqclasses(const rowSet& rows) {
+  active_eqclasses.clear();
+  if(eqclass_epoch.size() < eqclass_to_map.size()) {
+    eqclass_epoch.resize(eqclass_to_map.size(), 0);
   }
-  vector<char> seen = vector<char>(eqclass_to_map.size(), 0);
+  ++current_epoch;
   rowSet::const_iterator it = rows.begin();
   rowSet::const_iterator rows_end = rows.end();
   for(it; it != rows_end; ++it) {
-    if(seen[row_to_eqclass[*it]] == 0) {
-      to_return.push_back(row_to_eqclass[*it]);
+    eqclass_t eqclass = find_eqclass(row_to_eqclass[*it]);
+    if(eqclass_epoch[eqclass] != current_epoch) {
+      eqclass_epoch[eqclass] = current_epoch;
+      active_eqclasses.push_back(eqclass);
     }
-    seen[row_to_eqclass[*it]] = 1;
   }
-  return to_return;
 }
 
-void lazyEvalMap::update_maps(const vector<size_t>& eqclasses) {
-  size_t least_up_to_date = current_site;
+template<typename policy>
+void basicLazyEvalMap<policy>::update_maps(const vector<size_t>& eqclasses) {
   for(size_t i = 0; i < eqclasses.size(); i++) {
-    if(eqclass_last_updated[eqclasses[i]] < least_up_to_date) {
-      least_up_to_date = eqclass_last_updated[eqclasses[i]];
-    }
+    update_eqclass(eqclasses[i]);
   }
-  if(current_site != least_up_to_date) {
-    size_t suffixes_size = current_site - least_up_to_date;
-
-    vector<DPUpdateMap> suffixes = 
-              vector<DPUpdateMap>(suffixes_size, DPUpdateMap());
-    suffixes[0] = map_history[current_site];
-
-    for(size_t i = 1; i < suffixes_size; i++) {
-      suffixes[i] = suffixes[i-1].compose(map_history[current_site - i]);
-    }    
-    
-    for(size_t i = 0; i < eqclasses.size(); i++) {
-      if(eqclass_last_updated[eqclasses[i]] != current_site) {
-        // j is the eqclass's index in the suffix-vector
-        size_t j = current_site - eqclass_last_updated[eqclasses[i]] - 1;
-        eqclass_to_map[eqclasses[i]] = suffixes[j].of(eqclass_to_map[eqclasses[i]]);
-        eqclass_last_updated[eqclasses[i]] = current_site;
-      }
+  return;
+}
+
+// the whole group of eqclasses last updated alongside this one is caught up
+// with it, since the history range only needs composing once
+template<typename policy>
+void basicLazyEvalMap<policy>::update_eqclass(eqclass_t eqclass) {
+  if(eqclass_last_updated[eqclass] != current_site) {
+    catch_up_site(eqclass_last_updated[eqclass], current_site);
+  }
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::catch_up_site(step_t site, step_t top) {
+  eqclass_t head = get_rep_eqclass(site);
+  if(head == no_eqclass) {
+    return;
+  }
+  map_t range = map_history.compose_range(site, top);
+  eqclass_t tail = head;
+  for(eqclass_t eqclass = head; eqclass != no_eqclass; 
+            eqclass = site_class_list_above[eqclass]) {
+    journal_eqclass(eqclass);
+    eqclass_to_map[eqclass] = range.of(eqclass_to_map[eqclass]);
+    eqclass_last_updated[eqclass] = top;
+    tail = eqclass;
+  }
+  // splice the group onto the front of the list at top
+  size_t slot = site - site_list_base;
+  size_t top_slot = top - site_list_base;
+  eqclass_t top_head = rep_eqclass_of_site[top_slot];
+  journal_site_slot(slot);
+  journal_site_slot(top_slot);
+  site_class_list_above[tail] = top_head;
+  if(top_head != no_eqclass) {
+    journal_eqclass(top_head);
+    site_class_list_below[top_head] = tail;
+  }
+  rep_eqclass_of_site[top_slot] = head;
+  site_n_classes[top_slot] += site_n_classes[slot];
+  rep_eqclass_of_site[slot] = no_eqclass;
+  site_n_classes[slot] = 0;
+  if(merge_identical) {
+    merge_identical_in_group(top);
+  }
+}
+
+// Eqclasses are compared by sorting the group, which costs no allocation
+// once the scratch list has grown; only the group just caught up is examined
+// and the newest eqclass is never merged away, since rows are still being
+// assigned to it
+template<typename policy>
+void basicLazyEvalMap<policy>::merge_identical_in_group(step_t site) {
+  merge_candidates.clear();
+  for(eqclass_t eqclass = get_rep_eqclass(site); eqclass != no_eqclass; 
+            eqclass = site_class_list_above[eqclass]) {
+    merge_candidates.push_back(eqclass);
+  }
+  if(merge_candidates.size() < 2) {
+    return;
+  }
+  const vector<map_t>& maps = eqclass_to_map;
+  eqclass_t newest = newest_eqclass;
+  std::sort(merge_candidates.begin(), merge_candidates.end(), 
+            [&maps, newest](eqclass_t a, eqclass_t b) {
+    const map_t& map_a = maps[a];
+    const map_t& map_b = maps[b];
+    if(map_a.is_degenerate() != map_b.is_degenerate()) {
+      return map_a.is_degenerate();
+    }
+    if(map_a.coefficient != map_b.coefficient) {
+      return map_a.coefficient < map_b.coefficient;
+    }
+    if(!map_a.is_degenerate() && map_a.constant != map_b.constant) {
+      return map_a.constant < map_b.constant;
+    }
+    // the newest eqclass sorts first among equals so that it is kept
+    return (a == newest) > (b == newest);
+  });
+  eqclass_t kept = merge_candidates[0];
+  for(size_t i = 1; i < merge_candidates.size(); i++) {
+    eqclass_t eqclass = merge_candidates[i];
+    if(eqclass_to_map[eqclass] == eqclass_to_map[kept]) {
+      merge_eqclass(eqclass, kept);
+    } else {
+      kept = eqclass;
     }
   }
-  return;
 }
 
-void lazyEvalMap::delete_eqclass(size_t eqclass) {
+template<typename policy>
+void basicLazyEvalMap<policy>::merge_eqclass(eqclass_t from, eqclass_t into) {
+  site_class_list_remove(from);
+  journal_eqclass(from);
+  journal_eqclass(into);
+  eqclass_forward[from] = into;
+  ++eqclass_forwarders[into];
+  ++n_forwarded;
+  ++merge_count;
+  release_eqclass(from);
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::release_eqclass(eqclass_t eqclass) {
+  while(eqclass_forward[eqclass] != no_eqclass && eqclass_size[eqclass] == 0 &&
+            eqclass_forwarders[eqclass] == 0) {
+    eqclass_t into = eqclass_forward[eqclass];
+    journal_eqclass(eqclass);
+    journal_eqclass(into);
+    eqclass_forward[eqclass] = no_eqclass;
+    --n_forwarded;
+    eqclass_last_updated[eqclass] = current_site;
+    empty_eqclass_indices.push_back(eqclass);
+    --eqclass_forwarders[into];
+    eqclass = into;
+  }
+  if(eqclass_forward[eqclass] == no_eqclass && eqclass_size[eqclass] == 0 &&
+            eqclass_forwarders[eqclass] == 0 && eqclass != newest_eqclass) {
+    delete_eqclass(eqclass);
+  }
+}
+
+template<typename policy>
+eqclass_t basicLazyEvalMap<policy>::find_eqclass(eqclass_t eqclass) const {
+  while(eqclass_forward[eqclass] != no_eqclass) {
+    eqclass = eqclass_forward[eqclass];
+  }
+  return eqclass;
+}
+
+template<typename policy>
+eqclass_t basicLazyEvalMap<policy>::resolve_row(row_t row) {
+  eqclass_t eqclass = row_to_eqclass[row];
+  if(eqclass_forward[eqclass] == no_eqclass) {
+    return eqclass;
+  }
+  eqclass_t resolved = find_eqclass(eqclass);
+  journal_row(row);
+  journal_eqclass(resolved);
+  journal_eqclass(eqclass);
+  row_to_eqclass[row] = resolved;
+  ++eqclass_size[resolved];
+  --eqclass_size[eqclass];
+  release_eqclass(eqclass);
+  return resolved;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::set_merge_identical(bool merge) {
+  merge_identical = merge;
+}
+
+template<typename policy>
+size_t basicLazyEvalMap<policy>::get_merge_count() const {
+  return merge_count;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::site_class_list_insert(eqclass_t eqclass, step_t site) {
+  size_t slot = site - site_list_base;
+  eqclass_t head = rep_eqclass_of_site[slot];
+  journal_site_slot(slot);
+  journal_eqclass(eqclass);
+  site_class_list_above[eqclass] = head;
+  site_class_list_below[eqclass] = no_eqclass;
+  if(head != no_eqclass) {
+    journal_eqclass(head);
+    site_class_list_below[head] = eqclass;
+  }
+  rep_eqclass_of_site[slot] = eqclass;
+  ++site_n_classes[slot];
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::site_class_list_remove(eqclass_t eqclass) {
+  size_t slot = eqclass_last_updated[eqclass] - site_list_base;
+  eqclass_t above = site_class_list_above[eqclass];
+  eqclass_t below = site_class_list_below[eqclass];
+  journal_site_slot(slot);
+  if(below != no_eqclass) {
+    journal_eqclass(below);
+    site_class_list_above[below] = above;
+  } else {
+    rep_eqclass_of_site[slot] = above;
+  }
+  if(above != no_eqclass) {
+    journal_eqclass(above);
+    site_class_list_below[above] = below;
+  }
+  --site_n_classes[slot];
+}
+
+template<typename policy>
+eqclass_t basicLazyEvalMap<policy>::get_rep_eqclass(step_t site) const {
+  return rep_eqclass_of_site[site - site_list_base];
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::extend_site_lists() {
+  site_n_classes.push_back(0);
+  rep_eqclass_of_site.push_back(no_eqclass);
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::truncate_site_lists(step_t new_base) {
+  if(new_base > site_list_base) {
+    size_t dropped = new_base - site_list_base;
+    site_n_classes.erase(site_n_classes.begin(), site_n_classes.begin() + dropped);
+    rep_eqclass_of_site.erase(rep_eqclass_of_site.begin(), 
+              rep_eqclass_of_site.begin() + dropped);
+    site_list_base = new_base;
+  }
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::open_reset_eqclass() {
+  add_identity_eqclass();
+}
+
+template<typename policy>
+const basicDPUpdateMap<policy>& basicLazyEvalMap<policy>::catch_up_row(row_t row) {
+  eqclass_t eqclass = resolve_row(row);
+  update_eqclass(eqclass);
+  return eqclass_to_map[eqclass];
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::move_row_to_newest_eqclass(row_t row) {
+  decrement_eqclass(resolve_row(row));
+  journal_row(row);
+  journal_eqclass(newest_eqclass);
+  row_to_eqclass[row] = newest_eqclass;
+  eqclass_size[newest_eqclass]++;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::delete_eqclass(size_t eqclass) {
   // eqclass_to_map[eqclass] = DPUpdateMap(0);
+  site_class_list_remove(eqclass);
+  journal_eqclass(eqclass);
   eqclass_size[eqclass] = 0;
   eqclass_last_updated[eqclass] = current_site;
   empty_eqclass_indices.push_back(eqclass);
   return;
 }
 
-void lazyEvalMap::decrement_eqclass(size_t eqclass) {
-  if(eqclass_size[eqclass] == 1) {
+// an eqclass which merged eqclasses still forward to outlives its last row
+template<typename policy>
+void basicLazyEvalMap<policy>::decrement_eqclass(size_t eqclass) {
+  journal_eqclass(eqclass);
+  if(eqclass_size[eqclass] == 1 && eqclass_forwarders[eqclass] == 0) {
     delete_eqclass(eqclass);
   } else {
     --eqclass_size[eqclass];
@@ -179,78 +731,104 @@ void lazyEvalMap::decrement_eqclass(size_t eqclass) {
   return;
 }
 
-void lazyEvalMap::remove_row_from_eqclass(size_t row) {
-  decrement_eqclass(row_to_eqclass[row]);
+template<typename policy>
+void basicLazyEvalMap<policy>::remove_row_from_eqclass(size_t row) {
+  decrement_eqclass(resolve_row(row));
+  journal_row(row);
   // unassigned row is given max possible eqclass index + 1 to ensure that
   // accessing it will throw an error
   row_to_eqclass[row] = row_to_eqclass.size();
   return;
 }
 
-void lazyEvalMap::add_eqclass(const DPUpdateMap& map) {
+template<typename policy>
+void basicLazyEvalMap<policy>::add_eqclass(const map_t& map) {
   if(empty_eqclass_indices.size() == 0) {
     newest_eqclass = eqclass_to_map.size();
     eqclass_to_map.push_back(map);
     eqclass_size.push_back(0);
     eqclass_last_updated.push_back(current_site);
+    site_class_list_above.push_back(no_eqclass);
+    site_class_list_below.push_back(no_eqclass);
+    eqclass_forward.push_back(no_eqclass);
+    eqclass_forwarders.push_back(0);
+    site_class_list_insert(newest_eqclass, current_site);
     return;
   } else {
+    journal_empty_pop();
     newest_eqclass = empty_eqclass_indices.back();
     empty_eqclass_indices.pop_back();
+    journal_eqclass(newest_eqclass);
     eqclass_to_map[newest_eqclass] = map;
     eqclass_size[newest_eqclass] = 0;
     eqclass_last_updated[newest_eqclass] = current_site;
+    site_class_list_insert(newest_eqclass, current_site);
     return;
   }
 }
 
-double lazyEvalMap::get_constant(size_t row) const {
-  return eqclass_to_map[row_to_eqclass[row]].constant;
+template<typename policy>
+typename policy::value_t basicLazyEvalMap<policy>::get_constant(size_t row) const {
+  return eqclass_to_map[find_eqclass(row_to_eqclass[row])].constant;
 }
 
-double lazyEvalMap::get_coefficient(size_t row) const {
-  return eqclass_to_map[row_to_eqclass[row]].coefficient;
+template<typename policy>
+typename policy::value_t basicLazyEvalMap<policy>::get_coefficient(size_t row) const {
+  return eqclass_to_map[find_eqclass(row_to_eqclass[row])].coefficient;
 }
 
-const DPUpdateMap& lazyEvalMap::get_map(size_t row) const {
-  return eqclass_to_map[row_to_eqclass[row]];
+template<typename policy>
+const basicDPUpdateMap<policy>& basicLazyEvalMap<policy>::get_map(size_t row) const {
+  return eqclass_to_map[find_eqclass(row_to_eqclass[row])];
 }
 
-const vector<DPUpdateMap>& lazyEvalMap::get_maps() const {
+template<typename policy>
+const vector<basicDPUpdateMap<policy> >& basicLazyEvalMap<policy>::get_maps() const {
   return eqclass_to_map;
 }
 
-vector<DPUpdateMap>& lazyEvalMap::get_maps() {
+template<typename policy>
+vector<basicDPUpdateMap<policy> >& basicLazyEvalMap<policy>::get_maps() {
   return eqclass_to_map;
 }
 
-const vector<size_t>& lazyEvalMap::get_map_indices() const {
+template<typename policy>
+const vector<size_t>& basicLazyEvalMap<policy>::get_map_indices() const {
   return row_to_eqclass;
 }
 
-void lazyEvalMap::stage_map_for_span(const DPUpdateMap& span_map) {
+template<typename policy>
+void basicLazyEvalMap<policy>::stage_map_for_span(const map_t& span_map) {
   stage_map_for_site(span_map);
   return;
 }
 
-void lazyEvalMap::stage_map_for_site(const DPUpdateMap& site_map) {
+template<typename policy>
+void basicLazyEvalMap<policy>::stage_map_for_site(const map_t& site_map) {
   current_site++;
   map_history.push_back(site_map);
+  extend_site_lists();
+  if(current_site >= next_history_collection && checkpoints.empty()) {
+    collect_history();
+  }
   return;
 }
 
-size_t lazyEvalMap::last_update(size_t row) const {
+template<typename policy>
+size_t basicLazyEvalMap<policy>::last_update(size_t row) const {
   if(row_to_eqclass[row] != row_to_eqclass.size()) {
-    return eqclass_last_updated[row_to_eqclass[row]];
+    return eqclass_last_updated[find_eqclass(row_to_eqclass[row])];
   } else {
     return current_site;
   }
 }
 
-const vector<DPUpdateMap>& lazyEvalMap::get_map_history() const {
-  return map_history.get_elements();
+template<typename policy>
+const basicMapHistory<policy>& basicLazyEvalMap<policy>::get_map_history() const {
+  return map_history;
 }
-void lazyEvalMap::reset_rows(const rowSet& rows) {
+template<typename policy>
+void basicLazyEvalMap<policy>::reset_rows(const rowSet& rows) {
   rowSet::const_iterator it = rows.begin();
   rowSet::const_iterator rows_end = rows.end();
   for(it; it != rows_end; ++it) {
@@ -264,27 +842,464 @@ void lazyEvalMap::reset_rows(const rowSet& rows) {
   }
 }
 
-void lazyEvalMap::update_active_rows(const rowSet& active_rows) {
-  // update_maps(rows_to_eqclassmask(active_rows));
-  update_maps(rows_to_eqclasses(active_rows));
+template<typename policy>
+void basicLazyEvalMap<policy>::update_active_rows(const rowSet& active_rows) {
+  gather_eqclasses(active_rows);
+  update_maps(active_eqclasses);
 }
 
-size_t lazyEvalMap::number_of_eqclasses() const {
-  return eqclass_size.size() - empty_eqclass_indices.size();
+template<typename policy>
+size_t basicLazyEvalMap<policy>::number_of_eqclasses() const {
+  return eqclass_size.size() - empty_eqclass_indices.size() - n_forwarded;
 }
 
-size_t lazyEvalMap::row_updated_to(size_t row) const {
-  return eqclass_last_updated[row_to_eqclass[row]];
+template<typename policy>
+size_t basicLazyEvalMap<policy>::row_updated_to(size_t row) const {
+  return eqclass_last_updated[find_eqclass(row_to_eqclass[row])];
 }
 
-size_t lazyEvalMap::get_current_site() const {
+template<typename policy>
+size_t basicLazyEvalMap<policy>::get_current_site() const {
   return current_site;
 }
 
-size_t lazyEvalMap::get_eqclass(size_t row) const {
-  return row_to_eqclass[row];
+template<typename policy>
+size_t basicLazyEvalMap<policy>::get_eqclass(size_t row) const {
+  return find_eqclass(row_to_eqclass[row]);
+}
+
+template<typename policy>
+typename policy::value_t basicLazyEvalMap<policy>::evaluate(size_t row, value_t value) const {
+  return eqclass_to_map[find_eqclass(row_to_eqclass[row])].of(value);
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::journal_row(row_t row) {
+  if(checkpoints.empty() || row_undo_stamp[row] == undo_epoch) {
+    return;
+  }
+  row_undo_stamp[row] = undo_epoch;
+  row_undo_log.push_back(make_pair(row, row_to_eqclass[row]));
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::journal_eqclass(eqclass_t eqclass) {
+  if(checkpoints.empty() || eqclass >= checkpoints.back().n_eqclass_entries ||
+            eqclass_undo_stamp[eqclass] == undo_epoch) {
+    return;
+  }
+  eqclass_undo_stamp[eqclass] = undo_epoch;
+  eqclassUndoRecord record = {eqclass, eqclass_to_map[eqclass], 
+            eqclass_size[eqclass], eqclass_last_updated[eqclass],
+            site_class_list_above[eqclass], site_class_list_below[eqclass],
+            eqclass_forward[eqclass], eqclass_forwarders[eqclass]};
+  eqclass_undo_log.push_back(record);
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::journal_site_slot(size_t slot) {
+  if(checkpoints.empty() || slot >= checkpoints.back().n_site_slots ||
+            site_list_undo_stamp[slot] == undo_epoch) {
+    return;
+  }
+  site_list_undo_stamp[slot] = undo_epoch;
+  siteListUndoRecord record = {slot, site_n_classes[slot], 
+            rep_eqclass_of_site[slot]};
+  site_list_undo_log.push_back(record);
 }
 
-double lazyEvalMap::evaluate(size_t row, double value) const {
-  return eqclass_to_map[row_to_eqclass[row]].of(value);
+// an entry can only change by being popped, so entries below the size at the
+// last checkpoint are saved as they are popped. Entries pushed since are cut
+// off on rollback
+template<typename policy>
+void basicLazyEvalMap<policy>::journal_empty_pop() {
+  size_t index = empty_eqclass_indices.size() - 1;
+  if(checkpoints.empty() || index >= checkpoints.back().n_empty_eqclasses) {
+    return;
+  }
+  empty_undo_log.push_back(make_pair(index, empty_eqclass_indices[index]));
 }
+
+template<typename policy>
+size_t basicLazyEvalMap<policy>::checkpoint() {
+  mapCheckpoint to_add;
+  to_add.current_site = current_site;
+  to_add.next_history_collection = next_history_collection;
+  to_add.newest_eqclass = newest_eqclass;
+  to_add.merge_count = merge_count;
+  to_add.n_forwarded = n_forwarded;
+  to_add.history_end = map_history.end_site();
+  to_add.n_eqclass_entries = eqclass_to_map.size();
+  to_add.n_site_slots = site_n_classes.size();
+  to_add.n_empty_eqclasses = empty_eqclass_indices.size();
+  to_add.row_log_length = row_undo_log.size();
+  to_add.eqclass_log_length = eqclass_undo_log.size();
+  to_add.site_list_log_length = site_list_undo_log.size();
+  to_add.empty_log_length = empty_undo_log.size();
+  checkpoints.push_back(to_add);
+  ++undo_epoch;
+  row_undo_stamp.resize(row_to_eqclass.size(), 0);
+  if(eqclass_undo_stamp.size() < to_add.n_eqclass_entries) {
+    eqclass_undo_stamp.resize(to_add.n_eqclass_entries, 0);
+  }
+  if(site_list_undo_stamp.size() < to_add.n_site_slots) {
+    site_list_undo_stamp.resize(to_add.n_site_slots, 0);
+  }
+  return checkpoints.size() - 1;
+}
+
+// the logs are replayed newest first, so that each entry ends with the value
+// it was first saved with. Records journaled under inner checkpoints may be
+// of eqclasses and slots created since the target, which are cut off
+template<typename policy>
+void basicLazyEvalMap<policy>::rollback(size_t checkpoint) {
+  if(checkpoint >= checkpoints.size()) {
+    throw runtime_error("rollback to a checkpoint which is not open");
+  }
+  const mapCheckpoint& target = checkpoints[checkpoint];
+  for(size_t i = row_undo_log.size(); i > target.row_log_length; i--) {
+    row_to_eqclass[row_undo_log[i - 1].first] = row_undo_log[i - 1].second;
+  }
+  row_undo_log.resize(target.row_log_length);
+  
+  size_t n_eqclasses = target.n_eqclass_entries;
+  eqclass_to_map.resize(n_eqclasses);
+  eqclass_size.resize(n_eqclasses);
+  eqclass_last_updated.resize(n_eqclasses);
+  site_class_list_above.resize(n_eqclasses);
+  site_class_list_below.resize(n_eqclasses);
+  eqclass_forward.resize(n_eqclasses);
+  eqclass_forwarders.resize(n_eqclasses);
+  for(size_t i = eqclass_undo_log.size(); i > target.eqclass_log_length; i--) {
+    const eqclassUndoRecord& record = eqclass_undo_log[i - 1];
+    eqclass_t eqclass = record.eqclass;
+    if(eqclass >= n_eqclasses) {
+      continue;
+    }
+    eqclass_to_map[eqclass] = record.map;
+    eqclass_size[eqclass] = record.size;
+    eqclass_last_updated[eqclass] = record.last_updated;
+    site_class_list_above[eqclass] = record.above;
+    site_class_list_below[eqclass] = record.below;
+    eqclass_forward[eqclass] = record.forward;
+    eqclass_forwarders[eqclass] = record.forwarders;
+  }
+  eqclass_undo_log.resize(target.eqclass_log_length);
+  
+  site_n_classes.resize(target.n_site_slots);
+  rep_eqclass_of_site.resize(target.n_site_slots);
+  for(size_t i = site_list_undo_log.size(); i > target.site_list_log_length; i--) {
+    const siteListUndoRecord& record = site_list_undo_log[i - 1];
+    if(record.slot >= target.n_site_slots) {
+      continue;
+    }
+    site_n_classes[record.slot] = record.n_classes;
+    rep_eqclass_of_site[record.slot] = record.rep_eqclass;
+  }
+  site_list_undo_log.resize(target.site_list_log_length);
+  
+  empty_eqclass_indices.resize(target.n_empty_eqclasses);
+  for(size_t i = empty_undo_log.size(); i > target.empty_log_length; i--) {
+    size_t index = empty_undo_log[i - 1].first;
+    if(index < empty_eqclass_indices.size()) {
+      empty_eqclass_indices[index] = empty_undo_log[i - 1].second;
+    }
+  }
+  empty_undo_log.resize(target.empty_log_length);
+  
+  map_history.truncate(target.history_end);
+  current_site = target.current_site;
+  next_history_collection = target.next_history_collection;
+  newest_eqclass = target.newest_eqclass;
+  merge_count = target.merge_count;
+  n_forwarded = target.n_forwarded;
+  checkpoints.erase(checkpoints.begin() + checkpoint + 1, checkpoints.end());
+  ++undo_epoch;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::release_checkpoints() {
+  checkpoints.clear();
+  row_undo_log.clear();
+  eqclass_undo_log.clear();
+  site_list_undo_log.clear();
+  empty_undo_log.clear();
+}
+
+template<typename policy>
+size_t basicLazyEvalMap<policy>::number_of_checkpoints() const {
+  return checkpoints.size();
+}
+
+//-- binary serialization ------------------------------------------------------
+
+// a degenerate map x |-> Ax has no constant to write
+template<typename policy>
+static void write_map(ostream& out, const basicDPUpdateMap<policy>& map) {
+  write_bool(out, map.is_degenerate());
+  write_value(out, map.coefficient);
+  if(!map.is_degenerate()) {
+    write_value(out, map.constant);
+  }
+}
+
+template<typename policy>
+static basicDPUpdateMap<policy> read_map(istream& in) {
+  bool degenerate = read_bool(in);
+  typename policy::value_t coefficient, constant;
+  read_value(in, coefficient);
+  if(degenerate) {
+    return basicDPUpdateMap<policy>(coefficient);
+  }
+  read_value(in, constant);
+  return basicDPUpdateMap<policy>(coefficient, constant);
+}
+
+template<typename policy>
+void basicMapHistory<policy>::serialize_binary(ostream& out, size_t from) const {
+  write_uint64(out, from);
+  write_uint64(out, end);
+  for(size_t i = from; i < end; i++) {
+    const entry_t& e = entry(i);
+    write_map(out, e.map);
+    write_uint64(out, e.previous);
+    write_map(out, e.suffix);
+  }
+}
+
+// entries are stored as written rather than pushed, since their skips may
+// reach below the new start. They are read into a new history, which replaces
+// this one only once the whole of it has been read
+template<typename policy>
+void basicMapHistory<policy>::deserialize_binary(istream& in) {
+  basicMapHistory loaded;
+  loaded.start = read_uint64(in);
+  loaded.base = loaded.start;
+  loaded.end = loaded.start;
+  size_t new_end = read_uint64(in);
+  if(new_end < loaded.start) {
+    throw runtime_error("corrupt map history in binary stream");
+  }
+  expect_items(in, new_end - loaded.start, 
+            2 * (1 + sizeof(typename policy::value_t)) + 8);
+  while(loaded.end < new_end) {
+    map_t map = read_map<policy>(in);
+    size_t previous = read_uint64(in);
+    map_t suffix = read_map<policy>(in);
+    if(previous > loaded.end) {
+      throw runtime_error("corrupt map history in binary stream");
+    }
+    loaded.writable_last_chunk()->entries.push_back(entry_t(map, previous,
+              suffix));
+    ++loaded.end;
+  }
+  for(size_t i = 0; i < chunks.size(); i++) {
+    if(chunks[i].use_count() == 1) {
+      chunks[i]->entries.clear();
+      spare_chunks.push_back(chunks[i]);
+    }
+  }
+  *this = loaded;
+}
+
+template<typename policy>
+void basicLazyEvalMap<policy>::serialize_binary(ostream& out) const {
+  if(!checkpoints.empty()) {
+    throw runtime_error("cannot serialize a lazyEvalMap with open checkpoints");
+  }
+  write_uint64(out, binary_tag("SLLSMAP2"));
+  write_uint64(out, policy::binary_id);
+  write_uint64(out, current_site);
+  write_uint64(out, next_history_collection);
+  write_uint64(out, newest_eqclass);
+  write_bool(out, merge_identical);
+  write_uint64(out, merge_count);
+  write_uint64(out, n_forwarded);
+  write_size_vector(out, row_to_eqclass);
+  write_uint64(out, eqclass_to_map.size());
+  for(size_t i = 0; i < eqclass_to_map.size(); i++) {
+    write_map(out, eqclass_to_map[i]);
+  }
+  write_size_vector(out, eqclass_size);
+  write_size_vector(out, eqclass_last_updated);
+  write_size_vector(out, empty_eqclass_indices);
+  write_size_vector(out, site_class_list_above);
+  write_size_vector(out, site_class_list_below);
+  write_size_vector(out, eqclass_forward);
+  write_size_vector(out, eqclass_forwarders);
+  step_t oldest = oldest_live_site();
+  size_t dropped = oldest - site_list_base;
+  write_uint64(out, oldest);
+  write_uint64(out, site_n_classes.size() - dropped);
+  for(size_t i = dropped; i < site_n_classes.size(); i++) {
+    write_uint64(out, site_n_classes[i]);
+    write_uint64(out, rep_eqclass_of_site[i]);
+  }
+  map_history.serialize_binary(out, oldest);
+}
+
+// true if every entry is below bound, or is no_eqclass where that is allowed
+static bool indices_below(const vector<size_t>& v, size_t bound,
+            bool may_be_none) {
+  for(size_t i = 0; i < v.size(); i++) {
+    if(v[i] >= bound && !(may_be_none && v[i] == (size_t)(-1))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// true if no chain of forwarded eqclasses loops, so that every chain ends
+static bool forwards_end(const vector<size_t>& forward) {
+  // 1 while on the chain being followed, 2 once known to end
+  vector<unsigned char> state(forward.size(), 0);
+  for(size_t i = 0; i < forward.size(); i++) {
+    size_t j = i;
+    while(j != (size_t)(-1) && state[j] == 0) {
+      state[j] = 1;
+      j = forward[j];
+    }
+    if(j != (size_t)(-1) && state[j] == 1) {
+      return false;
+    }
+    for(j = i; j != (size_t)(-1) && state[j] == 1; j = forward[j]) {
+      state[j] = 2;
+    }
+  }
+  return true;
+}
+
+// true if each per-site list, followed up from its head, ends without meeting
+// an eqclass met before and holds as many eqclasses as are counted at its site
+static bool site_lists_end(const vector<size_t>& heads,
+            const vector<size_t>& counts, const vector<size_t>& above) {
+  vector<bool> met(above.size(), false);
+  for(size_t slot = 0; slot < heads.size(); slot++) {
+    size_t length = 0;
+    for(size_t j = heads[slot]; j != (size_t)(-1); j = above[j]) {
+      if(met[j]) {
+        return false;
+      }
+      met[j] = true;
+      ++length;
+    }
+    if(length != counts[slot]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The map is read into a new one and every index is checked against the
+// vector it indexes before any of this map is replaced, so that a corrupt
+// stream leaves the map as it was
+template<typename policy>
+void basicLazyEvalMap<policy>::deserialize_binary(istream& in) {
+  expect_tag(in, binary_tag("SLLSMAP2"), "lazyEvalMap");
+  if(read_uint64(in) != policy::binary_id) {
+    throw runtime_error("lazyEvalMap in binary stream has another arithmetic policy");
+  }
+  basicLazyEvalMap loaded;
+  loaded.current_site = read_uint64(in);
+  loaded.next_history_collection = read_uint64(in);
+  loaded.newest_eqclass = read_uint64(in);
+  loaded.merge_identical = read_bool(in);
+  loaded.merge_count = read_uint64(in);
+  loaded.n_forwarded = read_uint64(in);
+  read_size_vector(in, loaded.row_to_eqclass);
+  if(loaded.row_to_eqclass.size() != row_to_eqclass.size()) {
+    throw runtime_error("lazyEvalMap in binary stream has another number of rows");
+  }
+  size_t n_eqclasses = read_count(in, 1 + sizeof(value_t));
+  for(size_t i = 0; i < n_eqclasses; i++) {
+    loaded.eqclass_to_map.push_back(read_map<policy>(in));
+  }
+  read_size_vector(in, loaded.eqclass_size);
+  read_size_vector(in, loaded.eqclass_last_updated);
+  read_size_vector(in, loaded.empty_eqclass_indices);
+  read_size_vector(in, loaded.site_class_list_above);
+  read_size_vector(in, loaded.site_class_list_below);
+  read_size_vector(in, loaded.eqclass_forward);
+  read_size_vector(in, loaded.eqclass_forwarders);
+  loaded.site_list_base = read_uint64(in);
+  size_t n_slots = read_count(in, 16);
+  for(size_t i = 0; i < n_slots; i++) {
+    loaded.site_n_classes.push_back(read_uint64(in));
+    loaded.rep_eqclass_of_site.push_back(read_uint64(in));
+  }
+  loaded.map_history.deserialize_binary(in);
+  bool valid = loaded.eqclass_size.size() == n_eqclasses && 
+            loaded.eqclass_last_updated.size() == n_eqclasses &&
+            loaded.site_class_list_above.size() == n_eqclasses &&
+            loaded.site_class_list_below.size() == n_eqclasses &&
+            loaded.eqclass_forward.size() == n_eqclasses &&
+            loaded.eqclass_forwarders.size() == n_eqclasses &&
+            loaded.empty_eqclass_indices.size() <= n_eqclasses &&
+            loaded.newest_eqclass < n_eqclasses &&
+            loaded.site_list_base + n_slots == loaded.current_site + 1 &&
+            loaded.map_history.start_site() == loaded.site_list_base &&
+            loaded.map_history.end_site() == loaded.current_site + 1 &&
+            indices_below(loaded.row_to_eqclass, n_eqclasses, false) &&
+            indices_below(loaded.empty_eqclass_indices, n_eqclasses, false) &&
+            indices_below(loaded.site_class_list_above, n_eqclasses, true) &&
+            indices_below(loaded.site_class_list_below, n_eqclasses, true) &&
+            indices_below(loaded.eqclass_forward, n_eqclasses, true) &&
+            indices_below(loaded.rep_eqclass_of_site, n_eqclasses, true) &&
+            forwards_end(loaded.eqclass_forward) &&
+            site_lists_end(loaded.rep_eqclass_of_site, loaded.site_n_classes,
+                      loaded.site_class_list_above);
+  // a live eqclass is listed at the site it was last updated to
+  for(size_t i = 0; valid && i < n_eqclasses; i++) {
+    valid = loaded.eqclass_last_updated[i] <= loaded.current_site &&
+              (loaded.eqclass_size[i] == 0 ||
+               loaded.eqclass_last_updated[i] >= loaded.site_list_base);
+  }
+  if(!valid) {
+    throw runtime_error("corrupt lazyEvalMap in binary stream");
+  }
+  release_checkpoints();
+  current_site = loaded.current_site;
+  next_history_collection = loaded.next_history_collection;
+  newest_eqclass = loaded.newest_eqclass;
+  merge_identical = loaded.merge_identical;
+  merge_count = loaded.merge_count;
+  n_forwarded = loaded.n_forwarded;
+  row_to_eqclass.swap(loaded.row_to_eqclass);
+  eqclass_to_map.swap(loaded.eqclass_to_map);
+  eqclass_size.swap(loaded.eqclass_size);
+  eqclass_last_updated.swap(loaded.eqclass_last_updated);
+  empty_eqclass_indices.swap(loaded.empty_eqclass_indices);
+  site_class_list_above.swap(loaded.site_class_list_above);
+  site_class_list_below.swap(loaded.site_class_list_below);
+  eqclass_forward.swap(loaded.eqclass_forward);
+  eqclass_forwarders.swap(loaded.eqclass_forwarders);
+  site_list_base = loaded.site_list_base;
+  site_n_classes.swap(loaded.site_n_classes);
+  rep_eqclass_of_site.swap(loaded.rep_eqclass_of_site);
+  map_history = loaded.map_history;
+}
+
+template struct basicHistoryEntry<logSpace<double> >;
+template struct basicHistoryChunk<logSpace<double> >;
+template struct basicMapHistory<logSpace<double> >;
+template struct basicLazyEvalMap<logSpace<double> >;
+template struct basicHistoryEntry<logSpace<float> >;
+template struct basicHistoryChunk<logSpace<float> >;
+template struct basicMapHistory<logSpace<float> >;
+template struct basicLazyEvalMap<logSpace<float> >;
+template struct basicHistoryEntry<scaledLinear<double> >;
+template struct basicHistoryChunk<scaledLinear<double> >;
+template struct basicMapHistory<scaledLinear<double> >;
+template struct basicLazyEvalMap<scaledLinear<double> >;
+template struct basicHistoryEntry<scaledLinear<float> >;
+template struct basicHistoryChunk<scaledLinear<float> >;
+template struct basicMapHistory<scaledLinear<float> >;
+template struct basicLazyEvalMap<scaledLinear<float> >;
+template struct basicHistoryEntry<maxProduct>;
+template struct basicHistoryChunk<maxProduct>;
+template struct basicMapHistory<maxProduct>;
+template struct basicLazyEvalMap<maxProduct>;
+template struct basicHistoryEntry<sweepLinear>;
+template struct basicHistoryChunk<sweepLinear>;
+template struct basicMapHistory<sweepLinear>;
+template struct basicLazyEvalMap<sweepLinear>;
@@ -2,6 +2,9 @@
 #define DELAY_MULTIPLIER_H
 
 #include <vector>
+#include <memory>
+#include <istream>
+#include <ostream>
 #include "DP_map.hpp"
 #include "row_set.hpp"
 
@@ -11,30 +14,89 @@ typedef size_t eqclass_t;
 typedef size_t row_t;
 typedef size_t step_t;
 
-struct mapHistory{
+// Each entry i of the history holds the map for site i, the site prev_site(i)
+// its Fenwick skip reaches back to, and the composition suffix(i) of the maps
+// over that skip
+template<typename policy>
+struct basicHistoryEntry{
+  typedef basicDPUpdateMap<policy> map_t;
+  map_t map;
+  size_t previous;
+  map_t suffix;
+  basicHistoryEntry(const map_t& map, size_t previous,
+              const map_t& suffix);
+};
+
+// Entries are stored in fixed-size chunks. Full chunks are never written
+// again, so copies of a history share them by reference count and a copy
+// costs one pointer per chunk. The last chunk is cloned before writing only
+// if another history still refers to it
+template<typename policy>
+struct basicHistoryChunk{
+  typedef basicHistoryEntry<policy> entry_t;
+  static const size_t length_bits = 7;
+  static const size_t capacity = 1 << length_bits;
+  vector<entry_t> entries;
+  basicHistoryChunk();
+  basicHistoryChunk(const basicHistoryChunk& other);
+};
+
+template<typename policy>
+struct basicMapHistory{
+public:
+  typedef basicDPUpdateMap<policy> map_t;
+  typedef basicHistoryEntry<policy> entry_t;
+  typedef basicHistoryChunk<policy> chunk_t;
 private:
 	size_t start;
-	vector<DPUpdateMap> elements;
-  vector<size_t> previous;
-  vector<DPUpdateMap> suffixes;
+  // site of the first entry of chunks[0]
+  size_t base;
+  // one past the last site in the history
+  size_t end;
+  vector<shared_ptr<chunk_t> > chunks;
+  // cleared chunks kept by reset() for reuse; never shared with copies
+  vector<shared_ptr<chunk_t> > spare_chunks;
+  
+  const entry_t& entry(size_t i) const;
+  chunk_t* writable_last_chunk();
 public:
-  mapHistory();
-  mapHistory(const DPUpdateMap& map, size_t start = 0);
-  mapHistory(const mapHistory& other); 
-  mapHistory(const mapHistory& other, size_t new_start);
+  basicMapHistory();
+  basicMapHistory(const map_t& map, size_t start = 0);
+  basicMapHistory(const basicMapHistory& other); 
+  basicMapHistory(const basicMapHistory& other, size_t new_start);
+  basicMapHistory& operator=(const basicMapHistory& other);
   
   void reserve_length(size_t length);
+  // clears the history down to a single map at site `start` without releasing
+  // the storage already allocated
+  void reset(const map_t& map, size_t start = 0);
 	
-	void push_back(const DPUpdateMap& map);
+	void push_back(const map_t& map);
+  // forgets the maps at sites from new_end on. A chunk still shared with a
+  // copy is cloned before it is cut
+  void truncate(size_t new_end);
+  // composition of the maps at sites (from, to], in O(log n) compositions
+  map_t compose_range(size_t from, size_t to) const;
 	
-	DPUpdateMap& operator[](size_t i);
-	DPUpdateMap& back();
-  DPUpdateMap& suffix(size_t i);
-  size_t& prev_site(size_t i);
+	const map_t& operator[](size_t i) const;
+	const map_t& back() const;
+  const map_t& suffix(size_t i) const;
+  size_t prev_site(size_t i) const;
   size_t start_site() const;
+  // one past the last site in the history
+  size_t end_site() const;
   
 	size_t size() const;
-  const vector<DPUpdateMap>& get_elements() const;
+  // forgets the maps at sites before new_start, releasing the chunks which
+  // lie entirely below it
+  void drop_before(size_t new_start);
+  // number of chunks this history refers to
+  size_t number_of_chunks() const;
+  
+  // writes the entries at sites from `from` on, in the format of
+  // binary_io.hpp; reading them back replaces the history
+  void serialize_binary(ostream& out, size_t from) const;
+  void deserialize_binary(istream& in);
 };
 
 // Shorthand for statements of complexity:
@@ -52,20 +114,29 @@ public:
 // DP to O(M_avg * n) from O(|H| * n) at the expense of a memory use increase to
 // O(|H| + n) from O(|H|). However, the lazyEvalMap struct need not be
 // stored and may be replaced with O(|H|) information as long as we call
-// hard_update_all() first at at cost of O(|eqclasses| + n) time
+// hard_update_all() first at at cost of O(|eqclasses| log n) time
+//
+// Copies share the map history chunk by chunk, so copying costs
+// O(|H| + n / chunk length) and sibling states share their common prefix
 //
-// TODO this is currently O(n) to copy. Speed it up. Though for single query 
-// case doesn't matter if H < n(H^(2/3)). Certainly can assume that H < MAC
-struct lazyEvalMap{
+// The maps are evaluated under an arithmetic policy (see DP_map.hpp):
+// lazyEvalMap serves the log-space forward algorithm and maxProductLazyEvalMap
+// the Viterbi algorithm
+template<typename policy>
+struct basicLazyEvalMap{
+public:
+  typedef typename policy::value_t value_t;
+  typedef basicDPUpdateMap<policy> map_t;
+  typedef basicMapHistory<policy> history_t;
 private:  
   step_t current_site = 0;
   step_t current_step = 0;
-  mapHistory map_history;
+  history_t map_history;
 
   vector<eqclass_t> row_to_eqclass;                         // size = # haplotypes
 
   eqclass_t newest_eqclass = 0;
-  vector<DPUpdateMap> eqclass_to_map;                    // size = # eqclasses
+  vector<map_t> eqclass_to_map;                          // size = # eqclasses
   vector<size_t> eqclass_size;                           // size = # eqclasses
   vector<step_t> eqclass_last_updated;                // size = # eqclasses
   // stores which map eqclasses have been emptied so that new map
@@ -80,32 +151,137 @@ private:
   void decrement_eqclass(eqclass_t eqclass);
   // clears eqclass and returns it to the list of empty eqclasses
   void delete_eqclass(eqclass_t eqclass);
-  vector<DPUpdateMap> suffixes;
+  // moves all rows into a single identity eqclass without releasing storage
+  void collapse_eqclasses();
+  
+  // the history is condensed whenever the site marker reaches
+  // next_history_collection; see collect_history()
+  static const size_t min_history_window = 256;
+  step_t next_history_collection = 2 * min_history_window;
+  void collect_history();
+  // earliest site to which any live eqclass is updated
+  step_t oldest_live_site() const;
+  
+  // scratch buffers reused from site to site so that steady-state updates do
+  // not touch the heap. An eqclass is marked as gathered in the current pass
+  // by stamping it with the pass's epoch, so marks never need clearing and a
+  // pass costs O(|rows|) regardless of the number of eqclasses
+  vector<eqclass_t> active_eqclasses;
+  vector<size_t> eqclass_epoch;
+  size_t current_epoch = 0;
+  void gather_eqclasses(const rowSet& rows);
     
-  vector<size_t> site_n_classes;
-  vector<eqclass_t> site_class_list_above;
-  vector<eqclass_t> site_class_list_below;
-  vector<eqclass_t> rep_eqclass_of_site;
-  
-  inline bool is_singleton(eqclass_t eqclass) const;
-  inline bool is_front(eqclass_t eqclass) const;
-  void site_class_list_pop(step_t site);
-  eqclass_t get_eqclass_below(eqclass_t eqclass);
-  eqclass_t get_eqclass_above(eqclass_t eqclass);
-  eqclass_t get_rep_eqclass(step_t site);
-  void set_eqclass_below(eqclass_t eqclass, eqclass_t below);
-  void set_eqclass_above(eqclass_t eqclass, eqclass_t above);
-  void set_rep_eqclass(step_t site, eqclass_t rep);
-  void clear_rep_eqclass(step_t site);
-  void eqclass_unset_last_updated(eqclass_t eqclass);
-  void site_class_list_remove(size_t eqclass);
+  // Live eqclasses are grouped by the site to which they were last updated,
+  // in doubly-linked lists threaded through site_class_list_above/below with
+  // rep_eqclass_of_site holding the head of each site's list. Per-site
+  // entries are indexed from site_list_base
+  static const eqclass_t no_eqclass = (eqclass_t)(-1);
+  step_t site_list_base = 0;
+  vector<size_t> site_n_classes;                         // size = # sites
+  vector<eqclass_t> rep_eqclass_of_site;                 // size = # sites
+  vector<eqclass_t> site_class_list_above;               // size = # eqclasses
+  vector<eqclass_t> site_class_list_below;               // size = # eqclasses
+  
+  // O(1) insertion at the head of a site's list, and O(1) removal
+  void site_class_list_insert(eqclass_t eqclass, step_t site);
+  void site_class_list_remove(eqclass_t eqclass);
+  eqclass_t get_rep_eqclass(step_t site) const;
+  // adds an empty list for the current site
+  void extend_site_lists();
+  // forgets the lists of sites before new_base
+  void truncate_site_lists(step_t new_base);
+  // applies the composition of the maps in (site, top] to every eqclass
+  // listed at site, composing the history range once for the whole group,
+  // and moves the group to the list of site top
+  void catch_up_site(step_t site, step_t top);
+  
+  // Optionally, eqclasses caught up together whose maps are then identical
+  // are merged. A merged eqclass forwards to the eqclass it was merged into
+  // and rows still assigned to it are moved over the next time they are
+  // updated, so merging costs nothing per row. A forwarded eqclass is freed
+  // once no row or other forwarded eqclass refers to it
+  bool merge_identical = false;
+  size_t merge_count = 0;
+  size_t n_forwarded = 0;
+  vector<eqclass_t> eqclass_forward;                     // size = # eqclasses
+  vector<size_t> eqclass_forwarders;                     // size = # eqclasses
+  vector<eqclass_t> merge_candidates;
+  void merge_identical_in_group(step_t site);
+  void merge_eqclass(eqclass_t from, eqclass_t into);
+  // frees forwarded eqclasses which nothing refers to any more
+  void release_eqclass(eqclass_t eqclass);
+  // eqclass which a row's (possibly forwarded) eqclass resolves to
+  eqclass_t find_eqclass(eqclass_t eqclass) const;
+  // resolves the row's eqclass and reassigns the row to it
+  eqclass_t resolve_row(row_t row);
+  
+  // While a checkpoint is open, every row assignment, eqclass and per-site
+  // list entry is saved to an undo log before its first change since the
+  // checkpoint was opened or last rolled back to; being saved in the current
+  // undo epoch is marked by a stamp, as with gathered eqclasses. Entries
+  // created since the checkpoint are simply truncated on rollback, so a
+  // rollback costs O(entries changed). History collection is deferred while
+  // a checkpoint is open, so that no index the log refers to moves
+  struct eqclassUndoRecord{
+    eqclass_t eqclass;
+    map_t map;
+    size_t size;
+    step_t last_updated;
+    eqclass_t above;
+    eqclass_t below;
+    eqclass_t forward;
+    size_t forwarders;
+  };
+  struct siteListUndoRecord{
+    size_t slot;
+    size_t n_classes;
+    eqclass_t rep_eqclass;
+  };
+  struct mapCheckpoint{
+    step_t current_site;
+    step_t next_history_collection;
+    eqclass_t newest_eqclass;
+    size_t merge_count;
+    size_t n_forwarded;
+    size_t history_end;
+    size_t n_eqclass_entries;
+    size_t n_site_slots;
+    size_t n_empty_eqclasses;
+    size_t row_log_length;
+    size_t eqclass_log_length;
+    size_t site_list_log_length;
+    size_t empty_log_length;
+  };
+  vector<mapCheckpoint> checkpoints;
+  size_t undo_epoch = 0;
+  vector<size_t> row_undo_stamp;                         // size = # haplotypes
+  vector<size_t> eqclass_undo_stamp;                     // size = # eqclasses
+  vector<size_t> site_list_undo_stamp;                   // size = # sites
+  vector<pair<row_t, eqclass_t> > row_undo_log;
+  vector<eqclassUndoRecord> eqclass_undo_log;
+  vector<siteListUndoRecord> site_list_undo_log;
+  // (index, value) of entries popped from empty_eqclass_indices
+  vector<pair<size_t, eqclass_t> > empty_undo_log;
+  void journal_row(row_t row);
+  void journal_eqclass(eqclass_t eqclass);
+  void journal_site_slot(size_t slot);
+  void journal_empty_pop();
 public:
-  lazyEvalMap();
-  lazyEvalMap(size_t rows, size_t start = 0);
-  lazyEvalMap(const lazyEvalMap& other);
+  basicLazyEvalMap();
+  basicLazyEvalMap(size_t rows, size_t start = 0);
+  basicLazyEvalMap(const basicLazyEvalMap& other);
+  // copies as the copy constructor does, keeping the history back to the
+  // oldest live eqclass; open checkpoints of this map are released and those
+  // of the other are not copied
+  basicLazyEvalMap& operator=(const basicLazyEvalMap& other);
   
+  // reserves history storage for a query of `length` sites and spans
   void reserve_length(size_t length);
+  // returns the map to its just-constructed state starting at site `start`,
+  // keeping all allocated storage for reuse
+  void reset(size_t start = 0);
 	
+  // brings the eqclass's map up to the current site in O(log n)
   void update_eqclass(eqclass_t eqclass);
   void remove_from_site(eqclass_t eqclass);
   void add_to_current_site(eqclass_t eqclass);
@@ -113,22 +289,23 @@ public:
 	void assign_row_to_newest_eqclass(row_t row);
 	void remove_row_from_eqclass(row_t row);
 	
-  double evaluate(row_t row, double value) const;
+  value_t evaluate(row_t row, value_t value) const;
 
-  vector<size_t> rows_to_eqclasses(const rowSet& rows) const;
+  // distinct eqclasses of the rows, valid until the next update
+  const vector<eqclass_t>& rows_to_eqclasses(const rowSet& rows);
     
-	void stage_map_for_site(const DPUpdateMap& site_map);
-  void stage_map_for_span(const DPUpdateMap& span_map);
+	void stage_map_for_site(const map_t& site_map);
+  void stage_map_for_span(const map_t& span_map);
 
   // takes in a set of eqclass indices and extends their eqclass_to_map
-  // time complexity is O(|indices| + n)
+  // time complexity is O(|indices| log n)
   void update_maps(const vector<eqclass_t>& eqclasses);
 	
   void update_active_rows(const rowSet& active_rows);
   
   // Updates all maps to current position in preparation for taking a
   // "snapshot" of the current state of the DP.
-  // This has a cost of O(|eqclasses| + n) time but allows 
+  // This has a cost of O(|eqclasses| log n) time but allows 
   // storage of the DP state in O(|population|) rather than 
   // O(|population| + |sites|) space
   void hard_update_all();  
@@ -137,20 +314,36 @@ public:
 
 	void reset_rows(const rowSet& rows);
 
+  // per-row primitives for a single streaming pass over the active rows:
+  // open_reset_eqclass() first, then for each row catch_up_row() followed by
+  // move_row_to_newest_eqclass()
+  void open_reset_eqclass();
+  // brings the row's eqclass up to the current site and returns its map
+  const map_t& catch_up_row(row_t row);
+  void move_row_to_newest_eqclass(row_t row);
+
   // Adds a new eqclass containing the given DPUpdateMap
-  void add_eqclass(const DPUpdateMap& map);
+  void add_eqclass(const map_t& map);
   void add_identity_eqclass();
 	
-  // get a vector of indices-among-eqclasses of maps assigned to rows
+  // get a vector of indices-among-eqclasses of maps assigned to rows. If
+  // merging is enabled these may be merged eqclasses; get_eqclass(row)
+  // resolves them
   const vector<size_t>& 			get_map_indices() const;
-  const DPUpdateMap& 					get_map(row_t row) const;
-	const vector<DPUpdateMap>& 	get_map_history() const;
-  vector<DPUpdateMap>& 				get_maps();
-  const vector<DPUpdateMap>& 	get_maps() const;
-	double                      get_coefficient(row_t row) const;  
-	double                      get_constant(row_t row) const;
+  const map_t& 					get_map(row_t row) const;
+	const history_t& 	        get_map_history() const;
+  vector<map_t>& 				get_maps();
+  const vector<map_t>& 	get_maps() const;
+	value_t                     get_coefficient(row_t row) const;  
+	value_t                     get_constant(row_t row) const;
     
   size_t number_of_eqclasses() const;
+  
+  // enables merging eqclasses whose maps become identical when caught up
+  // together; off by default
+  void set_merge_identical(bool merge);
+  // number of eqclasses merged away since construction or the last reset
+  size_t get_merge_count() const;
 	size_t get_current_site() const;
   
   void increment_site_marker();
@@ -159,8 +352,35 @@ public:
 	size_t last_update(row_t row) const;
   size_t get_eqclass(row_t row) const;
   
+  // brings every live eqclass last updated in [bottom, top) up to site top,
+  // then drops the history older than the oldest live eqclass, unless a
+  // checkpoint is open
+  // time complexity is O(|eqclasses| + |caught-up eqclasses| log n)
   void 
   condense_history(step_t top, step_t bottom);
+  
+  // opens a checkpoint at the current site and returns its index. Checkpoints
+  // nest; rolling back to one discards those opened after it but keeps it
+  // open, so that several continuations can be tried from it in turn
+  size_t checkpoint();
+  // restores the map to its state when the checkpoint was opened, in time
+  // proportional to the entries changed since
+  void rollback(size_t checkpoint);
+  // closes every checkpoint and discards the undo log
+  void release_checkpoints();
+  size_t number_of_checkpoints() const;
+  
+  // Writes the eqclasses, their per-site lists and the history back to the
+  // oldest live eqclass, as a copy would keep them, in the format of
+  // binary_io.hpp; reading them back replaces the map, which must have the
+  // same number of rows. Scratch buffers are not written. Throws if a
+  // checkpoint is open, since the undo log is not written either
+  void serialize_binary(ostream& out) const;
+  void deserialize_binary(istream& in);
 };
 
+typedef basicMapHistory<sumProduct> mapHistory;
+typedef basicLazyEvalMap<sumProduct> lazyEvalMap;
+typedef basicLazyEvalMap<maxProduct> maxProductLazyEvalMap;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include "dense_solver.hpp"
+
+using namespace std;
+
+// independent partial sums per pass, which lets the compiler vectorize the
+// summation without reassociating it
+static const size_t LANES = 8;
+// partial sums of neighbouring threads are kept a cache line apart
+static const size_t SUM_STRIDE = 8;
+
+// R <- e(h) (aR + b) over a block of rows, returning the sum of the new R
+static double dense_site_pass(double* R, const unsigned char* column,
+            unsigned char allele, size_t n_rows, double coefficient,
+            double constant, double match, double mismatch) {
+  double sums[LANES] = {0};
+  size_t blocked = n_rows - n_rows % LANES;
+  for(size_t i = 0; i < blocked; i += LANES) {
+    for(size_t k = 0; k < LANES; k++) {
+      double emission = column[i + k] == allele ? match : mismatch;
+      double x = emission * (coefficient * R[i + k] + constant);
+      R[i + k] = x;
+      sums[k] += x;
+    }
+  }
+  for(size_t i = blocked; i < n_rows; i++) {
+    double emission = column[i] == allele ? match : mismatch;
+    double x = emission * (coefficient * R[i] + constant);
+    R[i] = x;
+    sums[0] += x;
+  }
+  double to_return = 0;
+  for(size_t k = 0; k < LANES; k++) {
+    to_return += sums[k];
+  }
+  return to_return;
+}
+
+// threads wait here once per site, until every thread has written its
+// partial sum
+struct denseFwdSolver::siteBarrier{
+  size_t n_threads;
+  atomic<size_t> arrived;
+  atomic<size_t> generation;
+  siteBarrier(size_t n_threads) : n_threads(n_threads), arrived(0),
+            generation(0) {}
+  void wait() {
+    size_t current = generation.load(memory_order_acquire);
+    if(arrived.fetch_add(1, memory_order_acq_rel) + 1 == n_threads) {
+      arrived.store(0, memory_order_relaxed);
+      generation.fetch_add(1, memory_order_release);
+    } else {
+      while(generation.load(memory_order_acquire) == current) {
+        this_thread::yield();
+      }
+    }
+  }
+};
+
+denseFwdSolver::denseFwdSolver(siteIndex* reference,
+            const penaltySet* penalties, const haplotypeCohort* cohort,
+            size_t n_threads) :
+            reference(reference), penalties(penalties), cohort(cohort),
+            H(cohort->get_n_haplotypes()) {
+  set_threads(n_threads);
+  size_t n_sites = cohort->get_n_sites();
+  columns.resize(n_sites * H);
+  for(size_t h = 0; h < H; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      columns[i * H + h] = (unsigned char)cohort->allele_at(i, h);
+    }
+  }
+  R.resize(H);
+}
+
+denseFwdSolver::~denseFwdSolver() {
+
+}
+
+void denseFwdSolver::set_threads(size_t n_threads) {
+  this->n_threads = max((size_t)1, n_threads);
+}
+
+size_t denseFwdSolver::get_threads() const {
+  return n_threads;
+}
+
+// The first site starts every row at e(h)/|H|, whether or not there is a
+// left tail, since the left tail leaves R uniform. Every later site composes
+// the span before it, in the gap after the previous site, with the step onto
+// it: R <- c_step (c_span R + s_span S) + rho S. Mutation penalties of spans
+// are summed into log_m
+void denseFwdSolver::stage_steps(const inputHaplotype* q, double& log_m) {
+  size_t n_sites = q->number_of_sites();
+  steps.resize(n_sites);
+  log_m = penalties->log_span_mutation_penalty(q->get_left_tail(),
+            q->get_n_novel_SNVs(-1));
+  for(size_t j = 0; j < n_sites; j++) {
+    size_t site_index = q->get_site_index(j);
+    siteStep& step = steps[j];
+    step.match = exp(penalties->one_minus_mu_at(site_index));
+    step.mismatch = exp(penalties->mu_at(site_index));
+    step.column = &columns[site_index * H];
+    step.allele = (unsigned char)q->get_allele(j);
+    if(j == 0) {
+      step.coefficient = 0;
+      step.constant = exp(-penalties->log_H);
+      continue;
+    }
+    // a single row has no other to recombine to, and its rho is undefined
+    if(H == 1) {
+      step.coefficient = 1;
+      step.constant = 0;
+      if(q->has_span_after(j - 1)) {
+        log_m += penalties->log_span_mutation_penalty(q->get_span_after(j - 1),
+                  q->get_n_novel_SNVs(j - 1));
+      }
+      continue;
+    }
+    double step_coefficient = exp(penalties->composed_R_coefficient(1,
+              site_index));
+    double rho = exp(penalties->rho_at_gap(site_index));
+    double span_coefficient = 1;
+    double span_constant = 0;
+    if(q->has_span_after(j - 1)) {
+      size_t l = q->get_span_after(j - 1);
+      size_t gap = q->get_site_index(j - 1) + 1;
+      span_coefficient = exp(penalties->composed_R_coefficient(l, gap));
+      span_constant = exp(penalties->span_coefficient(l, gap));
+      log_m += penalties->log_span_mutation_penalty(l,
+                q->get_n_novel_SNVs(j - 1));
+    }
+    step.coefficient = step_coefficient * span_coefficient;
+    step.constant = step_coefficient * span_constant + rho;
+  }
+  // the right tail conserves S
+  if(n_sites != 0 && q->has_span_after(n_sites - 1)) {
+    log_m += penalties->log_span_mutation_penalty(
+              q->get_span_after(n_sites - 1), q->get_n_novel_SNVs(n_sites - 1));
+  }
+}
+
+// runs every site over rows [begin, end), returning the sum of log S over the
+// sites. R is divided by the last S as it is mapped, so stays near a sum of 1
+double denseFwdSolver::run_rows(size_t begin, size_t end, size_t thread,
+            size_t n_used, vector<double>& partial_sums, siteBarrier* barrier) {
+  double S = 1;
+  double log_S_sum = 0;
+  for(size_t j = 0; j < steps.size(); j++) {
+    const siteStep& step = steps[j];
+    double partial = dense_site_pass(&R[begin], step.column + begin,
+              step.allele, end - begin, step.coefficient / S, step.constant,
+              step.match, step.mismatch);
+    if(n_used == 1) {
+      S = partial;
+    } else {
+      // partial sums alternate between two buffers, so that a thread cannot
+      // overwrite a sum which another has still to read
+      double* sums = &partial_sums[(j % 2) * n_used * SUM_STRIDE];
+      sums[thread * SUM_STRIDE] = partial;
+      barrier->wait();
+      S = 0;
+      for(size_t t = 0; t < n_used; t++) {
+        S += sums[t * SUM_STRIDE];
+      }
+    }
+    log_S_sum += log(S);
+  }
+  return log_S_sum;
+}
+
+double denseFwdSolver::calculate_probability(const inputHaplotype* q) {
+  double log_m;
+  stage_steps(q, log_m);
+  if(steps.empty()) {
+    return log_m;
+  }
+  size_t n_used = min(n_threads, H);
+  vector<double> partial_sums(2 * n_used * SUM_STRIDE, 0);
+  if(n_used == 1) {
+    return run_rows(0, H, 0, 1, partial_sums, nullptr) + log_m;
+  }
+  siteBarrier barrier(n_used);
+  size_t block = (H + n_used - 1) / n_used;
+  double log_S_sum = 0;
+  auto work = [&](size_t t) {
+    size_t begin = min(t * block, H);
+    size_t end = min(begin + block, H);
+    double result = run_rows(begin, end, t, n_used, partial_sums, &barrier);
+    if(t == 0) {
+      log_S_sum = result;
+    }
+  };
+  vector<thread> threads;
+  for(size_t t = 1; t < n_used; t++) {
+    threads.push_back(thread(work, t));
+  }
+  work(0);
+  for(size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  return log_S_sum + log_m;
+}
+
+forwardScorer::forwardScorer(forwardEngine engine, siteIndex* reference,
+            const penaltySet* penalties, const haplotypeCohort* cohort,
+            size_t n_threads) : engine(engine) {
+  if(engine == FAST_FORWARD) {
+    fast = new fastFwdAlgState(reference, penalties, cohort);
+  } else if(engine == DENSE_FORWARD) {
+    dense = new denseFwdSolver(reference, penalties, cohort, n_threads);
+  } else {
+    throw runtime_error("unknown forward engine");
+  }
+}
+
+forwardScorer::~forwardScorer() {
+  delete fast;
+  delete dense;
+}
+
+forwardEngine forwardScorer::get_engine() const {
+  return engine;
+}
+
+double forwardScorer::calculate_probability(const inputHaplotype* q) {
+  if(engine == FAST_FORWARD) {
+    return fast->calculate_probability(q);
+  } else {
+    return dense->calculate_probability(q);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef LINEAR_HAPLO_DENSE_SOLVER_H
+#define LINEAR_HAPLO_DENSE_SOLVER_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+// A denseFwdSolver is the conventional O(n|H|) forward algorithm, written to
+// be as fast as a dense method can be so that it serves both as a correctness
+// oracle and as a fair baseline for the lazy fwdAlgStates. It follows the
+// model of fastFwdAlgState exactly, including left and right tails, novel
+// SNVs within spans and site rates of the penaltySet.
+//
+// R-values are held in scaled linear space. The span before a site and the
+// step onto it compose to a single map aR + bS, so each site is one flat pass
+// over |H| contiguous R-values and the site's column of alleles which the
+// compiler can vectorize, summing into separate lanes as it goes. The cohort
+// is copied site-major at construction for the columns, at one byte per row
+// per site.
+//
+// Rows may be divided into contiguous blocks between threads, which meet
+// once per site to sum S; this pays off only for cohorts with many thousands
+// of rows
+struct denseFwdSolver{
+private:
+  siteIndex* reference;
+  const penaltySet* penalties;
+  const haplotypeCohort* cohort;
+  size_t n_threads;
+  size_t H;
+  // alleles by site, then by row
+  vector<unsigned char> columns;
+  vector<double> R;
+
+  // the composed map of the span before a site and the step onto it, less
+  // the division by S, and the site's emissions
+  struct siteStep{
+    double coefficient;
+    double constant;
+    double match;
+    double mismatch;
+    const unsigned char* column;
+    unsigned char allele;
+  };
+  vector<siteStep> steps;
+  struct siteBarrier;
+  void stage_steps(const inputHaplotype* q, double& log_m);
+  double run_rows(size_t begin, size_t end, size_t thread, size_t n_used,
+              vector<double>& partial_sums, siteBarrier* barrier);
+public:
+  denseFwdSolver(siteIndex* reference, const penaltySet* penalties,
+              const haplotypeCohort* cohort, size_t n_threads = 1);
+  ~denseFwdSolver();
+
+  // threads beyond the number of rows are not started
+  void set_threads(size_t n_threads);
+  size_t get_threads() const;
+  double calculate_probability(const inputHaplotype* q);
+};
+
+enum forwardEngine{
+  FAST_FORWARD = 0,
+  DENSE_FORWARD = 1
+};
+
+// scores queries with either engine behind one call, for differential tests
+// and for benchmarks which measure the lazy engine against the dense one
+struct forwardScorer{
+private:
+  forwardEngine engine;
+  fastFwdAlgState* fast = nullptr;
+  denseFwdSolver* dense = nullptr;
+public:
+  forwardScorer(forwardEngine engine, siteIndex* reference,
+              const penaltySet* penalties, const haplotypeCohort* cohort,
+              size_t n_threads = 1);
+  ~forwardScorer();
+  forwardScorer(const forwardScorer& other) = delete;
+  forwardScorer& operator=(const forwardScorer& other) = delete;
+
+  forwardEngine get_engine() const;
+  double calculate_probability(const inputHaplotype* q);
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "edit_scorer.hpp"
+#include "math.hpp"
+
+using namespace std;
+
+editScorer::editScorer(siteIndex* reference, const penaltySet* penalties,
+            const haplotypeCohort* cohort) :
+            reference(reference), penalties(penalties), cohort(cohort),
+            working(reference, penalties, cohort) {
+  combined = vector<double>(cohort->get_n_haplotypes());
+}
+
+editScorer::~editScorer() {
+
+}
+
+void editScorer::extend_forward(fastFwdAlgState& state, size_t j) const {
+  if(query.has_span_after(j - 1)) {
+    state.extend_probability_at_span_after(&query, j - 1);
+  }
+  state.extend_probability_at_site(&query, j);
+}
+
+void editScorer::extend_reverse(fastFwdAlgState& state, size_t j) const {
+  if(query.has_span_after(j)) {
+    state.extend_probability_at_span_after(&query, j);
+  }
+  state.extend_probability_at_site(&query, j);
+}
+
+void editScorer::initialize_reverse(fastFwdAlgState& state) const {
+  size_t last = query.number_of_sites() - 1;
+  state.set_reversed(true);
+  state.initialize_probability(query.get_site_index(last),
+            query.get_allele(last), query.get_span_after(last),
+            query.get_n_novel_SNVs(last));
+}
+
+double editScorer::log_emission(size_t j, size_t row) const {
+  size_t site = query.get_site_index(j);
+  if(cohort->allele_at(site, row) == query.get_allele(j)) {
+    return penalties->one_minus_mu_at(site);
+  } else {
+    return penalties->mu_at(site);
+  }
+}
+
+void editScorer::validate_forward(size_t b) {
+  if(b < forward_valid) {
+    return;
+  }
+  size_t site;
+  if(forward_valid == 0) {
+    working.reset();
+    working.initialize_probability(&query);
+    forward[0] = working;
+    forward_valid = 1;
+  } else {
+    working = forward[forward_valid - 1];
+  }
+  site = (forward_valid - 1) * checkpoint_interval;
+  while(forward_valid <= b) {
+    ++site;
+    extend_forward(working, site);
+    if(site % checkpoint_interval == 0) {
+      forward[forward_valid] = working;
+      ++forward_valid;
+    }
+  }
+}
+
+// brings the R-values of the reverse state up to date, so that the terms of
+// every row can be read in one pass
+void editScorer::store_reverse(size_t c, fastFwdAlgState& state) {
+  state.take_snapshot();
+  size_t j = c * checkpoint_interval;
+  vector<double>& terms = reverse_terms[c];
+  terms.resize(cohort->get_n_haplotypes());
+  for(size_t h = 0; h < terms.size(); h++) {
+    terms[h] = state.partial_likelihood_by_row(h) + penalties->log_H -
+              log_emission(j, h);
+  }
+  reverse[c] = state;
+}
+
+void editScorer::validate_reverse(size_t c) {
+  if(c >= reverse_valid_from) {
+    return;
+  }
+  size_t n_sites = query.number_of_sites();
+  fastFwdAlgState state(reference, penalties, cohort);
+  size_t site;
+  if(reverse_valid_from < reverse.size()) {
+    state = reverse[reverse_valid_from];
+    site = reverse_valid_from * checkpoint_interval;
+  } else {
+    state.get_maps().reserve_length(2 * n_sites + 1);
+    initialize_reverse(state);
+    site = n_sites - 1;
+    if(site % checkpoint_interval == 0 && site > 0) {
+      store_reverse(site / checkpoint_interval, state);
+    }
+  }
+  while(site > c * checkpoint_interval) {
+    --site;
+    extend_reverse(state, site);
+    if(site % checkpoint_interval == 0) {
+      store_reverse(site / checkpoint_interval, state);
+    }
+  }
+  reverse_valid_from = c;
+}
+
+void editScorer::edited_range(const vector<alleleEdit>& edits, size_t& lo,
+            size_t& hi) const {
+  lo = query.number_of_sites();
+  hi = 0;
+  for(size_t i = 0; i < edits.size(); i++) {
+    if(edits[i].first >= query.number_of_sites()) {
+      throw runtime_error("edit outside of query");
+    }
+    lo = min(lo, edits[i].first);
+    hi = max(hi, edits[i].first);
+  }
+}
+
+void editScorer::set_query(const inputHaplotype& q, size_t interval,
+            bool reverse_checkpoints) {
+  if(!q.has_sites()) {
+    throw runtime_error("edit scoring requires a query containing sites");
+  }
+  query = q;
+  has_query = true;
+  use_reverse = reverse_checkpoints;
+  size_t n_sites = q.number_of_sites();
+  if(interval == 0) {
+    interval = (size_t)ceil(sqrt((double)n_sites));
+  }
+  checkpoint_interval = interval;
+  size_t n_checkpoints = (n_sites - 1) / interval + 1;
+
+  working.reset();
+  working.get_maps().reserve_length(2 * n_sites + 1);
+  forward.assign(n_checkpoints, working);
+  forward_valid = 0;
+  validate_forward(n_checkpoints - 1);
+  for(size_t j = (n_checkpoints - 1) * interval + 1; j < n_sites; j++) {
+    extend_forward(working, j);
+  }
+  if(q.has_span_after(n_sites - 1)) {
+    working.extend_probability_at_span_after(&query, n_sites - 1);
+  }
+  likelihood = working.prefix_likelihood();
+
+  reverse.clear();
+  reverse_terms.clear();
+  reverse_valid_from = n_checkpoints;
+  if(use_reverse && n_checkpoints > 1) {
+    reverse.assign(n_checkpoints, fastFwdAlgState(reference, penalties, cohort));
+    reverse_terms.resize(n_checkpoints);
+    validate_reverse(1);
+  }
+}
+
+double editScorer::get_likelihood() const {
+  return likelihood;
+}
+
+const inputHaplotype& editScorer::get_query() const {
+  return query;
+}
+
+size_t editScorer::get_checkpoint_interval() const {
+  return checkpoint_interval;
+}
+
+double editScorer::score_edit(size_t j, alleleValue a) {
+  return score_edits(vector<alleleEdit>(1, alleleEdit(j, a)));
+}
+
+// the forward state is resumed at the last checkpoint before the first edit
+// and stopped at the first reverse checkpoint after the last, where
+//    log P = log sum_h exp(R_s(h) + R_rev_s(h) + log |H| - log e_s(h))
+double editScorer::score_edits(const vector<alleleEdit>& edits) {
+  if(!has_query) {
+    throw runtime_error("no query set for edit scoring");
+  }
+  if(edits.empty()) {
+    return likelihood;
+  }
+  size_t lo, hi;
+  edited_range(edits, lo, hi);
+  size_t n_sites = query.number_of_sites();
+  size_t c = hi / checkpoint_interval + 1;
+  bool combine = use_reverse && c < reverse.size();
+  if(lo > 0) {
+    validate_forward((lo - 1) / checkpoint_interval);
+  }
+  if(combine) {
+    validate_reverse(c);
+  }
+
+  vector<alleleValue> original(edits.size());
+  for(size_t i = 0; i < edits.size(); i++) {
+    original[i] = query.get_allele(edits[i].first);
+    query.set_allele(edits[i].first, edits[i].second);
+  }
+  size_t site;
+  if(lo == 0) {
+    working.reset();
+    working.initialize_probability(&query);
+    site = 0;
+  } else {
+    size_t b = (lo - 1) / checkpoint_interval;
+    working = forward[b];
+    site = b * checkpoint_interval;
+  }
+  size_t end = combine ? c * checkpoint_interval : n_sites - 1;
+  while(site < end) {
+    ++site;
+    extend_forward(working, site);
+  }
+  double to_return;
+  if(combine) {
+    working.take_snapshot();
+    const vector<double>& terms = reverse_terms[c];
+    for(size_t h = 0; h < combined.size(); h++) {
+      combined[h] = working.partial_likelihood_by_row(h) + terms[h];
+    }
+    to_return = log_big_sum(combined);
+  } else {
+    if(query.has_span_after(n_sites - 1)) {
+      working.extend_probability_at_span_after(&query, n_sites - 1);
+    }
+    to_return = working.prefix_likelihood();
+  }
+  // in reverse order, so that a site edited twice gets its first allele back
+  for(size_t i = edits.size(); i > 0; i--) {
+    query.set_allele(edits[i - 1].first, original[i - 1]);
+  }
+  return to_return;
+}
+
+double editScorer::accept_edits(const vector<alleleEdit>& edits) {
+  double new_likelihood = score_edits(edits);
+  if(edits.empty()) {
+    return likelihood;
+  }
+  size_t lo, hi;
+  edited_range(edits, lo, hi);
+  for(size_t i = 0; i < edits.size(); i++) {
+    query.set_allele(edits[i].first, edits[i].second);
+  }
+  forward_valid = min(forward_valid,
+            lo == 0 ? 0 : (lo - 1) / checkpoint_interval + 1);
+  reverse_valid_from = max(reverse_valid_from, hi / checkpoint_interval + 1);
+  likelihood = new_likelihood;
+  return likelihood;
+}
@@ -0,0 +1,89 @@
+#ifndef LINEAR_HAPLO_EDIT_SCORER_H
+#define LINEAR_HAPLO_EDIT_SCORER_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+typedef pair<size_t, alleleValue> alleleEdit;
+
+// An editScorer rescores a query after edits to the alleles at a few of its
+// sites, as made by phasing and MCMC proposals, without re-running the
+// forward algorithm over the whole query.
+//
+// set_query stores the forward state after every checkpoint interval of k
+// sites (sqrt(n) by default), and optionally the reverse state of the
+// forward-backward decomposition at the same sites (see fwdBwdSolver). For
+// edits confined to sites lo, ..., hi, the forward state is resumed at the
+// last checkpoint before lo. If there is a reverse checkpoint at a site
+// s > hi, the likelihood follows at s from
+//    P = sum_h R_s(h) * R_rev_s(h) * |H| / e_s(h)
+// in which only R_s has changed, so an edit costs O(k) extensions and one
+// pass over the rows, independently of the length of the query. Otherwise
+// the forward state is run from the edit to the end of the query.
+//
+// Accepting edits invalidates the forward checkpoints after lo and the
+// reverse checkpoints before hi, which are rebuilt from their valid
+// neighbours when next needed
+struct editScorer{
+private:
+  siteIndex* reference;
+  const penaltySet* penalties;
+  const haplotypeCohort* cohort;
+  inputHaplotype query;
+  bool has_query = false;
+  bool use_reverse = false;
+
+  size_t checkpoint_interval = 0;
+  // forward[b] is the forward state after site b * checkpoint_interval of the
+  // query; the first forward_valid of them are up to date
+  vector<fastFwdAlgState> forward;
+  size_t forward_valid = 0;
+  // reverse[c] is the reverse state at site c * checkpoint_interval, and
+  // reverse_terms[c][h] = R_rev(h) + log |H| - log e(h) there; those from
+  // reverse_valid_from on are up to date. Entry 0 is never used
+  vector<fastFwdAlgState> reverse;
+  vector<vector<double> > reverse_terms;
+  size_t reverse_valid_from = 0;
+  double likelihood = 0;
+  // state resumed from a checkpoint to score edits, and the terms of the
+  // sum over rows, kept to avoid reallocating them per edit
+  fastFwdAlgState working;
+  vector<double> combined;
+
+  void extend_forward(fastFwdAlgState& state, size_t j) const;
+  void extend_reverse(fastFwdAlgState& state, size_t j) const;
+  void initialize_reverse(fastFwdAlgState& state) const;
+  double log_emission(size_t j, size_t row) const;
+  // rebuilds the forward checkpoints up to b, and the reverse checkpoints
+  // down to c
+  void validate_forward(size_t b);
+  void validate_reverse(size_t c);
+  void store_reverse(size_t c, fastFwdAlgState& state);
+  // first and last sites edited; throws if an edit lies outside the query
+  void edited_range(const vector<alleleEdit>& edits, size_t& lo,
+              size_t& hi) const;
+public:
+  editScorer(siteIndex* reference, const penaltySet* penalties,
+              const haplotypeCohort* cohort);
+  ~editScorer();
+
+  // copies q, which must contain at least one site, and stores checkpoints
+  // over it. An interval of 0 chooses sqrt(number of sites)
+  void set_query(const inputHaplotype& q, size_t interval = 0,
+              bool reverse_checkpoints = true);
+
+  // log-likelihood of the query with every edit accepted so far
+  double get_likelihood() const;
+  const inputHaplotype& get_query() const;
+  size_t get_checkpoint_interval() const;
+
+  // log-likelihood of the query with the allele at site j, or at each site
+  // given, replaced. The query itself is left unchanged
+  double score_edit(size_t j, alleleValue a);
+  double score_edits(const vector<alleleEdit>& edits);
+  // applies the edits to the query, returning its new log-likelihood
+  double accept_edits(const vector<alleleEdit>& edits);
+};
+
+#endif
@@ -0,0 +1,355 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include "forward_backward.hpp"
+
+using namespace std;
+
+void aliasTable::build(const vector<double>& log_weights) {
+  size_t n = log_weights.size();
+  threshold.resize(n);
+  alias.resize(n);
+  double max_weight = -INFINITY;
+  for(size_t i = 0; i < n; i++) {
+    max_weight = max(max_weight, log_weights[i]);
+  }
+  double total = 0;
+  for(size_t i = 0; i < n; i++) {
+    threshold[i] = exp(log_weights[i] - max_weight);
+    total += threshold[i];
+  }
+  vector<size_t> small;
+  vector<size_t> large;
+  for(size_t i = 0; i < n; i++) {
+    threshold[i] *= n / total;
+    alias[i] = i;
+    if(threshold[i] < 1) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  while(!small.empty() && !large.empty()) {
+    size_t less = small.back();
+    small.pop_back();
+    size_t more = large.back();
+    alias[less] = more;
+    threshold[more] -= 1 - threshold[less];
+    if(threshold[more] < 1) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  // entries left over by rounding error are certain
+  for(size_t i = 0; i < small.size(); i++) {
+    threshold[small[i]] = 1;
+  }
+  for(size_t i = 0; i < large.size(); i++) {
+    threshold[large[i]] = 1;
+  }
+}
+
+size_t aliasTable::sample(mt19937& generator) const {
+  size_t i = uniform_int_distribution<size_t>(0, threshold.size() - 1)(generator);
+  if(uniform_real_distribution<double>(0, 1)(generator) < threshold[i]) {
+    return i;
+  } else {
+    return alias[i];
+  }
+}
+
+size_t aliasTable::size() const {
+  return threshold.size();
+}
+
+fwdBwdSolver::fwdBwdSolver(siteIndex* reference, const penaltySet* penalties,
+            const haplotypeCohort* cohort) :
+            reference(reference), penalties(penalties), cohort(cohort) {
+
+}
+
+fwdBwdSolver::~fwdBwdSolver() {
+
+}
+
+void fwdBwdSolver::extend_forward(fastFwdAlgState& state, size_t j) const {
+  if(query->has_span_after(j - 1)) {
+    state.extend_probability_at_span_after(query, j - 1);
+  }
+  state.extend_probability_at_site(query, j);
+}
+
+// the span between sites j and j + 1 is crossed in the opposite direction,
+// but the span update is the same
+void fwdBwdSolver::extend_reverse(fastFwdAlgState& state, size_t j) const {
+  if(query->has_span_after(j)) {
+    state.extend_probability_at_span_after(query, j);
+  }
+  state.extend_probability_at_site(query, j);
+}
+
+// the right tail of the query plays the part of the left tail
+void fwdBwdSolver::initialize_reverse(fastFwdAlgState& state) const {
+  size_t last = query->number_of_sites() - 1;
+  state.set_reversed(true);
+  state.initialize_probability(query->get_site_index(last),
+            query->get_allele(last), query->get_span_after(last),
+            query->get_n_novel_SNVs(last));
+}
+
+double fwdBwdSolver::log_emission(size_t j, size_t row) const {
+  size_t site = query->get_site_index(j);
+  if(cohort->allele_at(site, row) == query->get_allele(j)) {
+    return penalties->one_minus_mu_at(site);
+  } else {
+    return penalties->mu_at(site);
+  }
+}
+
+void fwdBwdSolver::set_query(const inputHaplotype* q, size_t interval) {
+  if(!q->has_sites()) {
+    throw runtime_error("forward-backward requires a query containing sites");
+  }
+  query = q;
+  size_t n_sites = q->number_of_sites();
+  if(interval == 0) {
+    interval = (size_t)ceil(sqrt((double)n_sites));
+  }
+  checkpoint_interval = interval;
+  checkpoints.clear();
+  checkpoints.reserve((n_sites - 1) / interval + 1);
+
+  fastFwdAlgState state(reference, penalties, cohort);
+  state.get_maps().reserve_length(2 * n_sites + 1);
+  state.initialize_probability(q);
+  checkpoints.push_back(state);
+  for(size_t j = 1; j < n_sites; j++) {
+    extend_forward(state, j);
+    if(j % interval == 0) {
+      checkpoints.push_back(state);
+    }
+  }
+  if(q->has_span_after(n_sites - 1)) {
+    state.extend_probability_at_span_after(q, n_sites - 1);
+  }
+  likelihood = state.prefix_likelihood();
+}
+
+double fwdBwdSolver::get_likelihood() const {
+  return likelihood;
+}
+
+size_t fwdBwdSolver::get_checkpoint_interval() const {
+  return checkpoint_interval;
+}
+
+size_t fwdBwdSolver::number_of_checkpoints() const {
+  return checkpoints.size();
+}
+
+// Entries are visited by decreasing site, so that the reverse pass is made
+// once. When the reverse pass enters a block holding requested sites, the
+// forward pass is re-run over that block from its checkpoint to collect the
+// forward values of the requested entries
+vector<double> fwdBwdSolver::log_posteriors(
+            const vector<pair<size_t, size_t> >& entries) {
+  if(query == NULL) {
+    throw runtime_error("no query set for forward-backward");
+  }
+  size_t n_sites = query->number_of_sites();
+  for(size_t i = 0; i < entries.size(); i++) {
+    if(entries[i].first >= n_sites ||
+              entries[i].second >= cohort->get_n_haplotypes()) {
+      throw runtime_error("posterior requested outside of query and cohort");
+    }
+  }
+  vector<size_t> order(entries.size());
+  for(size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(), [&entries](size_t a, size_t b) {
+    return entries[a].first > entries[b].first;
+  });
+
+  vector<double> to_return(entries.size());
+  fastFwdAlgState forward(reference, penalties, cohort);
+  fastFwdAlgState reverse(reference, penalties, cohort);
+  reverse.get_maps().reserve_length(2 * n_sites + 1);
+  initialize_reverse(reverse);
+  size_t reverse_site = n_sites - 1;
+
+  size_t block_begin = 0;
+  while(block_begin < order.size()) {
+    size_t block = entries[order[block_begin]].first / checkpoint_interval;
+    size_t block_end = block_begin;
+    while(block_end < order.size() &&
+              entries[order[block_end]].first / checkpoint_interval == block) {
+      ++block_end;
+    }
+
+    forward = checkpoints[block];
+    size_t forward_site = block * checkpoint_interval;
+    for(size_t i = block_end; i > block_begin; i--) {
+      const pair<size_t, size_t>& entry = entries[order[i - 1]];
+      while(forward_site < entry.first) {
+        ++forward_site;
+        extend_forward(forward, forward_site);
+      }
+      to_return[order[i - 1]] = forward.current_likelihood_by_row(entry.second);
+    }
+
+    for(size_t i = block_begin; i < block_end; i++) {
+      const pair<size_t, size_t>& entry = entries[order[i]];
+      while(reverse_site > entry.first) {
+        --reverse_site;
+        extend_reverse(reverse, reverse_site);
+      }
+      to_return[order[i]] += reverse.current_likelihood_by_row(entry.second) +
+                penalties->log_H - log_emission(entry.first, entry.second) -
+                likelihood;
+    }
+    block_begin = block_end;
+  }
+  return to_return;
+}
+
+vector<double> fwdBwdSolver::log_posteriors_at_site(size_t j) {
+  vector<pair<size_t, size_t> > entries(cohort->get_n_haplotypes());
+  for(size_t h = 0; h < entries.size(); h++) {
+    entries[h] = make_pair(j, h);
+  }
+  return log_posteriors(entries);
+}
+
+void fwdBwdSolver::transition_coefficients(size_t j, double& keep, 
+            double& redraw) const {
+  size_t steps = query->get_span_after(j) + 1;
+  size_t gap = query->get_site_index(j) + 1;
+  keep = penalties->composed_R_coefficient(steps, gap);
+  redraw = penalties->span_coefficient(steps, gap);
+}
+
+void fwdBwdSolver::row_forward_values(size_t block, size_t row, 
+            const vector<double>& block_S, vector<double>& values) {
+  size_t block_start = block * checkpoint_interval;
+  size_t block_end = min(block_start + checkpoint_interval, 
+            query->number_of_sites());
+  values.resize(block_end - block_start);
+  values[0] = checkpoints[block].current_likelihood_by_row(row);
+  for(size_t j = block_start + 1; j < block_end; j++) {
+    double keep, redraw;
+    transition_coefficients(j - 1, keep, redraw);
+    size_t k = j - block_start;
+    values[k] = log_emission(j, row) + logsum(keep + values[k - 1], 
+              redraw + block_S[k - 1]);
+    if(query->has_span_after(j - 1)) {
+      values[k] += penalties->span_mutation_penalty(query->get_span_after(j - 1),
+                query->get_n_novel_SNVs(j - 1));
+    }
+  }
+}
+
+// Blocks are visited from last to first. Within a block each path is walked
+// back, keeping its row, until it must redraw; the redraws of all paths are
+// then made in one forward re-run of the block from its checkpoint, and the
+// walk resumes. A block is re-run once per round of redraws
+vector<vector<pathSegment> > fwdBwdSolver::sample_paths(size_t n_paths, 
+            mt19937& generator) {
+  if(query == NULL) {
+    throw runtime_error("no query set for forward-backward");
+  }
+  size_t n_sites = query->number_of_sites();
+  size_t n_rows = cohort->get_n_haplotypes();
+  vector<vector<pathSegment> > paths(n_paths);
+  // sites 0, ..., undecided[p] - 1 of path p are yet to be sampled
+  vector<size_t> undecided(n_paths, n_sites);
+  vector<bool> must_redraw(n_paths, true);
+  uniform_real_distribution<double> uniform(0, 1);
+  
+  fastFwdAlgState state(reference, penalties, cohort);
+  vector<double> block_S(checkpoint_interval);
+  unordered_map<size_t, vector<double> > row_values;
+  vector<pair<size_t, size_t> > redraws;
+  vector<double> log_weights(n_rows);
+  aliasTable table;
+  
+  // extends path p to site j on the given row
+  auto record = [&](size_t p, size_t row, size_t j) {
+    vector<pathSegment>& segments = paths[p];
+    if(!segments.empty() && segments.back().row == row) {
+      segments.back().first_site = j;
+    } else {
+      pathSegment segment = {row, j, j};
+      segments.push_back(segment);
+    }
+    undecided[p] = j;
+  };
+  
+  for(size_t b = checkpoints.size(); b > 0; b--) {
+    size_t block_start = (b - 1) * checkpoint_interval;
+    size_t block_end = min(block_start + checkpoint_interval, n_sites);
+    state = checkpoints[b - 1];
+    block_S[0] = state.prefix_likelihood();
+    for(size_t j = block_start + 1; j < block_end; j++) {
+      extend_forward(state, j);
+      block_S[j - block_start] = state.prefix_likelihood();
+    }
+    row_values.clear();
+    
+    while(true) {
+      redraws.clear();
+      for(size_t p = 0; p < n_paths; p++) {
+        while(undecided[p] > block_start) {
+          size_t j = undecided[p] - 1;
+          if(must_redraw[p]) {
+            redraws.push_back(make_pair(j, p));
+            break;
+          }
+          size_t row = paths[p].back().row;
+          if(row_values.count(row) == 0) {
+            row_forward_values(b - 1, row, block_S, row_values[row]);
+          }
+          double keep, redraw;
+          transition_coefficients(j, keep, redraw);
+          double keep_weight = keep + row_values[row][j - block_start];
+          double total = logsum(keep_weight, redraw + block_S[j - block_start]);
+          if(uniform(generator) < exp(keep_weight - total)) {
+            record(p, row, j);
+          } else {
+            must_redraw[p] = true;
+          }
+        }
+      }
+      if(redraws.empty()) {
+        break;
+      }
+      
+      sort(redraws.begin(), redraws.end());
+      state = checkpoints[b - 1];
+      size_t state_site = block_start;
+      for(size_t i = 0; i < redraws.size(); i++) {
+        size_t j = redraws[i].first;
+        if(i == 0 || j != redraws[i - 1].first) {
+          while(state_site < j) {
+            ++state_site;
+            extend_forward(state, state_site);
+          }
+          // brings every R-value up to date without changing the state
+          state.take_snapshot();
+          for(size_t h = 0; h < n_rows; h++) {
+            log_weights[h] = state.partial_likelihood_by_row(h);
+          }
+          table.build(log_weights);
+        }
+        size_t p = redraws[i].second;
+        record(p, table.sample(generator), j);
+        must_redraw[p] = false;
+      }
+    }
+  }
+  for(size_t p = 0; p < n_paths; p++) {
+    reverse(paths[p].begin(), paths[p].end());
+  }
+  return paths;
+}
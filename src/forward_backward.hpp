@@ -0,0 +1,97 @@
+#ifndef LINEAR_HAPLO_FORWARD_BACKWARD_H
+#define LINEAR_HAPLO_FORWARD_BACKWARD_H
+
+#include <random>
+#include "probability.hpp"
+
+using namespace std;
+
+// Vose alias table for drawing indices in O(1) from a fixed distribution,
+// built in O(size) from log-weights
+struct aliasTable{
+private:
+  vector<double> threshold;
+  vector<size_t> alias;
+public:
+  void build(const vector<double>& log_weights);
+  size_t sample(mt19937& generator) const;
+  size_t size() const;
+};
+
+// A fwdBwdSolver answers posterior queries P(copying row h at site j | query)
+// for an inputHaplotype.
+//
+// The backward recursion for gamma_j(h) = e_j(h) * beta_j(h) is the forward
+// recursion run over the sites of the query in reverse order, so backward
+// values come from a second fastFwdAlgState driven from the last site to the
+// first, with all of the lazy evaluation of the forward algorithm; it enters
+// each site across the gap after it, so per-site rates apply the right way
+// round. We have
+// gamma_j(h) = |H| * R_rev_j(h), and the posterior is
+//    R_j(h) + R_rev_j(h) + log |H| - log e_j(h) - log P(query)
+//
+// set_query runs the forward pass once, copying the forward state every
+// checkpoint interval (sqrt(n) sites by default) so that memory is
+// O(|H| sqrt(n)). A posterior query then makes one reverse pass, and
+// re-runs the forward pass only over the blocks between checkpoints which
+// contain requested sites. Only the requested entries are ever evaluated,
+// each in O(log n), so the cost remains sublinear in |H| per site
+struct fwdBwdSolver{
+private:
+  siteIndex* reference;
+  const penaltySet* penalties;
+  const haplotypeCohort* cohort;
+  const inputHaplotype* query = NULL;
+
+  size_t checkpoint_interval = 0;
+  // checkpoints[b] is the forward state after site b * checkpoint_interval of
+  // the query
+  vector<fastFwdAlgState> checkpoints;
+  double likelihood = 0;
+
+  // extends a forward state from site j - 1 of the query to site j
+  void extend_forward(fastFwdAlgState& state, size_t j) const;
+  // extends a reverse state from site j + 1 of the query to site j
+  void extend_reverse(fastFwdAlgState& state, size_t j) const;
+  void initialize_reverse(fastFwdAlgState& state) const;
+  double log_emission(size_t j, size_t row) const;
+  
+  // The transition from site j to site j + 1 of the query, with any span
+  // between them, sends R to keep * R + redraw * S before emission
+  void transition_coefficients(size_t j, double& keep, double& redraw) const;
+  // forward values across a block of the single row, from its value at the
+  // block's checkpoint and the values of S across the block
+  void row_forward_values(size_t block, size_t row, const vector<double>& block_S,
+              vector<double>& values);
+public:
+  fwdBwdSolver(siteIndex* reference, const penaltySet* penalties,
+              const haplotypeCohort* cohort);
+  ~fwdBwdSolver();
+
+  // runs the forward pass over q and stores checkpoints; q must contain at
+  // least one site and must outlive the queries made against it. An interval
+  // of 0 chooses sqrt(number of sites)
+  void set_query(const inputHaplotype* q, size_t interval = 0);
+
+  // log-likelihood of the query
+  double get_likelihood() const;
+  size_t get_checkpoint_interval() const;
+  size_t number_of_checkpoints() const;
+
+  // log-posteriors of the entries (j, h), where j is a site index relative to
+  // the query and h a row of the cohort, returned in the order given
+  vector<double> log_posteriors(const vector<pair<size_t, size_t> >& entries);
+  // log-posteriors of every row at site j of the query
+  vector<double> log_posteriors_at_site(size_t j);
+  
+  // Draws paths of copied rows from the posterior by backward sampling. A
+  // path at row h at site j + 1 keeps h at site j with probability
+  //    keep * R_j(h) / (keep * R_j(h) + redraw * S_j)
+  // and otherwise redraws its row from R_j over all rows. Keeping needs only
+  // the values of the path's own row, which follow from S by a scalar
+  // recursion. A redraw materializes R_j once per site, into an alias table
+  // shared by every path redrawing there, so no |H| x n matrix is formed
+  vector<vector<pathSegment> > sample_paths(size_t n_paths, mt19937& generator);
+};
+
+#endif
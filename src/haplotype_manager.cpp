@@ -598,18 +598,18 @@ void haplotypeManager::build_next_level_interval(double threshold) {
     vector<haplotypeStateNode*> last_leaves = current_leaves;
     current_leaves.clear();
 
-    vector<rowSet*> current_rows = get_rowSets_at_site(current_site);
+    extensionSet current_extensions(cohort, current_site);
     
     if(last_leaves.size() != 0) {
-      branch_node(last_leaves[0], current_site, current_rows);
+      branch_node(last_leaves[0], current_extensions);
       cutoff_interval.set_new_site();
       cutoff_interval.check_for_new_bound(last_leaves[0]->get_unordered_children());
     }
     // thresholdInterval predictor(penalties);
     for(size_t i = 1; i < last_leaves.size(); i++) {
       haplotypeStateNode* n = last_leaves[i];
-      branch_node_interval(n, current_site, current_rows);
-      // branch_node_interval(n, current_site, current_rows, predictor);
+      branch_node_interval(n, current_extensions);
+      // branch_node_interval(n, current_extensions, predictor);
     }
     for(size_t i = 0; i < last_leaves.size(); i++) {
       for(size_t j = 0; j < last_leaves[i]->number_of_children(); j++) {
@@ -622,7 +622,6 @@ void haplotypeManager::build_next_level_interval(double threshold) {
       }
     }
     
-    clear_rowSet_vector(current_rows);
     delete_marked_children(last_leaves);
     trim_back_abandoned_nodes(last_leaves);
   }
@@ -646,20 +645,20 @@ void haplotypeManager::build_next_level(double threshold) {
     vector<haplotypeStateNode*> last_leaves = current_leaves;
     current_leaves.clear();
 
-    vector<rowSet*> current_rows = get_rowSets_at_site(current_site);
+    extensionSet current_extensions(cohort, current_site);
     
     double likeliest_unrep_failure = threshold;
     for(size_t i = 0; i < last_leaves.size(); i++) {
       haplotypeStateNode* n = last_leaves[i];
       if(threshold == 0) {
-        branch_node(n, current_site, current_rows);
+        branch_node(n, current_extensions);
         for(size_t j = 0; j < n->get_unordered_children().size(); j++) {
           current_leaves.push_back(n->get_unordered_children()[j]);
         }
       } else {
         if(!(n->is_marked_for_deletion())) {
           if(n->prefix_likelihood() >= threshold) {
-            branch_node(n, current_site, current_rows, threshold, likeliest_unrep_failure);
+            branch_node(n, current_extensions, threshold, likeliest_unrep_failure);
             for(size_t j = 0; j < n->get_unordered_children().size(); j++) {
               haplotypeStateNode* n_child = n->get_unordered_children()[j];
               if(n_child->prefix_likelihood() > threshold) {
@@ -674,7 +673,6 @@ void haplotypeManager::build_next_level(double threshold) {
         }
       }
     }
-    clear_rowSet_vector(current_rows);
     delete_marked_children(last_leaves);
     trim_back_abandoned_nodes(last_leaves);
   }
@@ -739,7 +737,8 @@ void haplotypeManager::branch_node(haplotypeStateNode* n, size_t i) {
 }
 
 void haplotypeManager::branch_node(haplotypeStateNode* n, 
-            size_t i, const vector<rowSet*>& rows, double threshold) {
+            const extensionSet& extensions, double threshold) {
+  size_t i = extensions.get_site_index();
   fill_in_span_before(n, i);
   alleleValue a;
   // if *anything* fails to pass threshold after extension, then this must also
@@ -751,7 +750,7 @@ void haplotypeManager::branch_node(haplotypeStateNode* n,
       if(!(unrepresented_will_hit_threshold && (cohort->number_matching(i, a) == 0))) {
         if(!will_hit_threshold(n, threshold, i, a)) {
           haplotypeStateNode* new_branch = n->add_child_copying_state(a);
-          new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+          extensions.extend_probability_by_allele(new_branch->state, j);
           if(new_branch->prefix_likelihood() < threshold) {
             unrepresented_will_hit_threshold = true;
           }
@@ -759,26 +758,28 @@ void haplotypeManager::branch_node(haplotypeStateNode* n,
       }      
     } else {
       haplotypeStateNode* new_branch = n->add_child_copying_state(a);
-      new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+      extensions.extend_probability_by_allele(new_branch->state, j);
     }
   }
   n->clear_state();
 }
 
 void haplotypeManager::branch_node_no_threshold(haplotypeStateNode* n, 
-            size_t i, const vector<rowSet*>& rows) {
+            const extensionSet& extensions) {
+  size_t i = extensions.get_site_index();
   fill_in_span_before(n, i);
   alleleValue a;
   for(size_t j = 0; j < 5; j++) {
     a = (alleleValue)j;
     haplotypeStateNode* new_branch = n->add_child_copying_state(a);
-    new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+    extensions.extend_probability_by_allele(new_branch->state, j);
   }
   n->clear_state();
 }
 
 void haplotypeManager::branch_node(haplotypeStateNode* n, 
-            size_t i, const vector<rowSet*>& rows, double threshold, double& likeliest_unrep_failure) {
+            const extensionSet& extensions, double threshold, double& likeliest_unrep_failure) {
+  size_t i = extensions.get_site_index();
   fill_in_span_before(n, i);
   alleleValue a;
   // if *anything* fails to pass threshold after extension, then this must also
@@ -790,7 +791,7 @@ void haplotypeManager::branch_node(haplotypeStateNode* n,
       if(!(unrepresented_will_hit_threshold && (cohort->number_matching(i, a) == 0))) {
         if(!will_hit_threshold(n, threshold, i, a)) {
           haplotypeStateNode* new_branch = n->add_child_copying_state(a);
-          new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+          extensions.extend_probability_by_allele(new_branch->state, j);
           if(new_branch->prefix_likelihood() < threshold) {
             likeliest_unrep_failure = new_branch->prefix_likelihood();
             unrepresented_will_hit_threshold = true;
@@ -799,33 +800,33 @@ void haplotypeManager::branch_node(haplotypeStateNode* n,
       }      
     } else {
       haplotypeStateNode* new_branch = n->add_child_copying_state(a);
-      new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+      extensions.extend_probability_by_allele(new_branch->state, j);
     }
   }
   n->clear_state();
 }
 
 void haplotypeManager::branch_node_interval(haplotypeStateNode* n, 
-            size_t i, const vector<rowSet*>& rows) {
+            const extensionSet& extensions) {
+  size_t i = extensions.get_site_index();
   fill_in_span_before(n, i);
-  alleleValue a;
-  vector<alleleValue> options;
-  // const vector<alleleValue>* options;
+  // fixed-size, so that branching allocates nothing beyond the children
+  alleleValue options[5] = {A, C, T, G, gap};
+  size_t n_options = 5;
   if(has_option_index && !option_index.consider_all(i)) {
-    options = {option_index.more_likely(i), option_index.less_likely(i)};
-  } else {
-    options = {A, C, T, G, gap};
-    // options = canonical_alleles(); 
+    options[0] = option_index.more_likely(i);
+    options[1] = option_index.less_likely(i);
+    n_options = 2;
   }
   
-  for(size_t j = 0; j < options.size(); j++) {
+  for(size_t j = 0; j < n_options; j++) {
     haplotypeStateNode* new_branch = nullptr;
-    if(j != options.size() - 1) {
+    if(j != n_options - 1) {
       new_branch = n->add_child_copying_state(options[j]);
     } else {
       new_branch = n->add_child_transferring_state(options[j]);
     }
-    new_branch->state->extend_probability_at_site(*(rows[(size_t)options[j]]), get_cohort()->match_is_rare(i, options[j]), options[j]);
+    extensions.extend_probability_by_allele(new_branch->state, (size_t)options[j]);
     if(cutoff_interval.is_within_interval(new_branch)) {
       cutoff_interval.check_for_new_bound(new_branch);
     } else {
@@ -836,7 +837,8 @@ void haplotypeManager::branch_node_interval(haplotypeStateNode* n,
 }
 
 void haplotypeManager::branch_node_interval(haplotypeStateNode* n, 
-            size_t i, const vector<rowSet*>& rows, thresholdInterval& predictor) {
+            const extensionSet& extensions, thresholdInterval& predictor) {
+  size_t i = extensions.get_site_index();
   fill_in_span_before(n, i);
   alleleValue a;
   // if *anything* fails to pass threshold after extension, then this must also
@@ -845,7 +847,7 @@ void haplotypeManager::branch_node_interval(haplotypeStateNode* n,
     a = (alleleValue)j;
     haplotypeStateNode* new_branch = n->add_child_copying_state(a);
     if(!predictor.using_interval_cutoff() || predictor.is_within_interval(n)) {
-      new_branch->state->extend_probability_at_site(*(rows[j]), get_cohort()->match_is_rare(i, a), a);
+      extensions.extend_probability_by_allele(new_branch->state, j);
       if(cutoff_interval.is_within_interval(new_branch)) {
         cutoff_interval.check_for_new_bound(new_branch);
       } else {
@@ -880,13 +882,13 @@ void haplotypeManager::fill_in_level_threshold(double threshold,
   for(size_t j = start_site; j < upper_bound_site; j++) {
     p = get_ref_site_read_position(j);
     consensus_read_allele = allele::from_char(read_reference[p]);
-    rowSet current_rowSet = get_cohort()->get_active_rowSet(j, consensus_read_allele);
+    const siteExtension& extension = cohort->get_extension(j, consensus_read_allele);
     for(size_t i = 0; i < current_leaves.size(); i++) {
       if(current_leaves[i]->prefix_likelihood() < threshold) {
         current_leaves[i]->mark_for_deletion();
       } else if(!current_leaves[i]->is_marked_for_deletion()) {
         n = current_leaves[i];
-        extend_node_at_site(n, j, consensus_read_allele, current_rowSet);
+        extend_node_at_site(n, j, extension);
       }
     }
   }
@@ -904,10 +906,10 @@ void haplotypeManager::fill_in_level_no_threshold(size_t start_site, size_t uppe
   for(size_t j = start_site; j < upper_bound_site; j++) {
     p = get_ref_site_read_position(j);
     consensus_read_allele = allele::from_char(read_reference[p]);
-    rowSet current_rowSet = get_cohort()->get_active_rowSet(j, consensus_read_allele);
+    const siteExtension& extension = cohort->get_extension(j, consensus_read_allele);
     for(size_t i = 0; i < current_leaves.size(); i++) {
       n = current_leaves[i];
-      extend_node_at_site(n, j, consensus_read_allele, current_rowSet);
+      extend_node_at_site(n, j, extension);
     }
   }
 }
@@ -992,9 +994,9 @@ void haplotypeManager::extend_node_at_site(haplotypeStateNode* n,
 }
 
 void haplotypeManager::extend_node_at_site(haplotypeStateNode* n, 
-        size_t i, alleleValue a, const rowSet& row_set) {
+        size_t i, const siteExtension& extension) {
   fill_in_span_before(n, i);
-  n->state->extend_probability_at_site(row_set, cohort->match_is_rare(i, a), a);
+  n->state->extend_probability_at_site(i, extension);
 }
 
 vector<haplotypeStateNode*> haplotypeManager::get_current_leaves() const {
@@ -1136,22 +1138,6 @@ void haplotypeManager::print_tree_transitions() {
   cout << total_nodes << " total nodes" << endl;
 }
 
-vector<rowSet*> haplotypeManager::get_rowSets_at_site(size_t current_site) const {
-	vector<rowSet*> to_return;
-  for(size_t i = 0; i < 5; i++) {
-    rowSet* to_add = new rowSet;
-    *to_add = get_cohort()->get_active_rowSet(current_site, (alleleValue)i);
-    to_return.push_back(to_add);
-  }
-  return to_return;
-}
-
-void haplotypeManager::clear_rowSet_vector(vector<rowSet*> row_sets) {
-  for(size_t i = 0; i < 5; i++) {
-    delete row_sets[i];
-  }
-}
-
 bool haplotypeManager::will_hit_threshold(haplotypeStateNode* n, 
           double threshold, size_t site_index, alleleValue a) const {
   return ((n->prefix_likelihood() - threshold) < penalties->mu) &&
@@ -5,6 +5,7 @@
 #include "haplotype_state_node.hpp"
 #include "haplotype_state_tree.hpp"
 #include "reference_sequence.hpp"
+#include "set_of_extensions.hpp"
 #include <vector>
 #include <string>
 #include <iostream>
@@ -228,21 +229,19 @@ public:
   void build_entire_tree(double absolute_threshold);
   void build_entire_tree_interval(double cutoff);
   
-  vector<rowSet*> get_rowSets_at_site(size_t current_site) const;
   void branch_node(haplotypeStateNode* n, 
-              size_t i, const vector<rowSet*>& rows, double threshold = 0);
+              const extensionSet& extensions, double threshold = 0);
   void branch_node(haplotypeStateNode* n, 
-              size_t i, const vector<rowSet*>& rows, double threshold, double& likeliest_unrep_failure);
+              const extensionSet& extensions, double threshold, double& likeliest_unrep_failure);
   void branch_node_interval(haplotypeStateNode* n, 
-              size_t i, const vector<rowSet*>& rows);
+              const extensionSet& extensions);
   void branch_node_interval(haplotypeStateNode* n, 
-              size_t i, const vector<rowSet*>& rows, thresholdInterval& predictor);
+              const extensionSet& extensions, thresholdInterval& predictor);
   void branch_node_no_threshold(haplotypeStateNode* n, 
-              size_t i, const vector<rowSet*>& rows);
-  void clear_rowSet_vector(vector<rowSet*> row_sets);
+              const extensionSet& extensions);
   
   void extend_node_at_site(haplotypeStateNode* n, 
-          size_t i, alleleValue a, const rowSet& row_set);
+          size_t i, const siteExtension& extension);
   
   vector<haplotypeStateNode*> get_current_leaves() const;
   
@@ -180,6 +180,10 @@ alleleValue inputHaplotype::get_allele(size_t j) const {
   return alleles[j];
 }
 
+void inputHaplotype::set_allele(size_t j, alleleValue a) {
+  alleles[j] = a;
+}
+
 size_t inputHaplotype::get_n_novel_SNVs(int j) const {
   return novel_SNVs[j + 1];
 }
@@ -196,8 +200,10 @@ bool inputHaplotype::has_left_tail() const {
   return left_tail_length != 0;
 }
 
+// i indexes sites relative to the haplotype, so the last is the one followed
+// by the right tail rather than by a full reference span
 size_t inputHaplotype::get_span_after(size_t i) const {
-  if(i = end_site) {
+  if(get_site_index(i) == end_site) {
     return right_tail_length;
   } else {
     return reference->span_length_after(get_site_index(i));
@@ -205,11 +211,7 @@ size_t inputHaplotype::get_span_after(size_t i) const {
 }
 
 bool inputHaplotype::has_span_after(size_t i) const {
-  if(i = end_site) {
-    return right_tail_length != 0;
-  } else {
-    return reference->span_length_after(get_site_index(i));
-  }
+  return get_span_after(i) != 0;
 }
 
 size_t inputHaplotype::number_of_sites() const {
@@ -53,6 +53,8 @@ public:
   ~inputHaplotype();
               
   alleleValue get_allele(size_t j) const;
+  // replaces the allele at site j of the haplotype, leaving its spans alone
+  void set_allele(size_t j, alleleValue a);
   const vector<alleleValue>& get_alleles() const;
   size_t get_start_site() const;
   
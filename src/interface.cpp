@@ -1,6 +1,7 @@
 #include "haplotype_manager.hpp"
 #include "reference.hpp"
 #include "probability.hpp"
+#include "dense_solver.hpp"
 #include "reference_sequence.hpp"
 #include "input_haplotype.hpp"
 #include "interface.h"
@@ -45,6 +46,7 @@ haplotypeManager* haplotypeManager_build_abs_bound(
             vector<size_t>(positions_of_ref_sites, positions_of_ref_sites + number_of_ref_sites);
   
   siteIndex* reference = new siteIndex(ref_site_position_vector, ref_seq_length);  
+  penalties->set_uniform_site_rates(reference);
     
   vector<vector<alleleValue> > haplotypes = 
             vector<vector<alleleValue> >(number_of_haplotypes,
@@ -353,10 +355,37 @@ double fastFwdAlgState_score(fastFwdAlgState* hap_matrix, inputHaplotype* observ
   return to_return;
 }
 
+double fastFwdAlgState_score_above(fastFwdAlgState* hap_matrix, 
+                                   inputHaplotype* observed_haplotype,
+                                   double threshold, size_t* stopped_at) {
+  return hap_matrix->calculate_probability(observed_haplotype, threshold, 
+              *stopped_at);
+}
+
+void fastFwdAlgState_reset(fastFwdAlgState* hap_matrix) {
+  hap_matrix->reset();
+}
+
 void fastFwdAlgState_delete(fastFwdAlgState* hap_matrix) {
   delete hap_matrix;
 }
 
+forwardScorer* forwardScorer_initialize(siteIndex* reference,
+                                        penaltySet* penalties,
+                                        haplotypeCohort* cohort,
+                                        int engine, size_t n_threads) {
+  return new forwardScorer((forwardEngine)engine, reference, penalties, cohort,
+                           n_threads);
+}
+
+double forwardScorer_score(forwardScorer* scorer, inputHaplotype* observed_haplotype) {
+  return scorer->calculate_probability(observed_haplotype);
+}
+
+void forwardScorer_delete(forwardScorer* scorer) {
+  delete scorer;
+}
+
 penaltySet* penaltySet_build(double recombination_penalty,
                              double mutation_penalty,
                              size_t number_of_haplotypes) {
@@ -370,6 +399,14 @@ void penaltySet_delete(penaltySet* penalty_set) {
   delete penalty_set;  
 }
 
+void penaltySet_set_site_rates(penaltySet* penalty_set, siteIndex* reference,
+                               double* log_rho_by_gap, double* log_mu_by_site) {
+  size_t n_sites = reference->number_of_sites();
+  penalty_set->set_site_rates(reference, 
+            vector<double>(log_rho_by_gap, log_rho_by_gap + n_sites + 1),
+            vector<double>(log_mu_by_site, log_mu_by_site + n_sites));
+}
+
 slowFwdSolver* slowFwd_initialize(siteIndex* reference, penaltySet* penalties, haplotypeCohort* cohort) {
   return new slowFwdSolver(reference, penalties, cohort);
 }
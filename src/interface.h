@@ -12,6 +12,7 @@ typedef struct inputHaplotype inputHaplotype;
 typedef struct alleleVector alleleVector;
 typedef struct fastFwdAlgState fastFwdAlgState;
 typedef struct slowFwdSolver slowFwdSolver;
+typedef struct forwardScorer forwardScorer;
 typedef struct haplotypeStateNode haplotypeStateNode;
 
 #ifdef __cplusplus
@@ -247,6 +248,12 @@ penaltySet* penaltySet_build(double recombination_penalty,
 
 void penaltySet_delete(penaltySet* penalty_set);
 
+// per-site rates: log_rho_by_gap holds number_of_sites + 1 recombination
+// penalties, for the stretch before each site and after the last, and
+// log_mu_by_site number_of_sites mutation penalties
+void penaltySet_set_site_rates(penaltySet* penalty_set, siteIndex* reference,
+                               double* log_rho_by_gap, double* log_mu_by_site);
+
 ////////////////////////////////////////////////////////////////////////////////
 // single haplotype probability calculation
 ////////////////////////////////////////////////////////////////////////////////
@@ -258,12 +265,40 @@ fastFwdAlgState* fastFwdAlgState_initialize(siteIndex* reference,
                                             penaltySet* penalties,
                                             haplotypeCohort* cohort);
 
+// a single fastFwdAlgState may score any number of queries in turn; its
+// buffers are reused between calls rather than reallocated
 double fastFwdAlgState_score(fastFwdAlgState* hap_matrix, inputHaplotype* observed_haplotype);
 
+// scores the haplotype only as far as needed to tell whether its
+// log-likelihood reaches threshold; returns the log-likelihood, or an upper
+// bound below threshold after stopping at site *stopped_at
+double fastFwdAlgState_score_above(fastFwdAlgState* hap_matrix, 
+                                   inputHaplotype* observed_haplotype,
+                                   double threshold, size_t* stopped_at);
+
+void fastFwdAlgState_reset(fastFwdAlgState* hap_matrix);
+
 void fastFwdAlgState_delete(fastFwdAlgState* hap_matrix);
 
+// either engine behind one interface
+//------------------------------------------------------------------------------
+
+// engine 0 is the fast forward algorithm and engine 1 the dense O(n|H|)
+// forward algorithm, which divides rows between n_threads threads. Both
+// give the same log-likelihoods and may be swapped for one another
+forwardScorer* forwardScorer_initialize(siteIndex* reference,
+                                        penaltySet* penalties,
+                                        haplotypeCohort* cohort,
+                                        int engine, size_t n_threads);
+
+double forwardScorer_score(forwardScorer* scorer, inputHaplotype* observed_haplotype);
+
+void forwardScorer_delete(forwardScorer* scorer);
+
 // conventional and conventional-linear forward algorithm
 //------------------------------------------------------------------------------
+// kept for reference; forwardScorer's dense engine is the baseline to
+// measure against, and handles the whole query
 
 slowFwdSolver* slowFwd_initialize(siteIndex* reference, penaltySet* penalties, haplotypeCohort* cohort);
 
@@ -0,0 +1,214 @@
+#include <cmath>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include "parameter_estimation.hpp"
+
+using namespace std;
+
+// floor on the estimated rates
+static const double MIN_RATE = 1e-12;
+
+void emCounts::add(const emCounts& other) {
+  log_likelihood += other.log_likelihood;
+  recombinations += other.recombinations;
+  steps += other.steps;
+  mismatches += other.mismatches;
+  emissions += other.emissions;
+}
+
+penaltyEstimator::penaltyEstimator(siteIndex* reference,
+            const haplotypeCohort* cohort) :
+            reference(reference), cohort(cohort) {
+
+}
+
+penaltyEstimator::~penaltyEstimator() {
+
+}
+
+// the reverse pass stores R_rev at the active rows of each site and S_rev,
+// which the forward pass then reads site by site
+void penaltyEstimator::add_query_counts(const inputHaplotype* q,
+            const penaltySet& penalties, fastFwdAlgState& forward,
+            fastFwdAlgState& reverse, vector<double>& reverse_values,
+            vector<size_t>& offsets, vector<double>& reverse_S,
+            emCounts& counts) const {
+  size_t n_sites = q->number_of_sites();
+  if(n_sites == 0) {
+    throw runtime_error("parameter estimation requires queries containing sites");
+  }
+  reverse_values.clear();
+  offsets.assign(n_sites + 1, 0);
+  reverse_S.resize(n_sites);
+
+  reverse.reset();
+  reverse.set_reversed(true);
+  reverse.get_maps().reserve_length(2 * n_sites + 1);
+  size_t last = n_sites - 1;
+  reverse.initialize_probability(q->get_site_index(last), q->get_allele(last),
+            q->get_span_after(last), q->get_n_novel_SNVs(last));
+  // sites are visited in reverse, so the values of site j are stored before
+  // those of site j - 1 and offsets[j] marks the end of site j's
+  for(size_t j = n_sites; j > 0; j--) {
+    size_t site = j - 1;
+    if(site < last) {
+      if(q->has_span_after(site)) {
+        reverse.extend_probability_at_span_after(q, site);
+      }
+      reverse.extend_probability_at_site(q, site);
+    }
+    reverse_S[site] = reverse.prefix_likelihood();
+    size_t site_index = q->get_site_index(site);
+    alleleValue a = q->get_allele(site);
+    offsets[site + 1] = reverse_values.size();
+    if(cohort->number_active(site_index, a) != 0) {
+      const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
+      for(rowSet::const_iterator it = active_rows.begin();
+                it != active_rows.end(); ++it) {
+        reverse_values.push_back(reverse.partial_likelihood_by_row(*it));
+      }
+    }
+  }
+  offsets[0] = reverse_values.size();
+
+  forward.reset();
+  forward.get_maps().reserve_length(2 * n_sites + 1);
+  // the likelihood is the reverse state's, which has run over every site
+  // and span of the query
+  double log_P = reverse_S[0];
+  if(q->has_left_tail()) {
+    log_P += penalties.log_span_mutation_penalty(q->get_left_tail(),
+              q->get_n_novel_SNVs(-1));
+  }
+  double log_r = penalties.rho + penalties.log_H;
+  double emissions = n_sites;
+  double mismatches = 0;
+  double recombinations = 0;
+  double steps = 0;
+  if(q->has_left_tail()) {
+    emissions += q->get_left_tail();
+    mismatches += q->get_n_novel_SNVs(-1);
+  }
+  forward.initialize_probability(q);
+  for(size_t j = 0; j < n_sites; j++) {
+    if(j > 0) {
+      forward.extend_probability_at_site(q, j);
+    }
+    size_t site_index = q->get_site_index(j);
+    alleleValue a = q->get_allele(j);
+    bool match_is_rare = cohort->match_is_rare(site_index, a);
+    double active_emission = match_is_rare ? penalties.one_minus_mu_at(site_index) :
+              penalties.mu_at(site_index);
+    double active_mass = 0;
+    if(cohort->number_active(site_index, a) != 0) {
+      const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
+      // offsets[j + 1] is where site j's values begin
+      size_t k = offsets[j + 1];
+      for(rowSet::const_iterator it = active_rows.begin();
+                it != active_rows.end(); ++it, ++k) {
+        active_mass += exp(forward.partial_likelihood_by_row(*it) +
+                  reverse_values[k] + penalties.log_H - active_emission - log_P);
+      }
+    }
+    mismatches += match_is_rare ? max(0.0, 1 - active_mass) : active_mass;
+
+    size_t span = q->get_span_after(j);
+    double log_m = 0;
+    if(span != 0) {
+      log_m = penalties.log_span_mutation_penalty(span, q->get_n_novel_SNVs(j));
+      emissions += span;
+      mismatches += q->get_n_novel_SNVs(j);
+    }
+    if(j + 1 < n_sites) {
+      recombinations += (span + 1) * exp(log_r + forward.prefix_likelihood() +
+                log_m + reverse_S[j + 1] - log_P);
+      steps += span + 1;
+    }
+    if(span != 0) {
+      forward.extend_probability_at_span_after(q, j);
+    }
+  }
+  counts.log_likelihood += log_P;
+  counts.recombinations += recombinations;
+  counts.steps += steps;
+  counts.mismatches += mismatches;
+  counts.emissions += emissions;
+}
+
+// queries are dealt to the threads in turn; each thread keeps its own states
+// and counts, which are added in thread order
+emCounts penaltyEstimator::expected_counts(
+            const vector<const inputHaplotype*>& queries,
+            const penaltyParameters& parameters, size_t n_threads) const {
+  penaltySet penalties(parameters.log_rho, parameters.log_mu,
+            cohort->get_n_haplotypes());
+  n_threads = max((size_t)1, min(n_threads, queries.size()));
+  vector<emCounts> thread_counts(n_threads);
+  auto work = [&](size_t t) {
+    fastFwdAlgState forward(reference, &penalties, cohort);
+    fastFwdAlgState reverse(reference, &penalties, cohort);
+    vector<double> reverse_values;
+    vector<size_t> offsets;
+    vector<double> reverse_S;
+    for(size_t i = t; i < queries.size(); i += n_threads) {
+      add_query_counts(queries[i], penalties, forward, reverse, reverse_values,
+                offsets, reverse_S, thread_counts[t]);
+    }
+  };
+  if(n_threads == 1) {
+    work(0);
+  } else {
+    vector<thread> threads;
+    for(size_t t = 0; t < n_threads; t++) {
+      threads.push_back(thread(work, t));
+    }
+    for(size_t t = 0; t < n_threads; t++) {
+      threads[t].join();
+    }
+  }
+  emCounts to_return;
+  for(size_t t = 0; t < n_threads; t++) {
+    to_return.add(thread_counts[t]);
+  }
+  return to_return;
+}
+
+// r = |H| rho, and the penaltySet takes log rho + log(|H| - 1)
+penaltyParameters penaltyEstimator::maximize(const emCounts& counts,
+            const penaltyParameters& current) const {
+  double log_H = log(cohort->get_n_haplotypes());
+  penaltyParameters to_return = current;
+  if(counts.steps > 0) {
+    double r = min(max(counts.recombinations / counts.steps, MIN_RATE),
+              1 - MIN_RATE);
+    to_return.log_rho = log(r) - log_H + log(cohort->get_n_haplotypes() - 1);
+  }
+  if(counts.emissions > 0) {
+    double mu = max(counts.mismatches / (4 * counts.emissions), MIN_RATE);
+    to_return.log_mu = log(mu);
+  }
+  return to_return;
+}
+
+emEstimate penaltyEstimator::estimate(const vector<const inputHaplotype*>& queries,
+            const penaltyParameters& initial, size_t n_threads,
+            size_t max_iterations, double tolerance) const {
+  emEstimate to_return;
+  to_return.parameters = initial;
+  emCounts counts = expected_counts(queries, initial, n_threads);
+  to_return.log_likelihoods.push_back(counts.log_likelihood);
+  for(size_t i = 0; i < max_iterations; i++) {
+    penaltyParameters next = maximize(counts, to_return.parameters);
+    emCounts next_counts = expected_counts(queries, next, n_threads);
+    to_return.parameters = next;
+    to_return.log_likelihoods.push_back(next_counts.log_likelihood);
+    double improvement = next_counts.log_likelihood - counts.log_likelihood;
+    counts = next_counts;
+    if(improvement < tolerance) {
+      to_return.converged = true;
+      break;
+    }
+  }
+  return to_return;
+}
@@ -0,0 +1,76 @@
+#ifndef LINEAR_HAPLO_PARAMETER_ESTIMATION_H
+#define LINEAR_HAPLO_PARAMETER_ESTIMATION_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+// Expected sufficient statistics of the model over a set of queries, given
+// the queries and a penaltySet
+struct emCounts{
+  double log_likelihood = 0;
+  // expected recombinations between consecutive sites of the queries, and
+  // the steps, one per position, over which they may occur
+  double recombinations = 0;
+  double steps = 0;
+  // expected mismatches at the sites and span positions of the queries, and
+  // the number of such positions
+  double mismatches = 0;
+  double emissions = 0;
+  void add(const emCounts& other);
+};
+
+struct emEstimate{
+  penaltyParameters parameters;
+  // log-likelihood of the queries under each iterate, starting with the
+  // initial parameters; non-decreasing
+  vector<double> log_likelihoods;
+  bool converged = false;
+};
+
+// A penaltyEstimator fits rho and mu to a sample of query haplotypes by
+// expectation-maximization (Baum-Welch). Each step from a position to the
+// next recombines with probability r = |H| rho, redrawing the copied row
+// uniformly, and each position emits a given mismatching allele with
+// probability mu and the matching allele with probability 1 - 4mu.
+//
+// The E-step runs the forward and reverse states of fwdBwdSolver over each
+// query, reading only the rows active at each site, whose R-values the fused
+// site update leaves current, so it keeps the cost of the forward algorithm:
+//  - the posterior mass on the rows mismatching site j is the sum over
+//    active rows of exp(R_j(h) + R_rev_j(h) + log |H| - log e_j(h) - log P),
+//    or one minus it if the active rows are those which match
+//  - L steps from site j to site j + 1, through the span between them with
+//    mutation penalty m, recombine L r S_j m S_rev_{j+1} / P times in
+//    expectation, since every redraw ends uniformly over the rows
+// Mismatches within spans are the query's novel SNVs, whichever row is
+// copied. The M-step sets r and 4 mu to the expected fraction of steps
+// recombining and of positions mismatching
+struct penaltyEstimator{
+private:
+  siteIndex* reference;
+  const haplotypeCohort* cohort;
+  void add_query_counts(const inputHaplotype* q, const penaltySet& penalties,
+              fastFwdAlgState& forward, fastFwdAlgState& reverse,
+              vector<double>& reverse_values, vector<size_t>& offsets,
+              vector<double>& reverse_S, emCounts& counts) const;
+public:
+  penaltyEstimator(siteIndex* reference, const haplotypeCohort* cohort);
+  ~penaltyEstimator();
+
+  // E-step over the queries, which must contain sites, split between
+  // n_threads threads
+  emCounts expected_counts(const vector<const inputHaplotype*>& queries,
+              const penaltyParameters& parameters, size_t n_threads = 1) const;
+  // M-step; a rate estimated as zero is held at a floor of 1e-12 so that
+  // the penaltySet stays finite, and rho is kept if there are no steps
+  penaltyParameters maximize(const emCounts& counts,
+              const penaltyParameters& current) const;
+  // iterates from the initial parameters until the log-likelihood improves
+  // by less than tolerance, or for at most max_iterations M-steps
+  emEstimate estimate(const vector<const inputHaplotype*>& queries,
+              const penaltyParameters& initial, size_t n_threads = 1,
+              size_t max_iterations = 100, double tolerance = 1e-6) const;
+};
+
+#endif
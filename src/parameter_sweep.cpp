@@ -0,0 +1,268 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include "parameter_sweep.hpp"
+
+using namespace std;
+
+static const size_t W = sweepLinear::width;
+
+sweepFwdAlgState::sweepFwdAlgState(siteIndex* reference,
+            const haplotypeCohort* cohort,
+            const vector<penaltyParameters>& settings) :
+            reference(reference), cohort(cohort), settings(settings),
+            map(lazy_map_t(cohort->get_n_haplotypes(), 0)) {
+  if(settings.empty()) {
+    throw runtime_error("a parameter sweep requires at least one setting");
+  }
+  int H = cohort->get_n_haplotypes();
+  for(size_t i = 0; i < settings.size(); i++) {
+    penalties.push_back(lane_penalties_t(settings[i].log_rho,
+              settings[i].log_mu, H));
+    penalties.back().set_uniform_site_rates(reference);
+  }
+  R = vector<value_t>(H, policy::one());
+  start_pass(0);
+}
+
+sweepFwdAlgState::~sweepFwdAlgState() {
+
+}
+
+size_t sweepFwdAlgState::number_of_settings() const {
+  return settings.size();
+}
+
+const sweepFwdAlgState::lane_penalties_t& sweepFwdAlgState::lane_penalties(
+            size_t lane) const {
+  return penalties[lanes[lane]];
+}
+
+// lanes past the last setting repeat it, and their results are dropped
+void sweepFwdAlgState::start_pass(size_t first_setting) {
+  for(size_t k = 0; k < W; k++) {
+    lanes[k] = min(first_setting + k, settings.size() - 1);
+    log_scale[k] = 0;
+  }
+  std::fill(R.begin(), R.end(), policy::one());
+  S = policy::one();
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  map.reset(0);
+  sites_since_snapshot = 0;
+}
+
+void sweepFwdAlgState::rescale(map_t& next_map) {
+  next_map.scale_in_place(policy::divide(policy::one(), S));
+  for(size_t k = 0; k < W; k++) {
+    log_scale[k] += log(S.lane[k]);
+  }
+  S = policy::one();
+  keep_maps_in_range(next_map.coefficient);
+}
+
+// as in basicFwdAlgState, taking a snapshot once any lane would leave the
+// range of double
+void sweepFwdAlgState::keep_maps_in_range(const value_t& next_coefficient) {
+  const double lower = sqrt(numeric_limits<double>::min());
+  const double upper = sqrt(numeric_limits<double>::max());
+  bool in_range = true;
+  for(size_t k = 0; k < W; k++) {
+    double& smallest = smallest_suffix_coefficient.lane[k];
+    double& largest = largest_suffix_coefficient.lane[k];
+    smallest = next_coefficient.lane[k] * min(1.0, smallest);
+    largest = next_coefficient.lane[k] * max(1.0, largest);
+    in_range = in_range && smallest >= lower && largest <= upper;
+  }
+  if(!in_range) {
+    take_snapshot();
+    smallest_suffix_coefficient = next_coefficient;
+    largest_suffix_coefficient = next_coefficient;
+  }
+}
+
+void sweepFwdAlgState::take_snapshot() {
+  map.hard_update_all();
+  size_t n_rows = R.size();
+  for(size_t i = 0; i < n_rows; i++) {
+    const map_t& row_map = map.get_map(i);
+    if(!row_map.is_identity()) {
+      R[i] = row_map.of(R[i]);
+    }
+  }
+  map.hard_clear_all();
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  snapshot_stats.snapshots_taken++;
+  snapshot_stats.rows_evaluated += n_rows;
+  sites_since_snapshot = 0;
+}
+
+void sweepFwdAlgState::check_snapshot_policy() {
+  size_t live_eqclasses = map.number_of_eqclasses();
+  size_t span = map.get_map_history().size();
+  snapshot_stats.max_live_eqclasses = max(snapshot_stats.max_live_eqclasses,
+              live_eqclasses);
+  snapshot_stats.max_history_length = max(snapshot_stats.max_history_length,
+              span);
+  sites_since_snapshot++;
+  if(!snapshot_policy.automatic ||
+            sites_since_snapshot < snapshot_policy.min_interval) {
+    return;
+  }
+  double debt = snapshot_policy.catch_up_cost * live_eqclasses * log2(span);
+  if(debt >= snapshot_policy.row_cost * R.size()) {
+    take_snapshot();
+  }
+}
+
+void sweepFwdAlgState::initialize_at_span(size_t length,
+            size_t mismatch_count) {
+  double log_H = lane_penalties(0).log_H;
+  for(size_t k = 0; k < W; k++) {
+    log_scale[k] = lane_penalties(k).log_span_mutation_penalty(length,
+              mismatch_count);
+  }
+  std::fill(R.begin(), R.end(), policy::from_log(-log_H));
+  S = policy::one();
+}
+
+void sweepFwdAlgState::initialize_at_site(size_t site_index, alleleValue a) {
+  double uniform = exp(-lane_penalties(0).log_H);
+  bool match_is_rare = cohort->match_is_rare(site_index, a);
+  size_t n_matching = cohort->number_matching(site_index, a);
+  size_t n_not_matching = cohort->number_not_matching(site_index, a);
+  value_t active_value, default_value;
+  for(size_t k = 0; k < W; k++) {
+    double mu = lane_penalties(k).mu_at(site_index);
+    double one_minus_mu = lane_penalties(k).one_minus_mu_at(site_index);
+    double match_initial_value = uniform * one_minus_mu;
+    double nonmatch_initial_value = uniform * mu;
+    active_value.lane[k] = match_is_rare ? match_initial_value : nonmatch_initial_value;
+    default_value.lane[k] = match_is_rare ? nonmatch_initial_value : match_initial_value;
+    if(n_matching == 0) {
+      S.lane[k] = mu;
+    } else if(n_not_matching == 0) {
+      S.lane[k] = one_minus_mu;
+    } else {
+      S.lane[k] = uniform * (exp(log(n_matching)) * one_minus_mu +
+                exp(log(n_not_matching)) * mu);
+    }
+    log_scale[k] = 0;
+  }
+  std::fill(R.begin(), R.end(), default_value);
+  if(cohort->number_active(site_index, a) != 0) {
+    const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
+    rowSet::const_iterator it = active_rows.begin();
+    rowSet::const_iterator rows_end = active_rows.end();
+    for(; it != rows_end; ++it) {
+      R[*it] = active_value;
+    }
+  }
+}
+
+// the lane maps are gathered from each setting's penaltySet, after which the
+// active rows are updated as by basicFwdAlgState::fused_site_update
+void sweepFwdAlgState::extend_at_site(size_t site_index, alleleValue a) {
+  const siteExtension& extension = cohort->get_extension(site_index, a);
+  bool match_is_rare = extension.match_is_rare;
+  value_t coefficient, constant, correction;
+  for(size_t k = 0; k < W; k++) {
+    basicDPUpdateMap<scaledLinear<double> > lane_map =
+              lane_penalties(k).get_current_map(S.lane[k], match_is_rare,
+              site_index, site_index);
+    coefficient.lane[k] = lane_map.coefficient;
+    constant.lane[k] = lane_map.constant;
+    correction.lane[k] = lane_penalties(k).get_minority_map_correction(
+              match_is_rare, site_index);
+  }
+  map_t current_map(coefficient, constant);
+  rescale(current_map);
+  map.stage_map_for_site(current_map);
+  const rowSet& active_rows = extension.active_rows;
+  if(active_rows.empty()) {
+    for(size_t k = 0; k < W; k++) {
+      S.lane[k] *= match_is_rare ? lane_penalties(k).mu_at(site_index) :
+                lane_penalties(k).one_minus_mu_at(site_index);
+    }
+  } else {
+    map.open_reset_eqclass();
+    policy::accumulator sum;
+    rowSet::const_iterator it = active_rows.begin();
+    rowSet::const_iterator rows_end = active_rows.end();
+    for(; it != rows_end; ++it) {
+      size_t row = *it;
+      R[row] = policy::times(correction, map.catch_up_row(row).of(R[row]));
+      map.move_row_to_newest_eqclass(row);
+      sum.add(R[row]);
+    }
+    for(size_t k = 0; k < W; k++) {
+      lane_penalties(k).update_S(S.lane[k], sum.total().lane[k], match_is_rare,
+                site_index);
+    }
+  }
+  check_snapshot_policy();
+}
+
+// see basicFwdAlgState::stage_span
+void sweepFwdAlgState::extend_at_span(size_t length, size_t mismatch_count,
+            size_t gap) {
+  value_t coefficient, constant;
+  for(size_t k = 0; k < W; k++) {
+    double composed = max(lane_penalties(k).composed_R_coefficient(length, gap),
+              sqrt(numeric_limits<double>::min()));
+    coefficient.lane[k] = composed;
+    constant.lane[k] = lane_penalties(k).span_coefficient(length, gap) *
+              S.lane[k] / composed;
+    log_scale[k] += lane_penalties(k).log_span_mutation_penalty(length,
+              mismatch_count);
+  }
+  map_t span_map(coefficient, constant);
+  rescale(span_map);
+  map.stage_map_for_span(span_map);
+}
+
+void sweepFwdAlgState::score_pass(const inputHaplotype* q) {
+  if(!q->has_sites()) {
+    initialize_at_span(q->get_left_tail(), q->get_n_novel_SNVs(-1));
+    return;
+  }
+  map.reserve_length(2 * q->number_of_sites() + 1);
+  if(q->has_left_tail()) {
+    initialize_at_span(q->get_left_tail(), q->get_n_novel_SNVs(-1));
+    extend_at_site(q->get_site_index(0), q->get_allele(0));
+  } else {
+    initialize_at_site(q->get_site_index(0), q->get_allele(0));
+  }
+  for(size_t j = 0; j < q->number_of_sites(); j++) {
+    if(j > 0) {
+      extend_at_site(q->get_site_index(j), q->get_allele(j));
+    }
+    if(q->has_span_after(j)) {
+      extend_at_span(q->get_span_after(j), q->get_n_novel_SNVs(j),
+                q->get_site_index(j) + 1);
+    }
+  }
+}
+
+vector<double> sweepFwdAlgState::calculate_probabilities(const inputHaplotype* q) {
+  vector<double> to_return(settings.size());
+  snapshot_stats = snapshotStats();
+  for(size_t first = 0; first < settings.size(); first += W) {
+    start_pass(first);
+    score_pass(q);
+    for(size_t k = 0; k < W && first + k < settings.size(); k++) {
+      to_return[first + k] = log(S.lane[k]) + log_scale[k];
+    }
+  }
+  return to_return;
+}
+
+void sweepFwdAlgState::set_snapshot_policy(const snapshotPolicy& new_policy) {
+  snapshot_policy = new_policy;
+}
+
+const snapshotStats& sweepFwdAlgState::get_snapshot_stats() const {
+  return snapshot_stats;
+}
@@ -0,0 +1,69 @@
+#ifndef LINEAR_HAPLO_PARAMETER_SWEEP_H
+#define LINEAR_HAPLO_PARAMETER_SWEEP_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+// A sweepFwdAlgState scores a query under many penalty settings in a single
+// traversal of the cohort, as for a grid search over rho and mu. The active
+// rows, their rarity and the eqclass structure of the lazyEvalMap depend on
+// the query and cohort alone, so settings are carried side by side as the
+// lanes of a sweepLinear value: each R-value and each map holds one entry
+// per setting, and catching up a row or an eqclass updates every lane in one
+// vectorizable loop. Settings beyond the lane width are scored in further
+// passes of sweepLinear::width lanes each.
+//
+// Each lane follows the scaled-linear forward algorithm of basicFwdAlgState,
+// with S and log_scale kept per lane and snapshots taken under the
+// snapshotPolicy once any lane calls for one
+struct sweepFwdAlgState{
+  typedef sweepLinear policy;
+  typedef policy::value_t value_t;
+  typedef basicDPUpdateMap<policy> map_t;
+  typedef basicLazyEvalMap<policy> lazy_map_t;
+  typedef basicPenaltySet<scaledLinear<double> > lane_penalties_t;
+private:
+  siteIndex* reference;
+  const haplotypeCohort* cohort;
+  vector<penaltyParameters> settings;
+  vector<lane_penalties_t> penalties;
+  // indices into penalties of the settings in each lane of the current pass
+  size_t lanes[sweepLinear::width];
+
+  lazy_map_t map;
+  vector<value_t> R;
+  value_t S;
+  double log_scale[sweepLinear::width];
+  value_t smallest_suffix_coefficient;
+  value_t largest_suffix_coefficient;
+  snapshotPolicy snapshot_policy;
+  snapshotStats snapshot_stats;
+  size_t sites_since_snapshot = 0;
+
+  const lane_penalties_t& lane_penalties(size_t lane) const;
+  void start_pass(size_t first_setting);
+  void rescale(map_t& next_map);
+  void keep_maps_in_range(const value_t& next_coefficient);
+  void take_snapshot();
+  void check_snapshot_policy();
+  void initialize_at_span(size_t length, size_t mismatch_count);
+  void initialize_at_site(size_t site_index, alleleValue a);
+  void extend_at_site(size_t site_index, alleleValue a);
+  void extend_at_span(size_t length, size_t mismatch_count, size_t gap);
+  void score_pass(const inputHaplotype* q);
+public:
+  sweepFwdAlgState(siteIndex* reference, const haplotypeCohort* cohort,
+              const vector<penaltyParameters>& settings);
+  ~sweepFwdAlgState();
+
+  size_t number_of_settings() const;
+  // log-likelihoods of q under each setting, in order
+  vector<double> calculate_probabilities(const inputHaplotype* q);
+
+  void set_snapshot_policy(const snapshotPolicy& new_policy);
+  // counters summed over the passes of the last query
+  const snapshotStats& get_snapshot_stats() const;
+};
+
+#endif
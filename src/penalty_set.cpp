@@ -1,31 +1,56 @@
 #include <cmath>
+#include <stdexcept>
 #include "penalty_set.hpp"
 
-penaltySet::~penaltySet() {
+template<typename policy>
+const size_t basicPenaltySet<policy>::uniform_span_table_length;
+
+template<typename policy>
+basicPenaltySet<policy>::~basicPenaltySet() {
   
 }
 
-penaltySet::penaltySet(double rho_in, double mu, int H) : H(H), 
-          mu(mu) {
-  rho = rho_in - log(H - 1);
+// the coefficients are derived in log space and then converted
+template<typename policy>
+basicPenaltySet<policy>::basicPenaltySet(double rho_in, double mu_in, int H) : 
+          H(H), log_rho_in_constructor(rho_in) {
+  double log_rho = rho_in - log(H - 1);
   log_H = log(H);
-  one_minus_mu = log1p(-4*exp(mu));
-  one_minus_2mu = log1p(-5*exp(mu));
-  R_coefficient = log1p(-H*exp(rho));
-  rho_over_R_coeff = rho - R_coefficient;
-  one_minus_mu_times_R_coeff = one_minus_mu + R_coefficient;
-  mu_times_R_coeff = mu + R_coefficient;
+  log_mu = mu_in;
+  log_one_minus_mu = log1p(-4*exp(mu_in));
+  double log_one_minus_2mu = log1p(-5*exp(mu_in));
+  log_R_coefficient = log1p(-H*exp(log_rho));
+  
+  rho = policy::from_log(log_rho);
+  mu = policy::from_log(log_mu);
+  one_minus_mu = policy::from_log(log_one_minus_mu);
+  one_minus_2mu = policy::from_log(log_one_minus_2mu);
+  R_coefficient = policy::from_log(log_R_coefficient);
+  stay_coefficient = policy::from_log(log1p(-(H - 1)*exp(log_rho)));
+  rho_over_R_coeff = policy::from_log(log_rho - log_R_coefficient);
+  one_minus_mu_times_R_coeff = policy::from_log(log_one_minus_mu + log_R_coefficient);
+  mu_times_R_coeff = policy::from_log(log_mu + log_R_coefficient);
+  uniform_composed_R_coefficients.resize(uniform_span_table_length);
+  uniform_span_coefficients.resize(uniform_span_table_length);
+  for(size_t l = 0; l < uniform_span_table_length; l++) {
+    uniform_composed_R_coefficients[l] = policy::from_log(log_R_coefficient * l);
+    uniform_span_coefficients[l] = policy::from_log(
+              log1p(-exp(log_R_coefficient * l)) - log_H);
+  }
 }
 
-DPUpdateMap penaltySet::get_match_map(double last_sum) const {
-  return DPUpdateMap(one_minus_mu_times_R_coeff, rho_over_R_coeff + last_sum);
+template<typename policy>
+basicDPUpdateMap<policy> basicPenaltySet<policy>::get_match_map(value_t last_sum) const {
+  return map_t(one_minus_mu_times_R_coeff, policy::times(rho_over_R_coeff, last_sum));
 }
 
-DPUpdateMap penaltySet::get_non_match_map(double last_sum) const {
-  return DPUpdateMap(mu_times_R_coeff, rho_over_R_coeff + last_sum);
+template<typename policy>
+basicDPUpdateMap<policy> basicPenaltySet<policy>::get_non_match_map(value_t last_sum) const {
+  return map_t(mu_times_R_coeff, policy::times(rho_over_R_coeff, last_sum));
 }
 
-DPUpdateMap penaltySet::get_current_map(double last_sum, bool match_is_rare) const {
+template<typename policy>
+basicDPUpdateMap<policy> basicPenaltySet<policy>::get_current_map(value_t last_sum, bool match_is_rare) const {
   if(match_is_rare) {
     return get_non_match_map(last_sum);
   } else {
@@ -33,47 +58,239 @@ DPUpdateMap penaltySet::get_current_map(double last_sum, bool match_is_rare) con
   }
 }
 
-double penaltySet::get_minority_map_correction(bool match_is_rare) const {
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::get_minority_map_correction(bool match_is_rare) const {
   if(match_is_rare) {
-    return one_minus_mu - mu;
+    return policy::divide(one_minus_mu, mu);
   } else {
-    return mu - one_minus_mu;
+    return policy::divide(mu, one_minus_mu);
   }
 }
 
-void penaltySet::update_S(double& S, const vector<double>& summands, 
+template<typename policy>
+void basicPenaltySet<policy>::update_S(value_t& S, value_t active_sum, 
               bool match_is_rare) const {
   if(match_is_rare) {
-    double correct_to_1_m_2mu = one_minus_2mu - one_minus_mu;
-    S += mu;
-    S = logsum(S, correct_to_1_m_2mu + log_big_sum(summands));
+    value_t correct_to_1_m_2mu = policy::divide(one_minus_2mu, one_minus_mu);
+    S = policy::times(mu, S);
+    S = policy::plus(S, policy::times(correct_to_1_m_2mu, active_sum));
   } else {
-    double correct_to_1_m_2mu = one_minus_2mu - mu;
-    S += one_minus_mu;
-    S = logdiff(S, correct_to_1_m_2mu + log_big_sum(summands));
+    value_t correct_to_1_m_2mu = policy::divide(one_minus_2mu, mu);
+    S = policy::times(one_minus_mu, S);
+    S = policy::minus(S, policy::times(correct_to_1_m_2mu, active_sum));
   }
 }
 
-void penaltySet::update_S(double& S, const vector<double>& summands, rowSet::const_iterator begin, rowSet::const_iterator end, bool match_is_rare) const {
-  if(match_is_rare) {
-    double correct_to_1_m_2mu = one_minus_2mu - one_minus_mu;
-    S += mu;
-    S = logsum(S, correct_to_1_m_2mu + log_big_sum(begin, end, summands));
+template<typename policy>
+void basicPenaltySet<policy>::update_S(value_t& S, const vector<value_t>& summands, 
+              bool match_is_rare) const {
+  typename policy::accumulator sum;
+  for(size_t i = 0; i < summands.size(); i++) {
+    sum.add(summands[i]);
+  }
+  update_S(S, sum.total(), match_is_rare);
+}
+
+template<typename policy>
+void basicPenaltySet<policy>::update_S(value_t& S, const vector<value_t>& summands, rowSet::const_iterator begin, rowSet::const_iterator end, bool match_is_rare) const {
+  typename policy::accumulator sum;
+  for(rowSet::const_iterator it = begin; it != end; ++it) {
+    sum.add(summands[*it]);
+  }
+  update_S(S, sum.total(), match_is_rare);
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::composed_R_coefficient(size_t l) const {
+  if(l < uniform_span_table_length) {
+    return uniform_composed_R_coefficients[l];
+  }
+  return policy::from_log(log_R_coefficient * l);
+}
+
+template<typename policy>
+double basicPenaltySet<policy>::log_span_mutation_penalty(size_t l, size_t a) const {
+  return (l - a) * log_one_minus_mu + a * log_mu;
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::span_mutation_penalty(size_t l, size_t a) const {
+  return policy::from_log(log_span_mutation_penalty(l, a));
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::span_coefficient(size_t l) const {
+  if(l < uniform_span_table_length) {
+    return uniform_span_coefficients[l];
+  }
+  return policy::from_log(log1p(-exp(log_R_coefficient * l)) - log_H);
+}
+
+template<typename policy>
+typename basicPenaltySet<policy>::siteRates basicPenaltySet<policy>::make_site_rates(
+            double log_site_mu) const {
+  siteRates to_return;
+  to_return.mu = policy::from_log(log_site_mu);
+  to_return.one_minus_mu = policy::from_log(log1p(-4*exp(log_site_mu)));
+  value_t site_one_minus_2mu = policy::from_log(log1p(-5*exp(log_site_mu)));
+  to_return.correction_match_rare = policy::divide(to_return.one_minus_mu, to_return.mu);
+  to_return.correction_match_common = policy::divide(to_return.mu, to_return.one_minus_mu);
+  to_return.S_factor_match_rare = policy::divide(site_one_minus_2mu, to_return.one_minus_mu);
+  to_return.S_factor_match_common = policy::divide(site_one_minus_2mu, to_return.mu);
+  return to_return;
+}
+
+template<typename policy>
+typename basicPenaltySet<policy>::gapRates basicPenaltySet<policy>::make_gap_rates(
+            double log_rho_in, size_t span_length) const {
+  gapRates to_return;
+  double gap_log_rho = log_rho_in - log(H - 1);
+  double log_coefficient = log1p(-H*exp(gap_log_rho));
+  to_return.rho = policy::from_log(gap_log_rho);
+  to_return.R_coefficient = policy::from_log(log_coefficient);
+  to_return.rho_over_R_coeff = policy::from_log(gap_log_rho - log_coefficient);
+  to_return.stay_coefficient = policy::from_log(log1p(-(H - 1)*exp(gap_log_rho)));
+  to_return.log_R_coefficient = log_coefficient;
+  to_return.span_length = span_length;
+  to_return.span_composed_R_coefficient = policy::from_log(log_coefficient * span_length);
+  to_return.span_span_coefficient = policy::from_log(
+            log1p(-exp(log_coefficient * span_length)) - log_H);
+  to_return.step_composed_R_coefficient = policy::from_log(
+            log_coefficient * (span_length + 1));
+  to_return.step_span_coefficient = policy::from_log(
+            log1p(-exp(log_coefficient * (span_length + 1))) - log_H);
+  return to_return;
+}
+
+template<typename policy>
+void basicPenaltySet<policy>::set_site_rates(const siteIndex* reference,
+            const vector<double>& log_rho_by_gap, 
+            const vector<double>& log_mu_by_site) {
+  size_t n_sites = reference->number_of_sites();
+  if(log_rho_by_gap.size() != n_sites + 1 || log_mu_by_site.size() != n_sites) {
+    throw runtime_error("site rates do not match the number of sites");
+  }
+  site_rates.resize(n_sites);
+  gap_rates.resize(n_sites + 1);
+  for(size_t i = 0; i < n_sites; i++) {
+    site_rates[i] = make_site_rates(log_mu_by_site[i]);
+    gap_rates[i] = make_gap_rates(log_rho_by_gap[i], 
+              reference->span_length_before(i));
+  }
+  size_t final_span = n_sites == 0 ? 0 : reference->span_length_after(n_sites - 1);
+  gap_rates[n_sites] = make_gap_rates(log_rho_by_gap[n_sites], final_span);
+}
+
+template<typename policy>
+void basicPenaltySet<policy>::set_uniform_site_rates(const siteIndex* reference) {
+  size_t n_sites = reference->number_of_sites();
+  set_site_rates(reference, vector<double>(n_sites + 1, log_rho_in_constructor), 
+            vector<double>(n_sites, log_mu));
+}
+
+template<typename policy>
+bool basicPenaltySet<policy>::has_site_rates() const {
+  return !site_rates.empty();
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::mu_at(size_t site) const {
+  return site_rates.empty() ? mu : site_rates[site].mu;
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::one_minus_mu_at(size_t site) const {
+  return site_rates.empty() ? one_minus_mu : site_rates[site].one_minus_mu;
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::rho_at_gap(size_t gap) const {
+  return gap_rates.empty() ? rho : gap_rates[gap].rho;
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::stay_coefficient_at_gap(size_t gap) const {
+  return gap_rates.empty() ? stay_coefficient : gap_rates[gap].stay_coefficient;
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::composed_R_coefficient(size_t l, 
+            size_t gap) const {
+  if(gap_rates.empty()) {
+    return composed_R_coefficient(l);
+  }
+  const gapRates& rates = gap_rates[gap];
+  if(l == rates.span_length) {
+    return rates.span_composed_R_coefficient;
+  } else if(l == rates.span_length + 1) {
+    return rates.step_composed_R_coefficient;
   } else {
-    double correct_to_1_m_2mu = one_minus_2mu - mu;
-    S += one_minus_mu;
-    S = logdiff(S, correct_to_1_m_2mu + log_big_sum(begin, end, summands));
+    return policy::from_log(rates.log_R_coefficient * l);
   }
 }
 
-double penaltySet::composed_R_coefficient(size_t l) const {
-  return R_coefficient * l;
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::span_coefficient(size_t l, 
+            size_t gap) const {
+  if(gap_rates.empty()) {
+    return span_coefficient(l);
+  }
+  const gapRates& rates = gap_rates[gap];
+  if(l == rates.span_length) {
+    return rates.span_span_coefficient;
+  } else if(l == rates.span_length + 1) {
+    return rates.step_span_coefficient;
+  } else {
+    return policy::from_log(log1p(-exp(rates.log_R_coefficient * l)) - log_H);
+  }
+}
+
+template<typename policy>
+basicDPUpdateMap<policy> basicPenaltySet<policy>::get_current_map(value_t last_sum, 
+            bool match_is_rare, size_t site, size_t gap) const {
+  if(site_rates.empty()) {
+    return get_current_map(last_sum, match_is_rare);
+  }
+  const gapRates& rates = gap_rates[gap];
+  value_t majority_emission = match_is_rare ? site_rates[site].mu : 
+            site_rates[site].one_minus_mu;
+  return map_t(policy::times(majority_emission, rates.R_coefficient),
+            policy::times(rates.rho_over_R_coeff, last_sum));
+}
+
+template<typename policy>
+typename policy::value_t basicPenaltySet<policy>::get_minority_map_correction(
+            bool match_is_rare, size_t site) const {
+  if(site_rates.empty()) {
+    return get_minority_map_correction(match_is_rare);
+  }
+  return match_is_rare ? site_rates[site].correction_match_rare : 
+            site_rates[site].correction_match_common;
 }
 
-double penaltySet::span_mutation_penalty(size_t l, size_t a) const {
-  return (l - a) * one_minus_mu + a * mu;
+template<typename policy>
+void basicPenaltySet<policy>::update_S(value_t& S, value_t active_sum, 
+            bool match_is_rare, size_t site) const {
+  if(site_rates.empty()) {
+    update_S(S, active_sum, match_is_rare);
+    return;
+  }
+  const siteRates& rates = site_rates[site];
+  if(match_is_rare) {
+    S = policy::times(rates.mu, S);
+    S = policy::plus(S, policy::times(rates.S_factor_match_rare, active_sum));
+  } else {
+    S = policy::times(rates.one_minus_mu, S);
+    S = policy::minus(S, policy::times(rates.S_factor_match_common, active_sum));
+  }
+}
+
+penaltySet::penaltySet(double logRho, double logMu, int H) : 
+          basicPenaltySet<sumProduct>(logRho, logMu, H) {
+  
 }
 
-double penaltySet::span_coefficient(size_t l) const {
-  return log1p(-exp(composed_R_coefficient(l))) - log_H;
-}
\ No newline at end of file
+template struct basicPenaltySet<logSpace<double> >;
+template struct basicPenaltySet<logSpace<float> >;
+template struct basicPenaltySet<scaledLinear<double> >;
+template struct basicPenaltySet<scaledLinear<float> >;
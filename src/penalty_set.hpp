@@ -3,42 +3,135 @@
 
 #include "math.hpp"
 #include "DP_map.hpp"
+#include "reference.hpp"
 
 using namespace std;
 
 // stores a shared set of penalty-derived coefficients for use in calculations
-// according to our model
-struct penaltySet{
+// according to our model. Coefficients are held in the representation of the
+// arithmetic policy; log_H is always a log
+template<typename policy>
+struct basicPenaltySet{
+  typedef typename policy::value_t value_t;
+  typedef basicDPUpdateMap<policy> map_t;
+  
   int H;
   double log_H;
-  double rho;
-  double mu;
-  double one_minus_mu;
-  double one_minus_2mu;
-  double rho_over_R_coeff;
-  double one_minus_mu_times_R_coeff;
-  double mu_times_R_coeff;
+  value_t rho;
+  value_t mu;
+  value_t one_minus_mu;
+  value_t one_minus_2mu;
+  value_t rho_over_R_coeff;
+  value_t one_minus_mu_times_R_coeff;
+  value_t mu_times_R_coeff;
   
-  double R_coefficient;
+  value_t R_coefficient;
+  // probability of copying the same row from one position to the next
+  value_t stay_coefficient;
   
-  penaltySet(double logRho, double logMu, int H);
-  ~penaltySet();
+  basicPenaltySet(double logRho, double logMu, int H);
+  ~basicPenaltySet();
+  
+  value_t composed_R_coefficient(size_t l) const;
+  value_t span_mutation_penalty(size_t l, size_t a) const;
+  value_t span_coefficient(size_t l) const;
+  // span_mutation_penalty as a log-probability, whatever the policy
+  double log_span_mutation_penalty(size_t l, size_t a) const;
   
-  double composed_R_coefficient(size_t l) const;
-  double span_mutation_penalty(size_t l, size_t a) const;
-  double span_coefficient(size_t l) const;
+  map_t get_match_map(value_t last_sum) const;
+  map_t get_non_match_map(value_t last_sum) const;
+  map_t get_current_map(value_t last_sum, bool match_is_rare) const;
+  value_t get_minority_map_correction(bool match_is_rare) const;
+  // updates S given the sum of the freshly updated active R-values
+  void update_S(value_t& S, value_t active_sum, bool match_is_rare) const;
+  void update_S(value_t& S, const vector<value_t>& summands, bool match_is_rare) const;
+  void update_S(value_t& S, const vector<value_t>& summands, rowSet::const_iterator begin, rowSet::const_iterator end, bool match_is_rare) const;
   
-  DPUpdateMap get_match_map(double last_sum) const;
-  DPUpdateMap get_non_match_map(double last_sum) const;
-  DPUpdateMap get_current_map(double last_sum, bool match_is_rare) const;
-  double get_minority_map_correction(bool match_is_rare) const;
-  void update_S(double& S, const vector<double>& summands, bool match_is_rare) const;
-  void update_S(double& S, const vector<double>& summands, rowSet::const_iterator begin, rowSet::const_iterator end, bool match_is_rare) const;
+  // Rates may also vary along the reference. Gap i is the stretch before site
+  // i: the span before it and the step onto it, so that gap 0 holds the left
+  // tail and gap n the right tail. log_rho_by_gap holds per-position
+  // recombination penalties on the scale of the constructor's, and
+  // log_mu_by_site the mutation penalty at each site; positions within spans
+  // keep the uniform mutation penalty. Every coefficient is computed once into
+  // flat tables, including those of spans of the reference's own lengths.
+  // Without site rates the accessors below return the uniform coefficients
+  void set_site_rates(const siteIndex* reference, 
+              const vector<double>& log_rho_by_gap, 
+              const vector<double>& log_mu_by_site);
+  // tables at the uniform rates, which take the span coefficients off the
+  // hot path
+  void set_uniform_site_rates(const siteIndex* reference);
+  bool has_site_rates() const;
+  
+  value_t mu_at(size_t site) const;
+  value_t one_minus_mu_at(size_t site) const;
+  value_t rho_at_gap(size_t gap) const;
+  value_t stay_coefficient_at_gap(size_t gap) const;
+  // the coefficients of l positions within a gap
+  value_t composed_R_coefficient(size_t l, size_t gap) const;
+  value_t span_coefficient(size_t l, size_t gap) const;
+  map_t get_current_map(value_t last_sum, bool match_is_rare, size_t site, 
+              size_t gap) const;
+  value_t get_minority_map_correction(bool match_is_rare, size_t site) const;
+  void update_S(value_t& S, value_t active_sum, bool match_is_rare, 
+              size_t site) const;
   
   // double mu_val(alleleValue from, alleleValue to) const;
   // double mu_loss_val(alleleValue from) const;
   // double rho_val(size_t position) const;
   // double rho_loss_val(size_t position) const;
+private:
+  double log_rho_in_constructor;
+  double log_mu;
+  double log_one_minus_mu;
+  double log_R_coefficient;
+  
+  // the span coefficients at the uniform rates of spans shorter than
+  // uniform_span_table_length, computed at construction, so that scoring
+  // without site rates pays no transcendental calls per span
+  static const size_t uniform_span_table_length = 1024;
+  vector<value_t> uniform_composed_R_coefficients;
+  vector<value_t> uniform_span_coefficients;
+  
+  struct siteRates{
+    value_t mu;
+    value_t one_minus_mu;
+    // minority corrections, and the factors applied to the sum of corrected
+    // minority R-values in update_S, by whether the match is rare
+    value_t correction_match_rare;
+    value_t correction_match_common;
+    value_t S_factor_match_rare;
+    value_t S_factor_match_common;
+  };
+  struct gapRates{
+    value_t rho;
+    value_t R_coefficient;
+    value_t rho_over_R_coeff;
+    value_t stay_coefficient;
+    double log_R_coefficient;
+    // coefficients of the gap's span, and of the span with the step onto the
+    // next site
+    size_t span_length;
+    value_t span_composed_R_coefficient;
+    value_t span_span_coefficient;
+    value_t step_composed_R_coefficient;
+    value_t step_span_coefficient;
+  };
+  vector<siteRates> site_rates;
+  vector<gapRates> gap_rates;
+  siteRates make_site_rates(double log_site_mu) const;
+  gapRates make_gap_rates(double log_rho, size_t span_length) const;
+};
+
+// A (log rho, log mu) pair, on the scale of the penaltySet constructor
+struct penaltyParameters{
+  double log_rho;
+  double log_mu;
+};
+
+// a struct rather than a typedef so that the C interface can declare it
+struct penaltySet : public basicPenaltySet<sumProduct>{
+  penaltySet(double logRho, double logMu, int H);
 };
 
-#endif
\ No newline at end of file
+#endif
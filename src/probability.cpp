@@ -1,6 +1,17 @@
 #include <cmath>
+#include <limits>
 #include "probability.hpp"
+#include "binary_io.hpp"
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+// default cost of a lazy update of an active row, relative to that of the
+// dense update of a row (see siteKernelPolicy). In log space a lazy row was
+// measured at 36-41ns and a dense row at 16-23ns, so the dense kernel only
+// pays off where near half the rows are active
+static const double LAZY_ROW_COST_LINEAR = 24;
+static const double LAZY_ROW_COST_LOG = 2.2;
 
 struct liStephensModel{
   liStephensModel(siteIndex* reference, haplotypeCohort* cohort, const penaltySet* penalties);
@@ -9,50 +20,168 @@ struct liStephensModel{
   const penaltySet* penalties;
 };
 
-fastFwdAlgState::fastFwdAlgState(siteIndex* reference, const penaltySet* penalties, const haplotypeCohort* cohort) :
-          reference(reference), cohort(cohort), penalties(penalties), map(lazyEvalMap(cohort->get_n_haplotypes(), 0)) {
-  S = 0;
-  R = vector<double>(cohort->get_n_haplotypes(), 0);
+template<typename policy>
+basicFwdAlgState<policy>::basicFwdAlgState(siteIndex* reference, const penalties_t* penalties, const haplotypeCohort* cohort) :
+          reference(reference), cohort(cohort), penalties(penalties), map(lazy_map_t(cohort->get_n_haplotypes(), 0)) {
+  S = policy::one();
+  R = vector<value_t>(cohort->get_n_haplotypes(), policy::one());
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  site_kernel_policy.lazy_row_cost = policy::is_linear ? LAZY_ROW_COST_LINEAR : 
+              LAZY_ROW_COST_LOG;
+}
+
+template<typename policy>
+basicFwdAlgState<policy>::basicFwdAlgState(const basicFwdAlgState &other, bool copy_map) {
+  copy_state(other);
+	if(copy_map) {
+		map = other.map;
+	} else {
+		map = lazy_map_t(cohort->get_n_haplotypes(), last_extended);
+	}
+}
+
+template<typename policy>
+basicFwdAlgState<policy>& basicFwdAlgState<policy>::operator=(const basicFwdAlgState& other) {
+  if(this == &other) {
+    return *this;
+  }
+  release_checkpoints();
+  copy_state(other);
+  map = other.map;
+  return *this;
 }
 
-fastFwdAlgState::fastFwdAlgState(const fastFwdAlgState &other, bool copy_map = true) {
+// everything but the map and the checkpoints
+template<typename policy>
+void basicFwdAlgState<policy>::copy_state(const basicFwdAlgState& other) {
 	reference = other.reference;
 	cohort = other.cohort;
 	penalties = other.penalties;
 	last_extended = other.last_extended;
 	last_span_extended = other.last_span_extended;
 	last_allele = other.last_allele;
+  last_site_index = other.last_site_index;
 	S = other.S;
 	R = other.R;
-	if(copy_map) {
-		map = lazyEvalMap(other.map);
-	} else {
-		map = lazyEvalMap(cohort->get_n_haplotypes(), last_extended);
-	}
+  log_scale = other.log_scale;
+  reversed = other.reversed;
+  smallest_suffix_coefficient = other.smallest_suffix_coefficient;
+  largest_suffix_coefficient = other.largest_suffix_coefficient;
+  snapshot_policy = other.snapshot_policy;
+  snapshot_stats = other.snapshot_stats;
+  sites_since_snapshot = other.sites_since_snapshot;
+  site_kernel_policy = other.site_kernel_policy;
+  dense_run_length = other.dense_run_length;
+}
+
+template<typename policy>
+basicFwdAlgState<policy>::~basicFwdAlgState() {
+  
 }
 
-fastFwdAlgState::~fastFwdAlgState() {
+fastFwdAlgState::fastFwdAlgState(siteIndex* ref, const penaltySet* pen,
+            const haplotypeCohort* haplotypes) : 
+            basicFwdAlgState<sumProduct>(ref, pen, haplotypes) {
   
 }
 
-void fastFwdAlgState::record_last_extended(alleleValue a) {
+fastFwdAlgState::fastFwdAlgState(const fastFwdAlgState& other, bool copy_map) :
+            basicFwdAlgState<sumProduct>(other, copy_map) {
+  
+}
+
+fastFwdAlgState& fastFwdAlgState::operator=(const fastFwdAlgState& other) {
+  basicFwdAlgState<sumProduct>::operator=(other);
+  return *this;
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::reset() {
+  release_checkpoints();
+  S = policy::one();
+  std::fill(R.begin(), R.end(), policy::one());
+  log_scale = 0;
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  last_extended = -1;
+  last_span_extended = -2;
+  last_allele = unassigned;
+  last_site_index = 0;
+  map.reset(0);
+  snapshot_stats = snapshotStats();
+  sites_since_snapshot = 0;
+  dense_run_length = 0;
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::record_last_extended(size_t site_index, 
+            alleleValue a) {
   last_extended++;
   last_allele = a;
+  last_site_index = site_index;
+}
+
+template<typename policy>
+size_t basicFwdAlgState<policy>::gap_entering(size_t site_index) const {
+  return reversed ? site_index + 1 : site_index;
 }
 
-bool fastFwdAlgState::last_extended_is_span() const {
+template<typename policy>
+void basicFwdAlgState<policy>::set_reversed(bool reversed) {
+  this->reversed = reversed;
+}
+
+template<typename policy>
+bool basicFwdAlgState<policy>::last_extended_is_span() const {
   return (last_extended == last_span_extended);
 }
 
-size_t fastFwdAlgState::get_last_site() const {
+template<typename policy>
+size_t basicFwdAlgState<policy>::get_last_site() const {
   return last_extended;
 }
 
-lazyEvalMap& fastFwdAlgState::get_maps() {
+template<typename policy>
+basicLazyEvalMap<policy>& basicFwdAlgState<policy>::get_maps() {
   return map;
 }
 
-void fastFwdAlgState::initialize_probability(const inputHaplotype* q) {
+template<typename policy>
+void basicFwdAlgState<policy>::rescale(map_t& next_map) {
+  if(!policy::is_linear) {
+    return;
+  }
+  next_map.scale_in_place(policy::divide(policy::one(), S));
+  log_scale += policy::to_log(S);
+  S = policy::one();
+  keep_maps_in_range(next_map.coefficient);
+}
+
+// the snapshot leaves R in the frame of the maps already staged, to which
+// next_map then applies
+template<typename policy>
+void basicFwdAlgState<policy>::keep_maps_in_range(value_t next_coefficient) {
+  const value_t lower = sqrt(numeric_limits<value_t>::min());
+  const value_t upper = sqrt(numeric_limits<value_t>::max());
+  smallest_suffix_coefficient = next_coefficient * 
+              min(policy::one(), smallest_suffix_coefficient);
+  largest_suffix_coefficient = next_coefficient * 
+              max(policy::one(), largest_suffix_coefficient);
+  if(smallest_suffix_coefficient < lower || largest_suffix_coefficient > upper) {
+    take_snapshot();
+    smallest_suffix_coefficient = next_coefficient;
+    largest_suffix_coefficient = next_coefficient;
+  }
+}
+
+template<typename policy>
+typename policy::value_t basicFwdAlgState<policy>::from_log_scaled(double x) const {
+  return policy::from_log(x - log_scale);
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::initialize_probability(const inputHaplotype* q) {
   if(q->has_sites()) {
     if(q->has_left_tail()) {
       initialize_probability(q->get_site_index(0), q->get_allele(0),
@@ -66,17 +195,23 @@ void fastFwdAlgState::initialize_probability(const inputHaplotype* q) {
   }
 }
 
-void fastFwdAlgState::extend_probability_at_site(const inputHaplotype* q, size_t j) {
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_site(const inputHaplotype* q, size_t j) {
   extend_probability_at_site(q->get_site_index(j), q->get_allele(j));
 }
 
-void fastFwdAlgState::extend_probability_at_span_after(const inputHaplotype* q, 
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_span_after(const inputHaplotype* q, 
             size_t j) {
-  extend_probability_at_span_after(q->get_site_index(j), 
-            q->get_n_novel_SNVs(j));
+  extend_probability_at_span_in_gap(q->get_span_after(j), 
+            q->get_n_novel_SNVs(j), q->get_site_index(j) + 1);
 }
 
-double fastFwdAlgState::calculate_probability(const inputHaplotype* q) {
+template<typename policy>
+double basicFwdAlgState<policy>::calculate_probability(const inputHaplotype* q) {
+  reset();
+  // one history entry per site and per span following it
+  map.reserve_length(2 * q->number_of_sites() + 1);
   initialize_probability(q);
   if(q->has_span_after(0)) {
     extend_probability_at_span_after(q, 0);
@@ -87,10 +222,60 @@ double fastFwdAlgState::calculate_probability(const inputHaplotype* q) {
       extend_probability_at_span_after(q, j);
     }
   }
-  return S;
+  return prefix_likelihood();
+}
+
+template<typename policy>
+double basicFwdAlgState<policy>::log_likelihood_ceiling(const inputHaplotype* q,
+            size_t j) const {
+  size_t site = q->get_site_index(j);
+  double to_return = max(policy::to_log(penalties->mu_at(site)), 
+              policy::to_log(penalties->one_minus_mu_at(site)));
+  if(q->has_span_after(j)) {
+    to_return += penalties->log_span_mutation_penalty(q->get_span_after(j),
+              q->get_n_novel_SNVs(j));
+  }
+  return to_return;
+}
+
+template<typename policy>
+double basicFwdAlgState<policy>::calculate_probability(const inputHaplotype* q,
+            double threshold, size_t& stopped_at) {
+  size_t n_sites = q->number_of_sites();
+  stopped_at = n_sites;
+  if(n_sites == 0) {
+    return calculate_probability(q);
+  }
+  reset();
+  map.reserve_length(2 * n_sites + 1);
+  // the most that the sites after the last extended can add to log S
+  double remaining = 0;
+  for(size_t j = 1; j < n_sites; j++) {
+    remaining += log_likelihood_ceiling(q, j);
+  }
+  initialize_probability(q);
+  if(q->has_span_after(0)) {
+    extend_probability_at_span_after(q, 0);
+  }
+  for(size_t j = 0; j < n_sites; j++) {
+    if(j > 0) {
+      extend_probability_at_site(q, j);
+      if(q->has_span_after(j)) {
+        extend_probability_at_span_after(q, j);
+      }
+      remaining -= log_likelihood_ceiling(q, j);
+    }
+    double bound = prefix_likelihood() + (j + 1 < n_sites ? remaining : 0);
+    if(bound < threshold) {
+      stopped_at = j;
+      return bound;
+    }
+  }
+  return prefix_likelihood();
 }
 
-void fastFwdAlgState::initialize_probability(size_t site_index, alleleValue a,
+template<typename policy>
+void basicFwdAlgState<policy>::initialize_probability(size_t site_index, alleleValue a,
             size_t left_tail_length, size_t mismatch_count) {
   if(left_tail_length != 0) {
     initialize_probability_at_span(left_tail_length, mismatch_count);
@@ -100,29 +285,40 @@ void fastFwdAlgState::initialize_probability(size_t site_index, alleleValue a,
   }
 }
 
-void fastFwdAlgState::initialize_probability_at_span(size_t length, 
+template<typename policy>
+void basicFwdAlgState<policy>::initialize_probability_at_span(size_t length, 
               size_t mismatch_count) {
   // There is a uniform 1/|H| probability of starting on any given haplotype.
-  // All emission probabilities are the same. So all R-values are the same
-  double common_initial_R = penalties->span_mutation_penalty(length, mismatch_count) - penalties->log_H;
+  // All emission probabilities are the same. So all R-values are the same.
+  // A linear state starts scaled so that S = 1
+  double log_m = penalties->log_span_mutation_penalty(length, mismatch_count);
+  log_scale = policy::is_linear ? log_m : 0;
+  value_t common_initial_R = from_log_scaled(log_m - penalties->log_H);
+  journal_all_R();
   for(size_t i = 0; i < R.size(); i++) {
     R[i] = common_initial_R;
   }
-  S = penalties->span_mutation_penalty(length, mismatch_count);  
+  S = from_log_scaled(log_m);
   last_span_extended = -1;
 }
 
-void fastFwdAlgState::initialize_probability_at_site(size_t site_index, 
+template<typename policy>
+void basicFwdAlgState<policy>::initialize_probability_at_site(size_t site_index, 
             alleleValue a) {
   // There are only two possible R-values at this site. There is a uniform
   // 1/|H| probability of starting on any given haplotype; the emission
   // probabilities account for differences in R-value
-  double match_initial_value = -penalties->log_H + penalties->one_minus_mu;
-  double nonmatch_initial_value = -penalties->log_H + penalties->mu;
+  value_t uniform = policy::from_log(-penalties->log_H);
+  value_t mu = penalties->mu_at(site_index);
+  value_t one_minus_mu = penalties->one_minus_mu_at(site_index);
+  value_t match_initial_value = policy::times(uniform, one_minus_mu);
+  value_t nonmatch_initial_value = policy::times(uniform, mu);
 
-  double active_value = cohort->match_is_rare(site_index, a) ? match_initial_value : nonmatch_initial_value;
-  double default_value = cohort->match_is_rare(site_index, a) ? nonmatch_initial_value : match_initial_value;
+  value_t active_value = cohort->match_is_rare(site_index, a) ? match_initial_value : nonmatch_initial_value;
+  value_t default_value = cohort->match_is_rare(site_index, a) ? nonmatch_initial_value : match_initial_value;
   
+  log_scale = 0;
+  journal_all_R();
   std::fill(R.begin(), R.end(), default_value);
   
   if(cohort->number_active(site_index, a) != 0) {
@@ -135,81 +331,240 @@ void fastFwdAlgState::initialize_probability_at_site(size_t site_index,
   }
 
   if(cohort->number_matching(site_index, a) == 0) {
-    S = penalties->mu;
+    S = mu;
   } else if(cohort->number_not_matching(site_index, a) == 0) {
-    S = penalties->one_minus_mu;
-  } else {  
-    S = -penalties->log_H + 
-                logsum(log(cohort->number_matching(site_index, a)) + penalties->one_minus_mu,
-                       log(cohort->number_not_matching(site_index, a)) + penalties->mu);
+    S = one_minus_mu;
+  } else {
+    value_t n_matching = policy::from_log(log(cohort->number_matching(site_index, a)));
+    value_t n_not_matching = policy::from_log(log(cohort->number_not_matching(site_index, a)));
+    S = policy::times(uniform, 
+                policy::plus(policy::times(n_matching, one_minus_mu),
+                             policy::times(n_not_matching, mu)));
   }
-  record_last_extended(a);
+  record_last_extended(site_index, a);
 }
 
-void fastFwdAlgState::update_subset_of_Rs(const rowSet& indices,
+template<typename policy>
+void basicFwdAlgState<policy>::update_subset_of_Rs(const rowSet& indices,
               bool active_is_match) {
-  double correction = penalties->get_minority_map_correction(active_is_match);
+  value_t correction = penalties->get_minority_map_correction(active_is_match);
   rowSet::const_iterator it = indices.begin();
   rowSet::const_iterator rows_end = indices.end();
   for(it; it != rows_end; ++it) {
     size_t row = *it;
-    R[row] = correction + calculate_R(R[row], map.get_map(row));
+    journal_R(row);
+    R[row] = policy::times(correction, map.get_map(row).of(R[row]));
   }
 }
 
-void fastFwdAlgState::fast_update_S(const rowSet& indices,
+template<typename policy>
+void basicFwdAlgState<policy>::fast_update_S(const rowSet& indices,
               bool active_is_match) {
   penalties->update_S(S, R, indices.begin(), indices.end(), active_is_match);
 }
 
-void fastFwdAlgState::extend_probability_at_site(size_t site_index,
+template<typename policy>
+void basicFwdAlgState<policy>::fused_site_update(size_t site_index, 
+              const rowSet& active_rows, bool match_is_rare) {
+  value_t correction = penalties->get_minority_map_correction(match_is_rare, 
+              site_index);
+  map.open_reset_eqclass();
+  typename policy::accumulator sum;
+  bool journaling = !checkpoints.empty();
+  rowSet::const_iterator it = active_rows.begin();
+  rowSet::const_iterator rows_end = active_rows.end();
+  for(it; it != rows_end; ++it) {
+    size_t row = *it;
+    value_t new_R = policy::times(correction, map.catch_up_row(row).of(R[row]));
+    if(journaling) {
+      journal_R(row);
+    }
+    R[row] = new_R;
+    map.move_row_to_newest_eqclass(row);
+    sum.add(new_R);
+  }
+  penalties->update_S(S, sum.total(), match_is_rare, site_index);
+}
+
+// The dense kernel applies the map of the site, staged onto the single
+// eqclass, to every R-value at once; the snapshot needed to enter it is taken
+// before the map is staged, so that no row is passed through the map twice
+template<typename policy>
+bool basicFwdAlgState<policy>::choose_dense_kernel(size_t n_active) {
+  if(!site_kernel_policy.adaptive || !checkpoints.empty() || 
+            site_kernel_policy.dense_row_cost * R.size() > 
+            site_kernel_policy.lazy_row_cost * n_active) {
+    dense_run_length = 0;
+    return false;
+  }
+  dense_run_length++;
+  if(map.number_of_eqclasses() == 1) {
+    return true;
+  }
+  if(dense_run_length < site_kernel_policy.min_dense_run) {
+    return false;
+  }
+  take_snapshot();
+  snapshot_stats.dense_runs_entered++;
+  return true;
+}
+
+// c + logsum(x, k) for every value, as c + max(x, k) + log1p(exp(-|x - k|)),
+// without branches. Each value still costs an exp and a log1p, which are not
+// vectorized
+template<typename T>
+static void log_affine_pass(T* values, size_t n_rows, T coefficient,
+              T constant) {
+  for(size_t i = 0; i < n_rows; i++) {
+    T x = values[i];
+    T larger = x > constant ? x : constant;
+    values[i] = coefficient + larger + log1p(exp(-fabs(x - constant)));
+  }
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::dense_site_update(size_t site_index, 
+              const rowSet& active_rows, bool match_is_rare) {
+  map.hard_update_all();
+  const map_t site_map = map.get_map(0);
+  value_t coefficient = site_map.coefficient;
+  value_t constant = site_map.constant;
+  value_t* values = R.data();
+  size_t n_rows = R.size();
+  // branch-free loops over contiguous values, which vectorize for linear
+  // policies
+  if(site_map.is_degenerate()) {
+    for(size_t i = 0; i < n_rows; i++) {
+      values[i] = policy::times(coefficient, values[i]);
+    }
+  } else if(!policy::is_linear) {
+    log_affine_pass(values, n_rows, coefficient, constant);
+  } else {
+    for(size_t i = 0; i < n_rows; i++) {
+      values[i] = policy::times(coefficient, policy::plus(values[i], constant));
+    }
+  }
+  value_t correction = penalties->get_minority_map_correction(match_is_rare, 
+              site_index);
+  typename policy::accumulator sum;
+  rowSet::const_iterator it = active_rows.begin();
+  rowSet::const_iterator rows_end = active_rows.end();
+  for(; it != rows_end; ++it) {
+    size_t row = *it;
+    values[row] = policy::times(correction, values[row]);
+    sum.add(values[row]);
+  }
+  map.hard_clear_all();
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  snapshot_stats.dense_sites++;
+  sites_since_snapshot = 0;
+  penalties->update_S(S, sum.total(), match_is_rare, site_index);
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_site(size_t site_index,
             alleleValue a) {
-  bool match_is_rare = cohort->match_is_rare(site_index, a);
-  DPUpdateMap current_map = penalties->get_current_map(S, match_is_rare);
-  const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
-  extend_probability_at_site(current_map, active_rows, match_is_rare, a);
+  extend_probability_at_site(site_index, cohort->get_extension(site_index, a));
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_site(size_t site_index,
+            const siteExtension& extension) {
+  extend_probability_at_site(site_index, extension.active_rows, 
+              extension.match_is_rare, extension.allele);
 }
 
-void fastFwdAlgState::extend_probability_at_span_after(size_t site_index,
-            size_t mismatch_count = 0) {
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_span_after(size_t site_index,
+            size_t mismatch_count) {
   size_t length = reference->span_length_after(site_index);
-  extend_probability_at_span_after_anonymous(length, mismatch_count);
+  extend_probability_at_span_in_gap(length, mismatch_count, site_index + 1);
 }
 
-void fastFwdAlgState::take_snapshot() {
-  if(last_extended >= 0) {
-    map.hard_update_all();
-    size_t j = last_extended;
-    bool reference_is_homogeneous = (cohort->number_matching(j, last_allele) == 0 || cohort->number_not_matching(j, last_allele) == 0);
-    if(reference_is_homogeneous || last_extended_is_span()) {
-      for(size_t i = 0; i < cohort->get_n_haplotypes(); i++) {
-        R[i] = calculate_R(R[i], map.get_map(i));
-      }
-    } else {
-      vector<bool> already_calculated(cohort->get_n_haplotypes(), false);
-      rowSet::const_iterator it = cohort->get_active_rowSet(j, last_allele).begin();
-      rowSet::const_iterator end = cohort->get_active_rowSet(j, last_allele).end();
-      for(it; it != end; ++it) {
-        already_calculated[*it] = true;
-      }
-      for(size_t i = 0; i < cohort->get_n_haplotypes(); i++) {
-        if(!already_calculated[i]) {
-          R[i] = calculate_R(R[i], map.get_map(i));
-        }
-      }
+// rows reset at the last site sit in an identity eqclass, so every row can
+// be passed through its map without tracking which were active
+template<typename policy>
+void basicFwdAlgState<policy>::take_snapshot() {
+  map.hard_update_all();
+  size_t n_rows = R.size();
+  for(size_t i = 0; i < n_rows; i++) {
+    const map_t& row_map = map.get_map(i);
+    if(!row_map.is_identity()) {
+      journal_R(i);
+      R[i] = row_map.of(R[i]);
     }
-    // since all R-values are up to date, we do not need entries in the lazyEvalMap
-    // therefore we can clear them all and replace them with the identity map
-    map.hard_clear_all();
   }
-} 
+  // since all R-values are up to date, we do not need entries in the lazyEvalMap
+  // therefore we can clear them all and replace them with the identity map
+  map.hard_clear_all();
+  smallest_suffix_coefficient = policy::one();
+  largest_suffix_coefficient = policy::one();
+  snapshot_stats.snapshots_taken++;
+  snapshot_stats.rows_evaluated += n_rows;
+  sites_since_snapshot = 0;
+}
 
-double fastFwdAlgState::prefix_likelihood() const {
-  return S;
+template<typename policy>
+void basicFwdAlgState<policy>::check_snapshot_policy() {
+  size_t live_eqclasses = map.number_of_eqclasses();
+  size_t span = map.get_map_history().size();
+  if(live_eqclasses > snapshot_stats.max_live_eqclasses) {
+    snapshot_stats.max_live_eqclasses = live_eqclasses;
+  }
+  if(span > snapshot_stats.max_history_length) {
+    snapshot_stats.max_history_length = span;
+  }
+  sites_since_snapshot++;
+  if(!snapshot_policy.automatic || !checkpoints.empty() ||
+            sites_since_snapshot < snapshot_policy.min_interval) {
+    return;
+  }
+  double debt = snapshot_policy.catch_up_cost * live_eqclasses * log2(span);
+  if(debt >= snapshot_policy.row_cost * R.size()) {
+    take_snapshot();
+  }
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::set_snapshot_policy(const snapshotPolicy& new_policy) {
+  snapshot_policy = new_policy;
+}
+
+template<typename policy>
+const snapshotPolicy& basicFwdAlgState<policy>::get_snapshot_policy() const {
+  return snapshot_policy;
+}
+
+template<typename policy>
+const snapshotStats& basicFwdAlgState<policy>::get_snapshot_stats() const {
+  return snapshot_stats;
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::set_site_kernel_policy(const siteKernelPolicy& new_policy) {
+  site_kernel_policy = new_policy;
+  dense_run_length = 0;
+}
+
+template<typename policy>
+const siteKernelPolicy& basicFwdAlgState<policy>::get_site_kernel_policy() const {
+  return site_kernel_policy;
+}
+
+template<typename policy>
+double basicFwdAlgState<policy>::prefix_likelihood() const {
+  return policy::to_log(S) + log_scale;
+}
+
+template<typename policy>
+double basicFwdAlgState<policy>::partial_likelihood_by_row(size_t row) const {
+  return policy::to_log(R[row]) + log_scale;
 }
 
-double fastFwdAlgState::partial_likelihood_by_row(size_t row) const {
-  return R[row];
+template<typename policy>
+double basicFwdAlgState<policy>::current_likelihood_by_row(size_t row) {
+  return policy::to_log(map.catch_up_row(row).of(R[row])) + log_scale;
 }
 
 double calculate_R(double oldR, const DPUpdateMap& map) {
@@ -220,42 +575,300 @@ double calculate_R(double oldR, double coefficient, double constant) {
   return calculate_R(oldR, DPUpdateMap(coefficient, constant));
 }
 
-void fastFwdAlgState::extend_probability_at_site(const DPUpdateMap& current_map, 
-            const rowSet& active_rows, bool match_is_rare, 
-            alleleValue a) {
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_site(size_t site_index,
+            const map_t& current_map, const rowSet& active_rows, 
+            bool match_is_rare, alleleValue a) {
+  bool dense = !active_rows.empty() && choose_dense_kernel(active_rows.size());
   map.stage_map_for_site(current_map);
-  if(active_rows.empty() && match_is_rare) {
+  if(dense) {
+    dense_site_update(site_index, active_rows, match_is_rare);
+  } else if(active_rows.empty() && match_is_rare) {
     // separate case to avoid log-summing "log 0"
-    S = penalties->mu + S;
+    S = policy::times(penalties->mu_at(site_index), S);
   } else if(active_rows.empty() && !match_is_rare) {
     // separate case to avoid log-summing "log 0"
-    S = penalties->one_minus_mu + S;
+    S = policy::times(penalties->one_minus_mu_at(site_index), S);
   } else {
-    map.update_active_rows(active_rows);
-    update_subset_of_Rs(active_rows, match_is_rare);
-    fast_update_S(active_rows, match_is_rare);
-    map.reset_rows(active_rows);
+    fused_site_update(site_index, active_rows, match_is_rare);
   }
-  record_last_extended(a);
+  record_last_extended(site_index, a);
+  check_snapshot_policy();
   return;
 }
 
-void fastFwdAlgState::extend_probability_at_site(
-            const rowSet& active_rows, bool match_is_rare, 
-            alleleValue a) {
-  DPUpdateMap current_map = penalties->get_current_map(S, match_is_rare);
-  extend_probability_at_site(current_map, active_rows, match_is_rare, a);
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_site(size_t site_index,
+            const rowSet& active_rows, bool match_is_rare, alleleValue a) {
+  map_t current_map = penalties->get_current_map(S, match_is_rare, site_index,
+              gap_entering(site_index));
+  rescale(current_map);
+  extend_probability_at_site(site_index, current_map, active_rows, 
+              match_is_rare, a);
 }
 
-void fastFwdAlgState::extend_probability_at_span_after_anonymous(size_t l, 
-            size_t mismatch_count) {
-  double m = penalties->span_mutation_penalty(l, mismatch_count);
-  map.stage_map_for_span(DPUpdateMap(m + penalties->composed_R_coefficient(l), 
-              penalties->span_coefficient(l) + S - penalties->composed_R_coefficient(l)));
-  S = m + S;
+// A linear state takes the span's mutation penalty into log_scale, where it
+// cannot underflow, and is then rescaled
+template<typename policy>
+void basicFwdAlgState<policy>::stage_span(size_t l, size_t mismatch_count,
+            value_t composed, value_t span_coefficient) {
+  double log_m = penalties->log_span_mutation_penalty(l, mismatch_count);
+  value_t m = policy::is_linear ? policy::one() : policy::from_log(log_m);
+  if(policy::is_linear) {
+    // over spans long enough for this to underflow, the term in R is
+    // negligible beside the term in S
+    composed = max(composed, sqrt(numeric_limits<value_t>::min()));
+  }
+  map_t span_map(policy::times(m, composed), 
+              policy::divide(policy::times(span_coefficient, S), composed));
+  S = policy::times(m, S);
+  if(policy::is_linear) {
+    log_scale += log_m;
+    rescale(span_map);
+  }
+  map.stage_map_for_span(span_map);
   last_span_extended = last_extended;
 }
 
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_span_in_gap(size_t l, 
+            size_t mismatch_count, size_t gap) {
+  stage_span(l, mismatch_count, penalties->composed_R_coefficient(l, gap),
+            penalties->span_coefficient(l, gap));
+}
+
+// a span outside the reference has the uniform rates
+template<typename policy>
+void basicFwdAlgState<policy>::extend_probability_at_span_after_anonymous(size_t l, 
+            size_t mismatch_count) {
+  stage_span(l, mismatch_count, penalties->composed_R_coefficient(l),
+            penalties->span_coefficient(l));
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::push_site(alleleValue a) {
+  push_site(last_extended < 0 ? 0 : last_site_index + 1, a);
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::push_site(size_t site_index, alleleValue a) {
+  if(last_extended < 0 && last_span_extended == -2) {
+    initialize_probability_at_site(site_index, a);
+  } else {
+    extend_probability_at_site(site_index, a);
+  }
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::push_span(size_t length, size_t mismatch_count) {
+  if(last_extended < 0 && last_span_extended == -2) {
+    initialize_probability_at_span(length, mismatch_count);
+  } else {
+    size_t gap = last_extended < 0 ? 0 : last_site_index + 1;
+    extend_probability_at_span_in_gap(length, mismatch_count, gap);
+  }
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::journal_R(size_t row) {
+  if(checkpoints.empty() || R_undo_stamp[row] == undo_epoch) {
+    return;
+  }
+  R_undo_stamp[row] = undo_epoch;
+  R_undo_log.push_back(make_pair(row, R[row]));
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::journal_all_R() {
+  if(checkpoints.empty()) {
+    return;
+  }
+  for(size_t i = 0; i < R.size(); i++) {
+    journal_R(i);
+  }
+}
+
+template<typename policy>
+size_t basicFwdAlgState<policy>::checkpoint() {
+  stateCheckpoint to_add;
+  to_add.S = S;
+  to_add.log_scale = log_scale;
+  to_add.smallest_suffix_coefficient = smallest_suffix_coefficient;
+  to_add.largest_suffix_coefficient = largest_suffix_coefficient;
+  to_add.last_extended = last_extended;
+  to_add.last_span_extended = last_span_extended;
+  to_add.last_allele = last_allele;
+  to_add.last_site_index = last_site_index;
+  to_add.snapshot_stats = snapshot_stats;
+  to_add.sites_since_snapshot = sites_since_snapshot;
+  to_add.dense_run_length = dense_run_length;
+  to_add.R_log_length = R_undo_log.size();
+  to_add.map_checkpoint = map.checkpoint();
+  checkpoints.push_back(to_add);
+  ++undo_epoch;
+  R_undo_stamp.resize(R.size(), 0);
+  return checkpoints.size() - 1;
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::rollback(size_t checkpoint) {
+  if(checkpoint >= checkpoints.size()) {
+    throw runtime_error("rollback to a checkpoint which is not open");
+  }
+  const stateCheckpoint& target = checkpoints[checkpoint];
+  for(size_t i = R_undo_log.size(); i > target.R_log_length; i--) {
+    R[R_undo_log[i - 1].first] = R_undo_log[i - 1].second;
+  }
+  R_undo_log.resize(target.R_log_length);
+  map.rollback(target.map_checkpoint);
+  S = target.S;
+  log_scale = target.log_scale;
+  smallest_suffix_coefficient = target.smallest_suffix_coefficient;
+  largest_suffix_coefficient = target.largest_suffix_coefficient;
+  last_extended = target.last_extended;
+  last_span_extended = target.last_span_extended;
+  last_allele = target.last_allele;
+  last_site_index = target.last_site_index;
+  snapshot_stats = target.snapshot_stats;
+  sites_since_snapshot = target.sites_since_snapshot;
+  dense_run_length = target.dense_run_length;
+  checkpoints.erase(checkpoints.begin() + checkpoint + 1, checkpoints.end());
+  ++undo_epoch;
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::release_checkpoints() {
+  checkpoints.clear();
+  R_undo_log.clear();
+  map.release_checkpoints();
+}
+
+template<typename policy>
+size_t basicFwdAlgState<policy>::number_of_checkpoints() const {
+  return checkpoints.size();
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::serialize_binary(ostream& out) const {
+  if(!checkpoints.empty()) {
+    throw runtime_error("cannot serialize a state with open checkpoints");
+  }
+  write_uint64(out, binary_tag("SLLSFWD2"));
+  write_uint64(out, policy::binary_id);
+  write_uint64(out, R.size());
+  write_value(out, S);
+  for(size_t i = 0; i < R.size(); i++) {
+    write_value(out, R[i]);
+  }
+  write_value(out, log_scale);
+  write_value(out, smallest_suffix_coefficient);
+  write_value(out, largest_suffix_coefficient);
+  write_uint64(out, (uint64_t)(int64_t)last_extended);
+  write_uint64(out, (uint64_t)(int64_t)last_span_extended);
+  write_uint64(out, last_extended < 0 ? 0 : (uint64_t)last_allele);
+  write_uint64(out, last_site_index);
+  write_bool(out, reversed);
+  write_bool(out, snapshot_policy.automatic);
+  write_value(out, snapshot_policy.catch_up_cost);
+  write_value(out, snapshot_policy.row_cost);
+  write_uint64(out, snapshot_policy.min_interval);
+  write_uint64(out, snapshot_stats.snapshots_taken);
+  write_uint64(out, snapshot_stats.rows_evaluated);
+  write_uint64(out, snapshot_stats.max_live_eqclasses);
+  write_uint64(out, snapshot_stats.max_history_length);
+  write_uint64(out, snapshot_stats.dense_sites);
+  write_uint64(out, snapshot_stats.dense_runs_entered);
+  write_uint64(out, sites_since_snapshot);
+  write_bool(out, site_kernel_policy.adaptive);
+  write_value(out, site_kernel_policy.dense_row_cost);
+  write_value(out, site_kernel_policy.lazy_row_cost);
+  write_uint64(out, site_kernel_policy.min_dense_run);
+  write_uint64(out, dense_run_length);
+  map.serialize_binary(out);
+}
+
+template<typename policy>
+void basicFwdAlgState<policy>::deserialize_binary(istream& in) {
+  expect_tag(in, binary_tag("SLLSFWD2"), "forward state");
+  if(read_uint64(in) != policy::binary_id) {
+    throw runtime_error("state in binary stream has another arithmetic policy");
+  }
+  if(read_uint64(in) != R.size()) {
+    throw runtime_error("state in binary stream has another number of haplotypes");
+  }
+  release_checkpoints();
+  read_value(in, S);
+  for(size_t i = 0; i < R.size(); i++) {
+    read_value(in, R[i]);
+  }
+  read_value(in, log_scale);
+  read_value(in, smallest_suffix_coefficient);
+  read_value(in, largest_suffix_coefficient);
+  // the position markers are checked against the reference before any is
+  // used, since the next extension indexes sites by them
+  int64_t extended = (int64_t)read_uint64(in);
+  int64_t span_extended = (int64_t)read_uint64(in);
+  uint64_t allele = read_uint64(in);
+  uint64_t site_index = read_uint64(in);
+  int64_t n_sites = (int64_t)reference->number_of_sites();
+  if(extended < -1 || extended >= n_sites || 
+            span_extended < -2 || span_extended >= n_sites ||
+            allele > gap || site_index >= (uint64_t)max(n_sites, (int64_t)1)) {
+    throw runtime_error("corrupt forward state in binary stream");
+  }
+  last_extended = (int)extended;
+  last_span_extended = (int)span_extended;
+  last_allele = (alleleValue)allele;
+  last_site_index = site_index;
+  reversed = read_bool(in);
+  snapshot_policy.automatic = read_bool(in);
+  read_value(in, snapshot_policy.catch_up_cost);
+  read_value(in, snapshot_policy.row_cost);
+  snapshot_policy.min_interval = read_uint64(in);
+  snapshot_stats.snapshots_taken = read_uint64(in);
+  snapshot_stats.rows_evaluated = read_uint64(in);
+  snapshot_stats.max_live_eqclasses = read_uint64(in);
+  snapshot_stats.max_history_length = read_uint64(in);
+  snapshot_stats.dense_sites = read_uint64(in);
+  snapshot_stats.dense_runs_entered = read_uint64(in);
+  sites_since_snapshot = read_uint64(in);
+  site_kernel_policy.adaptive = read_bool(in);
+  read_value(in, site_kernel_policy.dense_row_cost);
+  read_value(in, site_kernel_policy.lazy_row_cost);
+  site_kernel_policy.min_dense_run = read_uint64(in);
+  dense_run_length = read_uint64(in);
+  map.deserialize_binary(in);
+}
+
+template struct basicFwdAlgState<logSpace<double> >;
+template struct basicFwdAlgState<logSpace<float> >;
+template struct basicFwdAlgState<scaledLinear<double> >;
+template struct basicFwdAlgState<scaledLinear<float> >;
+
+void serialize_states(ostream& out, const vector<fastFwdAlgState>& states) {
+  write_uint64(out, binary_tag("SLLSBAT1"));
+  write_uint64(out, states.size());
+  for(size_t i = 0; i < states.size(); i++) {
+    states[i].serialize_binary(out);
+  }
+}
+
+vector<fastFwdAlgState> deserialize_states(istream& in, siteIndex* reference,
+            const penaltySet* penalties, const haplotypeCohort* cohort) {
+  expect_tag(in, binary_tag("SLLSBAT1"), "batch of forward states");
+  // a state holds at least its tag, header and R-values
+  size_t n_states = read_count(in, 24 + 
+            (cohort->get_n_haplotypes() + 1) * sizeof(double));
+  vector<fastFwdAlgState> to_return;
+  // states are read in place, so that none is ever copied
+  to_return.reserve(n_states);
+  for(size_t i = 0; i < n_states; i++) {
+    to_return.emplace_back(reference, penalties, cohort);
+    to_return.back().deserialize_binary(in);
+  }
+  return to_return;
+}
+
 slowFwdSolver::slowFwdSolver(siteIndex* ref, const penaltySet* pen, const haplotypeCohort* haplotypes) :
             reference(ref), penalties(pen), cohort(haplotypes) {
 }
@@ -10,24 +10,108 @@
 
 using namespace std;
 
+// Tuning for automatic snapshots. Every live eqclass must eventually be caught
+// up through O(log span) map compositions, where span is the length of the
+// retained map history; a snapshot pays that debt now and evaluates one map
+// per row, after which all rows share a single eqclass. A snapshot is taken
+// once catch_up_cost * |live eqclasses| * log2(span) reaches
+// row_cost * |H|, but no more often than every min_interval sites
+struct snapshotPolicy{
+  bool automatic = true;
+  double catch_up_cost = 1;
+  double row_cost = 1;
+  size_t min_interval = 64;
+};
+
+// Tuning for the dense site kernel. A site with many active rows costs less
+// as one flat pass over every R-value than as the lazy update of its active
+// rows, each of which is caught up, rewritten and moved between eqclasses. In
+// linear space the pass vectorizes; in log space it is a logsum per R-value,
+// so is cheaper only by the bookkeeping of the lazy path. A site favours the dense kernel when
+//    dense_row_cost * |H| <= lazy_row_cost * |active rows|
+// and is taken densely if every row shares one eqclass, as after a dense site
+// or a snapshot. Otherwise a snapshot is taken to enter the kernel once
+// min_dense_run sites in a row have favoured it. Returning to the lazy path
+// costs nothing. The default costs depend on the arithmetic policy, since a
+// log-space R-value costs a logsum whichever path it takes
+struct siteKernelPolicy{
+  bool adaptive = true;
+  double dense_row_cost = 1;
+  double lazy_row_cost = 1;
+  size_t min_dense_run = 4;
+};
+
+struct snapshotStats{
+  size_t snapshots_taken = 0;
+  size_t rows_evaluated = 0;
+  size_t max_live_eqclasses = 0;
+  size_t max_history_length = 0;
+  // sites taken by the dense kernel, and runs of them entered by a snapshot
+  size_t dense_sites = 0;
+  size_t dense_runs_entered = 0;
+};
+
+// A run of consecutive sites of a query, relative to the query, over which a
+// copying path stays on a single row of the cohort
+struct pathSegment{
+  size_t row;
+  size_t first_site;
+  size_t last_site;
+};
+
 // A fastFwdAlgState is the matrix which iteratively calculates haplotype
 // likelihood. It takes in a haplotypeCohort and a siteIndex, an
 // inputHaplotype built against the siteIndex, and a penaltySet
 // of mutation and recombination penalties. It calculates and returns the
 // likelihood of the inputHaplotype relative to the haplotypeCohort when
 // calculate_probability is called
-struct fastFwdAlgState{
+//
+// basicFwdAlgState holds R, S and its maps under an arithmetic policy (see
+// DP_map.hpp); fastFwdAlgState is the double-precision, log-space state.
+// Under a linear policy the state is rescaled at every site and span so that
+// S is 1 before it is updated, and the log of the accumulated scale is kept
+// in log_scale. The likelihood accessors return log-probabilities whatever
+// the policy
+template<typename policy>
+struct basicFwdAlgState{
+public:
+  typedef typename policy::value_t value_t;
+  typedef basicDPUpdateMap<policy> map_t;
+  typedef basicLazyEvalMap<policy> lazy_map_t;
+  typedef basicPenaltySet<policy> penalties_t;
 private:
   
 //-- support structures --------------------------------------------------------
   
   siteIndex* reference;
   const haplotypeCohort* cohort;
-  const penaltySet* penalties;
+  const penalties_t* penalties;
   
 //-- blockwise lazy eval "backend" ---------------------------------------------
   
-  lazyEvalMap map;
+  lazy_map_t map;
+  
+//-- scaling -------------------------------------------------------------------
+  
+  // log of the factor by which R and S are held scaled down; always 0 under
+  // log-space policies
+  double log_scale = 0;
+  // folds division by S into the map about to be staged and resets S to 1,
+  // under linear policies only
+  void rescale(map_t& next_map);
+  value_t from_log_scaled(double x) const;
+  // the most that site j of q and the span after it can add to log S
+  double log_likelihood_ceiling(const inputHaplotype* q, size_t j) const;
+  // stages the map of a span of l positions with the given coefficients
+  void stage_span(size_t l, size_t mismatch_count, value_t composed,
+              value_t span_coefficient);
+  // Under linear policies, a composed map A(x + B) whose coefficient A leaves
+  // the range of value_t takes B out of range with it, so the smallest and
+  // largest coefficients of any composition of maps since the last snapshot
+  // are tracked, and a snapshot is taken before these would leave the range
+  value_t smallest_suffix_coefficient;
+  value_t largest_suffix_coefficient;
+  void keep_maps_in_range(value_t next_coefficient);
   
 //-- position markers ----------------------------------------------------------
 
@@ -37,25 +121,102 @@ private:
   // -2 : nothing extended; -1 : before-first-site span extended; i : span after
   // index i extended
   int last_span_extended = -2;
-  alleleValue last_allele;
-  void record_last_extended(alleleValue a);
+  // unassigned until a site is extended
+  alleleValue last_allele = unassigned;
+  // reference index of the last site extended, when one has been
+  size_t last_site_index = 0;
+  void record_last_extended(size_t site_index, alleleValue a);
+  // a reversed state runs from the last site to the first, and so enters
+  // site i across gap i + 1 rather than gap i (see basicPenaltySet)
+  bool reversed = false;
+  size_t gap_entering(size_t site_index) const;
+
+//-- automatic snapshotting ----------------------------------------------------
+
+  snapshotPolicy snapshot_policy;
+  snapshotStats snapshot_stats;
+  size_t sites_since_snapshot = 0;
+  // records lazy-evaluation debt and snapshots if the policy calls for it
+  void check_snapshot_policy();
+
+//-- dense site kernel ---------------------------------------------------------
+
+  siteKernelPolicy site_kernel_policy;
+  // consecutive sites which have favoured the dense kernel
+  size_t dense_run_length = 0;
+  // chooses the kernel for a site before its map is staged, taking a snapshot
+  // to enter the dense kernel if need be
+  bool choose_dense_kernel(size_t n_active);
+  // brings every R-value through the staged map in one pass, then corrects
+  // the active rows and updates S
+  void dense_site_update(size_t site_index, const rowSet& active_rows, 
+              bool match_is_rare);
+  
+//-- undo log ------------------------------------------------------------------
+
+  // Each open checkpoint holds the scalars of the state, and R-values are
+  // saved to the undo log before their first change since the checkpoint was
+  // opened or last rolled back to, as the lazyEvalMap saves its entries (see
+  // basicLazyEvalMap). Automatic snapshots are suspended while a checkpoint
+  // is open, since a snapshot changes every R-value
+  struct stateCheckpoint{
+    value_t S;
+    double log_scale;
+    value_t smallest_suffix_coefficient;
+    value_t largest_suffix_coefficient;
+    int last_extended;
+    int last_span_extended;
+    alleleValue last_allele;
+    size_t last_site_index;
+    snapshotStats snapshot_stats;
+    size_t sites_since_snapshot;
+    size_t dense_run_length;
+    size_t R_log_length;
+    size_t map_checkpoint;
+  };
+  vector<stateCheckpoint> checkpoints;
+  size_t undo_epoch = 0;
+  vector<size_t> R_undo_stamp;                              // size = # haplotypes
+  vector<pair<size_t, value_t> > R_undo_log;
+  void journal_R(size_t row);
+  void journal_all_R();
+  void copy_state(const basicFwdAlgState& other);
   
 public:
-  fastFwdAlgState(siteIndex* ref, const penaltySet* pen,
+  basicFwdAlgState(siteIndex* ref, const penalties_t* pen,
             const haplotypeCohort* haplotypes);
-  fastFwdAlgState(const fastFwdAlgState& other, bool copy_map);
-  ~fastFwdAlgState();
+  basicFwdAlgState(const basicFwdAlgState& other, bool copy_map = true);
+  // copies as the copy constructor does with copy_map; open checkpoints of
+  // this state are released and those of the other are not copied
+  basicFwdAlgState& operator=(const basicFwdAlgState& other);
+  ~basicFwdAlgState();
   
-  double S;
-  vector<double> R;
+  // returns the state to its just-constructed condition so that it can score
+  // another query without reallocating R or the lazyEvalMap
+  void reset();
   
-  lazyEvalMap& get_maps();
+  value_t S;
+  vector<value_t> R;
+  
+  lazy_map_t& get_maps();
 
 //-- probability queries -------------------------------------------------------
   
   double prefix_likelihood() const;
   double partial_likelihood_by_row(size_t row) const;
+  // R-value of the row at the last position extended, bringing its map up to
+  // date in O(log n)
+  double current_likelihood_by_row(size_t row);
   double calculate_probability(const inputHaplotype* q);
+  // Scores q only as far as needed to tell whether its log-likelihood reaches
+  // threshold. S never increases: each site multiplies it by at most the
+  // larger of mu and 1 - mu, and each span by its mutation penalty exactly.
+  // Scoring stops after the first site j for which S plus these ceilings over
+  // the rest of q falls below threshold, returning that upper bound on the
+  // log-likelihood with stopped_at = j. Otherwise the log-likelihood is
+  // returned with stopped_at = the number of sites of q
+  double calculate_probability(const inputHaplotype* q, double threshold,
+              size_t& stopped_at);
 
 //-- position-initial state calculators ----------------------------------------
 
@@ -68,17 +229,48 @@ public:
 //-- non-initial state calculators ---------------------------------------------
   
   void extend_probability_at_site(const inputHaplotype* q, size_t j);
-  void extend_probability_at_site(const DPUpdateMap& current_map, 
+  void extend_probability_at_site(size_t site_index, const map_t& current_map, 
               const rowSet& active_rows, bool match_is_rare, 
               alleleValue a);
-  void extend_probability_at_site(const rowSet& active_rows, 
+  void extend_probability_at_site(size_t site_index, const rowSet& active_rows, 
               bool match_is_rare, alleleValue a);
   void extend_probability_at_site(size_t site_index, alleleValue a);
+  // reads the active rows and their rarity from the cohort's precomputed
+  // extension for the site and allele; does not allocate
+  void extend_probability_at_site(size_t site_index, 
+              const siteExtension& extension);
   void extend_probability_at_span_after_anonymous(size_t l,
               size_t mismatch_count);
   void extend_probability_at_span_after(const inputHaplotype* q, size_t j);
   void extend_probability_at_span_after(size_t site_index, 
               size_t mismatch_count);            
+  // a span of l positions within the given gap
+  void extend_probability_at_span_in_gap(size_t l, size_t mismatch_count,
+              size_t gap);
+  
+  void set_reversed(bool reversed);
+  
+//-- incremental queries -------------------------------------------------------
+
+  // Extends by the allele at the next site of the reference, or at the given
+  // site, initializing the state if nothing has been extended yet
+  void push_site(alleleValue a);
+  void push_site(size_t site_index, alleleValue a);
+  // Extends by a span following the last site extended, or by the left tail
+  // if nothing has been extended yet
+  void push_span(size_t length, size_t mismatch_count);
+  
+  // Opens a checkpoint at the current position and returns its index.
+  // Checkpoints nest; rollback(c) returns the state to checkpoint c in time
+  // proportional to the rows and eqclasses changed since, discarding the
+  // checkpoints opened after c but keeping c open, so that alternative
+  // continuations of a query can be scored from c in turn without copying
+  // the state
+  size_t checkpoint();
+  void rollback(size_t checkpoint);
+  // closes every checkpoint and discards the undo log
+  void release_checkpoints();
+  size_t number_of_checkpoints() const;
 
   bool last_extended_is_span() const;
   size_t get_last_site() const;
@@ -88,16 +280,60 @@ public:
   void update_subset_of_Rs(const rowSet& indices, bool active_is_match);
   void fast_update_S(const rowSet& indices, bool active_is_match);
   
+  // Single streaming pass over the active rows of a site which, row by row,
+  // brings the row's eqclass up to date, updates its R-value, accumulates
+  // the log-sum of updated R-values for S and moves the row into the new
+  // identity eqclass. Equivalent to update_active_rows, update_subset_of_Rs,
+  // fast_update_S and reset_rows in turn, which read the row list six times
+  void fused_site_update(size_t site_index, const rowSet& active_rows, 
+              bool match_is_rare);
+  
 //-- functions to force lazy-evaluation map to update --------------------------
   
   // Applies the delayed-arithmetic maps to all R-values 
   // This also calls hard_clear_all on the delayed-arithmetic map, which
   // resets all linear maps contained to the identity map; this means that
-  // accidentally calling take_snapshot() twice has no effect
+  // accidentally calling take_snapshot() twice has no effect. Does not
+  // allocate. Called automatically according to the snapshotPolicy
   void take_snapshot();
   double get_single_element_score(size_t hap_idx); 
+  
+  void set_snapshot_policy(const snapshotPolicy& new_policy);
+  const snapshotPolicy& get_snapshot_policy() const;
+  // counters since construction or the last reset()
+  const snapshotStats& get_snapshot_stats() const;
+  
+  void set_site_kernel_policy(const siteKernelPolicy& new_policy);
+  const siteKernelPolicy& get_site_kernel_policy() const;
+  
+//-- binary serialization ------------------------------------------------------
+  
+  // Writes R, S, the position markers, the scaling, snapshot and kernel state
+  // and the lazyEvalMap in the format of binary_io.hpp, so that a preempted
+  // job can resume from the state. Reading replaces the state, which must be built
+  // against the same cohort and penalties; a stream written under another
+  // arithmetic policy or number of haplotypes is refused. Throws if a
+  // checkpoint is open
+  void serialize_binary(ostream& out) const;
+  void deserialize_binary(istream& in);
 };
 
+// a struct rather than a typedef so that the C interface can declare it
+struct fastFwdAlgState : public basicFwdAlgState<sumProduct>{
+  fastFwdAlgState(siteIndex* ref, const penaltySet* pen,
+            const haplotypeCohort* haplotypes);
+  fastFwdAlgState(const fastFwdAlgState& other, bool copy_map = true);
+  fastFwdAlgState& operator=(const fastFwdAlgState& other);
+};
+
+// a batch of states, such as the checkpoints of a long query, written one
+// after another so that the batch is never held in memory twice
+void serialize_states(ostream& out, const vector<fastFwdAlgState>& states);
+vector<fastFwdAlgState> deserialize_states(istream& in, siteIndex* reference,
+            const penaltySet* penalties, const haplotypeCohort* cohort);
+
+// the textbook forward algorithm over the reference's own spans, kept for
+// reference. denseFwdSolver is the baseline to measure against
 struct slowFwdSolver{
   siteIndex* reference;
   const penaltySet* penalties;
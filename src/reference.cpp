@@ -207,15 +207,14 @@ void haplotypeCohort::populate_allele_counts() {
     }
   }
 
-  active_rowSets_by_site_and_allele = vector<vector<rowSet> >(num_sites, vector<rowSet>(5));
   for(size_t i = 0; i < num_sites; i++) {
     for(size_t a = 0; a < 5; a++) {
       if(haplotype_indices_by_site_and_allele[i][a].size() > number_of_haplotypes / 2) {
         haplotype_indices_by_site_and_allele[i][a].clear();
       }
-      active_rowSets_by_site_and_allele[i][a] = build_active_rowSet(i, (alleleValue)a);
     }
   }
+  build_extension_table();
   finalized = true;
 }
 
@@ -316,7 +315,29 @@ void haplotypeCohort::assign_alleles_at_site(size_t i,
 }
 
 const rowSet& haplotypeCohort::get_active_rowSet(size_t site, alleleValue a) const {
-  return active_rowSets_by_site_and_allele[site][(size_t)a];
+  return extensions[5 * site + (size_t)a].active_rows;
+}
+
+const siteExtension& haplotypeCohort::get_extension(size_t site, alleleValue a) const {
+  return extensions[5 * site + (size_t)a];
+}
+
+const siteExtension* haplotypeCohort::get_extensions_at_site(size_t site) const {
+  return &(extensions[5 * site]);
+}
+
+void haplotypeCohort::build_extension_table() {
+  size_t num_sites = allele_counts_by_site_index.size();
+  extensions = vector<siteExtension>(5 * num_sites);
+  for(size_t i = 0; i < num_sites; i++) {
+    for(size_t a = 0; a < 5; a++) {
+      siteExtension& extension = extensions[5 * i + a];
+      extension.allele = (alleleValue)a;
+      extension.match_is_rare = match_is_rare(i, (alleleValue)a);
+      extension.number_active = number_active(i, (alleleValue)a);
+      extension.active_rows = build_active_rowSet(i, (alleleValue)a);
+    }
+  }
 }
 
 rowSet haplotypeCohort::build_active_rowSet(size_t site, alleleValue a) const {
@@ -738,16 +759,11 @@ void haplotypeCohort::remove_homogeneous_sites() {
     haplotype_indices_by_site_and_allele.resize(sites_to_keep.size());
     allele_counts_by_site_index.resize(sites_to_keep.size());
     
-    active_rowSets_by_site_and_allele = vector<vector<rowSet> >(sites_to_keep.size(), vector<rowSet>(5));
-    for(size_t i = 0; i < sites_to_keep.size(); i++) {
-      for(size_t a = 0; a < 5; a++) {
-        active_rowSets_by_site_and_allele[i][a] = build_active_rowSet(i, (alleleValue)a);
-      }
-    }
+    build_extension_table();
   } else {
     alleles_by_haplotype_and_site.clear();
     haplotype_indices_by_site_and_allele.clear();
-    active_rowSets_by_site_and_allele.clear();
+    extensions.clear();
     allele_counts_by_site_index.clear();
   }
 }
@@ -918,8 +934,6 @@ haplotypeCohort::haplotypeCohort(std::istream& cohortin, siteIndex* reference) :
   cohortin >> number_of_haplotypes;
   haplotype_indices_by_site_and_allele = vector<vector<vector<haplo_id_t> > >(reference->number_of_sites(),
                                                 vector<vector<haplo_id_t> >(5));
-  active_rowSets_by_site_and_allele = vector<vector<rowSet> >(reference->number_of_sites(),
-                                             vector<rowSet>(5));
   allele_counts_by_site_index = vector<vector<size_t> >(reference->number_of_sites(),
                                        vector<size_t>(5));
   for(size_t i = 0; i < reference->number_of_sites(); i++) {
@@ -936,9 +950,7 @@ haplotypeCohort::haplotypeCohort(std::istream& cohortin, siteIndex* reference) :
         cohortin >> haplotype_indices_by_site_and_allele[i][a][j];
       }
     }
-    for(size_t a = 0; a < 5; a++) {
-      active_rowSets_by_site_and_allele[i][a] = build_active_rowSet(i, (alleleValue)a);
-    }
   }
+  build_extension_table();
   finalized = true;
 }
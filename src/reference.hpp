@@ -90,6 +90,17 @@ public:
   void serialize_human(std::ostream& out) const;
 };
 
+//------------------------------------------------------------------------------
+// Everything about extending by an allele at a site which does not depend on
+// the state being extended: the rows whose R-values must be touched, whether
+// these are the matching rows, and their number
+struct siteExtension{
+  rowSet active_rows;
+  size_t number_active = 0;
+  bool match_is_rare = false;
+  alleleValue allele = A;
+};
+
 //------------------------------------------------------------------------------
 struct haplotypeCohort{
 //------------------------------------------------------------------------------
@@ -115,7 +126,10 @@ private:
   //      allele j              vector[ ][j][ ]
   //      haplotype rank k      vector[ ][ ][k]
   vector<vector<vector<haplo_id_t> > > haplotype_indices_by_site_and_allele;
-  vector<vector<rowSet> > active_rowSets_by_site_and_allele;
+  
+  // maps [sites] x [alleles] -> extension descriptors, flattened
+  //      site i, allele j      vector[5 * i + j]
+  vector<siteExtension> extensions;
 
   // maps [sites] -> vectors of allele counts
   //      site i                vector[i][ ]
@@ -148,6 +162,8 @@ public:
   
   void populate_allele_counts();
   rowSet build_active_rowSet(site_idx_t site, alleleValue a) const;
+  // rebuilds the extension descriptors from haplotype_indices_by_site_and_allele
+  void build_extension_table();
   
 //-- basic attributes ----------------------------------------------------------
 
@@ -180,6 +196,11 @@ public:
   // site -> mask
   vector<size_t> get_active_rows(site_idx_t site, alleleValue a) const;
   const rowSet& get_active_rowSet(site_idx_t site, alleleValue a) const;
+  
+  // site x allele -> precomputed extension
+  const siteExtension& get_extension(site_idx_t site, alleleValue a) const;
+  // the five extensions at a site, in allele order
+  const siteExtension* get_extensions_at_site(site_idx_t site) const;
 
 //-- downsampling --------------------------------------------------------------
 
@@ -84,4 +84,12 @@ rowSet::const_iterator rowSet::const_iterator::operator++(int foo) {
 
 bool rowSet::empty() const {
   return n_row_vectors == 0;
+}
+
+size_t rowSet::size() const {
+  size_t to_return = 0;
+  for(size_t i = 0; i < n_row_vectors; i++) {
+    to_return += sizes[i];
+  }
+  return to_return;
 }
\ No newline at end of file
@@ -45,6 +45,8 @@ public:
   const_iterator begin() const;
   const_iterator end() const;
   bool empty() const;
+  // number of rows, in O(number of row vectors)
+  size_t size() const;
 };
 
 #endif
\ No newline at end of file
@@ -1,29 +1,32 @@
 #include "set_of_extensions.hpp"
 
-extensionSet::extensionSet(haplotypeCohort* cohort, size_t site_index) {
-  alleleValue a;
-  for(size_t i = 0; i < 5; i++) {
-    a = get_allele(i);
-    match_is_rare.push_back(cohort->match_is_rare(site_index, a));
-    active_rows.push_back(&(cohort->get_active_rowSet(site_index, a)));
-  }
+extensionSet::extensionSet(const haplotypeCohort* cohort, size_t site_index) :
+            extensions(cohort->get_extensions_at_site(site_index)),
+            site_index(site_index) {
+  
+}
+
+size_t extensionSet::get_site_index() const {
+  return site_index;
+}
+
+const siteExtension& extensionSet::get_extension(size_t i) const {
+  return extensions[i];
 }
 
 bool extensionSet::get_match_is_rare(size_t i) const {
-  return match_is_rare[i];
+  return extensions[i].match_is_rare;
 }
 
 alleleValue extensionSet::get_allele(size_t i) const  {
-  return (alleleValue)i;
+  return extensions[i].allele;
 }
 
 const rowSet& extensionSet::get_active_rows(size_t i) const  {
-  return *(active_rows[i]);
+  return extensions[i].active_rows;
 }
 
 void extensionSet::extend_probability_by_allele(fastFwdAlgState* hap_mat,
-            size_t i) {
-              
-  hap_mat->extend_probability_at_site(current_map[i], *(active_rows[i]),
-              match_is_rare[i], get_allele(i));
+            size_t i) const {
+  hap_mat->extend_probability_at_site(site_index, extensions[i]);
 }
@@ -9,23 +9,24 @@
 
 using namespace std;
 
-// An extensionSet holds the results of expensive but not haplotype-specific
-// calls. Faster lookup that using a rowSet and also holds the current_maps for
-// each allele
+// An extensionSet is a view of the five siteExtensions which the cohort
+// precomputes for a site, one per allele in allele order. It holds no rowSets
+// of its own, so constructing one per site or per node costs nothing
 
 struct extensionSet{
 private:
-  vector<DPUpdateMap> current_map;
-  vector<rowSet const*> active_rows;
-  vector<bool> match_is_rare;
+  const siteExtension* extensions;
+  size_t site_index;
 public:
-  extensionSet(haplotypeCohort* cohort, size_t site_index);
+  extensionSet(const haplotypeCohort* cohort, size_t site_index);
   
+  size_t                get_site_index() const;
+  const siteExtension&  get_extension(size_t i) const;
   bool                  get_match_is_rare(size_t i) const;
   alleleValue           get_allele(size_t i) const;
   const rowSet&         get_active_rows(size_t i) const;
   
-  void extend_probability_by_allele(fastFwdAlgState* hap_mat, size_t i);
+  void extend_probability_by_allele(fastFwdAlgState* hap_mat, size_t i) const;
 };
 
-#endif
\ No newline at end of file
+#endif
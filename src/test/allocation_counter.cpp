@@ -0,0 +1,62 @@
+#include <cstdlib>
+#include <new>
+#include "allocation_counter.hpp"
+
+using namespace std;
+
+// Every form of the global operators is replaced, so that each block is freed
+// by the allocator which made it. They are kept apart from the tests so that
+// the compiler never inlines a pair of them into one caller, where it would
+// see malloc and free behind new and delete
+size_t heap_allocation_count = 0;
+
+static void* counted_malloc(size_t size) noexcept {
+  ++heap_allocation_count;
+  return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size) {
+  void* p = counted_malloc(size);
+  if(p == nullptr) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept {
+  free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+#endif
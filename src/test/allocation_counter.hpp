@@ -0,0 +1,11 @@
+#ifndef LINEAR_HAPLO_ALLOCATION_COUNTER_H
+#define LINEAR_HAPLO_ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+// counts every global heap allocation made by the test binary, which replaces
+// the global operator new, so that tests can check that hot loops stay off
+// the heap
+extern size_t heap_allocation_count;
+
+#endif
@@ -0,0 +1,255 @@
+// Differential test of the fast forward algorithm against the dense solver
+//
+// usage: differential [quick|full] [seed] [tolerance] [dense threads]
+//
+// For each point of a grid over cohort size, number of sites, allele
+// frequency spectrum and penalties, builds a random cohort and mosaic
+// queries from a generator seeded by the seed and the point's index, so that
+// any row can be reproduced alone. Queries span the whole reference or an
+// interval starting and ending within spans, with novel SNVs in some spans.
+// Both engines score every query through forwardScorer; a point fails if any
+// log-likelihood differs by more than tolerance relative to its magnitude.
+//
+// Prints one tab-separated row per point with the ns/site of each engine, the
+// speed-up of the fast engine over the dense solver and the largest relative
+// difference, and exits nonzero if any point fails. The header says whether
+// the harness was built with optimization, without which the timings are not
+// comparable
+//
+// spectra
+//    rare      every site has alt allele frequency 0.01
+//    common    every site has alt allele frequency 0.2
+//    neutral   site frequencies drawn from a 1/f density over [1/|H|, 1/2]
+//    multi     as neutral, with a second alt allele at half the frequency
+
+#include <iostream>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include "probability.hpp"
+#include "dense_solver.hpp"
+
+using namespace std;
+
+struct gridPoint{
+  size_t n_haplotypes;
+  size_t n_sites;
+  const char* spectrum;
+  penaltyParameters parameters;
+};
+
+struct randomCohort{
+  vector<size_t> positions;
+  vector<vector<alleleValue> > haplotypes;
+  size_t length;
+  siteIndex* reference;
+  haplotypeCohort* cohort;
+
+  // sites are two to seven bp apart, with tails of five bp and four bp, so
+  // that every site is followed by a span
+  randomCohort(const gridPoint& point, mt19937& generator) {
+    uniform_int_distribution<size_t> gap(2, 7);
+    size_t position = 5;
+    for(size_t i = 0; i < point.n_sites; i++) {
+      positions.push_back(position);
+      position += gap(generator);
+    }
+    length = positions.back() + 5;
+    haplotypes = vector<vector<alleleValue> >(point.n_haplotypes,
+              vector<alleleValue>(point.n_sites, A));
+    bool multiallelic = strcmp(point.spectrum, "multi") == 0;
+    for(size_t i = 0; i < point.n_sites; i++) {
+      double frequency = site_frequency(point, generator);
+      bernoulli_distribution is_alt(frequency);
+      bernoulli_distribution is_second_alt(multiallelic ? frequency / 2 : 0);
+      for(size_t h = 0; h < point.n_haplotypes; h++) {
+        if(is_alt(generator)) {
+          haplotypes[h][i] = T;
+        } else if(is_second_alt(generator)) {
+          haplotypes[h][i] = C;
+        }
+      }
+    }
+    reference = new siteIndex(positions, length);
+    cohort = new haplotypeCohort(haplotypes, reference);
+  }
+
+  ~randomCohort() {
+    delete cohort;
+    delete reference;
+  }
+
+  static double site_frequency(const gridPoint& point, mt19937& generator) {
+    if(strcmp(point.spectrum, "rare") == 0) {
+      return 0.01;
+    } else if(strcmp(point.spectrum, "common") == 0) {
+      return 0.2;
+    } else if(strcmp(point.spectrum, "neutral") == 0 ||
+              strcmp(point.spectrum, "multi") == 0) {
+      uniform_real_distribution<double> log_frequency(
+                -log((double)point.n_haplotypes), log(0.5));
+      return exp(log_frequency(generator));
+    }
+    throw runtime_error("unknown allele frequency spectrum");
+  }
+
+  // a mosaic of the sites in [first, last) switching rows at 0.5% of sites
+  // and mutating at 0.1%, with a novel SNV in 5% of the spans around them
+  inputHaplotype* query(size_t first, size_t last, mt19937& generator) const {
+    uniform_int_distribution<size_t> which_haplotype(0, haplotypes.size() - 1);
+    bernoulli_distribution switches(0.005);
+    bernoulli_distribution mutates(0.001);
+    bernoulli_distribution novel(0.05);
+    vector<alleleValue> alleles;
+    size_t h = which_haplotype(generator);
+    for(size_t i = first; i < last; i++) {
+      if(switches(generator)) {
+        h = which_haplotype(generator);
+      }
+      alleles.push_back(haplotypes[h][i]);
+      if(mutates(generator)) {
+        alleles.back() = (alleles.back() == A) ? G : A;
+      }
+    }
+    // every span within the query, and both tails, has length at least one
+    vector<size_t> novel_SNVs(alleles.size() + 1, 0);
+    for(size_t j = 0; j < novel_SNVs.size(); j++) {
+      novel_SNVs[j] = novel(generator) ? 1 : 0;
+    }
+    size_t start = first == 0 ? 0 : positions[first - 1] + 1;
+    size_t end = last == positions.size() ? length : positions[last];
+    return new inputHaplotype(alleles, novel_SNVs, reference, start,
+              end - start);
+  }
+};
+
+struct pointResult{
+  double fast_ns_per_site = 0;
+  double dense_ns_per_site = 0;
+  double max_difference = 0;
+};
+
+// ns/site of an engine over the queries, writing their log-likelihoods
+double time_engine(forwardScorer& scorer, const vector<inputHaplotype*>& queries,
+            vector<double>& results) {
+  size_t sites = 0;
+  results.clear();
+  auto begin = chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < queries.size(); i++) {
+    results.push_back(scorer.calculate_probability(queries[i]));
+    sites += queries[i]->number_of_sites();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  return chrono::duration_cast<chrono::nanoseconds>(end - begin).count() /
+            (double)max(sites, (size_t)1);
+}
+
+pointResult run_point(const gridPoint& point, size_t seed, size_t index,
+            size_t dense_threads) {
+  seed_seq point_seed = {(unsigned)seed, (unsigned)index};
+  mt19937 generator(point_seed);
+  randomCohort panel(point, generator);
+  vector<inputHaplotype*> queries;
+  uniform_int_distribution<size_t> first_site(1, point.n_sites / 3);
+  for(size_t i = 0; i < 2; i++) {
+    queries.push_back(panel.query(0, point.n_sites, generator));
+    size_t first = first_site(generator);
+    queries.push_back(panel.query(first, point.n_sites - first, generator));
+  }
+  penaltySet penalties(point.parameters.log_rho, point.parameters.log_mu,
+            point.n_haplotypes);
+  forwardScorer fast(FAST_FORWARD, panel.reference, &penalties, panel.cohort);
+  forwardScorer dense(DENSE_FORWARD, panel.reference, &penalties, panel.cohort,
+            dense_threads);
+
+  pointResult to_return;
+  vector<double> fast_results, dense_results;
+  to_return.fast_ns_per_site = time_engine(fast, queries, fast_results);
+  to_return.dense_ns_per_site = time_engine(dense, queries, dense_results);
+  for(size_t i = 0; i < queries.size(); i++) {
+    double difference = fabs(fast_results[i] - dense_results[i]) /
+              max(1.0, fabs(dense_results[i]));
+    // a NaN from either engine is kept, and fails the point
+    if(std::isnan(difference) || std::isnan(to_return.max_difference)) {
+      to_return.max_difference = NAN;
+    } else {
+      to_return.max_difference = max(to_return.max_difference, difference);
+    }
+    delete queries[i];
+  }
+  return to_return;
+}
+
+vector<gridPoint> make_grid(bool quick) {
+  vector<size_t> cohort_sizes = quick ? vector<size_t>{20, 200} :
+            vector<size_t>{100, 1000, 5000};
+  vector<size_t> site_counts = quick ? vector<size_t>{200, 1000} :
+            vector<size_t>{1000, 5000};
+  const char* spectra[4] = {"rare", "common", "neutral", "multi"};
+  penaltyParameters settings[2] = {{-6, -9}, {-3, -5}};
+  vector<gridPoint> to_return;
+  for(size_t h = 0; h < cohort_sizes.size(); h++) {
+    for(size_t n = 0; n < site_counts.size(); n++) {
+      for(size_t s = 0; s < 4; s++) {
+        for(size_t p = 0; p < 2; p++) {
+          gridPoint point = {cohort_sizes[h], site_counts[n], spectra[s],
+                    settings[p]};
+          to_return.push_back(point);
+        }
+      }
+    }
+  }
+  return to_return;
+}
+
+int main(int argc, char* argv[]) {
+  bool quick = false;
+  size_t seed = 1;
+  double tolerance = 1e-9;
+  size_t dense_threads = 1;
+  if(argc >= 2) {
+    if(strcmp(argv[1], "quick") == 0) {
+      quick = true;
+    } else if(strcmp(argv[1], "full") != 0) {
+      cerr << "usage: differential [quick|full] [seed] [tolerance] [dense threads]" << endl;
+      return 1;
+    }
+  }
+  if(argc >= 3) {
+    seed = strtoul(argv[2], NULL, 0);
+  }
+  if(argc >= 4) {
+    tolerance = atof(argv[3]);
+  }
+  if(argc >= 5) {
+    dense_threads = strtoul(argv[4], NULL, 0);
+  }
+  vector<gridPoint> grid = make_grid(quick);
+  size_t failures = 0;
+#ifdef __OPTIMIZE__
+  const char* optimized = "yes";
+#else
+  const char* optimized = "no";
+#endif
+  cout << "seed\t" << seed << "\ttolerance\t" << tolerance
+       << "\tdense threads\t" << dense_threads << "\toptimized\t"
+       << optimized << endl;
+  cout << "point\thaplotypes\tsites\tspectrum\tlog rho\tlog mu\t"
+       << "fast ns/site\tdense ns/site\tspeed-up\tmax rel diff\tresult" << endl;
+  for(size_t i = 0; i < grid.size(); i++) {
+    const gridPoint& point = grid[i];
+    pointResult result = run_point(point, seed, i, dense_threads);
+    bool passed = result.max_difference <= tolerance;
+    failures += passed ? 0 : 1;
+    cout << i << "\t" << point.n_haplotypes << "\t" << point.n_sites << "\t"
+         << point.spectrum << "\t" << point.parameters.log_rho << "\t"
+         << point.parameters.log_mu << "\t" << result.fast_ns_per_site << "\t"
+         << result.dense_ns_per_site << "\t"
+         << result.dense_ns_per_site / result.fast_ns_per_site << "\t"
+         << result.max_difference << "\t" << (passed ? "ok" : "FAIL") << endl;
+  }
+  cout << "points\t" << grid.size() << "\tfailures\t" << failures << endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,896 @@
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include "probability.hpp"
+#include "forward_backward.hpp"
+#include "edit_scorer.hpp"
+#include "window_scorer.hpp"
+#include "parameter_sweep.hpp"
+#include "parameter_estimation.hpp"
+#include "dense_solver.hpp"
+
+// Benchmarks for the single-query forward algorithm
+//
+// usage: speed_fwd <mode> [sites] [haplotypes] [alt allele frequency] [seed]
+//
+// modes
+//    fused     per-site cost of the fused single-pass site update against the
+//              original multi-pass update
+//    long      per-site cost of a single long query without snapshots, and of
+//              bringing the whole lazy-evaluation state up to date at its end
+//    snapshot  cost of scoring with and without automatic snapshots, and the
+//              snapshot statistics
+//    sample    cost of sampling copying paths by backward sampling from
+//              checkpointed lazy states, against sampling from the dense
+//              |H| x n forward matrix
+//    precision per-site cost and log-likelihood error of each arithmetic
+//              policy against the double-precision log-space baseline
+//    edits     proposals per second rescoring single-site edits from
+//              checkpoints, forward-only and forward-backward, against
+//              rescoring the whole query, with every proposal rejected and
+//              with every tenth accepted
+//    windows   cost of the log-likelihood track of every window of 100 sites
+//              in one forward pass, against scoring each window as a query
+//              of its own, and the mean difference between the two scores
+//    kernel    per-site cost of each arithmetic policy with the lazy site
+//              update only, the dense site kernel at every site, and the
+//              adaptive choice between them, over a spectrum of alt allele
+//              frequencies in place of the one given
+//    screen    cost of screening mosaic and unrelated queries against a
+//              threshold, stopping once a query cannot reach it, against
+//              scoring every query in full, and the fraction of sites scored
+//    sweep     cost of scoring a query under a 4 x 4 grid of (rho, mu) in one
+//              parameter sweep, against scoring it once per setting
+//    em        cost of fitting rho and mu to mosaic queries by
+//              expectation-maximization on one thread and on four, and the
+//              fitted rates against those the mosaics were drawn with
+//    dense     per-site cost of the fast forward algorithm against the dense
+//              solver on one thread and on four, and the classical linear
+//              solver, and the largest difference in log-likelihood
+
+using namespace std;
+
+struct randomPanel{
+  vector<size_t> positions;
+  vector<vector<alleleValue> > haplotypes;
+  siteIndex* reference;
+  haplotypeCohort* cohort;
+
+  // sites are spaced two bp apart so that every site is followed by a span
+  randomPanel(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+    bernoulli_distribution is_alt(alt_frequency);
+    for(size_t i = 0; i < n_sites; i++) {
+      positions.push_back(2 * i);
+    }
+    haplotypes = vector<vector<alleleValue> >(n_haplotypes,
+              vector<alleleValue>(n_sites, A));
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      for(size_t i = 0; i < n_sites; i++) {
+        if(is_alt(generator)) {
+          haplotypes[h][i] = T;
+        }
+      }
+    }
+    reference = new siteIndex(positions, 2 * n_sites);
+    cohort = new haplotypeCohort(haplotypes, reference);
+  }
+
+  ~randomPanel() {
+    delete cohort;
+    delete reference;
+  }
+
+  // a mosaic of cohort haplotypes with occasional switches and mutations
+  vector<alleleValue> mosaic(mt19937& generator) const {
+    size_t n_sites = positions.size();
+    uniform_int_distribution<size_t> which_haplotype(0, haplotypes.size() - 1);
+    bernoulli_distribution switches(0.01);
+    bernoulli_distribution mutates(0.001);
+    vector<alleleValue> to_return(n_sites);
+    size_t h = which_haplotype(generator);
+    for(size_t i = 0; i < n_sites; i++) {
+      if(switches(generator)) {
+        h = which_haplotype(generator);
+      }
+      to_return[i] = haplotypes[h][i];
+      if(mutates(generator)) {
+        to_return[i] = (to_return[i] == A) ? C : A;
+      }
+    }
+    return to_return;
+  }
+};
+
+// the site update as it was before fused_site_update: catch up eqclasses,
+// update R, sum R for S and reassign eqclasses in four passes
+void multipass_extend(fastFwdAlgState& state, const penaltySet& penalties,
+              const haplotypeCohort& cohort, size_t site, alleleValue a) {
+  bool match_is_rare = cohort.match_is_rare(site, a);
+  const rowSet& active_rows = cohort.get_active_rowSet(site, a);
+  lazyEvalMap& map = state.get_maps();
+  map.stage_map_for_site(penalties.get_current_map(state.S, match_is_rare));
+  if(active_rows.empty()) {
+    state.S += match_is_rare ? penalties.mu : penalties.one_minus_mu;
+  } else {
+    map.update_active_rows(active_rows);
+    state.update_subset_of_Rs(active_rows, match_is_rare);
+    state.fast_update_S(active_rows, match_is_rare);
+    map.reset_rows(active_rows);
+  }
+}
+
+int benchmark_fused(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  size_t n_queries = 10;
+  vector<vector<alleleValue> > queries;
+  size_t total_active = 0;
+  for(size_t q = 0; q < n_queries; q++) {
+    queries.push_back(panel.mosaic(generator));
+    for(size_t i = 1; i < n_sites; i++) {
+      total_active += panel.cohort->number_active(i, queries[q][i]);
+    }
+  }
+  double active_per_site = (double)total_active / (n_queries * (n_sites - 1));
+
+  fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+  state.get_maps().reserve_length(2 * n_sites + 1);
+
+  vector<double> multipass_results;
+  auto begin = chrono::high_resolution_clock::now();
+  for(size_t q = 0; q < n_queries; q++) {
+    state.reset();
+    state.initialize_probability_at_site(0, queries[q][0]);
+    for(size_t i = 1; i < n_sites; i++) {
+      multipass_extend(state, penalties, *(panel.cohort), i, queries[q][i]);
+    }
+    multipass_results.push_back(state.S);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double multipass_ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+
+  double max_difference = 0;
+  begin = chrono::high_resolution_clock::now();
+  for(size_t q = 0; q < n_queries; q++) {
+    state.reset();
+    state.initialize_probability_at_site(0, queries[q][0]);
+    for(size_t i = 1; i < n_sites; i++) {
+      state.extend_probability_at_site(i, queries[q][i]);
+    }
+    max_difference = max(max_difference, fabs(state.S - multipass_results[q]));
+  }
+  end = chrono::high_resolution_clock::now();
+  double fused_ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+
+  // Modelled memory traffic, in 8-byte words touched per active row. The
+  // multipass update reads the row list six times (gathering eqclasses, the R
+  // update, two passes of log_big_sum and two of reset_rows), reads R three
+  // times and writes it once, reads row_to_eqclass three times, writes it
+  // twice and updates eqclass sizes twice. The fused update reads the row list
+  // once, reads and writes R once, reads row_to_eqclass twice, writes it once
+  // and updates eqclass sizes twice.
+  size_t multipass_words = 6 + 4 + 5 + 2;
+  size_t fused_words = 1 + 2 + 3 + 2;
+
+  double site_count = n_queries * (n_sites - 1);
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency
+       << "\tactive rows/site\t" << active_per_site << endl;
+  cout << "kernel\tns/site\tmodelled bytes/site" << endl;
+  cout << "multipass\t" << multipass_ns / site_count << "\t"
+       << 8 * multipass_words * active_per_site << endl;
+  cout << "fused\t" << fused_ns / site_count << "\t"
+       << 8 * fused_words * active_per_site << endl;
+  cout << "speedup\t" << multipass_ns / fused_ns << endl;
+  cout << "max |difference| in log-likelihood\t" << max_difference << endl;
+  return 0;
+}
+
+int benchmark_snapshot(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  size_t n_queries = 10;
+  vector<inputHaplotype*> queries;
+  for(size_t q = 0; q < n_queries; q++) {
+    queries.push_back(new inputHaplotype(panel.mosaic(generator), 
+              vector<size_t>(n_sites + 1, 0), panel.reference, 0, 2 * n_sites));
+  }
+  fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+  
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << endl;
+  cout << "policy\tns/site\tsnapshots\trows evaluated\tmax eqclasses\tmax history" << endl;
+  vector<double> results(n_queries);
+  for(size_t automatic = 0; automatic < 2; automatic++) {
+    snapshotPolicy policy;
+    policy.automatic = automatic;
+    state.set_snapshot_policy(policy);
+    snapshotStats totals;
+    double max_difference = 0;
+    auto begin = chrono::high_resolution_clock::now();
+    for(size_t q = 0; q < n_queries; q++) {
+      double result = state.calculate_probability(queries[q]);
+      if(automatic) {
+        max_difference = max(max_difference, fabs(result - results[q]));
+      } else {
+        results[q] = result;
+      }
+      const snapshotStats& stats = state.get_snapshot_stats();
+      totals.snapshots_taken += stats.snapshots_taken;
+      totals.rows_evaluated += stats.rows_evaluated;
+      totals.max_live_eqclasses = max(totals.max_live_eqclasses, stats.max_live_eqclasses);
+      totals.max_history_length = max(totals.max_history_length, stats.max_history_length);
+    }
+    auto end = chrono::high_resolution_clock::now();
+    double ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+    cout << (automatic ? "automatic" : "manual") << "\t" 
+         << ns / (n_queries * n_sites) << "\t" << totals.snapshots_taken << "\t"
+         << totals.rows_evaluated << "\t" << totals.max_live_eqclasses << "\t"
+         << totals.max_history_length << endl;
+    if(automatic) {
+      cout << "max |difference| in log-likelihood\t" << max_difference << endl;
+    }
+  }
+  for(size_t q = 0; q < n_queries; q++) {
+    delete queries[q];
+  }
+  return 0;
+}
+
+int benchmark_long(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  vector<alleleValue> query = panel.mosaic(generator);
+  fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+  snapshotPolicy manual;
+  manual.automatic = false;
+  state.set_snapshot_policy(manual);
+  state.get_maps().reserve_length(2 * n_sites + 1);
+  
+  auto begin = chrono::high_resolution_clock::now();
+  state.initialize_probability_at_site(0, query[0]);
+  for(size_t i = 1; i < n_sites; i++) {
+    state.extend_probability_at_site(i, query[i]);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double extend_ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+  size_t live_eqclasses = state.get_maps().number_of_eqclasses();
+  size_t history_length = state.get_maps().get_map_history().size();
+  
+  begin = chrono::high_resolution_clock::now();
+  state.get_maps().hard_update_all();
+  end = chrono::high_resolution_clock::now();
+  double update_ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << endl;
+  cout << "ns/site\t" << extend_ns / (n_sites - 1) << endl;
+  cout << "live eqclasses at end\t" << live_eqclasses << endl;
+  cout << "retained history at end\t" << history_length << endl;
+  cout << "ns to update all eqclasses at end\t" << update_ns << endl;
+  return 0;
+}
+
+// Backward sampling from the full forward matrix, redrawing rows from alias
+// tables built on demand for each site
+struct denseSampler{
+  vector<vector<double> > R;
+  vector<double> S;
+  vector<double> keep;
+  vector<double> redraw;
+  vector<aliasTable> tables;
+
+  denseSampler(const inputHaplotype& q, const penaltySet& penalties,
+              const haplotypeCohort& cohort) {
+    size_t n_sites = q.number_of_sites();
+    size_t n_rows = cohort.get_n_haplotypes();
+    R = vector<vector<double> >(n_sites, vector<double>(n_rows));
+    S = vector<double>(n_sites);
+    keep = vector<double>(n_sites);
+    redraw = vector<double>(n_sites);
+    tables = vector<aliasTable>(n_sites);
+    for(size_t j = 0; j < n_sites; j++) {
+      size_t steps = q.get_span_after(j) + 1;
+      keep[j] = penalties.composed_R_coefficient(steps);
+      redraw[j] = penalties.span_coefficient(steps);
+      for(size_t h = 0; h < n_rows; h++) {
+        double emission = cohort.allele_at(q.get_site_index(j), h) == q.get_allele(j) ?
+                  penalties.one_minus_mu : penalties.mu;
+        if(j == 0) {
+          R[j][h] = emission - penalties.log_H;
+        } else {
+          R[j][h] = emission + penalties.span_mutation_penalty(q.get_span_after(j - 1), 0) +
+                    logsum(keep[j - 1] + R[j - 1][h], redraw[j - 1] + S[j - 1]);
+        }
+      }
+      S[j] = log_big_sum(R[j]);
+    }
+  }
+
+  size_t draw(size_t j, mt19937& generator) {
+    if(tables[j].size() == 0) {
+      tables[j].build(R[j]);
+    }
+    return tables[j].sample(generator);
+  }
+
+  vector<pathSegment> sample(mt19937& generator) {
+    uniform_real_distribution<double> uniform(0, 1);
+    size_t n_sites = S.size();
+    vector<pathSegment> segments;
+    size_t row = draw(n_sites - 1, generator);
+    pathSegment last = {row, n_sites - 1, n_sites - 1};
+    segments.push_back(last);
+    for(size_t j = n_sites - 1; j > 0; j--) {
+      double keep_weight = keep[j - 1] + R[j - 1][row];
+      double total = logsum(keep_weight, redraw[j - 1] + S[j - 1]);
+      if(uniform(generator) >= exp(keep_weight - total)) {
+        row = draw(j - 1, generator);
+      }
+      if(row == segments.back().row) {
+        segments.back().first_site = j - 1;
+      } else {
+        pathSegment segment = {row, j - 1, j - 1};
+        segments.push_back(segment);
+      }
+    }
+    reverse(segments.begin(), segments.end());
+    return segments;
+  }
+};
+
+int benchmark_sample(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  inputHaplotype query(panel.mosaic(generator), vector<size_t>(n_sites + 1, 0), 
+            panel.reference, 0, 2 * n_sites);
+  size_t n_paths = 100;
+  
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tpaths\t" << n_paths << endl;
+  cout << "method\tms forward pass\tms sampling\tus/path\tMB forward values\tmean segments" << endl;
+  
+  auto begin = chrono::high_resolution_clock::now();
+  fwdBwdSolver solver(panel.reference, &penalties, panel.cohort);
+  solver.set_query(&query);
+  auto middle = chrono::high_resolution_clock::now();
+  vector<vector<pathSegment> > paths = solver.sample_paths(n_paths, generator);
+  auto end = chrono::high_resolution_clock::now();
+  double forward_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+  double sample_ms = chrono::duration_cast<chrono::microseconds>(end - middle).count() / 1000.0;
+  size_t total_segments = 0;
+  for(size_t p = 0; p < n_paths; p++) {
+    total_segments += paths[p].size();
+  }
+  cout << "lazy\t" << forward_ms << "\t" << sample_ms << "\t" << 1000 * sample_ms / n_paths
+       << "\t" << 8.0 * n_haplotypes * solver.number_of_checkpoints() / 1e6
+       << "\t" << (double)total_segments / n_paths << endl;
+  
+  begin = chrono::high_resolution_clock::now();
+  denseSampler dense(query, penalties, *(panel.cohort));
+  middle = chrono::high_resolution_clock::now();
+  total_segments = 0;
+  for(size_t p = 0; p < n_paths; p++) {
+    total_segments += dense.sample(generator).size();
+  }
+  end = chrono::high_resolution_clock::now();
+  forward_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+  sample_ms = chrono::duration_cast<chrono::microseconds>(end - middle).count() / 1000.0;
+  cout << "dense\t" << forward_ms << "\t" << sample_ms << "\t" << 1000 * sample_ms / n_paths
+       << "\t" << 8.0 * n_haplotypes * n_sites / 1e6
+       << "\t" << (double)total_segments / n_paths << endl;
+  return 0;
+}
+
+// scores each query under a policy, returning ns/site and the log-likelihoods
+template<typename policy>
+double score_under_policy(const randomPanel& panel, size_t n_haplotypes,
+              const vector<inputHaplotype*>& queries, vector<double>& results) {
+  basicPenaltySet<policy> penalties(-6, -9, n_haplotypes);
+  basicFwdAlgState<policy> state(panel.reference, &penalties, panel.cohort);
+  results.clear();
+  auto begin = chrono::high_resolution_clock::now();
+  for(size_t q = 0; q < queries.size(); q++) {
+    results.push_back(state.calculate_probability(queries[q]));
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+  return ns / (queries.size() * queries[0]->number_of_sites());
+}
+
+template<typename policy>
+void report_policy(const char* name, const randomPanel& panel, 
+              size_t n_haplotypes, const vector<inputHaplotype*>& queries,
+              const vector<double>& baseline) {
+  vector<double> results;
+  double ns_per_site = score_under_policy<policy>(panel, n_haplotypes, queries, 
+              results);
+  double max_error = 0;
+  double max_relative_error = 0;
+  for(size_t q = 0; q < queries.size(); q++) {
+    double error = fabs(results[q] - baseline[q]);
+    // written so that a NaN is reported rather than dropped
+    if(!(error <= max_error)) {
+      max_error = error;
+    }
+    if(!(error / fabs(baseline[q]) <= max_relative_error)) {
+      max_relative_error = error / fabs(baseline[q]);
+    }
+  }
+  cout << name << "\t" << ns_per_site << "\t" << sizeof(typename policy::value_t) 
+       << "\t" << max_error << "\t" << max_relative_error << endl;
+}
+
+int benchmark_precision(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  size_t n_queries = 10;
+  vector<inputHaplotype*> queries;
+  for(size_t q = 0; q < n_queries; q++) {
+    queries.push_back(new inputHaplotype(panel.mosaic(generator), 
+              vector<size_t>(n_sites + 1, 0), panel.reference, 0, 2 * n_sites));
+  }
+  vector<double> baseline;
+  score_under_policy<logSpace<double> >(panel, n_haplotypes, queries, baseline);
+  
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tqueries\t" << n_queries << endl;
+  cout << "policy\tns/site\tbytes/value\tmax abs error\tmax relative error" << endl;
+  report_policy<logSpace<double> >("log double", panel, n_haplotypes, queries, baseline);
+  report_policy<logSpace<float> >("log float", panel, n_haplotypes, queries, baseline);
+  report_policy<scaledLinear<double> >("linear double", panel, n_haplotypes, queries, baseline);
+  report_policy<scaledLinear<float> >("linear float", panel, n_haplotypes, queries, baseline);
+  for(size_t q = 0; q < n_queries; q++) {
+    delete queries[q];
+  }
+  return 0;
+}
+
+// p is accepted when accept_every is nonzero and divides p + 1
+bool accepts_proposal(size_t p, size_t accept_every) {
+  return accept_every != 0 && p % accept_every == accept_every - 1;
+}
+
+double accepted_fraction(size_t accept_every) {
+  return accept_every == 0 ? 0 : 1.0 / accept_every;
+}
+
+int benchmark_edits(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  inputHaplotype query(panel.mosaic(generator), vector<size_t>(n_sites + 1, 0),
+            panel.reference, 0, 2 * n_sites);
+  size_t n_proposals = 200;
+  uniform_int_distribution<size_t> which_site(0, n_sites - 1);
+  vector<alleleEdit> proposals;
+  for(size_t p = 0; p < n_proposals; p++) {
+    size_t j = which_site(generator);
+    proposals.push_back(alleleEdit(j, query.get_allele(j) == A ? T : A));
+  }
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tproposals\t" << n_proposals << endl;
+  cout << "method\taccepted\tsetup ms\tproposals/s\tmax abs difference" << endl;
+
+  // every proposal rejected, then every tenth accepted
+  size_t accept_every[2] = {0, 10};
+  vector<vector<double> > full_results(2);
+  fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+  for(size_t run = 0; run < 2; run++) {
+    inputHaplotype full_query = query;
+    auto begin = chrono::high_resolution_clock::now();
+    for(size_t p = 0; p < n_proposals; p++) {
+      size_t j = proposals[p].first;
+      alleleValue original = full_query.get_allele(j);
+      full_query.set_allele(j, proposals[p].second);
+      full_results[run].push_back(state.calculate_probability(&full_query));
+      if(!accepts_proposal(p, accept_every[run])) {
+        full_query.set_allele(j, original);
+      }
+    }
+    auto end = chrono::high_resolution_clock::now();
+    double seconds = chrono::duration_cast<chrono::microseconds>(end - begin).count() / 1e6;
+    cout << "full\t" << accepted_fraction(accept_every[run]) << "\t0\t" << n_proposals / seconds 
+         << "\t0" << endl;
+  }
+
+  for(size_t with_reverse = 0; with_reverse < 2; with_reverse++) {
+    for(size_t run = 0; run < 2; run++) {
+      editScorer scorer(panel.reference, &penalties, panel.cohort);
+      auto begin = chrono::high_resolution_clock::now();
+      scorer.set_query(query, 0, with_reverse == 1);
+      auto middle = chrono::high_resolution_clock::now();
+      double max_difference = 0;
+      for(size_t p = 0; p < n_proposals; p++) {
+        vector<alleleEdit> edit(1, proposals[p]);
+        double result = accepts_proposal(p, accept_every[run]) ? 
+                  scorer.accept_edits(edit) : scorer.score_edits(edit);
+        max_difference = max(max_difference, fabs(result - full_results[run][p]));
+      }
+      auto end = chrono::high_resolution_clock::now();
+      double setup_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+      double seconds = chrono::duration_cast<chrono::microseconds>(end - middle).count() / 1e6;
+      cout << (with_reverse ? "fwd-bwd" : "forward") << "\t" << accepted_fraction(accept_every[run])
+           << "\t" << setup_ms << "\t" << n_proposals / seconds << "\t" 
+           << max_difference << endl;
+    }
+  }
+  return 0;
+}
+
+int benchmark_windows(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  inputHaplotype query(panel.mosaic(generator), vector<size_t>(n_sites + 1, 0),
+            panel.reference, 0, 2 * n_sites);
+  size_t window_length = min((size_t)100, n_sites);
+  windowScorer scorer(panel.reference, &penalties, panel.cohort);
+
+  auto begin = chrono::high_resolution_clock::now();
+  vector<double> track = scorer.window_log_likelihoods(&query, window_length);
+  auto middle = chrono::high_resolution_clock::now();
+  double total_difference = 0;
+  for(size_t i = 0; i < track.size(); i++) {
+    double standalone = scorer.standalone_window_log_likelihood(&query, i, 
+              window_length);
+    total_difference += fabs(track[i] - standalone);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double track_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+  double windows_ms = chrono::duration_cast<chrono::microseconds>(end - middle).count() / 1000.0;
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\twindow\t" << window_length << endl;
+  cout << "method\tms\tus/window" << endl;
+  cout << "track\t" << track_ms << "\t" << 1000 * track_ms / track.size() << endl;
+  cout << "per window\t" << windows_ms << "\t" << 1000 * windows_ms / track.size() << endl;
+  cout << "mean |conditional - standalone|\t" << total_difference / track.size() << endl;
+  return 0;
+}
+
+// ns/site and log-likelihoods of the queries under a site kernel policy
+template<typename policy>
+double score_under_kernel(const randomPanel& panel, size_t n_haplotypes,
+              const vector<inputHaplotype*>& queries, 
+              const siteKernelPolicy& kernel, vector<double>& results, 
+              size_t& dense_sites) {
+  basicPenaltySet<policy> penalties(-6, -9, n_haplotypes);
+  basicFwdAlgState<policy> state(panel.reference, &penalties, panel.cohort);
+  state.set_site_kernel_policy(kernel);
+  results.clear();
+  dense_sites = 0;
+  auto begin = chrono::high_resolution_clock::now();
+  for(size_t q = 0; q < queries.size(); q++) {
+    results.push_back(state.calculate_probability(queries[q]));
+    dense_sites += state.get_snapshot_stats().dense_sites;
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+  return ns / (queries.size() * queries[0]->number_of_sites());
+}
+
+template<typename policy>
+void report_kernels(const char* name, const randomPanel& panel,
+              size_t n_haplotypes, const vector<inputHaplotype*>& queries) {
+  basicPenaltySet<policy> penalties(-6, -9, n_haplotypes);
+  basicFwdAlgState<policy> defaults(panel.reference, &penalties, panel.cohort);
+  siteKernelPolicy adaptive = defaults.get_site_kernel_policy();
+  siteKernelPolicy lazy = adaptive;
+  lazy.adaptive = false;
+  siteKernelPolicy dense = adaptive;
+  dense.lazy_row_cost = n_haplotypes;
+  dense.min_dense_run = 1;
+  vector<double> lazy_results, results;
+  size_t dense_sites;
+  double total_sites = queries.size() * queries[0]->number_of_sites();
+  double lazy_ns = score_under_kernel<policy>(panel, n_haplotypes, queries, lazy,
+              lazy_results, dense_sites);
+  double dense_ns = score_under_kernel<policy>(panel, n_haplotypes, queries, 
+              dense, results, dense_sites);
+  double adaptive_ns = score_under_kernel<policy>(panel, n_haplotypes, queries, 
+              adaptive, results, dense_sites);
+  double max_error = 0;
+  for(size_t q = 0; q < queries.size(); q++) {
+    double error = fabs(results[q] - lazy_results[q]);
+    if(!(error <= max_error)) {
+      max_error = error;
+    }
+  }
+  cout << name << "\t" << lazy_ns << "\t" << dense_ns << "\t" << adaptive_ns 
+       << "\t" << dense_sites / total_sites << "\t" << max_error << endl;
+}
+
+int benchmark_kernel(size_t n_sites, size_t n_haplotypes, mt19937& generator) {
+  const double spectrum[] = {0.01, 0.05, 0.2, 0.5};
+  size_t n_queries = 10;
+  for(size_t f = 0; f < 4; f++) {
+    randomPanel panel(n_sites, n_haplotypes, spectrum[f], generator);
+    vector<inputHaplotype*> queries;
+    for(size_t q = 0; q < n_queries; q++) {
+      queries.push_back(new inputHaplotype(panel.mosaic(generator), 
+                vector<size_t>(n_sites + 1, 0), panel.reference, 0, 2 * n_sites));
+    }
+    cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+         << "\talt freq\t" << spectrum[f] << "\tqueries\t" << n_queries << endl;
+    cout << "policy\tlazy ns/site\tdense ns/site\tadaptive ns/site"
+         << "\tadaptive dense fraction\tmax |adaptive - lazy|" << endl;
+    report_kernels<logSpace<double> >("log double", panel, n_haplotypes, queries);
+    report_kernels<logSpace<float> >("log float", panel, n_haplotypes, queries);
+    report_kernels<scaledLinear<double> >("linear double", panel, n_haplotypes, queries);
+    report_kernels<scaledLinear<float> >("linear float", panel, n_haplotypes, queries);
+    for(size_t q = 0; q < n_queries; q++) {
+      delete queries[q];
+    }
+  }
+  return 0;
+}
+
+// the threshold is the lowest log-likelihood of a mosaic, so that only the
+// unrelated queries, drawn at the panel's allele frequency, are rejected
+int benchmark_screen(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+  size_t n_queries = 20;
+  bernoulli_distribution is_alt(alt_frequency);
+  vector<inputHaplotype*> queries;
+  for(size_t q = 0; q < 2 * n_queries; q++) {
+    vector<alleleValue> alleles = panel.mosaic(generator);
+    if(q >= n_queries) {
+      for(size_t i = 0; i < n_sites; i++) {
+        alleles[i] = is_alt(generator) ? T : A;
+      }
+    }
+    queries.push_back(new inputHaplotype(alleles, vector<size_t>(n_sites + 1, 0),
+              panel.reference, 0, 2 * n_sites));
+  }
+
+  auto begin = chrono::high_resolution_clock::now();
+  vector<double> full(queries.size());
+  for(size_t q = 0; q < queries.size(); q++) {
+    full[q] = state.calculate_probability(queries[q]);
+  }
+  auto middle = chrono::high_resolution_clock::now();
+  double threshold = *min_element(full.begin(), full.begin() + n_queries);
+  size_t rejected = 0;
+  size_t sites_scored = 0;
+  size_t rejected_sites_scored = 0;
+  for(size_t q = 0; q < queries.size(); q++) {
+    size_t stopped_at;
+    state.calculate_probability(queries[q], threshold, stopped_at);
+    if(stopped_at < n_sites) {
+      rejected++;
+      rejected_sites_scored += stopped_at + 1;
+    }
+    sites_scored += min(stopped_at + 1, n_sites);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double full_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+  double screen_ms = chrono::duration_cast<chrono::microseconds>(end - middle).count() / 1000.0;
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tmosaics\t" << n_queries 
+       << "\tunrelated\t" << n_queries << "\tthreshold\t" << threshold << endl;
+  cout << "method\tms\tfraction of sites scored" << endl;
+  cout << "full\t" << full_ms << "\t1" << endl;
+  cout << "screen\t" << screen_ms << "\t" 
+       << (double)sites_scored / (queries.size() * n_sites) << endl;
+  cout << "rejected\t" << rejected << "\tfraction of their sites scored\t"
+       << (rejected == 0 ? 0 : (double)rejected_sites_scored / (rejected * n_sites)) 
+       << endl;
+  for(size_t q = 0; q < queries.size(); q++) {
+    delete queries[q];
+  }
+  return 0;
+}
+
+int benchmark_sweep(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  inputHaplotype query(panel.mosaic(generator), vector<size_t>(n_sites + 1, 0),
+            panel.reference, 0, 2 * n_sites);
+  vector<penaltyParameters> settings;
+  for(size_t r = 0; r < 4; r++) {
+    for(size_t m = 0; m < 4; m++) {
+      penaltyParameters setting = {-8.0 + r, -11.0 + m};
+      settings.push_back(setting);
+    }
+  }
+  sweepFwdAlgState sweep(panel.reference, panel.cohort, settings);
+
+  auto begin = chrono::high_resolution_clock::now();
+  vector<double> swept = sweep.calculate_probabilities(&query);
+  auto middle = chrono::high_resolution_clock::now();
+  vector<double> separate;
+  for(size_t i = 0; i < settings.size(); i++) {
+    penaltySet penalties(settings[i].log_rho, settings[i].log_mu, n_haplotypes);
+    fastFwdAlgState state(panel.reference, &penalties, panel.cohort);
+    separate.push_back(state.calculate_probability(&query));
+  }
+  auto linear = chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < settings.size(); i++) {
+    basicPenaltySet<scaledLinear<double> > penalties(settings[i].log_rho, 
+              settings[i].log_mu, n_haplotypes);
+    basicFwdAlgState<scaledLinear<double> > state(panel.reference, &penalties, 
+              panel.cohort);
+    state.calculate_probability(&query);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double sweep_ms = chrono::duration_cast<chrono::microseconds>(middle - begin).count() / 1000.0;
+  double log_ms = chrono::duration_cast<chrono::microseconds>(linear - middle).count() / 1000.0;
+  double linear_ms = chrono::duration_cast<chrono::microseconds>(end - linear).count() / 1000.0;
+  double max_error = 0;
+  for(size_t i = 0; i < settings.size(); i++) {
+    max_error = max(max_error, fabs(swept[i] - separate[i]));
+  }
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tsettings\t" << settings.size() 
+       << "\tlanes\t" << sweepLinear::width << endl;
+  cout << "method\tms\tms/setting" << endl;
+  cout << "sweep\t" << sweep_ms << "\t" << sweep_ms / settings.size() << endl;
+  cout << "separate log double\t" << log_ms << "\t" << log_ms / settings.size() << endl;
+  cout << "separate linear double\t" << linear_ms << "\t" 
+       << linear_ms / settings.size() << endl;
+  cout << "max |sweep - separate|\t" << max_error << endl;
+  return 0;
+}
+
+// mosaics switch at 1% of sites and mutate at 0.1%; each site is followed by
+// a one-bp span, so there are two steps and two positions per site
+int benchmark_em(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  size_t n_queries = 16;
+  vector<inputHaplotype*> owned;
+  vector<const inputHaplotype*> queries;
+  for(size_t i = 0; i < n_queries; i++) {
+    owned.push_back(new inputHaplotype(panel.mosaic(generator), 
+              vector<size_t>(n_sites + 1, 0), panel.reference, 0, 2 * n_sites));
+    queries.push_back(owned.back());
+  }
+  penaltyEstimator estimator(panel.reference, panel.cohort);
+  penaltyParameters initial = {-8, -11};
+  double true_r = 0.01 / 2;
+  double true_mu = 0.001 / 8;
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tqueries\t" << n_queries << endl;
+  cout << "threads\tms\titerations\tlog-likelihood\tr\tmu" << endl;
+  size_t thread_counts[2] = {1, 4};
+  for(size_t t = 0; t < 2; t++) {
+    auto begin = chrono::high_resolution_clock::now();
+    emEstimate estimate = estimator.estimate(queries, initial, thread_counts[t]);
+    auto end = chrono::high_resolution_clock::now();
+    double ms = chrono::duration_cast<chrono::microseconds>(end - begin).count() / 1000.0;
+    double r = n_haplotypes * exp(estimate.parameters.log_rho) / (n_haplotypes - 1);
+    cout << thread_counts[t] << "\t" << ms << "\t" 
+         << estimate.log_likelihoods.size() - 1 << "\t" 
+         << estimate.log_likelihoods.back() << "\t" << r << "\t" 
+         << exp(estimate.parameters.log_mu) << endl;
+  }
+  cout << "drawn with\tr\t" << true_r << "\tmu\t" << true_mu << endl;
+  for(size_t i = 0; i < owned.size(); i++) {
+    delete owned[i];
+  }
+  return 0;
+}
+
+int benchmark_dense(size_t n_sites, size_t n_haplotypes, double alt_frequency,
+              mt19937& generator) {
+  randomPanel panel(n_sites, n_haplotypes, alt_frequency, generator);
+  size_t n_queries = 4;
+  vector<vector<alleleValue> > alleles;
+  vector<inputHaplotype*> queries;
+  for(size_t i = 0; i < n_queries; i++) {
+    alleles.push_back(panel.mosaic(generator));
+    queries.push_back(new inputHaplotype(alleles.back(), 
+              vector<size_t>(n_sites + 1, 0), panel.reference, 0, 2 * n_sites));
+  }
+  penaltySet penalties(-6, -9, n_haplotypes);
+  fastFwdAlgState fast(panel.reference, &penalties, panel.cohort);
+  denseFwdSolver dense(panel.reference, &penalties, panel.cohort);
+  slowFwdSolver slow(panel.reference, &penalties, panel.cohort);
+  double sites = (double)n_sites * n_queries;
+
+  vector<double> fast_results, dense_results;
+  auto begin = chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < n_queries; i++) {
+    fast_results.push_back(fast.calculate_probability(queries[i]));
+  }
+  auto fast_end = chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < n_queries; i++) {
+    dense_results.push_back(dense.calculate_probability(queries[i]));
+  }
+  auto dense_end = chrono::high_resolution_clock::now();
+  dense.set_threads(4);
+  for(size_t i = 0; i < n_queries; i++) {
+    dense.calculate_probability(queries[i]);
+  }
+  auto threaded_end = chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < n_queries; i++) {
+    slow.calculate_probability_linear(alleles[i], 0);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  double max_error = 0;
+  for(size_t i = 0; i < n_queries; i++) {
+    max_error = max(max_error, fabs(fast_results[i] - dense_results[i]));
+  }
+
+  cout << "sites\t" << n_sites << "\thaplotypes\t" << n_haplotypes
+       << "\talt freq\t" << alt_frequency << "\tqueries\t" << n_queries << endl;
+  cout << "method\tns/site" << endl;
+  cout << "fast\t" << chrono::duration_cast<chrono::nanoseconds>(fast_end - begin).count() / sites << endl;
+  cout << "dense, 1 thread\t" << chrono::duration_cast<chrono::nanoseconds>(dense_end - fast_end).count() / sites << endl;
+  cout << "dense, 4 threads\t" << chrono::duration_cast<chrono::nanoseconds>(threaded_end - dense_end).count() / sites << endl;
+  cout << "classical linear\t" << chrono::duration_cast<chrono::nanoseconds>(end - threaded_end).count() / sites << endl;
+  cout << "max |fast - dense|\t" << max_error << endl;
+  for(size_t i = 0; i < n_queries; i++) {
+    delete queries[i];
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if(argc < 2) {
+    cerr << "usage: speed_fwd <mode> [sites] [haplotypes] [alt allele frequency] [seed]" << endl;
+    cerr << "modes: fused long snapshot sample precision edits windows kernel screen sweep em dense" << endl;
+    return 1;
+  }
+  size_t n_sites = 10000;
+  size_t n_haplotypes = 1000;
+  double alt_frequency = 0.05;
+  size_t seed = 1;
+  if(argc >= 3) {
+    n_sites = strtoul(argv[2], NULL, 0);
+  }
+  if(argc >= 4) {
+    n_haplotypes = strtoul(argv[3], NULL, 0);
+  }
+  if(argc >= 5) {
+    alt_frequency = atof(argv[4]);
+  }
+  if(argc >= 6) {
+    seed = strtoul(argv[5], NULL, 0);
+  }
+  mt19937 generator(seed);
+
+  if(strcmp(argv[1], "fused") == 0) {
+    return benchmark_fused(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "long") == 0) {
+    return benchmark_long(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "snapshot") == 0) {
+    return benchmark_snapshot(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "sample") == 0) {
+    return benchmark_sample(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "precision") == 0) {
+    return benchmark_precision(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "edits") == 0) {
+    return benchmark_edits(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "windows") == 0) {
+    return benchmark_windows(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "kernel") == 0) {
+    return benchmark_kernel(n_sites, n_haplotypes, generator);
+  } else if(strcmp(argv[1], "screen") == 0) {
+    return benchmark_screen(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "sweep") == 0) {
+    return benchmark_sweep(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "em") == 0) {
+    return benchmark_em(n_sites, n_haplotypes, alt_frequency, generator);
+  } else if(strcmp(argv[1], "dense") == 0) {
+    return benchmark_dense(n_sites, n_haplotypes, alt_frequency, generator);
+  } else {
+    cerr << "unknown mode " << argv[1] << endl;
+    return 1;
+  }
+}
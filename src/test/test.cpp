@@ -6,10 +6,20 @@
 #include "probability.hpp"
 #include "input_haplotype.hpp"
 #include "delay_multiplier.hpp"
+#include "forward_backward.hpp"
+#include "viterbi.hpp"
+#include "edit_scorer.hpp"
+#include "window_scorer.hpp"
+#include "parameter_sweep.hpp"
+#include "parameter_estimation.hpp"
+#include "dense_solver.hpp"
 #include "catch.hpp"
+#include "allocation_counter.hpp"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace std;
 
@@ -124,6 +134,27 @@ TEST_CASE( "haplotypeCohort accessors", "[cohort][cohort-accessors]") {
     ++it;
     REQUIRE(*it == 3);
   }
+  SECTION( "Extension table agrees with per-site queries" ) {
+    for(size_t i = 0; i < 3; i++) {
+      const siteExtension* at_site = cohort.get_extensions_at_site(i);
+      for(size_t a = 0; a < 5; a++) {
+        const siteExtension& extension = cohort.get_extension(i, (alleleValue)a);
+        REQUIRE(&extension == at_site + a);
+        REQUIRE(extension.allele == (alleleValue)a);
+        REQUIRE(extension.match_is_rare == cohort.match_is_rare(i, (alleleValue)a));
+        REQUIRE(extension.number_active == cohort.number_active(i, (alleleValue)a));
+        size_t count = 0;
+        if(!extension.active_rows.empty()) {
+          rowSet::const_iterator it = extension.active_rows.begin();
+          for(; it != extension.active_rows.end(); ++it) {
+            ++count;
+          }
+        }
+        REQUIRE(count == (extension.number_active == cohort.get_n_haplotypes() ?
+                  0 : extension.number_active));
+      }
+    }
+  }
 }
 
 TEST_CASE( "haplotypeCohort construction", "[cohort][cohort-constructors]") {
@@ -728,6 +759,1539 @@ TEST_CASE( "Fast method gives same result as classical", "[probability][sublinea
   }
 }
 
+TEST_CASE( "Dense solver gives same result as the fast method", "[probability][dense]" ) {
+  size_t n_sites = 150;
+  size_t n_haplotypes = 23;
+  // spans of varying length between sites
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + (i / 10) * 5 + 1);
+  }
+  size_t length = positions.back() + 12;
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + 2 * i) % 11 == 0) {
+        haplotypes[h][i] = G;
+      }
+    }
+  }
+  siteIndex reference(positions, length);
+  haplotypeCohort cohort(haplotypes, &reference);
+  penaltySet penalties(-6, -9, n_haplotypes);
+
+  // a mosaic of rows 3 and 15 with mismatches, novel SNVs and both tails,
+  // over the whole reference and over an interval within it
+  vector<alleleValue> whole = haplotypes[3];
+  std::copy(haplotypes[15].begin() + 70, haplotypes[15].end(), whole.begin() + 70);
+  for(size_t i = 4; i < n_sites; i += 29) {
+    whole[i] = C;
+  }
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[0] = 1;
+  novel_SNVs[33] = 2;
+  novel_SNVs[n_sites] = 1;
+  inputHaplotype whole_query(whole, novel_SNVs, &reference, 0, length);
+  size_t start = 40;
+  size_t interval_length = 300;
+  vector<alleleValue> interval;
+  for(size_t i = 0; i < n_sites; i++) {
+    if(positions[i] >= start && positions[i] < start + interval_length) {
+      interval.push_back(whole[i]);
+    }
+  }
+  vector<size_t> interval_SNVs(interval.size() + 1, 0);
+  interval_SNVs[5] = 1;
+  inputHaplotype interval_query(interval, interval_SNVs, &reference, start, 
+            interval_length);
+  vector<const inputHaplotype*> queries = {&whole_query, &interval_query};
+
+  SECTION( "At uniform rates, on one thread and on several" ) {
+    fastFwdAlgState fast(&reference, &penalties, &cohort);
+    denseFwdSolver dense(&reference, &penalties, &cohort);
+    denseFwdSolver threaded(&reference, &penalties, &cohort, 4);
+    for(size_t i = 0; i < queries.size(); i++) {
+      double expected = fast.calculate_probability(queries[i]);
+      REQUIRE(dense.calculate_probability(queries[i]) == Approx(expected));
+      REQUIRE(threaded.calculate_probability(queries[i]) == Approx(expected));
+    }
+  }
+  SECTION( "At site rates" ) {
+    vector<double> log_rho_by_gap(n_sites + 1);
+    vector<double> log_mu_by_site(n_sites);
+    for(size_t i = 0; i <= n_sites; i++) {
+      log_rho_by_gap[i] = -8 + (double)(i % 7) / 2;
+    }
+    for(size_t i = 0; i < n_sites; i++) {
+      log_mu_by_site[i] = -10 + (double)(i % 5) / 2;
+    }
+    penalties.set_site_rates(&reference, log_rho_by_gap, log_mu_by_site);
+    fastFwdAlgState fast(&reference, &penalties, &cohort);
+    denseFwdSolver dense(&reference, &penalties, &cohort, 2);
+    for(size_t i = 0; i < queries.size(); i++) {
+      REQUIRE(dense.calculate_probability(queries[i]) == 
+                Approx(fast.calculate_probability(queries[i])));
+    }
+  }
+  SECTION( "Either engine may be selected" ) {
+    forwardScorer fast(FAST_FORWARD, &reference, &penalties, &cohort);
+    forwardScorer dense(DENSE_FORWARD, &reference, &penalties, &cohort, 3);
+    REQUIRE(fast.get_engine() == FAST_FORWARD);
+    REQUIRE(dense.get_engine() == DENSE_FORWARD);
+    REQUIRE(dense.calculate_probability(&whole_query) == 
+              Approx(fast.calculate_probability(&whole_query)));
+  }
+  SECTION( "Agrees with the classical solver" ) {
+    // on a reference without spans, which the classical solver does not
+    // scale by S
+    vector<size_t> adjacent_positions;
+    for(size_t i = 0; i < n_sites; i++) {
+      adjacent_positions.push_back(i);
+    }
+    siteIndex adjacent_reference(adjacent_positions, n_sites);
+    haplotypeCohort adjacent_cohort(haplotypes, &adjacent_reference);
+    inputHaplotype plain_query(whole, vector<size_t>(n_sites + 1, 0), 
+              &adjacent_reference, 0, n_sites);
+    slowFwdSolver linear_fwd(&adjacent_reference, &penalties, &adjacent_cohort);
+    denseFwdSolver dense(&adjacent_reference, &penalties, &adjacent_cohort);
+    REQUIRE(dense.calculate_probability(&plain_query) == 
+              Approx(linear_fwd.calculate_probability_linear(whole, 0)));
+  }
+}
+
+TEST_CASE( "Fast method agrees with the dense solver on random cohorts", "[probability][dense][differential]" ) {
+  // small cohorts of every shape, including single rows and fixed sites;
+  // bin/differential runs the full grid with timings
+  mt19937 generator(2024);
+  size_t cohort_sizes[4] = {1, 2, 9, 40};
+  double frequencies[3] = {0.02, 0.3, 0.5};
+  for(size_t c = 0; c < 4; c++) {
+    for(size_t f = 0; f < 3; f++) {
+      size_t n_haplotypes = cohort_sizes[c];
+      size_t n_sites = 60;
+      uniform_int_distribution<size_t> gap(1, 4);
+      bernoulli_distribution is_alt(frequencies[f]);
+      bernoulli_distribution is_novel(0.2);
+      vector<size_t> positions;
+      size_t position = gap(generator) - 1;
+      for(size_t i = 0; i < n_sites; i++) {
+        positions.push_back(position);
+        position += gap(generator);
+      }
+      size_t length = position;
+      vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        for(size_t i = 0; i < n_sites; i++) {
+          haplotypes[h][i] = is_alt(generator) ? C : A;
+        }
+      }
+      siteIndex reference(positions, length);
+      haplotypeCohort cohort(haplotypes, &reference);
+      vector<alleleValue> query(n_sites);
+      for(size_t i = 0; i < n_sites; i++) {
+        query[i] = haplotypes[(i / 15) % n_haplotypes][i];
+      }
+      query[n_sites / 2] = T;
+      // novel SNVs only where there is a span to hold them
+      vector<size_t> novel_SNVs(n_sites + 1, 0);
+      for(size_t j = 0; j <= n_sites; j++) {
+        size_t span_start = j == 0 ? 0 : positions[j - 1] + 1;
+        size_t span_end = j == n_sites ? length : positions[j];
+        if(span_end > span_start && is_novel(generator)) {
+          novel_SNVs[j] = 1;
+        }
+      }
+      inputHaplotype query_ih(query, novel_SNVs, &reference, 0, length);
+      penaltySet penalties(-4, -7, n_haplotypes);
+      forwardScorer fast(FAST_FORWARD, &reference, &penalties, &cohort);
+      forwardScorer dense(DENSE_FORWARD, &reference, &penalties, &cohort, 2);
+      REQUIRE(fast.calculate_probability(&query_ih) == 
+                Approx(dense.calculate_probability(&query_ih)));
+    }
+  }
+}
+
+TEST_CASE( "Scoring stops once the likelihood cannot reach a threshold", "[probability][threshold]" ) {
+  size_t n_sites = 200;
+  size_t n_haplotypes = 20;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  fastFwdAlgState state(&reference, &penalties, &cohort);
+  // novel SNVs in some spans, so that their penalties enter the bound
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  for(size_t i = 0; i <= n_sites; i += 17) {
+    novel_SNVs[i] = 1;
+  }
+  inputHaplotype good(haplotypes[5], novel_SNVs, &reference, 0, 3 * n_sites);
+  inputHaplotype bad(vector<alleleValue>(n_sites, C), novel_SNVs, &reference, 
+            0, 3 * n_sites);
+  double good_likelihood = state.calculate_probability(&good);
+  double bad_likelihood = state.calculate_probability(&bad);
+  size_t stopped_at;
+
+  SECTION( "A query above the threshold is scored in full" ) {
+    double result = state.calculate_probability(&good, good_likelihood - 1, 
+              stopped_at);
+    REQUIRE(stopped_at == n_sites);
+    REQUIRE(result == Approx(good_likelihood));
+  }
+  SECTION( "A query far below the threshold is rejected after a few sites" ) {
+    double threshold = good_likelihood - 10;
+    double result = state.calculate_probability(&bad, threshold, stopped_at);
+    REQUIRE(stopped_at < n_sites / 10);
+    REQUIRE(result < threshold);
+    REQUIRE(result >= bad_likelihood);
+  }
+  SECTION( "The bound returned is never below the log-likelihood" ) {
+    bool bounded = true;
+    for(double margin = 0.5; margin < 64; margin *= 2) {
+      double result = state.calculate_probability(&good, good_likelihood + margin,
+                stopped_at);
+      bounded = bounded && stopped_at < n_sites && 
+                result < good_likelihood + margin && 
+                result >= good_likelihood - 1e-9 * fabs(good_likelihood);
+    }
+    REQUIRE(bounded);
+  }
+}
+
+TEST_CASE( "Map history stays bounded on long queries", "[probability][history-gc]" ) {
+  size_t n_sites = 3000;
+  size_t n_haplotypes = 8;
+  penaltySet penalties = penaltySet(-6, -9, n_haplotypes);
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(i);
+  }
+  // haplotype 0 always carries the common allele, so its row never becomes
+  // active and its eqclass would otherwise pin the whole history
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 1; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 13 + i * 7) % 9 == 0) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query = haplotypes[0];
+  for(size_t i = 0; i < n_sites; i += 50) {
+    query[i] = T;
+  }
+  inputHaplotype query_ih(query, vector<size_t>(n_sites, 0), &reference, 0, n_sites);
+  
+  fastFwdAlgState fast_fwd(&reference, &penalties, &cohort);
+  slowFwdSolver linear_fwd(&reference, &penalties, &cohort);
+  double result_fast = fast_fwd.calculate_probability(&query_ih);
+  REQUIRE(result_fast == Approx(linear_fwd.calculate_probability_linear(query, 0)));
+  REQUIRE(fast_fwd.get_maps().get_map_history().size() <= 1024);
+  
+  SECTION( "automatic snapshots do not change the likelihood" ) {
+    snapshotPolicy eager;
+    eager.row_cost = 0;
+    eager.min_interval = 10;
+    fast_fwd.set_snapshot_policy(eager);
+    REQUIRE(fast_fwd.calculate_probability(&query_ih) == Approx(result_fast));
+    REQUIRE(fast_fwd.get_snapshot_stats().snapshots_taken == (n_sites - 1) / 10);
+    REQUIRE(fast_fwd.get_snapshot_stats().rows_evaluated == n_haplotypes * ((n_sites - 1) / 10));
+    REQUIRE(fast_fwd.get_snapshot_stats().max_history_length <= 11);
+    snapshotPolicy manual;
+    manual.automatic = false;
+    fast_fwd.set_snapshot_policy(manual);
+    REQUIRE(fast_fwd.calculate_probability(&query_ih) == Approx(result_fast));
+    REQUIRE(fast_fwd.get_snapshot_stats().snapshots_taken == 0);
+  }
+  SECTION( "merging identical eqclasses does not change the likelihood" ) {
+    fast_fwd.get_maps().set_merge_identical(true);
+    REQUIRE(fast_fwd.calculate_probability(&query_ih) == Approx(result_fast));
+    fast_fwd.take_snapshot();
+    for(size_t row = 1; row < n_haplotypes; row++) {
+      REQUIRE(fast_fwd.get_maps().get_map(row).is_identity());
+    }
+  }
+  SECTION( "condense_history catches stale eqclasses up" ) {
+    lazyEvalMap& map = fast_fwd.get_maps();
+    size_t top = map.get_current_site();
+    map.condense_history(top, 0);
+    REQUIRE(map.get_map_history().size() == 1);
+    REQUIRE(map.row_updated_to(0) == top);
+  }
+}
+
+// a small cohort in which each haplotype carries T at two sites in seven, in
+// a phase of its own
+static vector<vector<alleleValue> > striped_cohort(size_t n_haplotypes,
+            size_t n_sites) {
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 5 + i * 3) % 7 < 2) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  return haplotypes;
+}
+
+// copies the haplotypes in turn, moving to the next every run sites, with a
+// novel allele G at one site
+static vector<alleleValue> mosaic_query(
+            const vector<vector<alleleValue> >& haplotypes, size_t run,
+            size_t mutated_site) {
+  size_t n_sites = haplotypes[0].size();
+  vector<alleleValue> query(n_sites);
+  for(size_t i = 0; i < n_sites; i++) {
+    query[i] = haplotypes[(i / run) % haplotypes.size()][i];
+  }
+  query[mutated_site] = G;
+  return query;
+}
+
+TEST_CASE( "Forward-backward posteriors", "[probability][forward-backward]" ) {
+  size_t n_sites = 30;
+  size_t n_haplotypes = 6;
+  penaltySet penalties = penaltySet(-4, -6, n_haplotypes);
+  vector<vector<alleleValue> > haplotypes = striped_cohort(n_haplotypes, n_sites);
+  vector<alleleValue> query = mosaic_query(haplotypes, 8, 11);
+  
+  SECTION( "posteriors match a direct forward-backward computation" ) {
+    vector<size_t> positions;
+    for(size_t i = 0; i < n_sites; i++) {
+      positions.push_back(i);
+    }
+    siteIndex reference(positions, n_sites);
+    haplotypeCohort cohort(haplotypes, &reference);
+    inputHaplotype query_ih(query, vector<size_t>(n_sites + 1, 0), &reference, 0, n_sites);
+    
+    // linear-space forward and backward matrices
+    double rho = exp(penalties.rho);
+    double stay = 1 - (n_haplotypes - 1) * rho;
+    vector<vector<double> > emission(n_sites, vector<double>(n_haplotypes));
+    for(size_t i = 0; i < n_sites; i++) {
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        emission[i][h] = exp(haplotypes[h][i] == query[i] ? penalties.one_minus_mu : penalties.mu);
+      }
+    }
+    vector<vector<double> > alpha(n_sites, vector<double>(n_haplotypes));
+    vector<vector<double> > beta(n_sites, vector<double>(n_haplotypes, 1));
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      alpha[0][h] = emission[0][h] / n_haplotypes;
+    }
+    for(size_t i = 1; i < n_sites; i++) {
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        double sum = 0;
+        for(size_t g = 0; g < n_haplotypes; g++) {
+          sum += alpha[i - 1][g] * (g == h ? stay : rho);
+        }
+        alpha[i][h] = emission[i][h] * sum;
+      }
+    }
+    for(size_t i = n_sites - 1; i > 0; i--) {
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        double sum = 0;
+        for(size_t g = 0; g < n_haplotypes; g++) {
+          sum += (g == h ? stay : rho) * emission[i][g] * beta[i][g];
+        }
+        beta[i - 1][h] = sum;
+      }
+    }
+    double likelihood = 0;
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      likelihood += alpha[n_sites - 1][h];
+    }
+    
+    fwdBwdSolver solver(&reference, &penalties, &cohort);
+    solver.set_query(&query_ih);
+    REQUIRE(solver.get_checkpoint_interval() == 6);
+    REQUIRE(solver.number_of_checkpoints() == 5);
+    REQUIRE(solver.get_likelihood() == Approx(log(likelihood)));
+    
+    vector<pair<size_t, size_t> > entries = {{3, 1}, {29, 0}, {0, 5}, {11, 2}, 
+                                             {17, 4}, {11, 3}, {6, 0}};
+    vector<double> posteriors = solver.log_posteriors(entries);
+    for(size_t k = 0; k < entries.size(); k++) {
+      size_t i = entries[k].first;
+      size_t h = entries[k].second;
+      REQUIRE(exp(posteriors[k]) == Approx(alpha[i][h] * beta[i][h] / likelihood));
+    }
+  }
+  SECTION( "posteriors at each site sum to one across spans and tails" ) {
+    vector<size_t> positions;
+    for(size_t i = 0; i < n_sites; i++) {
+      positions.push_back(3 * i + 2 + (i % 4 == 0));
+    }
+    siteIndex reference(positions, 3 * n_sites + 6);
+    haplotypeCohort cohort(haplotypes, &reference);
+    vector<size_t> novel_SNVs(n_sites + 1, 0);
+    novel_SNVs[4] = 1;
+    inputHaplotype query_ih(query, novel_SNVs, &reference, 0, 3 * n_sites + 4);
+    REQUIRE(query_ih.has_left_tail());
+    REQUIRE(query_ih.has_span_after(n_sites - 1));
+    
+    fastFwdAlgState fast_fwd(&reference, &penalties, &cohort);
+    fwdBwdSolver solver(&reference, &penalties, &cohort);
+    solver.set_query(&query_ih, 4);
+    REQUIRE(solver.get_likelihood() == Approx(fast_fwd.calculate_probability(&query_ih)));
+    for(size_t i = 0; i < n_sites; i += 7) {
+      vector<double> posteriors = solver.log_posteriors_at_site(i);
+      double total = 0;
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        total += exp(posteriors[h]);
+      }
+      REQUIRE(total == Approx(1));
+    }
+  }
+  SECTION( "sampled paths follow the posteriors" ) {
+    vector<size_t> positions;
+    for(size_t i = 0; i < n_sites; i++) {
+      positions.push_back(3 * i + 2 + (i % 4 == 0));
+    }
+    siteIndex reference(positions, 3 * n_sites + 6);
+    haplotypeCohort cohort(haplotypes, &reference);
+    vector<size_t> novel_SNVs(n_sites + 1, 0);
+    novel_SNVs[4] = 1;
+    inputHaplotype query_ih(query, novel_SNVs, &reference, 0, 3 * n_sites + 4);
+    
+    fwdBwdSolver solver(&reference, &penalties, &cohort);
+    solver.set_query(&query_ih, 4);
+    mt19937 generator(12);
+    size_t n_paths = 4000;
+    vector<vector<pathSegment> > paths = solver.sample_paths(n_paths, generator);
+    REQUIRE(paths.size() == n_paths);
+    vector<size_t> sites = {0, 6, 11, 16, 29};
+    vector<vector<double> > frequencies(sites.size(), vector<double>(n_haplotypes, 0));
+    bool contiguous = true;
+    for(size_t p = 0; p < n_paths; p++) {
+      contiguous &= paths[p].front().first_site == 0;
+      contiguous &= paths[p].back().last_site == n_sites - 1;
+      vector<size_t> rows(n_sites);
+      for(size_t s = 0; s < paths[p].size(); s++) {
+        if(s > 0) {
+          contiguous &= paths[p][s].first_site == paths[p][s - 1].last_site + 1;
+        }
+        for(size_t j = paths[p][s].first_site; j <= paths[p][s].last_site; j++) {
+          rows[j] = paths[p][s].row;
+        }
+      }
+      for(size_t k = 0; k < sites.size(); k++) {
+        frequencies[k][rows[sites[k]]] += 1.0 / n_paths;
+      }
+    }
+    REQUIRE(contiguous);
+    for(size_t k = 0; k < sites.size(); k++) {
+      vector<double> posteriors = solver.log_posteriors_at_site(sites[k]);
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        REQUIRE(fabs(frequencies[k][h] - exp(posteriors[h])) < 0.03);
+      }
+    }
+  }
+}
+
+TEST_CASE( "Per-site rates", "[probability][site-rates]" ) {
+  size_t n_sites = 30;
+  size_t n_haplotypes = 6;
+  vector<vector<alleleValue> > haplotypes = striped_cohort(n_haplotypes, n_sites);
+  vector<alleleValue> query = mosaic_query(haplotypes, 8, 11);
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 2 + (i % 4 == 0));
+  }
+  size_t length = 3 * n_sites + 4;
+  siteIndex reference(positions, length + 2);
+  haplotypeCohort cohort(haplotypes, &reference);
+  inputHaplotype query_ih(query, vector<size_t>(n_sites + 1, 0), &reference, 0, length);
+  
+  SECTION( "uniform site rates change nothing" ) {
+    penaltySet penalties(-4, -6, n_haplotypes);
+    penaltySet tabled(-4, -6, n_haplotypes);
+    tabled.set_uniform_site_rates(&reference);
+    REQUIRE(tabled.has_site_rates());
+    fastFwdAlgState fast_fwd(&reference, &penalties, &cohort);
+    fastFwdAlgState tabled_fwd(&reference, &tabled, &cohort);
+    REQUIRE(tabled_fwd.calculate_probability(&query_ih) == 
+            fast_fwd.calculate_probability(&query_ih));
+  }
+  SECTION( "forward-backward follows per-site rates in both directions" ) {
+    penaltySet penalties(-4, -6, n_haplotypes);
+    vector<double> log_rho_by_gap(n_sites + 1);
+    for(size_t g = 0; g <= n_sites; g++) {
+      log_rho_by_gap[g] = -3 - 2.0 * (g % 3);
+    }
+    vector<double> log_mu_by_site(n_sites);
+    for(size_t i = 0; i < n_sites; i++) {
+      log_mu_by_site[i] = -6 + (double)(i % 4);
+    }
+    penalties.set_site_rates(&reference, log_rho_by_gap, log_mu_by_site);
+    
+    // a direct computation position by position, in which the step onto
+    // each position takes the rate of the gap containing it
+    vector<size_t> gap(length);
+    size_t next_site = 0;
+    for(size_t p = 0; p < length; p++) {
+      gap[p] = next_site;
+      if(next_site < n_sites && positions[next_site] == p) {
+        ++next_site;
+      }
+    }
+    auto emission = [&](size_t p, size_t h) {
+      if(gap[p] < n_sites && positions[gap[p]] == p) {
+        double mu = exp(log_mu_by_site[gap[p]]);
+        return haplotypes[h][gap[p]] == query[gap[p]] ? 1 - 4 * mu : mu;
+      }
+      return 1 - 4 * exp(-6.0);
+    };
+    auto step = [&](const vector<double>& from, size_t p) {
+      double rho = exp(log_rho_by_gap[gap[p]]) / (n_haplotypes - 1);
+      double total = 0;
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        total += from[h];
+      }
+      vector<double> to_return(n_haplotypes);
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        to_return[h] = (1 - n_haplotypes * rho) * from[h] + rho * total;
+      }
+      return to_return;
+    };
+    vector<vector<double> > alpha(length, vector<double>(n_haplotypes));
+    vector<vector<double> > beta(length, vector<double>(n_haplotypes, 1));
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      alpha[0][h] = emission(0, h) / n_haplotypes;
+    }
+    for(size_t p = 1; p < length; p++) {
+      alpha[p] = step(alpha[p - 1], p);
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        alpha[p][h] *= emission(p, h);
+      }
+    }
+    for(size_t p = length - 1; p > 0; p--) {
+      vector<double> weighted(n_haplotypes);
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        weighted[h] = emission(p, h) * beta[p][h];
+      }
+      // the step matrix is symmetric
+      beta[p - 1] = step(weighted, p);
+    }
+    double likelihood = 0;
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      likelihood += alpha[length - 1][h];
+    }
+    
+    fwdBwdSolver solver(&reference, &penalties, &cohort);
+    solver.set_query(&query_ih, 4);
+    REQUIRE(solver.get_likelihood() == Approx(log(likelihood)));
+    bool posteriors_match = true;
+    for(size_t i = 0; i < n_sites; i += 5) {
+      vector<double> posteriors = solver.log_posteriors_at_site(i);
+      size_t p = positions[i];
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        double expected = alpha[p][h] * beta[p][h] / likelihood;
+        posteriors_match &= fabs(exp(posteriors[h]) - expected) < 1e-9;
+      }
+    }
+    REQUIRE(posteriors_match);
+  }
+}
+
+TEST_CASE( "Viterbi paths", "[probability][viterbi]" ) {
+  size_t n_sites = 30;
+  size_t n_haplotypes = 6;
+  penaltySet penalties = penaltySet(-4, -6, n_haplotypes);
+  vector<vector<alleleValue> > haplotypes = striped_cohort(n_haplotypes, n_sites);
+  vector<alleleValue> query = mosaic_query(haplotypes, 8, 11);
+  
+  SECTION( "max-product maps compose" ) {
+    maxProductMap first(-1, -3);
+    maxProductMap second(-2, 0.5);
+    maxProductMap composed = second.of(first);
+    for(double x = -6; x < 2; x += 0.75) {
+      REQUIRE(composed.of(x) == Approx(second.of(first.of(x))));
+    }
+  }
+  
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 2 + (i % 4 == 0));
+  }
+  siteIndex reference(positions, 3 * n_sites + 6);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[4] = 1;
+  inputHaplotype query_ih(query, novel_SNVs, &reference, 0, 3 * n_sites + 4);
+  REQUIRE(query_ih.has_left_tail());
+  REQUIRE(query_ih.has_span_after(n_sites - 1));
+  
+  // direct max-product recursion over every position of the query
+  double stay = penalties.stay_coefficient;
+  auto transition = [&](vector<double>& V) {
+    vector<double> last_V = V;
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      V[h] = stay + last_V[h];
+      for(size_t g = 0; g < n_haplotypes; g++) {
+        if(g != h) {
+          V[h] = max(V[h], penalties.rho + last_V[g]);
+        }
+      }
+    }
+  };
+  auto span_mutations = [&](int j) {
+    return penalties.span_mutation_penalty(j < 0 ? query_ih.get_left_tail() : 
+              query_ih.get_span_after(j), query_ih.get_n_novel_SNVs(j));
+  };
+  vector<double> V(n_haplotypes, span_mutations(-1) - penalties.log_H);
+  for(size_t j = 0; j < n_sites; j++) {
+    if(j > 0) {
+      for(size_t k = 0; k < query_ih.get_span_after(j - 1); k++) {
+        transition(V);
+      }
+      for(size_t h = 0; h < n_haplotypes; h++) {
+        V[h] += span_mutations(j - 1);
+      }
+    }
+    transition(V);
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      V[h] += haplotypes[h][j] == query[j] ? penalties.one_minus_mu : penalties.mu;
+    }
+  }
+  double best = -INFINITY;
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    best = max(best, V[h]);
+  }
+  best += span_mutations(n_sites - 1) + query_ih.get_span_after(n_sites - 1) * stay;
+  
+  // log-probability of a path which switches rows only at sites
+  auto path_score = [&](const vector<pathSegment>& segments) {
+    double score = span_mutations(-1) - penalties.log_H + stay;
+    size_t last_row = segments[0].row;
+    for(size_t s = 0; s < segments.size(); s++) {
+      for(size_t j = segments[s].first_site; j <= segments[s].last_site; j++) {
+        size_t row = segments[s].row;
+        if(j > 0) {
+          size_t steps = query_ih.get_span_after(j - 1) + 1;
+          score += span_mutations(j - 1) + (steps - 1) * stay;
+          score += row == last_row ? stay : penalties.rho;
+        }
+        score += haplotypes[row][j] == query[j] ? penalties.one_minus_mu : penalties.mu;
+        last_row = row;
+      }
+    }
+    return score + span_mutations(n_sites - 1) + query_ih.get_span_after(n_sites - 1) * stay;
+  };
+  
+  for(size_t interval : {0, 1, 4, 30}) {
+    viterbiSolver solver(&reference, &penalties, &cohort);
+    solver.set_query(&query_ih, interval);
+    REQUIRE(solver.get_log_probability() == Approx(best));
+    vector<pathSegment> segments = solver.traceback();
+    REQUIRE(segments.size() > 1);
+    REQUIRE(segments.front().first_site == 0);
+    REQUIRE(segments.back().last_site == n_sites - 1);
+    for(size_t s = 1; s < segments.size(); s++) {
+      REQUIRE(segments[s].first_site == segments[s - 1].last_site + 1);
+      REQUIRE(segments[s].row != segments[s - 1].row);
+    }
+    REQUIRE(path_score(segments) == Approx(best));
+  }
+}
+
+TEST_CASE( "Reused fastFwdAlgState scores without allocating", "[probability][allocation]" ) {
+  size_t n_sites = 40;
+  size_t n_haplotypes = 12;
+  penaltySet penalties = penaltySet(-6, -9, n_haplotypes);
+  // sites at 1, 4, 7, ... so that every site is followed by a span
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + i) % 11 == 0) {
+        haplotypes[h][i] = C;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  
+  vector<alleleValue> query_0 = haplotypes[3];
+  vector<alleleValue> query_1 = haplotypes[8];
+  for(size_t i = 0; i < n_sites; i += 4) {
+    query_1[i] = G;
+  }
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[5] = 1;
+  inputHaplotype q_0(query_0, novel_SNVs, &reference, 0, 3 * n_sites);
+  inputHaplotype q_1(query_1, novel_SNVs, &reference, 0, 3 * n_sites);
+  
+  fastFwdAlgState fast_fwd(&reference, &penalties, &cohort);
+  double first_0 = fast_fwd.calculate_probability(&q_0);
+  double first_1 = fast_fwd.calculate_probability(&q_1);
+  
+  SECTION( "steady-state scoring loop performs no heap allocations" ) {
+    size_t allocations_before = heap_allocation_count;
+    double second_0 = fast_fwd.calculate_probability(&q_0);
+    double second_1 = fast_fwd.calculate_probability(&q_1);
+    size_t allocations = heap_allocation_count - allocations_before;
+    REQUIRE(allocations == 0);
+    REQUIRE(second_0 == first_0);
+    REQUIRE(second_1 == first_1);
+  }
+  SECTION( "reset state gives the same result as a fresh one" ) {
+    fastFwdAlgState fresh_fwd(&reference, &penalties, &cohort);
+    REQUIRE(fresh_fwd.calculate_probability(&q_1) == Approx(first_1));
+    fast_fwd.reset();
+    REQUIRE(fast_fwd.prefix_likelihood() == 0);
+    REQUIRE(fast_fwd.get_maps().number_of_eqclasses() == 1);
+    REQUIRE(fast_fwd.get_maps().get_map_history().size() == 1);
+  }
+}
+
+TEST_CASE( "Fused site update matches the multi-pass update", "[probability][fused]" ) {
+  penaltySet penalties = penaltySet(-6, -9, 6);
+  vector<size_t> positions = {0, 1, 2, 3, 4, 5};
+  vector<vector<alleleValue> > haplotypes = {
+    {A, A, T, T, G, A},
+    {A, C, A, A, G, A},
+    {C, A, T, T, G, T},
+    {A, C, C, A, A, T},
+    {A, A, A, A, G, A},
+    {T, A, A, T, G, A}
+  };
+  siteIndex reference(positions, 6);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query = {A, A, T, A, G, T};
+  
+  fastFwdAlgState fused(&reference, &penalties, &cohort);
+  fastFwdAlgState multipass(&reference, &penalties, &cohort);
+  fused.initialize_probability_at_site(0, query[0]);
+  multipass.initialize_probability_at_site(0, query[0]);
+  for(size_t i = 1; i < query.size(); i++) {
+    fused.extend_probability_at_site(i, query[i]);
+    
+    bool match_is_rare = cohort.match_is_rare(i, query[i]);
+    const rowSet& active_rows = cohort.get_active_rowSet(i, query[i]);
+    lazyEvalMap& map = multipass.get_maps();
+    map.stage_map_for_site(penalties.get_current_map(multipass.S, match_is_rare));
+    if(active_rows.empty()) {
+      multipass.S += match_is_rare ? penalties.mu : penalties.one_minus_mu;
+    } else {
+      map.update_active_rows(active_rows);
+      multipass.update_subset_of_Rs(active_rows, match_is_rare);
+      multipass.fast_update_S(active_rows, match_is_rare);
+      map.reset_rows(active_rows);
+    }
+    REQUIRE(fused.S == Approx(multipass.S));
+  }
+  fused.get_maps().hard_update_all();
+  multipass.get_maps().hard_update_all();
+  for(size_t h = 0; h < haplotypes.size(); h++) {
+    REQUIRE(fused.get_maps().evaluate(h, fused.R[h]) == 
+            Approx(multipass.get_maps().evaluate(h, multipass.R[h])));
+  }
+}
+
+template<typename policy>
+vector<double> likelihoods_under_policy(siteIndex* reference,
+            const haplotypeCohort* cohort, const inputHaplotype* query) {
+  basicPenaltySet<policy> penalties(-6, -9, cohort->get_n_haplotypes());
+  basicFwdAlgState<policy> state(reference, &penalties, cohort);
+  vector<double> to_return(1, state.calculate_probability(query));
+  for(size_t h = 0; h < cohort->get_n_haplotypes(); h++) {
+    to_return.push_back(state.current_likelihood_by_row(h));
+  }
+  return to_return;
+}
+
+TEST_CASE( "Arithmetic policies agree with double-precision log-space", "[probability][policy]" ) {
+  size_t n_sites = 400;
+  size_t n_haplotypes = 30;
+  // sites at 1, 4, 7, ... so that every site is followed by a span, and a
+  // long span at the end
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  size_t length = 3 * n_sites + 100000;
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + i) % 13 == 0) {
+        haplotypes[h][i] = C;
+      }
+    }
+  }
+  siteIndex reference(positions, length);
+  haplotypeCohort cohort(haplotypes, &reference);
+  // frequent minority alleles drive the maps of untouched rows towards the
+  // edge of single-precision range
+  vector<alleleValue> query = haplotypes[4];
+  for(size_t i = 0; i < n_sites; i += 3) {
+    query[i] = T;
+  }
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[0] = 1;
+  novel_SNVs[n_sites] = 2;
+  inputHaplotype q(query, novel_SNVs, &reference, 0, length);
+  
+  vector<double> baseline = likelihoods_under_policy<logSpace<double> >(&reference, &cohort, &q);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  fastFwdAlgState fast_fwd(&reference, &penalties, &cohort);
+  REQUIRE(baseline[0] == fast_fwd.calculate_probability(&q));
+  
+  vector<vector<double> > results;
+  results.push_back(likelihoods_under_policy<logSpace<float> >(&reference, &cohort, &q));
+  results.push_back(likelihoods_under_policy<scaledLinear<double> >(&reference, &cohort, &q));
+  results.push_back(likelihoods_under_policy<scaledLinear<float> >(&reference, &cohort, &q));
+  vector<double> tolerances = {1e-4, 1e-10, 1e-4};
+  for(size_t p = 0; p < results.size(); p++) {
+    bool within_tolerance = true;
+    for(size_t i = 0; i < baseline.size(); i++) {
+      if(!(fabs(results[p][i] - baseline[i]) <= tolerances[p] * fabs(baseline[i]))) {
+        within_tolerance = false;
+      }
+    }
+    REQUIRE(within_tolerance);
+  }
+}
+
+// sites at 3i + 1 of a reference of length 3n, so that the left tail and the
+// span after each site are pushed as well
+template<typename policy>
+void push_query_sites(basicFwdAlgState<policy>& state,
+            const vector<alleleValue>& query, size_t from, size_t to) {
+  for(size_t i = from; i < to; i++) {
+    if(i == 0) {
+      state.push_span(1, 0);
+    }
+    state.push_site(query[i]);
+    state.push_span(i + 1 == query.size() ? 1 : 2, 0);
+  }
+}
+
+// the likelihood and row values of the query under a site kernel policy,
+// and the number of sites taken by the dense kernel
+template<typename policy>
+vector<double> likelihoods_under_kernel(siteIndex* reference, 
+            const haplotypeCohort* cohort, const vector<alleleValue>& query,
+            const siteKernelPolicy& kernel, size_t& dense_sites) {
+  basicPenaltySet<policy> penalties(-6, -9, cohort->get_n_haplotypes());
+  basicFwdAlgState<policy> state(reference, &penalties, cohort);
+  state.set_site_kernel_policy(kernel);
+  push_query_sites(state, query, 0, query.size());
+  dense_sites = state.get_snapshot_stats().dense_sites;
+  vector<double> to_return(1, state.prefix_likelihood());
+  for(size_t h = 0; h < cohort->get_n_haplotypes(); h++) {
+    to_return.push_back(state.current_likelihood_by_row(h));
+  }
+  return to_return;
+}
+
+// the dense kernel, at every site it can take and as chosen by default,
+// agrees with the lazy update alone
+template<typename policy>
+void check_site_kernels(siteIndex* reference, const haplotypeCohort* cohort,
+            const vector<alleleValue>& query, double tolerance) {
+  basicPenaltySet<policy> penalties(-6, -9, cohort->get_n_haplotypes());
+  basicFwdAlgState<policy> state(reference, &penalties, cohort);
+  siteKernelPolicy adaptive = state.get_site_kernel_policy();
+  siteKernelPolicy lazy = adaptive;
+  lazy.adaptive = false;
+  siteKernelPolicy dense = adaptive;
+  dense.lazy_row_cost = cohort->get_n_haplotypes();
+  dense.min_dense_run = 1;
+  size_t lazy_sites, dense_sites, adaptive_sites;
+  vector<double> baseline = likelihoods_under_kernel<policy>(reference, cohort, 
+            query, lazy, lazy_sites);
+  vector<double> forced = likelihoods_under_kernel<policy>(reference, cohort, 
+            query, dense, dense_sites);
+  vector<double> chosen = likelihoods_under_kernel<policy>(reference, cohort, 
+            query, adaptive, adaptive_sites);
+  REQUIRE(lazy_sites == 0);
+  REQUIRE(dense_sites > query.size() / 2);
+  // a log-space R-value costs a logsum on either path
+  REQUIRE((adaptive_sites > 0) == policy::is_linear);
+  bool within_tolerance = true;
+  for(size_t i = 0; i < baseline.size(); i++) {
+    if(!(fabs(forced[i] - baseline[i]) <= tolerance * fabs(baseline[i])) ||
+              !(fabs(chosen[i] - baseline[i]) <= tolerance * fabs(baseline[i]))) {
+      within_tolerance = false;
+    }
+  }
+  REQUIRE(within_tolerance);
+}
+
+TEST_CASE( "Dense site kernel agrees with the lazy update", "[probability][kernel]" ) {
+  size_t n_sites = 300;
+  size_t n_haplotypes = 40;
+  // minority alleles at about two in five rows of every site
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 < 2) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query = haplotypes[3];
+  for(size_t i = 0; i < n_sites; i += 7) {
+    query[i] = query[i] == A ? T : A;
+  }
+  std::copy(haplotypes[11].begin() + n_sites / 2, haplotypes[11].end(), 
+            query.begin() + n_sites / 2);
+  
+  check_site_kernels<logSpace<double> >(&reference, &cohort, query, 1e-10);
+  check_site_kernels<logSpace<float> >(&reference, &cohort, query, 1e-4);
+  check_site_kernels<scaledLinear<double> >(&reference, &cohort, query, 1e-10);
+  check_site_kernels<scaledLinear<float> >(&reference, &cohort, query, 1e-4);
+  
+  SECTION( "The dense kernel is not taken while a checkpoint is open" ) {
+    basicPenaltySet<scaledLinear<double> > penalties(-6, -9, n_haplotypes);
+    basicFwdAlgState<scaledLinear<double> > state(&reference, &penalties, &cohort);
+    push_query_sites(state, query, 0, n_sites / 2);
+    size_t dense_sites = state.get_snapshot_stats().dense_sites;
+    REQUIRE(dense_sites > 0);
+    state.checkpoint();
+    push_query_sites(state, query, n_sites / 2, n_sites);
+    REQUIRE(state.get_snapshot_stats().dense_sites == dense_sites);
+  }
+}
+
+template<typename policy>
+void check_rollback_under_policy(siteIndex* reference, const haplotypeCohort* cohort,
+            const vector<alleleValue>& query_0, const vector<alleleValue>& query_1,
+            double tolerance) {
+  size_t n_sites = query_0.size();
+  size_t n_haplotypes = cohort->get_n_haplotypes();
+  basicPenaltySet<policy> penalties(-6, -9, n_haplotypes);
+  vector<double> fresh_0;
+  vector<double> fresh_1;
+  vector<double> fresh_prefix;
+  // query_1 is only ever pushed after the first third of query_0
+  vector<alleleValue> spliced = query_1;
+  std::copy(query_0.begin(), query_0.begin() + n_sites / 3, spliced.begin());
+  for(size_t q = 0; q < 3; q++) {
+    basicFwdAlgState<policy> fresh(reference, &penalties, cohort);
+    const vector<alleleValue>& query = q == 1 ? spliced : query_0;
+    push_query_sites(fresh, query, 0, q == 2 ? n_sites / 3 : n_sites);
+    vector<double>& values = q == 0 ? fresh_0 : (q == 1 ? fresh_1 : fresh_prefix);
+    values.push_back(fresh.prefix_likelihood());
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      values.push_back(fresh.current_likelihood_by_row(h));
+    }
+  }
+
+  auto agrees_with = [&](basicFwdAlgState<policy>& state, const vector<double>& values) {
+    bool agrees = fabs(state.prefix_likelihood() - values[0]) <=
+              tolerance * fabs(values[0]);
+    for(size_t h = 0; h < n_haplotypes; h++) {
+      double value = state.current_likelihood_by_row(h);
+      agrees = agrees && fabs(value - values[h + 1]) <= tolerance * fabs(values[h + 1]);
+    }
+    return agrees;
+  };
+
+  basicFwdAlgState<policy> state(reference, &penalties, cohort);
+  state.get_maps().set_merge_identical(true);
+  push_query_sites(state, query_0, 0, n_sites / 3);
+  size_t n_eqclasses = state.get_maps().number_of_eqclasses();
+  size_t history_length = state.get_maps().get_map_history().size();
+  size_t outer = state.checkpoint();
+  push_query_sites(state, query_0, n_sites / 3, 2 * n_sites / 3);
+  size_t inner = state.checkpoint();
+  push_query_sites(state, query_1, 2 * n_sites / 3, n_sites);
+  state.rollback(inner);
+  push_query_sites(state, query_0, 2 * n_sites / 3, n_sites);
+  REQUIRE(agrees_with(state, fresh_0));
+
+  state.rollback(outer);
+  REQUIRE(state.number_of_checkpoints() == 1);
+  REQUIRE(state.get_maps().number_of_eqclasses() == n_eqclasses);
+  REQUIRE(state.get_maps().get_map_history().size() == history_length);
+  REQUIRE(agrees_with(state, fresh_prefix));
+  push_query_sites(state, query_1, n_sites / 3, n_sites);
+  REQUIRE(agrees_with(state, fresh_1));
+
+  state.rollback(outer);
+  state.release_checkpoints();
+  push_query_sites(state, query_0, n_sites / 3, n_sites);
+  REQUIRE(agrees_with(state, fresh_0));
+}
+
+TEST_CASE( "Checkpoints roll the state back to an earlier prefix", "[probability][rollback]" ) {
+  size_t n_sites = 300;
+  size_t n_haplotypes = 25;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + i) % 13 == 0) {
+        haplotypes[h][i] = C;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query_0 = haplotypes[4];
+  vector<alleleValue> query_1 = haplotypes[9];
+  for(size_t i = 0; i < n_sites; i += 3) {
+    query_0[i] = T;
+  }
+
+  SECTION( "pushing sites and spans matches scoring the whole query" ) {
+    penaltySet penalties(-6, -9, n_haplotypes);
+    inputHaplotype q(query_0, vector<size_t>(n_sites + 1, 0), &reference, 0,
+              3 * n_sites);
+    fastFwdAlgState whole(&reference, &penalties, &cohort);
+    fastFwdAlgState pushed(&reference, &penalties, &cohort);
+    push_query_sites(pushed, query_0, 0, n_sites);
+    REQUIRE(pushed.prefix_likelihood() == Approx(whole.calculate_probability(&q)));
+  }
+  SECTION( "rollback restores log-space states" ) {
+    check_rollback_under_policy<logSpace<double> >(&reference, &cohort,
+              query_0, query_1, 1e-10);
+  }
+  SECTION( "rollback restores linear states across snapshots" ) {
+    // single-precision linear maps leave their range within the suffixes, so
+    // snapshots are taken while checkpoints are open
+    check_rollback_under_policy<scaledLinear<float> >(&reference, &cohort,
+              query_0, query_1, 1e-4);
+  }
+}
+
+TEST_CASE( "Rolling back past an inner checkpoint drops what it created", "[probability][rollback]" ) {
+  // the inner checkpoint journals eqclasses and site slots created after the
+  // outer one, which the rollback to the outer one must skip rather than
+  // restore; make checked_tests runs this with bounds-checked vectors
+  size_t n_sites = 120;
+  size_t n_haplotypes = 30;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  vector<alleleValue> query = haplotypes[11];
+
+  fastFwdAlgState fresh(&reference, &penalties, &cohort);
+  push_query_sites(fresh, query, 0, 2);
+  double prefix_likelihood = fresh.prefix_likelihood();
+  push_query_sites(fresh, query, 2, n_sites);
+
+  fastFwdAlgState state(&reference, &penalties, &cohort);
+  push_query_sites(state, query, 0, 2);
+  size_t n_eqclasses = state.get_maps().number_of_eqclasses();
+  size_t outer = state.checkpoint();
+  push_query_sites(state, query, 2, n_sites / 2);
+  REQUIRE(state.get_maps().number_of_eqclasses() > n_eqclasses);
+  state.checkpoint();
+  push_query_sites(state, query, n_sites / 2, n_sites);
+  state.rollback(outer);
+  REQUIRE(state.number_of_checkpoints() == 1);
+  REQUIRE(state.get_maps().number_of_eqclasses() == n_eqclasses);
+  REQUIRE(state.prefix_likelihood() == Approx(prefix_likelihood));
+  push_query_sites(state, query, 2, n_sites);
+  REQUIRE(state.prefix_likelihood() == Approx(fresh.prefix_likelihood()));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    REQUIRE(state.current_likelihood_by_row(h) == Approx(fresh.current_likelihood_by_row(h)));
+  }
+}
+
+// a state read back from its serialization continues exactly as the original
+template<typename policy>
+bool resumes_exactly(siteIndex* reference, const haplotypeCohort* cohort,
+            const vector<alleleValue>& query) {
+  size_t n_sites = query.size();
+  basicPenaltySet<policy> penalties(-6, -9, cohort->get_n_haplotypes());
+  basicFwdAlgState<policy> original(reference, &penalties, cohort);
+  original.get_maps().set_merge_identical(true);
+  push_query_sites(original, query, 0, n_sites / 2);
+  stringstream stream;
+  original.serialize_binary(stream);
+  basicFwdAlgState<policy> restored(reference, &penalties, cohort);
+  restored.deserialize_binary(stream);
+  push_query_sites(original, query, n_sites / 2, n_sites);
+  push_query_sites(restored, query, n_sites / 2, n_sites);
+  bool agrees = restored.prefix_likelihood() == original.prefix_likelihood() &&
+            restored.get_snapshot_stats().snapshots_taken == 
+            original.get_snapshot_stats().snapshots_taken;
+  for(size_t h = 0; h < cohort->get_n_haplotypes(); h++) {
+    agrees = agrees && 
+              restored.current_likelihood_by_row(h) == original.current_likelihood_by_row(h);
+  }
+  return agrees;
+}
+
+TEST_CASE( "States are saved and restored in binary", "[probability][serialization]" ) {
+  size_t n_sites = 1200;
+  size_t n_haplotypes = 25;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + i) % 13 == 0) {
+        haplotypes[h][i] = C;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query = haplotypes[4];
+  for(size_t i = 0; i < n_sites; i += 3) {
+    query[i] = T;
+  }
+  
+  SECTION( "a restored state continues as the original under each policy" ) {
+    REQUIRE(resumes_exactly<logSpace<double> >(&reference, &cohort, query));
+    REQUIRE(resumes_exactly<logSpace<float> >(&reference, &cohort, query));
+    REQUIRE(resumes_exactly<scaledLinear<double> >(&reference, &cohort, query));
+    REQUIRE(resumes_exactly<scaledLinear<float> >(&reference, &cohort, query));
+  }
+  SECTION( "batches of states round-trip" ) {
+    penaltySet penalties(-6, -9, n_haplotypes);
+    inputHaplotype q(query, vector<size_t>(n_sites + 1, 0), &reference, 0, 3 * n_sites);
+    vector<fastFwdAlgState> states;
+    fastFwdAlgState state(&reference, &penalties, &cohort);
+    state.initialize_probability(&q);
+    for(size_t j = 1; j < n_sites; j++) {
+      state.extend_probability_at_span_after(&q, j - 1);
+      state.extend_probability_at_site(&q, j);
+      if(j % 300 == 0) {
+        states.push_back(state);
+      }
+    }
+    stringstream stream;
+    serialize_states(stream, states);
+    REQUIRE(stream.str().compare(0, 8, "SLLSBAT1") == 0);
+    vector<fastFwdAlgState> restored = deserialize_states(stream, &reference,
+              &penalties, &cohort);
+    REQUIRE(restored.size() == states.size());
+    for(size_t k = 0; k < states.size(); k++) {
+      REQUIRE(restored[k].prefix_likelihood() == states[k].prefix_likelihood());
+      REQUIRE(restored[k].get_last_site() == states[k].get_last_site());
+      for(size_t h = 0; h < n_haplotypes; h += 6) {
+        REQUIRE(restored[k].current_likelihood_by_row(h) == 
+                  states[k].current_likelihood_by_row(h));
+      }
+    }
+  }
+  SECTION( "mismatched and truncated streams are refused" ) {
+    penaltySet penalties(-6, -9, n_haplotypes);
+    fastFwdAlgState state(&reference, &penalties, &cohort);
+    push_query_sites(state, query, 0, 100);
+    stringstream stream;
+    state.serialize_binary(stream);
+    string bytes = stream.str();
+    
+    basicPenaltySet<scaledLinear<float> > linear_penalties(-6, -9, n_haplotypes);
+    basicFwdAlgState<scaledLinear<float> > linear(&reference, &linear_penalties, &cohort);
+    stringstream linear_stream(bytes);
+    REQUIRE_THROWS(linear.deserialize_binary(linear_stream));
+    
+    fastFwdAlgState restored(&reference, &penalties, &cohort);
+    stringstream truncated(bytes.substr(0, bytes.size() - 9));
+    REQUIRE_THROWS(restored.deserialize_binary(truncated));
+    
+    // the position markers follow the 24-byte header, S, the R-values and
+    // three more values
+    size_t markers = 24 + 8 * (n_haplotypes + 4);
+    string bad_allele = bytes;
+    bad_allele[markers + 16] = 9;
+    stringstream bad_allele_stream(bad_allele);
+    REQUIRE_THROWS(restored.deserialize_binary(bad_allele_stream));
+    string bad_site = bytes;
+    bad_site[markers + 24 + 5] = 1;
+    stringstream bad_site_stream(bad_site);
+    REQUIRE_THROWS(restored.deserialize_binary(bad_site_stream));
+    stringstream good(bytes);
+    restored.deserialize_binary(good);
+    REQUIRE(restored.prefix_likelihood() == state.prefix_likelihood());
+    
+    state.checkpoint();
+    stringstream open_stream;
+    REQUIRE_THROWS(state.serialize_binary(open_stream));
+  }
+  SECTION( "corrupt indices and counts are refused and leave the map as it was" ) {
+    penaltySet penalties(-6, -9, n_haplotypes);
+    fastFwdAlgState state(&reference, &penalties, &cohort);
+    push_query_sites(state, query, 0, 100);
+    stringstream stream;
+    state.get_maps().serialize_binary(stream);
+    string bytes = stream.str();
+    fastFwdAlgState other(&reference, &penalties, &cohort);
+    push_query_sites(other, query, 0, 50);
+    stringstream before;
+    other.get_maps().serialize_binary(before);
+    
+    // the row count of the first vector starts after 57 bytes of header, and
+    // the eqclass of row 0 follows it
+    string bad_row = bytes;
+    bad_row[65 + 3] = 0x7f;
+    stringstream bad_row_stream(bad_row);
+    REQUIRE_THROWS(other.get_maps().deserialize_binary(bad_row_stream));
+    string bad_count = bytes;
+    for(size_t i = 57; i < 65; i++) {
+      bad_count[i] = (char)0xff;
+    }
+    stringstream bad_count_stream(bad_count);
+    REQUIRE_THROWS(other.get_maps().deserialize_binary(bad_count_stream));
+    // a Viterbi map holds doubles in log space too, but is refused
+    maxProductLazyEvalMap viterbi_map(n_haplotypes, 0);
+    stringstream viterbi_stream;
+    viterbi_map.serialize_binary(viterbi_stream);
+    REQUIRE_THROWS(other.get_maps().deserialize_binary(viterbi_stream));
+    
+    stringstream after;
+    other.get_maps().serialize_binary(after);
+    REQUIRE(after.str() == before.str());
+    stringstream good(bytes);
+    other.get_maps().deserialize_binary(good);
+    REQUIRE(other.get_maps().number_of_eqclasses() == 
+              state.get_maps().number_of_eqclasses());
+  }
+}
+
+TEST_CASE( "Edited queries are rescored from checkpoints", "[probability][edits]" ) {
+  size_t n_sites = 100;
+  size_t n_haplotypes = 12;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  penaltySet penalties(-6, -9, n_haplotypes);
+  vector<alleleValue> alleles = haplotypes[3];
+  std::copy(haplotypes[8].begin() + 40, haplotypes[8].begin() + 70, alleles.begin() + 40);
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[20] = 1;
+  inputHaplotype query(alleles, novel_SNVs, &reference, 0, 3 * n_sites);
+  REQUIRE(query.has_left_tail());
+  REQUIRE(query.has_span_after(n_sites - 1));
+
+  fastFwdAlgState fresh(&reference, &penalties, &cohort);
+  auto rescored = [&](vector<alleleValue> edited, const vector<alleleEdit>& edits) {
+    for(size_t i = 0; i < edits.size(); i++) {
+      edited[edits[i].first] = edits[i].second;
+    }
+    inputHaplotype q(edited, novel_SNVs, &reference, 0, 3 * n_sites);
+    return fresh.calculate_probability(&q);
+  };
+  vector<vector<alleleEdit> > proposals = {{{0, T}}, {{9, C}}, {{10, T}},
+            {{50, G}, {52, T}}, {{89, T}, {90, T}}, {{99, C}}, {{35, T}, {35, A}}};
+
+  for(size_t with_reverse = 0; with_reverse < 2; with_reverse++) {
+    editScorer scorer(&reference, &penalties, &cohort);
+    scorer.set_query(query, 0, with_reverse == 1);
+    REQUIRE(scorer.get_checkpoint_interval() == 10);
+    REQUIRE(scorer.get_likelihood() == Approx(fresh.calculate_probability(&query)));
+    for(size_t p = 0; p < proposals.size(); p++) {
+      REQUIRE(scorer.score_edits(proposals[p]) == Approx(rescored(alleles, proposals[p])));
+    }
+    REQUIRE(scorer.get_query().get_alleles() == alleles);
+
+    // accepted edits invalidate checkpoints on both sides of them
+    vector<alleleValue> accepted = alleles;
+    vector<vector<alleleEdit> > to_accept = {{{45, G}}, {{12, C}, {67, C}}, {{0, G}}};
+    for(size_t k = 0; k < to_accept.size(); k++) {
+      double expected = rescored(accepted, to_accept[k]);
+      REQUIRE(scorer.accept_edits(to_accept[k]) == Approx(expected));
+      for(size_t i = 0; i < to_accept[k].size(); i++) {
+        accepted[to_accept[k][i].first] = to_accept[k][i].second;
+      }
+      REQUIRE(scorer.get_query().get_alleles() == accepted);
+      for(size_t p = 0; p < proposals.size(); p++) {
+        REQUIRE(scorer.score_edits(proposals[p]) == Approx(rescored(accepted, proposals[p])));
+      }
+    }
+  }
+
+  // the scorer reassigns its working state from its checkpoints; a state
+  // assigned over a longer one with a checkpoint open continues as a copy
+  fastFwdAlgState stored(&reference, &penalties, &cohort);
+  push_query_sites(stored, alleles, 0, 30);
+  fastFwdAlgState working(&reference, &penalties, &cohort);
+  push_query_sites(working, alleles, 0, 80);
+  working.checkpoint();
+  working = stored;
+  fastFwdAlgState copied(stored);
+  REQUIRE(working.number_of_checkpoints() == 0);
+  push_query_sites(working, alleles, 30, n_sites);
+  push_query_sites(copied, alleles, 30, n_sites);
+  REQUIRE(working.prefix_likelihood() == copied.prefix_likelihood());
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    REQUIRE(working.current_likelihood_by_row(h) == copied.current_likelihood_by_row(h));
+  }
+}
+
+TEST_CASE( "Sliding windows are scored in one forward pass", "[probability][windows]" ) {
+  size_t n_sites = 40;
+  size_t n_haplotypes = 8;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  vector<vector<alleleValue> > haplotypes = striped_cohort(n_haplotypes, n_sites);
+  siteIndex reference(positions, 3 * n_sites);
+  haplotypeCohort cohort(haplotypes, &reference);
+  penaltySet penalties(-5, -7, n_haplotypes);
+  vector<alleleValue> alleles = mosaic_query(haplotypes, 9, 17);
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[10] = 1;
+  inputHaplotype query(alleles, novel_SNVs, &reference, 0, 3 * n_sites);
+
+  // log-likelihood of the query up to and including site j
+  fastFwdAlgState fresh(&reference, &penalties, &cohort);
+  vector<double> prefix(n_sites);
+  for(size_t j = 0; j < n_sites; j++) {
+    vector<alleleValue> prefix_alleles(alleles.begin(), alleles.begin() + j + 1);
+    vector<size_t> prefix_SNVs(novel_SNVs.begin(), novel_SNVs.begin() + j + 2);
+    prefix_SNVs.back() = 0;
+    inputHaplotype q(prefix_alleles, prefix_SNVs, &reference, 0, 3 * j + 2);
+    prefix[j] = fresh.calculate_probability(&q);
+  }
+
+  windowScorer scorer(&reference, &penalties, &cohort);
+  vector<size_t> lengths = {1, 6, 13, n_sites};
+  for(size_t k = 0; k < lengths.size(); k++) {
+    size_t L = lengths[k];
+    vector<double> windows = scorer.window_log_likelihoods(&query, L);
+    REQUIRE(windows.size() == n_sites - L + 1);
+    for(size_t i = 0; i < windows.size(); i++) {
+      double expected = prefix[i + L - 1] - (i == 0 ? 0 : prefix[i - 1]);
+      REQUIRE(windows[i] == Approx(expected));
+    }
+  }
+  REQUIRE_THROWS(scorer.window_log_likelihoods(&query, 0));
+  REQUIRE_THROWS(scorer.window_log_likelihoods(&query, n_sites + 1));
+
+  SECTION( "standalone windows are scored as queries of their own" ) {
+    size_t L = 6;
+    for(size_t i = 0; i + L <= n_sites; i += 5) {
+      vector<alleleValue> window(alleles.begin() + i, alleles.begin() + i + L);
+      vector<size_t> window_SNVs(novel_SNVs.begin() + i, novel_SNVs.begin() + i + L + 1);
+      window_SNVs.front() = 0;
+      window_SNVs.back() = 0;
+      inputHaplotype q(window, window_SNVs, &reference, 3 * i + 1, 3 * (L - 1) + 1);
+      REQUIRE(scorer.standalone_window_log_likelihood(&query, i, L) ==
+                Approx(fresh.calculate_probability(&q)));
+    }
+  }
+}
+
+TEST_CASE( "Parameter sweeps agree with scoring each setting alone", "[probability][sweep]" ) {
+  size_t n_sites = 300;
+  size_t n_haplotypes = 30;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  size_t length = 3 * n_sites + 1000;
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      }
+    }
+  }
+  siteIndex reference(positions, length);
+  haplotypeCohort cohort(haplotypes, &reference);
+  vector<alleleValue> query = haplotypes[4];
+  std::copy(haplotypes[9].begin() + n_sites / 2, haplotypes[9].end(), 
+            query.begin() + n_sites / 2);
+  for(size_t i = 0; i < n_sites; i += 11) {
+    query[i] = query[i] == A ? T : A;
+  }
+  vector<size_t> novel_SNVs(n_sites + 1, 0);
+  novel_SNVs[0] = 1;
+  novel_SNVs[n_sites] = 2;
+  inputHaplotype q(query, novel_SNVs, &reference, 0, length);
+
+  // more settings than lanes, so that the sweep takes two passes
+  vector<penaltyParameters> settings;
+  for(double log_rho = -9; log_rho <= -3; log_rho += 2) {
+    for(double log_mu = -12; log_mu <= -6; log_mu += 2) {
+      penaltyParameters setting = {log_rho, log_mu};
+      settings.push_back(setting);
+    }
+  }
+  REQUIRE(settings.size() > sweepLinear::width);
+  sweepFwdAlgState sweep(&reference, &cohort, settings);
+  vector<double> results = sweep.calculate_probabilities(&q);
+  REQUIRE(results.size() == settings.size());
+  bool agrees = true;
+  for(size_t i = 0; i < settings.size(); i++) {
+    penaltySet penalties(settings[i].log_rho, settings[i].log_mu, n_haplotypes);
+    fastFwdAlgState state(&reference, &penalties, &cohort);
+    double expected = state.calculate_probability(&q);
+    agrees = agrees && fabs(results[i] - expected) <= 1e-10 * fabs(expected);
+  }
+  REQUIRE(agrees);
+  // a second query reuses the sweep
+  inputHaplotype q_0(haplotypes[0], vector<size_t>(n_sites + 1, 0), &reference, 0, length);
+  penaltySet penalties(settings[5].log_rho, settings[5].log_mu, n_haplotypes);
+  fastFwdAlgState state(&reference, &penalties, &cohort);
+  REQUIRE(sweep.calculate_probabilities(&q_0)[5] == 
+            Approx(state.calculate_probability(&q_0)));
+}
+
+TEST_CASE( "Penalties are estimated by expectation-maximization", "[probability][estimation]" ) {
+  size_t n_sites = 200;
+  size_t n_haplotypes = 20;
+  vector<size_t> positions;
+  for(size_t i = 0; i < n_sites; i++) {
+    positions.push_back(3 * i + 1);
+  }
+  size_t length = 3 * n_sites + 20;
+  vector<vector<alleleValue> > haplotypes(n_haplotypes, vector<alleleValue>(n_sites, A));
+  for(size_t h = 0; h < n_haplotypes; h++) {
+    for(size_t i = 0; i < n_sites; i++) {
+      if((h * 7 + i * 3) % 5 == 0) {
+        haplotypes[h][i] = T;
+      } else if((h + i) % 13 == 0) {
+        haplotypes[h][i] = C;
+      }
+    }
+  }
+  siteIndex reference(positions, length);
+  haplotypeCohort cohort(haplotypes, &reference);
+  // mosaics of two or three rows with a few mismatches and novel SNVs
+  vector<inputHaplotype*> owned;
+  vector<const inputHaplotype*> queries;
+  for(size_t i = 0; i < 6; i++) {
+    vector<alleleValue> query = haplotypes[i];
+    std::copy(haplotypes[i + 7].begin() + 60 + 10 * i, haplotypes[i + 7].end(), 
+              query.begin() + 60 + 10 * i);
+    if(i % 2 == 0) {
+      std::copy(haplotypes[19 - i].begin() + 150, haplotypes[19 - i].end(), 
+                query.begin() + 150);
+    }
+    for(size_t j = 5 + i; j < n_sites; j += 37) {
+      query[j] = query[j] == A ? T : A;
+    }
+    vector<size_t> novel_SNVs(n_sites + 1, 0);
+    novel_SNVs[0] = i % 2;
+    novel_SNVs[40 + i] = 1;
+    owned.push_back(new inputHaplotype(query, novel_SNVs, &reference, 0, length));
+    queries.push_back(owned.back());
+  }
+  penaltyEstimator estimator(&reference, &cohort);
+  penaltyParameters initial = {-6, -9};
+
+  SECTION( "Expected counts give the gradient of the log-likelihood" ) {
+    // Fisher's identity: the gradient of log P in log rho and log mu is the
+    // expected gradient of the complete-data log-likelihood
+    emCounts counts = estimator.expected_counts(queries, initial);
+    double r = n_haplotypes * exp(initial.log_rho) / (n_haplotypes - 1);
+    double mu = exp(initial.log_mu);
+    double rho_gradient = counts.recombinations - 
+              (counts.steps - counts.recombinations) * r / (1 - r);
+    double mu_gradient = counts.mismatches - 
+              4 * mu * (counts.emissions - counts.mismatches) / (1 - 4 * mu);
+    double epsilon = 1e-5;
+    penaltyParameters rho_up = {initial.log_rho + epsilon, initial.log_mu};
+    penaltyParameters rho_down = {initial.log_rho - epsilon, initial.log_mu};
+    penaltyParameters mu_up = {initial.log_rho, initial.log_mu + epsilon};
+    penaltyParameters mu_down = {initial.log_rho, initial.log_mu - epsilon};
+    double rho_difference = (estimator.expected_counts(queries, rho_up).log_likelihood -
+              estimator.expected_counts(queries, rho_down).log_likelihood) / (2 * epsilon);
+    double mu_difference = (estimator.expected_counts(queries, mu_up).log_likelihood -
+              estimator.expected_counts(queries, mu_down).log_likelihood) / (2 * epsilon);
+    REQUIRE(rho_gradient == Approx(rho_difference).epsilon(1e-4));
+    REQUIRE(mu_gradient == Approx(mu_difference).epsilon(1e-4));
+    
+    double log_likelihood = 0;
+    penaltySet penalties(initial.log_rho, initial.log_mu, n_haplotypes);
+    fastFwdAlgState state(&reference, &penalties, &cohort);
+    for(size_t i = 0; i < queries.size(); i++) {
+      log_likelihood += state.calculate_probability(queries[i]);
+    }
+    REQUIRE(counts.log_likelihood == Approx(log_likelihood));
+  }
+  SECTION( "Threads share the queries" ) {
+    emCounts single = estimator.expected_counts(queries, initial, 1);
+    emCounts threaded = estimator.expected_counts(queries, initial, 4);
+    REQUIRE(threaded.log_likelihood == Approx(single.log_likelihood));
+    REQUIRE(threaded.recombinations == Approx(single.recombinations));
+    REQUIRE(threaded.mismatches == Approx(single.mismatches));
+    REQUIRE(threaded.steps == single.steps);
+    REQUIRE(threaded.emissions == single.emissions);
+  }
+  SECTION( "Iterates never decrease the likelihood and converge" ) {
+    emEstimate estimate = estimator.estimate(queries, initial, 2);
+    REQUIRE(estimate.converged);
+    bool increasing = true;
+    for(size_t i = 1; i < estimate.log_likelihoods.size(); i++) {
+      increasing = increasing && estimate.log_likelihoods[i] >= 
+                estimate.log_likelihoods[i - 1] - 1e-8;
+    }
+    REQUIRE(increasing);
+    REQUIRE(estimate.log_likelihoods.back() > estimate.log_likelihoods[0]);
+    // the fit is a fixed point of the EM map
+    penaltyParameters again = estimator.maximize(
+              estimator.expected_counts(queries, estimate.parameters), 
+              estimate.parameters);
+    REQUIRE(again.log_rho == Approx(estimate.parameters.log_rho).epsilon(1e-2));
+    REQUIRE(again.log_mu == Approx(estimate.parameters.log_mu).epsilon(1e-2));
+  }
+  for(size_t i = 0; i < owned.size(); i++) {
+    delete owned[i];
+  }
+}
+
 // TEST_CASE( "Relative indexing works", "[haplotype][reference][input]" ) {
 //   //                01234567890123456789
 //   // sites              4    9    4
@@ -843,6 +2407,114 @@ TEST_CASE( "Delay map structure is built correctly ", "[delay][lazyEval-build]"
   }
 }
 
+TEST_CASE( "Gathering the eqclasses of a set of rows", "[delay][gather-eqclasses]" ) {
+  lazyEvalMap map = lazyEvalMap(6, 0);
+  map.add_eqclass(DPUpdateMap(1.0, 1.0));
+  for(size_t row = 3; row < 6; row++) {
+    map.remove_row_from_eqclass(row);
+    map.assign_row_to_newest_eqclass(row);
+  }
+  vector<size_t> first_rows = {0, 3, 1, 4, 5};
+  vector<size_t> second_rows = {4, 5};
+  rowSet first({&first_rows});
+  rowSet second({&second_rows});
+  REQUIRE(map.rows_to_eqclasses(first) == vector<size_t>({0, 1}));
+  // marks from the previous pass must not hide eqclasses from the next one
+  REQUIRE(map.rows_to_eqclasses(second) == vector<size_t>({1}));
+  REQUIRE(map.rows_to_eqclasses(first) == vector<size_t>({0, 1}));
+}
+
+TEST_CASE( "Eqclasses are caught up in groups by site", "[delay][site-groups]" ) {
+  lazyEvalMap map = lazyEvalMap(4, 0);
+  // rows 0 and 1 get separate eqclasses at site 1, row 2 one at site 2
+  map.stage_map_for_site(DPUpdateMap(-1.0, -2.0));
+  for(size_t row = 0; row < 2; row++) {
+    map.add_eqclass(DPUpdateMap(-0.5 * (row + 1), -1.0));
+    map.remove_row_from_eqclass(row);
+    map.assign_row_to_newest_eqclass(row);
+  }
+  map.stage_map_for_site(DPUpdateMap(-1.5, -1.0));
+  map.add_eqclass(DPUpdateMap(-0.25, -3.0));
+  map.remove_row_from_eqclass(2);
+  map.assign_row_to_newest_eqclass(2);
+  map.stage_map_for_site(DPUpdateMap(-2.0, -0.5));
+  map.stage_map_for_site(DPUpdateMap(-0.5, -4.0));
+  
+  DPUpdateMap expected_0 = DPUpdateMap(-0.5, -1.0);
+  DPUpdateMap expected_1 = DPUpdateMap(-1.0, -1.0);
+  for(size_t i = 2; i <= 4; i++) {
+    expected_0 = map.get_map_history()[i].of(expected_0);
+    expected_1 = map.get_map_history()[i].of(expected_1);
+  }
+  
+  map.catch_up_row(0);
+  // row 1 shares its last-updated site with row 0, so is caught up with it
+  REQUIRE(map.row_updated_to(1) == 4);
+  REQUIRE(map.get_coefficient(1) == Approx(expected_1.coefficient));
+  REQUIRE(map.get_constant(1) == Approx(expected_1.constant));
+  REQUIRE(map.get_coefficient(0) == Approx(expected_0.coefficient));
+  REQUIRE(map.row_updated_to(2) == 2);
+  REQUIRE(map.row_updated_to(3) == 0);
+  
+  SECTION( "condensing catches up every group below the top" ) {
+    map.condense_history(3, 0);
+    REQUIRE(map.row_updated_to(2) == 3);
+    REQUIRE(map.row_updated_to(3) == 3);
+    REQUIRE(map.get_map_history().start_site() == 3);
+    map.hard_update_all();
+    for(size_t row = 0; row < 4; row++) {
+      REQUIRE(map.row_updated_to(row) == 4);
+    }
+  }
+  SECTION( "the first site is forgotten once its eqclass empties" ) {
+    map.add_eqclass(DPUpdateMap(-0.75, -2.0));
+    map.remove_row_from_eqclass(3);
+    map.assign_row_to_newest_eqclass(3);
+    // row 2 is the oldest left, at site 2
+    lazyEvalMap copied(map);
+    REQUIRE(copied.get_map_history().start_site() == 2);
+  }
+}
+
+TEST_CASE( "Eqclasses with identical maps are merged", "[delay][merge-eqclasses]" ) {
+  lazyEvalMap map = lazyEvalMap(6, 0);
+  map.set_merge_identical(true);
+  map.stage_map_for_site(DPUpdateMap(-1.0, -2.0));
+  // three identity eqclasses reset at the same site
+  vector<size_t> rows_0 = {0, 1};
+  vector<size_t> rows_1 = {2, 3};
+  vector<size_t> rows_2 = {4};
+  map.reset_rows(rowSet({&rows_0}));
+  map.reset_rows(rowSet({&rows_1}));
+  map.reset_rows(rowSet({&rows_2}));
+  REQUIRE(map.number_of_eqclasses() == 4);
+  map.stage_map_for_site(DPUpdateMap(-1.5, -1.0));
+  map.stage_map_for_site(DPUpdateMap(-0.5, -3.0));
+  
+  map.catch_up_row(0);
+  // the newest eqclass is kept and the other two forward to it
+  REQUIRE(map.get_merge_count() == 2);
+  REQUIRE(map.number_of_eqclasses() == 2);
+  for(size_t row = 0; row < 5; row++) {
+    REQUIRE(map.get_eqclass(row) == map.get_eqclass(4));
+    REQUIRE(map.row_updated_to(row) == 3);
+  }
+  DPUpdateMap expected = DPUpdateMap(-0.5, -3.0).of(DPUpdateMap(-1.5, -1.0));
+  REQUIRE(map.get_map(1) == map.get_map(4));
+  REQUIRE(map.get_coefficient(1) == Approx(expected.coefficient));
+  REQUIRE(map.get_constant(1) == Approx(expected.constant));
+  
+  SECTION( "forwarded eqclasses are freed once their rows move on" ) {
+    vector<size_t> moved = {0, 1, 2, 3};
+    map.reset_rows(rowSet({&moved}));
+    // one eqclass holding row 4, one for row 5 and the new reset eqclass
+    REQUIRE(map.number_of_eqclasses() == 3);
+    map.hard_update_all();
+    REQUIRE(map.get_map(0).is_identity());
+    REQUIRE(map.get_coefficient(4) == Approx(expected.coefficient));
+  }
+}
+
 TEST_CASE( "Delay map structure stores values correctly ", "[delay][storage]" ) {
   SECTION( "Updating maps performs correct arithmetic" ) {
     lazyEvalMap map = lazyEvalMap(3, 0);
@@ -877,6 +2549,60 @@ TEST_CASE( "Delay map structure stores history correctly ", "[delay][encode-hist
   }
 }
 
+TEST_CASE( "Map history composes arbitrary ranges", "[delay][history-ranges]" ) {
+  mapHistory history(DPUpdateMap(0), 3);
+  for(size_t i = 4; i < 60; i++) {
+    history.push_back(DPUpdateMap(-0.5 - 0.01 * i, -1.0 - 0.1 * (i % 7)));
+  }
+  SECTION( "range compositions match sequential composition" ) {
+    for(size_t from = 3; from < 60; from += 5) {
+      for(size_t to = from; to < 60; to += 3) {
+        DPUpdateMap expected(0);
+        for(size_t i = from + 1; i <= to; i++) {
+          expected = history[i].of(expected);
+        }
+        DPUpdateMap composed = history.compose_range(from, to);
+        REQUIRE(composed.coefficient == Approx(expected.coefficient));
+        if(from != to) {
+          REQUIRE(composed.constant == Approx(expected.constant));
+        }
+      }
+    }
+  }
+  SECTION( "trimmed copies compose the retained ranges" ) {
+    mapHistory trimmed(history, 21);
+    DPUpdateMap expected(0);
+    for(size_t i = 22; i < 60; i++) {
+      expected = trimmed[i].of(expected);
+    }
+    REQUIRE(trimmed.compose_range(21, 59).coefficient == Approx(expected.coefficient));
+    REQUIRE(trimmed.compose_range(21, 59).constant == Approx(expected.constant));
+  }
+  SECTION( "copies share their prefix and diverge independently" ) {
+    for(size_t i = 60; i < 300; i++) {
+      history.push_back(DPUpdateMap(-0.5, -1.0 - 0.1 * (i % 5)));
+    }
+    mapHistory sibling(history);
+    REQUIRE(sibling.number_of_chunks() == history.number_of_chunks());
+    DPUpdateMap prefix = history.compose_range(3, 299);
+    for(size_t i = 300; i < 400; i++) {
+      history.push_back(DPUpdateMap(-0.25, -2.0));
+      sibling.push_back(DPUpdateMap(-0.75, -0.5));
+    }
+    DPUpdateMap expected = prefix;
+    DPUpdateMap expected_sibling = prefix;
+    for(size_t i = 300; i < 400; i++) {
+      expected = DPUpdateMap(-0.25, -2.0).of(expected);
+      expected_sibling = DPUpdateMap(-0.75, -0.5).of(expected_sibling);
+    }
+    REQUIRE(history.compose_range(3, 399).constant == Approx(expected.constant));
+    REQUIRE(sibling.compose_range(3, 399).constant == Approx(expected_sibling.constant));
+    REQUIRE(sibling.compose_range(3, 299).constant == Approx(prefix.constant));
+    REQUIRE(sibling[299] == history[299]);
+    REQUIRE(sibling[350] == DPUpdateMap(-0.75, -0.5));
+  }
+}
+
 TEST_CASE( "PenaltySet gives right values", "[penaltyset]") {
   double eps = 0.0000001;
   penaltySet penalties = penaltySet(-6, -9, 3);
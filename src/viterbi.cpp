@@ -0,0 +1,315 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "viterbi.hpp"
+
+using namespace std;
+
+viterbiState::viterbiState(siteIndex* ref, const penaltySet* pen,
+            const haplotypeCohort* haplotypes) :
+            reference(ref), cohort(haplotypes), penalties(pen),
+            map(maxProductLazyEvalMap(haplotypes->get_n_haplotypes(), 0)),
+            M(0) {
+  V = vector<double>(cohort->get_n_haplotypes(), 0);
+  heap = vector<row_t>(V.size());
+  heap_position = vector<size_t>(V.size());
+}
+
+void viterbiState::reserve_length(size_t length) {
+  map.reserve_length(length);
+}
+
+double viterbiState::current_value(row_t row) {
+  return map.catch_up_row(row).of(V[row]);
+}
+
+double viterbiState::best_value() const {
+  return M;
+}
+
+row_t viterbiState::best_row() const {
+  return heap[0];
+}
+
+void viterbiState::swap_heap_entries(size_t a, size_t b) {
+  swap(heap[a], heap[b]);
+  heap_position[heap[a]] = a;
+  heap_position[heap[b]] = b;
+}
+
+void viterbiState::sift_up(size_t position, double value) {
+  while(position > 0) {
+    size_t parent = (position - 1) / 2;
+    if(current_value(heap[parent]) >= value) {
+      return;
+    }
+    swap_heap_entries(position, parent);
+    position = parent;
+  }
+}
+
+void viterbiState::sift_down(size_t position, double value) {
+  size_t n_rows = heap.size();
+  while(2 * position + 1 < n_rows) {
+    size_t child = 2 * position + 1;
+    double child_value = current_value(heap[child]);
+    if(child + 1 < n_rows) {
+      double right_value = current_value(heap[child + 1]);
+      if(right_value > child_value) {
+        ++child;
+        child_value = right_value;
+      }
+    }
+    if(child_value <= value) {
+      return;
+    }
+    swap_heap_entries(position, child);
+    position = child;
+  }
+}
+
+void viterbiState::sift(row_t row) {
+  size_t position = heap_position[row];
+  double value = current_value(row);
+  sift_up(position, value);
+  if(heap_position[row] == position) {
+    sift_down(position, value);
+  }
+}
+
+void viterbiState::make_heap() {
+  for(size_t i = 0; i < heap.size(); i++) {
+    heap[i] = i;
+    heap_position[i] = i;
+  }
+  for(size_t i = heap.size() / 2; i > 0; i--) {
+    sift_down(i - 1, current_value(heap[i - 1]));
+  }
+}
+
+void viterbiState::initialize(const inputHaplotype* q) {
+  if(q->has_left_tail()) {
+    initialize_at_span(q->get_left_tail(), q->get_n_novel_SNVs(-1));
+    extend_at_site(q->get_site_index(0), q->get_allele(0));
+  } else {
+    initialize_at_site(q->get_site_index(0), q->get_allele(0));
+  }
+}
+
+void viterbiState::initialize_at_span(size_t length, size_t mismatch_count) {
+  map.reset(0);
+  M = penalties->span_mutation_penalty(length, mismatch_count) - penalties->log_H;
+  std::fill(V.begin(), V.end(), M);
+  make_heap();
+}
+
+void viterbiState::initialize_at_site(size_t site_index, alleleValue a) {
+  map.reset(0);
+  double match_initial_value = -penalties->log_H + penalties->one_minus_mu_at(site_index);
+  double nonmatch_initial_value = -penalties->log_H + penalties->mu_at(site_index);
+  bool match_is_rare = cohort->match_is_rare(site_index, a);
+  double active_value = match_is_rare ? match_initial_value : nonmatch_initial_value;
+  double default_value = match_is_rare ? nonmatch_initial_value : match_initial_value;
+  std::fill(V.begin(), V.end(), default_value);
+  if(cohort->number_active(site_index, a) != 0) {
+    const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
+    rowSet::const_iterator it = active_rows.begin();
+    rowSet::const_iterator rows_end = active_rows.end();
+    for(; it != rows_end; ++it) {
+      V[*it] = active_value;
+    }
+  }
+  make_heap();
+  M = V[heap[0]];
+}
+
+// Majority rows take the map x |-> e + ls + max(x, rho - ls + M), where ls is
+// the log-probability of staying on a row; minority rows are corrected for
+// their emission and sifted. Every other row keeps its place in the heap
+void viterbiState::extend_at_site(size_t site_index, alleleValue a) {
+  bool match_is_rare = cohort->match_is_rare(site_index, a);
+  double majority_emission = match_is_rare ? penalties->mu_at(site_index) : 
+              penalties->one_minus_mu_at(site_index);
+  double stay = penalties->stay_coefficient_at_gap(site_index);
+  map.stage_map_for_site(maxProductMap(majority_emission + stay,
+              penalties->rho_at_gap(site_index) - stay + M));
+  const rowSet& active_rows = cohort->get_active_rowSet(site_index, a);
+  if(!active_rows.empty()) {
+    double correction = penalties->get_minority_map_correction(match_is_rare, 
+                site_index);
+    map.open_reset_eqclass();
+    rowSet::const_iterator it = active_rows.begin();
+    rowSet::const_iterator rows_end = active_rows.end();
+    for(; it != rows_end; ++it) {
+      size_t row = *it;
+      V[row] = correction + map.catch_up_row(row).of(V[row]);
+      map.move_row_to_newest_eqclass(row);
+      sift(row);
+    }
+  }
+  M = current_value(heap[0]);
+}
+
+// the best path through the span either stays on its row throughout or
+// switches once from the best row, and the best row itself stays
+void viterbiState::extend_at_span_after(size_t site_index, size_t length, 
+            size_t mismatch_count) {
+  size_t gap = site_index + 1;
+  double stay = penalties->stay_coefficient_at_gap(gap);
+  double coefficient = penalties->span_mutation_penalty(length, mismatch_count) +
+              length * stay;
+  map.stage_map_for_span(maxProductMap(coefficient, 
+              penalties->rho_at_gap(gap) - stay + M));
+  M = coefficient + M;
+}
+
+viterbiSolver::viterbiSolver(siteIndex* reference, const penaltySet* penalties,
+            const haplotypeCohort* cohort) :
+            reference(reference), penalties(penalties), cohort(cohort) {
+
+}
+
+viterbiSolver::~viterbiSolver() {
+
+}
+
+void viterbiSolver::extend(viterbiState& state, size_t j) const {
+  if(query->has_span_after(j - 1)) {
+    state.extend_at_span_after(query->get_site_index(j - 1),
+              query->get_span_after(j - 1), query->get_n_novel_SNVs(j - 1));
+  }
+  state.extend_at_site(query->get_site_index(j), query->get_allele(j));
+}
+
+double viterbiSolver::span_penalty_before(size_t j) const {
+  if(!query->has_span_after(j - 1)) {
+    return 0;
+  }
+  size_t length = query->get_span_after(j - 1);
+  return penalties->span_mutation_penalty(length,
+              query->get_n_novel_SNVs(j - 1)) + length * stay_before(j);
+}
+
+double viterbiSolver::stay_before(size_t j) const {
+  return penalties->stay_coefficient_at_gap(query->get_site_index(j));
+}
+
+double viterbiSolver::switch_offset_before(size_t j) const {
+  return penalties->rho_at_gap(query->get_site_index(j)) - stay_before(j);
+}
+
+double viterbiSolver::log_emission(size_t j, row_t row) const {
+  size_t site = query->get_site_index(j);
+  if(cohort->allele_at(site, row) == query->get_allele(j)) {
+    return penalties->one_minus_mu_at(site);
+  } else {
+    return penalties->mu_at(site);
+  }
+}
+
+void viterbiSolver::set_query(const inputHaplotype* q, size_t interval) {
+  if(!q->has_sites()) {
+    throw runtime_error("Viterbi traceback requires a query containing sites");
+  }
+  query = q;
+  size_t n_sites = q->number_of_sites();
+  if(interval == 0) {
+    interval = (size_t)ceil(sqrt((double)n_sites));
+  }
+  checkpoint_interval = interval;
+  checkpoints.clear();
+  checkpoints.reserve((n_sites - 1) / interval + 1);
+
+  viterbiState state(reference, penalties, cohort);
+  state.reserve_length(2 * n_sites + 1);
+  state.initialize(q);
+  checkpoints.push_back(state);
+  for(size_t j = 1; j < n_sites; j++) {
+    extend(state, j);
+    if(j % interval == 0) {
+      checkpoints.push_back(state);
+    }
+  }
+  if(q->has_span_after(n_sites - 1)) {
+    state.extend_at_span_after(q->get_site_index(n_sites - 1),
+              q->get_span_after(n_sites - 1), q->get_n_novel_SNVs(n_sites - 1));
+  }
+  log_probability = state.best_value();
+}
+
+double viterbiSolver::get_log_probability() const {
+  return log_probability;
+}
+
+size_t viterbiSolver::get_checkpoint_interval() const {
+  return checkpoint_interval;
+}
+
+size_t viterbiSolver::number_of_checkpoints() const {
+  return checkpoints.size();
+}
+
+// The path row at site j is the row h at site j + 1 if
+//    V_j(h) >= rho - ls + M_j,
+// and the best row at site j otherwise, where rho and ls are those of the
+// gap before site j + 1. Each block is re-run from its checkpoint to record
+// M_j and the best rows; V_j(h) is then recomputed across the block from V(h)
+// at the checkpoint whenever h changes, by
+//    V_j(h) = e_j(h) + ls + [span before j] + max(V_{j-1}(h), rho - ls + M_{j-1})
+vector<pathSegment> viterbiSolver::traceback() {
+  if(query == NULL) {
+    throw runtime_error("no query set for Viterbi traceback");
+  }
+  size_t n_sites = query->number_of_sites();
+  vector<pathSegment> to_return;
+  vector<double> block_max(checkpoint_interval);
+  vector<row_t> block_best_row(checkpoint_interval);
+  vector<double> path_values(checkpoint_interval);
+
+  bool has_next = false;
+  row_t next = 0;
+  for(size_t b = checkpoints.size(); b > 0; b--) {
+    size_t block_start = (b - 1) * checkpoint_interval;
+    size_t block_end = min(block_start + checkpoint_interval, n_sites);
+    viterbiState state = checkpoints[b - 1];
+    block_max[0] = state.best_value();
+    block_best_row[0] = state.best_row();
+    for(size_t j = block_start + 1; j < block_end; j++) {
+      extend(state, j);
+      block_max[j - block_start] = state.best_value();
+      block_best_row[j - block_start] = state.best_row();
+    }
+
+    bool have_path_values = false;
+    for(size_t j = block_end; j > block_start; j--) {
+      size_t k = j - 1 - block_start;
+      row_t row = block_best_row[k];
+      if(has_next) {
+        if(!have_path_values) {
+          path_values[0] = checkpoints[b - 1].current_value(next);
+          for(size_t i = 1; i < block_end - block_start; i++) {
+            size_t site = block_start + i;
+            path_values[i] = log_emission(site, next) + stay_before(site) +
+                      span_penalty_before(site) + max(path_values[i - 1], 
+                      switch_offset_before(site) + block_max[i - 1]);
+          }
+          have_path_values = true;
+        }
+        if(path_values[k] >= switch_offset_before(j) + block_max[k]) {
+          row = next;
+        }
+      }
+      if(has_next && row == next) {
+        to_return.back().first_site = j - 1;
+      } else {
+        pathSegment segment = {row, j - 1, j - 1};
+        to_return.push_back(segment);
+        next = row;
+        has_next = true;
+        have_path_values = false;
+      }
+    }
+  }
+  reverse(to_return.begin(), to_return.end());
+  return to_return;
+}
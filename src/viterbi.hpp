@@ -0,0 +1,113 @@
+#ifndef LINEAR_HAPLO_VITERBI_H
+#define LINEAR_HAPLO_VITERBI_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+// A viterbiState runs the max-product recursion
+//    V'(h) = e(h) * max( (1 - (|H| - 1)rho) V(h), rho max_g V(g) )
+// with the lazy evaluation of fastFwdAlgState: rows whose allele is in the
+// majority at a site all receive the same map x |-> A max(x, B), so only the
+// minority rows are touched and maps compose in the max-product semiring.
+// Spans of l positions compose to a single such map, since the best path
+// through a span switches at most once.
+//
+// The running maximum M, which takes the place of the sum S of the forward
+// algorithm, is kept by an indexed max-heap over all rows ordered by their
+// current values. Rows not updated at a site all pass through the same
+// monotone map, which preserves their order, so only the rows updated at a
+// site need to be sifted
+struct viterbiState{
+private:
+  siteIndex* reference;
+  const haplotypeCohort* cohort;
+  const penaltySet* penalties;
+
+  maxProductLazyEvalMap map;
+  // value of each row when its map was last reset
+  vector<double> V;
+  double M;
+
+  vector<row_t> heap;
+  vector<size_t> heap_position;                             // size = # haplotypes
+  void make_heap();
+  // restores the heap order around a row whose value has changed
+  void sift(row_t row);
+  void sift_up(size_t position, double value);
+  void sift_down(size_t position, double value);
+  void swap_heap_entries(size_t a, size_t b);
+public:
+  viterbiState(siteIndex* ref, const penaltySet* pen,
+            const haplotypeCohort* haplotypes);
+
+  void reserve_length(size_t length);
+
+  void initialize(const inputHaplotype* q);
+  void initialize_at_span(size_t length, size_t mismatch_count);
+  void initialize_at_site(size_t site_index, alleleValue a);
+  void extend_at_site(size_t site_index, alleleValue a);
+  // a span of the given length after the site
+  void extend_at_span_after(size_t site_index, size_t length, 
+              size_t mismatch_count);
+
+  // value of the row at the last position extended, bringing its map up to
+  // date in O(log n)
+  double current_value(row_t row);
+  // log-probability of the most probable path to the last position extended
+  double best_value() const;
+  // row in which that path ends
+  row_t best_row() const;
+};
+
+// A viterbiSolver finds the most probable path of copied rows for an
+// inputHaplotype. set_query runs the max-product recursion once at the
+// sublinear per-site cost of the forward algorithm, copying the state every
+// checkpoint interval (sqrt(n) sites by default). traceback() then walks the
+// blocks between checkpoints from last to first, re-running each block to
+// recover the running maxima and their rows; the values of the single row
+// on the path follow from these by a scalar recursion, so memory is
+// O(|H| sqrt(n)) and no per-row backpointers are stored
+struct viterbiSolver{
+private:
+  siteIndex* reference;
+  const penaltySet* penalties;
+  const haplotypeCohort* cohort;
+  const inputHaplotype* query = NULL;
+
+  size_t checkpoint_interval = 0;
+  // checkpoints[b] is the state after site b * checkpoint_interval of the
+  // query
+  vector<viterbiState> checkpoints;
+  double log_probability = 0;
+
+  // extends a state from site j - 1 of the query to site j
+  void extend(viterbiState& state, size_t j) const;
+  // log-probability, common to all rows, of the span before site j
+  double span_penalty_before(size_t j) const;
+  // log-probability of staying on a row, and offset of switching rows, at
+  // each position of the gap before site j
+  double stay_before(size_t j) const;
+  double switch_offset_before(size_t j) const;
+  double log_emission(size_t j, row_t row) const;
+public:
+  viterbiSolver(siteIndex* reference, const penaltySet* penalties,
+              const haplotypeCohort* cohort);
+  ~viterbiSolver();
+
+  // runs the max-product recursion over q and stores checkpoints; q must
+  // contain at least one site and must outlive the traceback. An interval
+  // of 0 chooses sqrt(number of sites)
+  void set_query(const inputHaplotype* q, size_t interval = 0);
+
+  // log-probability of the most probable path
+  double get_log_probability() const;
+  size_t get_checkpoint_interval() const;
+  size_t number_of_checkpoints() const;
+
+  // the most probable path as runs of sites copying the same row, in order
+  // of site. Switches within a span are placed at the site following it
+  vector<pathSegment> traceback();
+};
+
+#endif
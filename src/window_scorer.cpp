@@ -0,0 +1,62 @@
+#include <stdexcept>
+#include "window_scorer.hpp"
+
+using namespace std;
+
+windowScorer::windowScorer(siteIndex* reference, const penaltySet* penalties,
+            const haplotypeCohort* cohort) :
+            reference(reference), penalties(penalties), cohort(cohort),
+            state(reference, penalties, cohort) {
+
+}
+
+windowScorer::~windowScorer() {
+
+}
+
+// prefix[j % (L + 1)] holds P_j for the last L + 1 sites
+vector<double> windowScorer::window_log_likelihoods(const inputHaplotype* q,
+            size_t window_length) {
+  size_t n_sites = q->number_of_sites();
+  if(window_length == 0 || window_length > n_sites) {
+    throw runtime_error("window length must be between 1 and the number of sites");
+  }
+  vector<double> to_return;
+  to_return.reserve(n_sites - window_length + 1);
+  prefix.resize(window_length + 1);
+  state.reset();
+  state.get_maps().reserve_length(2 * n_sites + 1);
+  state.initialize_probability(q);
+  for(size_t j = 0; j < n_sites; j++) {
+    if(j > 0) {
+      if(q->has_span_after(j - 1)) {
+        state.extend_probability_at_span_after(q, j - 1);
+      }
+      state.extend_probability_at_site(q, j);
+    }
+    double P = state.prefix_likelihood();
+    prefix[j % (window_length + 1)] = P;
+    if(j + 1 == window_length) {
+      to_return.push_back(P);
+    } else if(j + 1 > window_length) {
+      to_return.push_back(P - prefix[(j - window_length) % (window_length + 1)]);
+    }
+  }
+  return to_return;
+}
+
+double windowScorer::standalone_window_log_likelihood(const inputHaplotype* q,
+            size_t i, size_t window_length) {
+  if(window_length == 0 || i + window_length > q->number_of_sites()) {
+    throw runtime_error("window outside of query");
+  }
+  state.reset();
+  state.initialize_probability_at_site(q->get_site_index(i), q->get_allele(i));
+  for(size_t j = i + 1; j < i + window_length; j++) {
+    if(q->has_span_after(j - 1)) {
+      state.extend_probability_at_span_after(q, j - 1);
+    }
+    state.extend_probability_at_site(q, j);
+  }
+  return state.prefix_likelihood();
+}
@@ -0,0 +1,45 @@
+#ifndef LINEAR_HAPLO_WINDOW_SCORER_H
+#define LINEAR_HAPLO_WINDOW_SCORER_H
+
+#include "probability.hpp"
+
+using namespace std;
+
+// A windowScorer gives the log-likelihood of every window of L consecutive
+// sites along a query in a single forward pass. Since S after site j is the
+// log-likelihood P_j of the query up to site j, the window of sites
+// i, ..., i + L - 1 scores
+//    P_{i + L - 1} - P_{i - 1} = log P(sites i, ..., i + L - 1 | sites before i)
+// which takes the contribution of the sites before the window out of the
+// running prefix likelihood. Each window includes the span before its first
+// site, the first window includes the left tail, and the right tail belongs
+// to no window. Only the last L + 1 prefix likelihoods are kept, so the track
+// costs one forward pass and O(L) memory against O(nL) for scoring each
+// window as a query of its own.
+//
+// Windows are scored conditionally on the sites before them, since a window
+// cannot be scored from a uniform prior without re-running the forward pass
+// over it; standalone_window_log_likelihood does so for comparison
+struct windowScorer{
+private:
+  siteIndex* reference;
+  const penaltySet* penalties;
+  const haplotypeCohort* cohort;
+  fastFwdAlgState state;
+  vector<double> prefix;
+public:
+  windowScorer(siteIndex* reference, const penaltySet* penalties,
+              const haplotypeCohort* cohort);
+  ~windowScorer();
+
+  // log-likelihoods of the windows of q starting at sites 0, ..., n - L, in
+  // order. L must be between 1 and the number of sites of q
+  vector<double> window_log_likelihoods(const inputHaplotype* q,
+              size_t window_length);
+  // log-likelihood of the window of q starting at site i, scored from a
+  // uniform prior at site i with the spans between its sites, in O(L)
+  double standalone_window_log_likelihood(const inputHaplotype* q, size_t i,
+              size_t window_length);
+};
+
+#endif